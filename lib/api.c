@@ -0,0 +1,332 @@
+/*
+ * The krb5-sync library interface.
+ *
+ * A thin layer over the same code used by the kadmind plugin.  Each handle
+ * holds the plugin configuration and a Kerberos context of its own, so
+ * nothing is shared between handles except the state the plugin already
+ * shares between processes, such as the queue and the rate and concurrency
+ * controller.  Errors are copied out of the handle's Kerberos context into
+ * error objects before the handle is unlocked.
+ *
+ * Targets without ad_ccache get a memory cache private to the handle, so
+ * that the Active Directory tickets for a handle are obtained once and then
+ * reused until they're near expiration, as they would be with a shared
+ * cache.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include <lib/krb5-sync.h>
+#include <plugin/internal.h>
+#include <util/macros.h>
+
+/* The handle for the library. */
+struct krb5_sync {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t mutex;
+#endif
+    krb5_context ctx;
+    kadm5_hook_modinfo *config;
+    struct vector *caches;      /* Memory caches owned by the handle. */
+};
+
+/* An error returned by the library. */
+struct krb5_sync_error {
+    long code;
+    char *message;
+};
+
+/* Returned if we can't allocate memory for an error object. */
+static struct krb5_sync_error error_nomem = {
+    ENOMEM, (char *) "cannot allocate memory"
+};
+
+
+/*
+ * Create an error object from an error code and message.
+ */
+static struct krb5_sync_error *
+error_string(long code, const char *message)
+{
+    struct krb5_sync_error *error;
+
+    error = calloc(1, sizeof(struct krb5_sync_error));
+    if (error == NULL)
+        return &error_nomem;
+    error->code = code;
+    error->message = strdup(message);
+    if (error->message == NULL) {
+        free(error);
+        return &error_nomem;
+    }
+    return error;
+}
+
+
+/*
+ * Create an error object from a Kerberos error code and the message stored
+ * in the Kerberos context.
+ */
+static struct krb5_sync_error *
+error_krb5(krb5_context ctx, krb5_error_code code)
+{
+    struct krb5_sync_error *error;
+    const char *message;
+
+    message = krb5_get_error_message(ctx, code);
+    error = error_string(code, message);
+    krb5_free_error_message(ctx, message);
+    return error;
+}
+
+
+/*
+ * Lock and unlock a handle.
+ */
+static void
+handle_lock(struct krb5_sync *sync UNUSED)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&sync->mutex);
+#endif
+}
+
+static void
+handle_unlock(struct krb5_sync *sync UNUSED)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&sync->mutex);
+#endif
+}
+
+
+/*
+ * Give every target without a shared credential cache a memory cache of the
+ * handle's own.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+handle_caches(struct krb5_sync *sync)
+{
+    struct sync_target *target;
+    char *name;
+    size_t i;
+
+    sync->caches = sync_vector_new();
+    if (sync->caches == NULL)
+        return sync_error_system(sync->ctx, "cannot allocate memory");
+    for (i = 0; i < sync->config->ad_targets_count; i++) {
+        target = &sync->config->ad_targets[i];
+        if (target->ad_ccache != NULL)
+            continue;
+        if (asprintf(&name, "MEMORY:krb5-sync-%p-%s", (void *) sync,
+                     target->name) < 0)
+            return sync_error_system(sync->ctx, "cannot allocate memory");
+        if (!sync_vector_add(sync->caches, name)) {
+            free(name);
+            return sync_error_system(sync->ctx, "cannot allocate memory");
+        }
+        target->ad_ccache = name;
+    }
+    return 0;
+}
+
+
+/*
+ * Create a new handle.
+ */
+struct krb5_sync *
+krb5_sync_new(const char *config, struct krb5_sync_error **error)
+{
+    struct krb5_sync *sync;
+    krb5_error_code code;
+
+    *error = NULL;
+    sync = calloc(1, sizeof(struct krb5_sync));
+    if (sync == NULL) {
+        *error = &error_nomem;
+        return NULL;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&sync->mutex, NULL);
+#endif
+    code = sync_config_context(config, &sync->ctx);
+    if (code != 0) {
+        *error = error_string(code, "cannot create Kerberos context");
+        krb5_sync_free(sync);
+        return NULL;
+    }
+    code = sync_init(sync->ctx, &sync->config);
+    if (code == 0 && config != NULL) {
+        sync->config->krb5_conf = strdup(config);
+        if (sync->config->krb5_conf == NULL)
+            code = sync_error_system(sync->ctx, "cannot allocate memory");
+    }
+    if (code == 0)
+        code = handle_caches(sync);
+    if (code != 0) {
+        *error = error_krb5(sync->ctx, code);
+        krb5_sync_free(sync);
+        return NULL;
+    }
+    return sync;
+}
+
+
+/*
+ * Free a handle, destroying the memory caches it owns.
+ */
+void
+krb5_sync_free(struct krb5_sync *sync)
+{
+    krb5_ccache ccache;
+    size_t i;
+
+    if (sync == NULL)
+        return;
+    for (i = 0; sync->caches != NULL && i < sync->caches->count; i++)
+        if (krb5_cc_resolve(sync->ctx, sync->caches->strings[i], &ccache) == 0)
+            krb5_cc_destroy(sync->ctx, ccache);
+    if (sync->config != NULL)
+        sync_close(sync->ctx, sync->config);
+    sync_vector_free(sync->caches);
+    if (sync->ctx != NULL)
+        krb5_free_context(sync->ctx);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&sync->mutex);
+#endif
+    free(sync);
+}
+
+
+/*
+ * Make one change with the handle already locked, returning an error object
+ * or NULL on success.
+ */
+static struct krb5_sync_error *
+change(struct krb5_sync *sync, enum krb5_sync_op op, const char *user,
+       const char *password)
+{
+    krb5_principal principal;
+    krb5_error_code code;
+
+    if (user == NULL)
+        return error_string(EINVAL, "no principal given");
+    if (op == KRB5_SYNC_PASSWORD && password == NULL)
+        return error_string(EINVAL, "no password given");
+    code = krb5_parse_name(sync->ctx, user, &principal);
+    if (code != 0)
+        return error_krb5(sync->ctx, code);
+    switch (op) {
+    case KRB5_SYNC_PASSWORD:
+        code = sync_chpass(sync->config, sync->ctx, principal, password);
+        break;
+    case KRB5_SYNC_ENABLE:
+        code = sync_status(sync->config, sync->ctx, principal, true);
+        break;
+    case KRB5_SYNC_DISABLE:
+        code = sync_status(sync->config, sync->ctx, principal, false);
+        break;
+    default:
+        krb5_free_principal(sync->ctx, principal);
+        return error_string(EINVAL, "unknown operation");
+    }
+    krb5_free_principal(sync->ctx, principal);
+    return (code == 0) ? NULL : error_krb5(sync->ctx, code);
+}
+
+
+/*
+ * Push a password change.
+ */
+struct krb5_sync_error *
+krb5_sync_password(struct krb5_sync *sync, const char *principal,
+                   const char *password)
+{
+    struct krb5_sync_error *error;
+
+    handle_lock(sync);
+    error = change(sync, KRB5_SYNC_PASSWORD, principal, password);
+    handle_unlock(sync);
+    return error;
+}
+
+
+/*
+ * Push an account status change.
+ */
+struct krb5_sync_error *
+krb5_sync_status(struct krb5_sync *sync, const char *principal, int enabled)
+{
+    struct krb5_sync_error *error;
+    enum krb5_sync_op op;
+
+    op = enabled ? KRB5_SYNC_ENABLE : KRB5_SYNC_DISABLE;
+    handle_lock(sync);
+    error = change(sync, op, principal, NULL);
+    handle_unlock(sync);
+    return error;
+}
+
+
+/*
+ * Push a batch of changes, holding the lock on the handle for the whole
+ * batch so that they're made in order.
+ */
+size_t
+krb5_sync_submit(struct krb5_sync *sync, struct krb5_sync_change *changes,
+                 size_t count)
+{
+    size_t i, failed = 0;
+
+    handle_lock(sync);
+    for (i = 0; i < count; i++) {
+        changes[i].error = change(sync, changes[i].op, changes[i].principal,
+                                  changes[i].password);
+        if (changes[i].error != NULL)
+            failed++;
+    }
+    handle_unlock(sync);
+    return failed;
+}
+
+
+/*
+ * Accessors for error objects.
+ */
+long
+krb5_sync_error_code(const struct krb5_sync_error *error)
+{
+    return error->code;
+}
+
+const char *
+krb5_sync_error_message(const struct krb5_sync_error *error)
+{
+    return error->message;
+}
+
+
+/*
+ * Free an error object, except for the static one used when we're out of
+ * memory.
+ */
+void
+krb5_sync_error_free(struct krb5_sync_error *error)
+{
+    if (error == NULL || error == &error_nomem)
+        return;
+    free(error->message);
+    free(error);
+}
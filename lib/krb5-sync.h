@@ -0,0 +1,102 @@
+/*
+ * Public interface to the krb5-sync library.
+ *
+ * This library pushes password and account status changes to Active
+ * Directory using the same krb5.conf configuration as the kadmind plugin, for
+ * services that provision accounts and want to push changes in-process
+ * rather than running krb5-sync for each one.  Changes that fail are queued
+ * if queue_dir is set, exactly as in the plugin.
+ *
+ * All state is held in a handle.  Each handle has its own Kerberos context
+ * and caches the Active Directory tickets it obtains, and may be shared
+ * between threads, although calls on the same handle are serialized.  Every
+ * call that can fail returns an error object, which the caller must free,
+ * rather than storing the error in the handle.
+ *
+ * The library never changes the process environment if the GSSAPI library
+ * provides gss_krb5_ccache_name.  Otherwise, as in the plugin, account
+ * status changes have to point SASL at their tickets by setting KRB5CCNAME.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef KRB5_SYNC_H
+#define KRB5_SYNC_H 1
+
+#include <stddef.h>
+
+/* Opaque handle and error object. */
+struct krb5_sync;
+struct krb5_sync_error;
+
+/* The changes that may be submitted in a batch. */
+enum krb5_sync_op {
+    KRB5_SYNC_PASSWORD,
+    KRB5_SYNC_ENABLE,
+    KRB5_SYNC_DISABLE
+};
+
+/*
+ * One change in a batch.  password is only used for KRB5_SYNC_PASSWORD.
+ * error is set by krb5_sync_submit to NULL if the change succeeded and to an
+ * error object, which the caller must free, if it failed.
+ */
+struct krb5_sync_change {
+    enum krb5_sync_op op;
+    const char *principal;
+    const char *password;
+    struct krb5_sync_error *error;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Create a new handle, reading the configuration from the given krb5.conf
+ * file or, if it is NULL, from the default Kerberos configuration.  Returns
+ * NULL and sets error on failure.
+ */
+struct krb5_sync *krb5_sync_new(const char *config,
+                                struct krb5_sync_error **error);
+
+/* Free a handle and all of its state. */
+void krb5_sync_free(struct krb5_sync *);
+
+/*
+ * Push a password change or an account status change for a principal.
+ * Returns NULL on success, including when the change was queued, and an
+ * error object otherwise.
+ */
+struct krb5_sync_error *krb5_sync_password(struct krb5_sync *,
+                                           const char *principal,
+                                           const char *password);
+struct krb5_sync_error *krb5_sync_status(struct krb5_sync *,
+                                         const char *principal, int enabled);
+
+/*
+ * Push a batch of changes in order, reusing the handle's Kerberos context
+ * and tickets for all of them, and set the error of each one.  Returns the
+ * number of changes that failed.
+ */
+size_t krb5_sync_submit(struct krb5_sync *, struct krb5_sync_change *,
+                        size_t count);
+
+/*
+ * Return the Kerberos error code or the message of an error object.  The
+ * message is valid until the error object is freed.
+ */
+long krb5_sync_error_code(const struct krb5_sync_error *);
+const char *krb5_sync_error_message(const struct krb5_sync_error *);
+
+/* Free an error object.  Does nothing if it is NULL. */
+void krb5_sync_error_free(struct krb5_sync_error *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !KRB5_SYNC_H */
@@ -18,10 +18,15 @@
 #include <portable/system.h>
 
 #include <errno.h>
+#ifdef HAVE_GSS_KRB5_CCACHE_NAME
+# include <gssapi/gssapi_krb5.h>
+#endif
 #include <lber.h>
 #include <ldap.h>
+#include <sys/time.h>
 
 #include <plugin/internal.h>
+#include <plugin/probes.h>
 #include <util/macros.h>
 
 /* The memory cache name used to store credentials for AD. */
@@ -30,37 +35,89 @@
 /* The flag value used in Active Directory to indicate a disabled account. */
 #define UF_ACCOUNTDISABLE 0x02
 
+/*
+ * The search filter for user accounts and the number of them to ask for in
+ * each page of results, which is the default MaxPageSize in AD.
+ */
+#define ACCOUNT_FILTER "(&(objectClass=user)(userPrincipalName=*))"
+#define ACCOUNT_PAGE   1000
+
+/*
+ * The DirSync control, used to retrieve only the accounts that changed since
+ * the last search, and its flag asking for only the objects and attributes
+ * we have permission to read, which avoids needing replication rights.
+ * DirSync only supports simple filters and only returns the changed
+ * attributes, so the filter can't require a userPrincipalName.
+ */
+#define DIRSYNC_OID             "1.2.840.113556.1.4.841"
+#define DIRSYNC_OBJECT_SECURITY 0x01
+#define CHANGE_FILTER           "(objectClass=user)"
+
+/* The number of accounts to look up in a single search. */
+#define LOOKUP_BATCH 100
+
 
 /*
- * Check a specific configuratino attribute to ensure that it's set and, if
- * not, set the error string and return.  Assumes that the configuration
- * struct is config and errstr and errstrlen are declared in the current
- * scope.
+ * Check a specific configuration attribute of the target to ensure that it's
+ * set and, if not, set the error string and return.  Assumes that the target
+ * is target and the Kerberos context is ctx.
  */
 #define STRINGIFY(s) #s
 #define CHECK_CONFIG(c)                                                 \
     do {                                                                \
-        if (config->c == NULL)                                          \
+        if (target->c == NULL)                                          \
             return sync_error_config(ctx, "configuration setting %s"    \
-                                     " missing", STRINGIFY(c));         \
+                                     " missing for target %s",          \
+                                     STRINGIFY(c), target->name);       \
     } while (0)
 
 
 /*
- * Given the plugin options, a Kerberos context, and a pointer to krb5_ccache
- * storage, initialize a memory cache using the configured keytab to obtain
- * initial credentials.  Returns a Kerberos status code.
+ * Return true if a Kerberos error indicates that the domain controller is
+ * overloaded or unreachable and that we should back off, rather than a
+ * problem with the specific change.
+ */
+static bool
+kerberos_soft_error(krb5_error_code code)
+{
+    return code == KRB5_KDC_UNREACH || code == ETIMEDOUT;
+}
+
+
+/*
+ * The same for LDAP errors.
+ */
+static bool
+ldap_soft_error(int code)
+{
+    switch (code) {
+    case LDAP_BUSY:
+    case LDAP_UNAVAILABLE:
+    case LDAP_SERVER_DOWN:
+    case LDAP_TIMEOUT:
+    case LDAP_TIMELIMIT_EXCEEDED:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/*
+ * Given the target, a Kerberos context, and a pointer to krb5_ccache storage,
+ * initialize a memory cache with initial credentials, obtained from the
+ * keytab or the shared cache configured with ad_ccache.  If unique is true,
+ * use a new, uniquely named memory cache rather than the shared one, so that
+ * concurrent attempts don't step on each other.  Returns a Kerberos status
+ * code.
  */
 static krb5_error_code
-get_creds(kadm5_hook_modinfo *config, krb5_context ctx, krb5_ccache *cc)
+get_creds(kadm5_hook_modinfo *config, struct sync_target *target,
+          krb5_context ctx, bool unique, krb5_ccache *cc)
 {
     krb5_error_code code;
-    krb5_keytab kt = NULL;
     krb5_principal princ = NULL;
-    krb5_get_init_creds_opt *opts = NULL;
     krb5_creds creds;
-    bool creds_valid = false;
-    const char *realm UNUSED;
 
     /* Initialize the credential cache pointer to NULL. */
     *cc = NULL;
@@ -69,71 +126,55 @@ get_creds(kadm5_hook_modinfo *config, krb5_context ctx, krb5_ccache *cc)
     CHECK_CONFIG(ad_keytab);
     CHECK_CONFIG(ad_principal);
 
-    /* Resolve the keytab and principal used to get credentials. */
-    code = krb5_kt_resolve(ctx, config->ad_keytab, &kt);
-    if (code != 0)
-        goto fail;
-    code = krb5_parse_name(ctx, config->ad_principal, &princ);
-    if (code != 0)
-        goto fail;
-
-    /* Set our credential acquisition options. */
-    code = krb5_get_init_creds_opt_alloc(ctx, &opts);
+    /* Obtain credentials for the principal. */
+    SYNC_PROBE1(creds_entry, target->name);
+    if (SYNC_FAULT(SYNC_FAULT_CREDS)) {
+        code = KRB5_KDC_UNREACH;
+        goto done;
+    }
+    code = krb5_parse_name(ctx, target->ad_principal, &princ);
     if (code != 0)
-        goto fail;
-    realm = krb5_principal_get_realm(ctx, princ);
-    krb5_get_init_creds_opt_set_default_flags(ctx, "krb5-sync", realm, opts);
-
-    /* Obtain credentials. */
-    memset(&creds, 0, sizeof(creds));
-    code = krb5_get_init_creds_keytab(ctx, &creds, princ, kt, 0, NULL, opts);
+        goto done;
+    code = sync_ccache_creds(config, target, ctx, princ, &creds);
     if (code != 0)
-        goto fail;
-    krb5_get_init_creds_opt_free(ctx, opts);
-    opts = NULL;
-    krb5_kt_close(ctx, kt);
-    kt = NULL;
-    creds_valid = true;
+        goto done;
 
     /* Open and initialize the credential cache. */
-    code = krb5_cc_resolve(ctx, CACHE_NAME, cc);
-    if (code != 0)
-        goto fail;
-    code = krb5_cc_initialize(ctx, *cc, princ);
-    if (code == 0)
-        code = krb5_cc_store_cred(ctx, *cc, &creds);
-    if (code != 0) {
-        krb5_cc_close(ctx, *cc);
-        *cc = NULL;
-        goto fail;
+    if (unique)
+        code = krb5_cc_new_unique(ctx, "MEMORY", NULL, cc);
+    else
+        code = krb5_cc_resolve(ctx, CACHE_NAME, cc);
+    if (code == 0) {
+        code = krb5_cc_initialize(ctx, *cc, princ);
+        if (code == 0)
+            code = krb5_cc_store_cred(ctx, *cc, &creds);
+        if (code != 0) {
+            krb5_cc_close(ctx, *cc);
+            *cc = NULL;
+        }
     }
 
-    /* Clean up and return success. */
+    /* Clean up. */
     krb5_free_cred_contents(ctx, &creds);
-    krb5_free_principal(ctx, princ);
-    return 0;
 
-fail:
-    if (kt != NULL)
-        krb5_kt_close(ctx, kt);
+done:
     if (princ != NULL)
         krb5_free_principal(ctx, princ);
-    if (opts != NULL)
-        krb5_get_init_creds_opt_free(ctx, opts);
-    if (creds_valid)
-        krb5_free_cred_contents(ctx, &creds);
+    SYNC_PROBE2(creds_return, target->name, code);
     return code;
 }
 
 
 /*
  * Given the krb5_principal from kadmind, convert it to the corresponding
- * principal in Active Directory.  This may involve removing ad_base_instance
- * and always involves changing the realm.  Returns a Kerberos error code.
+ * principal in the Active Directory target.  This may involve removing
+ * ad_base_instance and always involves changing the realm.  Returns a
+ * Kerberos error code.
  */
-static krb5_error_code
-get_ad_principal(kadm5_hook_modinfo *config, krb5_context ctx,
-                 krb5_const_principal principal, krb5_principal *ad_principal)
+krb5_error_code
+sync_ad_principal(kadm5_hook_modinfo *config, struct sync_target *target,
+                  krb5_context ctx, krb5_const_principal principal,
+                  krb5_principal *ad_principal)
 {
     krb5_error_code code;
     int ncomp;
@@ -156,8 +197,8 @@ get_ad_principal(kadm5_hook_modinfo *config, krb5_context ctx,
         if (strcmp(instance, config->ad_base_instance) == 0) {
             base = krb5_principal_get_comp_string(ctx, principal, 0);
             code = krb5_build_principal(ctx, ad_principal,
-                                        strlen(config->ad_realm),
-                                        config->ad_realm, base, (char *) 0);
+                                        strlen(target->ad_realm),
+                                        target->ad_realm, base, (char *) 0);
             if (code != 0)
                 return code;
         }
@@ -168,73 +209,200 @@ get_ad_principal(kadm5_hook_modinfo *config, krb5_context ctx,
         code = krb5_copy_principal(ctx, principal, ad_principal);
         if (code != 0)
             return code;
-        krb5_principal_set_realm(ctx, *ad_principal, config->ad_realm);
+        krb5_principal_set_realm(ctx, *ad_principal, target->ad_realm);
     }
     return 0;
 }
 
 
 /*
- * Push a password change to Active Directory.  Takes the module
- * configuration, a Kerberos context, the principal whose password is being
- * changed (we will have to change the realm), and the new password and its
- * length.  Returns a Kerberos error code.
+ * Return the current time in microseconds, used to measure latency.
  */
-krb5_error_code
-sync_ad_chpass(kadm5_hook_modinfo *config, krb5_context ctx,
-               krb5_principal principal, const char *password)
+static uint64_t
+ad_now(void)
 {
-    krb5_error_code code;
-    char *target = NULL;
-    krb5_ccache ccache;
-    krb5_principal ad_principal = NULL;
-    int result_code;
-    krb5_data result_code_string, result_string;
+    struct timeval tv;
 
-    /* Ensure the configuration is sane. */
-    CHECK_CONFIG(ad_realm);
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + (uint64_t) tv.tv_usec;
+}
 
-    /* Get the credentials we'll use to make the change in AD. */
-    code = get_creds(config, ctx, &ccache);
-    if (code != 0)
-        return code;
 
-    /* Get the corresponding AD principal. */
-    code = get_ad_principal(config, ctx, principal, &ad_principal);
+/*
+ * Report the result of an operation to the rate and concurrency controller,
+ * along with its latency if it was successful and sample is true, and to the
+ * statistics, and log it.  operation is password, enable, or disable.  soft
+ * says whether the operation already determined that the failure should make
+ * us back off.  Hedged operations don't sample the latency here, since it may
+ * be that of the hedge server, and instead let the attempt against the usual
+ * domain controller sample its own.
+ */
+static void
+ad_result(kadm5_hook_modinfo *config, struct sync_target *target,
+          struct sync_op *op, const char *operation, const char *dc,
+          uint64_t start, bool sample, krb5_error_code code, bool soft)
+{
+    static const char *const outcomes[] = { "success", "soft", "hard" };
+    struct sync_log_fields fields;
+    enum sync_outcome outcome;
+    const char *display;
+    uint64_t now;
+
+    if (code == 0)
+        outcome = SYNC_OUTCOME_SUCCESS;
+    else if (soft || kerberos_soft_error(code))
+        outcome = SYNC_OUTCOME_SOFT;
+    else
+        outcome = SYNC_OUTCOME_HARD;
+    sync_control_result(config, dc, outcome);
+    now = ad_now();
+    if (sample && outcome == SYNC_OUTCOME_SUCCESS && now > start)
+        sync_control_latency(config, dc, (unsigned long) (now - start));
+    sync_stats_dc(config, dc, outcome, start);
+
+    /* Log the result, with the Active Directory name if it succeeded. */
+    fields.operation = operation;
+    fields.target = target->name;
+    fields.dc = dc;
+    fields.outcome = outcomes[outcome];
+    fields.latency = (now > start) ? now - start : 0;
     if (code != 0)
-        goto done;
+        sync_log_event(config, SYNC_LOG_DEBUG, op, &fields, "krb5-sync: AD"
+                       " %s change for %s in %s failed on %s (trace %s)",
+                       operation, op->name, target->name, dc, op->trace);
+    else if (SYNC_LOG_ENABLED(config, SYNC_LOG_INFO)) {
+        if (sync_op_ad_name(config, op, target, &display) != 0)
+            display = op->name;
+        if (strcmp(operation, "password") == 0)
+            sync_log_event(config, SYNC_LOG_INFO, op, &fields, "krb5-sync:"
+                           " %s password changed (trace %s)", display,
+                           op->trace);
+        else
+            sync_log_event(config, SYNC_LOG_INFO, op, &fields,
+                           "successfully %sd account %s (trace %s)",
+                           operation, display, op->trace);
+    }
+}
 
-    /* This is just for logging purposes. */
-    code = krb5_unparse_name(ctx, ad_principal, &target);
+
+/*
+ * Push a password change to Active Directory using the credentials in the
+ * given cache.  Takes the module configuration, the target, the operation,
+ * the credential cache, and the new password.  Sets soft if the failure is
+ * one that should make us back off.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+ad_chpass(kadm5_hook_modinfo *config, struct sync_target *target,
+          struct sync_op *op, krb5_ccache ccache, const char *password,
+          bool *soft)
+{
+    krb5_context ctx = op->ctx;
+    krb5_error_code code;
+    const char *display;
+    krb5_principal ad_principal;
+    int result_code = 0;
+    krb5_data result_code_string, result_string;
+
+    /* Get the corresponding AD principal and its name for logging. */
+    code = sync_op_ad_principal(config, op, target, &ad_principal);
     if (code != 0)
-        goto done;
+        return code;
+    code = sync_op_ad_name(config, op, target, &display);
+    if (code != 0)
+        return code;
 
     /* Do the actual password change and record any error. */
-    code = krb5_set_password_using_ccache(ctx, ccache, (char *) password,
-                                          ad_principal, &result_code,
-                                          &result_code_string, &result_string);
-    if (code != 0)
-        goto done;
-    if (result_code != 0) {
+    memset(&result_code_string, 0, sizeof(result_code_string));
+    memset(&result_string, 0, sizeof(result_string));
+    if (sync_hedge_abandoned(op))
+        return sync_error_generic(ctx, "password for %s already changed by"
+                                  " another attempt", display);
+    SYNC_PROBE2(kpasswd_entry, display, target->name);
+    if (SYNC_FAULT(SYNC_FAULT_KPASSWD))
+        code = KRB5_KDC_UNREACH;
+    else
+        code = krb5_set_password_using_ccache(ctx, ccache, (char *) password,
+                                              ad_principal, &result_code,
+                                              &result_code_string,
+                                              &result_string);
+    SYNC_PROBE3(kpasswd_return, display, code, result_code);
+    if (code == 0 && result_code != 0) {
+        *soft = (result_code == KRB5_KPASSWD_SOFTERROR);
         code = sync_error_generic(ctx, "password change failed for %s: (%d)"
-                                  " %.*s%s%.*s", target, result_code,
+                                  " %.*s%s%.*s", display, result_code,
                                   (int) result_code_string.length,
                                   (char *) result_code_string.data,
                                   result_string.length ? ": " : "",
                                   (int) result_string.length,
                                   (char *) result_string.data);
-        goto done;
     }
     free(result_string.data);
     free(result_code_string.data);
-    sync_syslog_info(config, "krb5-sync: %s password changed", target);
+    return code;
+}
 
-done:
-    krb5_cc_destroy(ctx, ccache);
-    if (target != NULL)
-        krb5_free_unparsed_name(ctx, target);
-    if (ad_principal != NULL)
-        krb5_free_principal(ctx, ad_principal);
+
+/*
+ * Make a password change as one attempt.  The attempt may run in a thread
+ * with a Kerberos context of its own, as part of a hedged request or a change
+ * pushed to several targets, so it uses its own uniquely named credential
+ * cache.  Returns a Kerberos error code.
+ */
+krb5_error_code
+sync_ad_chpass_attempt(kadm5_hook_modinfo *config, struct sync_target *target,
+                       struct sync_op *op, const char *password, bool *soft)
+{
+    krb5_ccache ccache;
+    krb5_error_code code;
+
+    code = get_creds(config, target, op->ctx, true, &ccache);
+    if (code != 0)
+        return code;
+    code = ad_chpass(config, target, op, ccache, password, soft);
+    krb5_cc_destroy(op->ctx, ccache);
+    return code;
+}
+
+
+/*
+ * Push a password change to an Active Directory target.  Takes the module
+ * configuration, the target, the operation, whose principal will have its
+ * realm changed, and the new password.  Returns a Kerberos error code.
+ *
+ * Setting a password to the same value twice is harmless, so if a hedge
+ * server is configured and the change takes too long, it may also be sent to
+ * the hedge server.
+ */
+krb5_error_code
+sync_ad_chpass(kadm5_hook_modinfo *config, struct sync_target *target,
+               struct sync_op *op, const char *password)
+{
+    krb5_context ctx = op->ctx;
+    krb5_error_code code;
+    const char *dc;
+    unsigned long delay;
+    uint64_t start;
+    bool soft = false;
+
+    /* Ensure the configuration is sane. */
+    CHECK_CONFIG(ad_realm);
+
+    /* Wait for our turn if we're rate-limited. */
+    dc = sync_control_dc(target);
+    code = sync_control_acquire(config, ctx, dc);
+    if (code != 0)
+        return code;
+    start = ad_now();
+
+    /* Hedge the change if possible, or otherwise make it directly. */
+    delay = sync_hedge_delay(config, target, dc, SYNC_HEDGE_CHPASS);
+    if (delay > 0)
+        code = sync_hedge_chpass(config, target, op, dc, delay, password,
+                                 &soft);
+    else
+        code = sync_ad_chpass_attempt(config, target, op, password, &soft);
+    ad_result(config, target, op, "password", dc, start, delay == 0, code,
+              soft);
     return code;
 }
 
@@ -252,117 +420,245 @@ ad_interact_sasl(LDAP *ld UNUSED, unsigned flags UNUSED,
 
 
 /*
- * Change the status of an account in Active Directory.  Takes the plugin
- * configuration, a Kerberos context, the principal whose status changed (only
- * the principal name is used, ignoring the realm), a flag saying whether the
- * account is enabled, and a buffer into which to put error messages and its
- * length.
+ * Connect to the given server via LDAP and bind using GSSAPI.  The caller is
+ * responsible for pointing SASL at credentials for the bind.  Sets soft if
+ * the failure is one that should make us back off.  Returns a Kerberos error
+ * code.
  */
-krb5_error_code
-sync_ad_status(kadm5_hook_modinfo *config, krb5_context ctx,
-               krb5_principal principal, bool enabled)
+static krb5_error_code
+ad_bind(krb5_context ctx, const char *server, LDAP **result, bool *soft)
 {
-    krb5_ccache ccache;
-    krb5_principal ad_principal = NULL;
     LDAP *ld = NULL;
-    LDAPMessage *res = NULL;
-    LDAPMod mod, *mod_array[2];
-    char *dn;
-    char *ldapuri = NULL, *ldapdn = NULL, *control = NULL, *target = NULL;
-    struct berval **vals = NULL;
-    char *value;
-    const char *attrs[] = { "userAccountControl", NULL };
-    char *strvals[2];
+    char *ldapuri = NULL;
     int option;
-    unsigned int acctcontrol;
     krb5_error_code code;
 
-    /* Ensure the configuration is sane. */
-    CHECK_CONFIG(ad_admin_server);
-    CHECK_CONFIG(ad_ldap_base);
-
-    /* Get the credentials we'll use to make the change in AD. */
-    code = get_creds(config, ctx, &ccache);
-    if (code != 0)
-        return code;
-
-    /*
-     * Point SASL at the memory cache we're about to create.  This is changing
-     * the global environment for kadmind and is therefore quite ugly, but
-     * should hopefully be harmless.  Ideally OpenLDAP should provide some way
-     * of calling through to Cyrus SASL to set the ticket cache, but that's
-     * hard.
-     */
-    if (putenv((char *) "KRB5CCNAME=" CACHE_NAME) != 0) {
-        code = sync_error_system(ctx, "putenv of KRB5CCNAME failed");
-        goto done;
-    }
-
-    /* Now, bind to the directory server using GSSAPI. */
-    if (asprintf(&ldapuri, "ldap://%s", config->ad_admin_server) < 0) {
-        code = sync_error_system(ctx, "cannot allocate memory");
-        goto done;
-    }
+    *result = NULL;
+    if (asprintf(&ldapuri, "ldap://%s", server) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
     code = ldap_initialize(&ld, ldapuri);
+    free(ldapuri);
     if (code != LDAP_SUCCESS) {
-        code = sync_error_ldap(ctx, code, "LDAP initialization failed");
-        goto done;
+        *soft = ldap_soft_error(code);
+        return sync_error_ldap(ctx, code, "LDAP initialization failed");
     }
     option = LDAP_VERSION3;
     code = ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &option);
     if (code != LDAP_SUCCESS) {
+        *soft = ldap_soft_error(code);
         code = sync_error_ldap(ctx, code, "LDAP protocol selection failed");
-        goto done;
+        goto fail;
     }
-    code = ldap_sasl_interactive_bind_s(ld, NULL, "GSSAPI", NULL, NULL,
-                                       LDAP_SASL_QUIET, ad_interact_sasl,
-                                       NULL);
+    SYNC_PROBE1(ldap_bind_entry, server);
+    if (SYNC_FAULT(SYNC_FAULT_LDAP_BIND))
+        code = LDAP_SERVER_DOWN;
+    else
+        code = ldap_sasl_interactive_bind_s(ld, NULL, "GSSAPI", NULL, NULL,
+                                           LDAP_SASL_QUIET, ad_interact_sasl,
+                                           NULL);
+    SYNC_PROBE2(ldap_bind_return, server, code);
     if (code != LDAP_SUCCESS) {
+        *soft = ldap_soft_error(code);
         code = sync_error_ldap(ctx, code, "LDAP bind failed");
-        goto done;
+        goto fail;
+    }
+    *result = ld;
+    return 0;
+
+fail:
+    ldap_unbind_ext_s(ld, NULL, NULL);
+    return code;
+}
+
+
+/*
+ * Copy a value into buffer, escaping the characters that are special in
+ * search filters as described in RFC 4515, and return a pointer to the nul
+ * at the end of the copy.  The buffer must have room for three times the
+ * length of the value plus the nul.
+ */
+static char *
+ad_filter_escape(char *buffer, const char *value)
+{
+    const char *p;
+    char *q = buffer;
+
+    for (p = value; *p != '\0'; p++)
+        if (*p == '*' || *p == '(' || *p == ')' || *p == '\\')
+            q += sprintf(q, "\\%02x", (unsigned int) (unsigned char) *p);
+        else
+            *q++ = *p;
+    *q = '\0';
+    return q;
+}
+
+
+/*
+ * Build a search filter matching the account with the given
+ * userPrincipalName, allocated with the operation.  Returns NULL on memory
+ * allocation failure.
+ */
+static char *
+ad_upn_filter(struct sync_op *op, const char *upn)
+{
+    static const char prefix[] = "(userPrincipalName=";
+    char *filter, *q;
+
+    filter = sync_op_alloc(op, strlen(prefix) + 3 * strlen(upn) + 2);
+    if (filter == NULL)
+        return NULL;
+    strcpy(filter, prefix);
+    q = ad_filter_escape(filter + strlen(prefix), upn);
+    strcpy(q, ")");
+    return filter;
+}
+
+
+/*
+ * Search for the account with the given userPrincipalName in a target,
+ * retrieving the attributes, and store the result, which will hold at least
+ * one entry, in res.  If the DN of the account is cached, read the account
+ * directly, treating it as not cached if it no longer has that
+ * userPrincipalName, and otherwise search for it and cache its DN or that it
+ * doesn't exist.  Cache keys include the target name, since the same
+ * userPrincipalName may be a different account in each.  A cached record
+ * that the account doesn't exist is ignored when draining the queue, which
+ * retries changes because the account may since have been created.  Sets
+ * soft if the failure is one that should make us back off.  Returns a
+ * Kerberos error code.
+ */
+static krb5_error_code
+ad_search_user(kadm5_hook_modinfo *config, struct sync_target *target,
+               struct sync_op *op, LDAP *ld, const char *upn,
+               const char **attrs, LDAPMessage **res, bool *soft)
+{
+    krb5_context ctx = op->ctx;
+    char dn[512];
+    char *key, *filter, *found;
+    bool negative;
+    int status;
+
+    *res = NULL;
+    key = sync_op_printf(op, "%s %s", target->name, upn);
+    filter = ad_upn_filter(op, upn);
+    if (key == NULL || filter == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    if (sync_cache_get(config, SYNC_CACHE_DN, key, dn, sizeof(dn),
+                       &negative)) {
+        if (negative && !config->drain)
+            return sync_error_generic(ctx, "user \"%s\" not found via LDAP",
+                                      upn);
+        if (!negative) {
+            SYNC_PROBE2(ldap_search_entry, upn, dn);
+            if (SYNC_FAULT(SYNC_FAULT_LDAP_SEARCH))
+                status = LDAP_SERVER_DOWN;
+            else
+                status = ldap_search_ext_s(ld, dn, LDAP_SCOPE_BASE, filter,
+                                           (char **) attrs, 0, NULL, NULL,
+                                           NULL, 0, res);
+            SYNC_PROBE2(ldap_search_return, upn, status);
+            if (status == LDAP_SUCCESS && ldap_count_entries(ld, *res) > 0)
+                return 0;
+            if (*res != NULL) {
+                ldap_msgfree(*res);
+                *res = NULL;
+            }
+            if (status != LDAP_SUCCESS && status != LDAP_NO_SUCH_OBJECT) {
+                *soft = ldap_soft_error(status);
+                return sync_error_ldap(ctx, status, "LDAP search for \"%s\""
+                                       " failed", dn);
+            }
+        }
+        sync_cache_remove(config, SYNC_CACHE_DN, key);
+    }
+    SYNC_PROBE2(ldap_search_entry, upn, target->ad_ldap_base);
+    if (SYNC_FAULT(SYNC_FAULT_LDAP_SEARCH))
+        status = LDAP_SERVER_DOWN;
+    else
+        status = ldap_search_ext_s(ld, target->ad_ldap_base,
+                                   LDAP_SCOPE_SUBTREE, filter,
+                                   (char **) attrs, 0, NULL, NULL, NULL, 0,
+                                   res);
+    SYNC_PROBE2(ldap_search_return, upn, status);
+    if (status != LDAP_SUCCESS) {
+        *soft = ldap_soft_error(status);
+        return sync_error_ldap(ctx, status, "LDAP search for \"%s\" failed",
+                               filter);
+    }
+    if (ldap_count_entries(ld, *res) == 0) {
+        sync_cache_put(config, SYNC_CACHE_DN, key, NULL);
+        return sync_error_generic(ctx, "user \"%s\" not found via LDAP",
+                                  upn);
+    }
+    found = ldap_get_dn(ld, ldap_first_entry(ld, *res));
+    if (found != NULL) {
+        sync_cache_put(config, SYNC_CACHE_DN, key, found);
+        ldap_memfree(found);
     }
+    return 0;
+}
+
+
+/*
+ * Change the status of an account in Active Directory via LDAP to the given
+ * server.  Takes the plugin configuration, the target, the operation (only
+ * the principal name is used, ignoring the realm), the server, and a flag
+ * saying whether the account is enabled.  The caller is responsible for
+ * pointing SASL at credentials for the bind.  Sets soft if the failure is one
+ * that should make us back off.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+ad_status(kadm5_hook_modinfo *config, struct sync_target *target,
+          struct sync_op *op, const char *server, bool enabled, bool *soft)
+{
+    krb5_context ctx = op->ctx;
+    LDAP *ld = NULL;
+    LDAPMessage *res = NULL, *entry;
+    LDAPMod mod, *mod_array[2];
+    char *dn = NULL;
+    char *control;
+    const char *display;
+    struct berval **vals = NULL;
+    char *value;
+    const char *attrs[] = { "userAccountControl", NULL };
+    char *strvals[2];
+    unsigned int acctcontrol;
+    krb5_error_code code;
+
+    /* Bind to the directory server using GSSAPI. */
+    code = ad_bind(ctx, server, &ld, soft);
+    if (code != 0)
+        goto done;
 
     /*
      * Since all we know is the local principal, we have to convert that to
      * the AD principal and then query Active Directory via LDAP to get back
      * the CN for the user to construct the full DN.
      */
-    code = get_ad_principal(config, ctx, principal, &ad_principal);
+    code = sync_op_ad_name(config, op, target, &display);
     if (code != 0)
         goto done;
-    code = krb5_unparse_name(ctx, ad_principal, &target);
+    code = ad_search_user(config, target, op, ld, display, attrs, &res, soft);
     if (code != 0)
         goto done;
-    if (asprintf(&ldapdn, "(userPrincipalName=%s)", target) < 0) {
-        code = sync_error_system(ctx, "cannot allocate memory");
-        goto done;
-    }
-    code = ldap_search_ext_s(ld, config->ad_ldap_base, LDAP_SCOPE_SUBTREE,
-                             ldapdn, (char **) attrs, 0, NULL, NULL, NULL, 0,
-                             &res);
-    if (code != LDAP_SUCCESS) {
-        code = sync_error_ldap(ctx, code, "LDAP search for \"%s\" failed",
-                               ldapdn);
-        goto done;
-    }
-    if (ldap_count_entries(ld, res) == 0) {
-        code = sync_error_generic(ctx, "user \"%s\" not found via LDAP",
-                                  target);
-        goto done;
-    }
-    res = ldap_first_entry(ld, res);
-    dn = ldap_get_dn(ld, res);
-    if (ldap_msgtype(res) != LDAP_RES_SEARCH_ENTRY) {
+    entry = ldap_first_entry(ld, res);
+    if (ldap_msgtype(entry) != LDAP_RES_SEARCH_ENTRY) {
         code = sync_error_generic(ctx, "expected LDAP msgtype of"
                                   " RES_SEARCH_ENTRY (0x61), but got type %x"
-                                  " instead", ldap_msgtype(res));
+                                  " instead", ldap_msgtype(entry));
+        goto done;
+    }
+    dn = ldap_get_dn(ld, entry);
+    if (dn == NULL) {
+        code = sync_error_generic(ctx, "cannot get DN for user \"%s\"",
+                                  display);
         goto done;
     }
-    vals = ldap_get_values_len(ld, res, "userAccountControl");
+    vals = ldap_get_values_len(ld, entry, "userAccountControl");
     if (ldap_count_values_len(vals) != 1) {
         code = sync_error_generic(ctx, "expected one value for"
                                   " userAccountControl for user \"%s\" and"
-                                  " got %d", target,
+                                  " got %d", display,
                                   ldap_count_values_len(vals));
         goto done;
     }
@@ -381,7 +677,7 @@ sync_ad_status(kadm5_hook_modinfo *config, krb5_context ctx,
     value[vals[0]->bv_len] = '\0';
     if (sscanf(value, "%u", &acctcontrol) != 1) {
         code = sync_error_generic(ctx, "unable to parse userAccountControl"
-                                  " for user \"%s\" (%s)", target, value);
+                                  " for user \"%s\" (%s)", display, value);
         free(value);
         goto done;
     }
@@ -393,7 +689,8 @@ sync_ad_status(kadm5_hook_modinfo *config, krb5_context ctx,
     memset(&mod, 0, sizeof(mod));
     mod.mod_op = LDAP_MOD_REPLACE;
     mod.mod_type = (char *) "userAccountControl";
-    if (asprintf(&control, "%u", acctcontrol) < 0) {
+    control = sync_op_printf(op, "%u", acctcontrol);
+    if (control == NULL) {
         code = sync_error_system(ctx, "cannot allocate memory");
         goto done;
     }
@@ -402,30 +699,698 @@ sync_ad_status(kadm5_hook_modinfo *config, krb5_context ctx,
     mod.mod_vals.modv_strvals = strvals;
     mod_array[0] = &mod;
     mod_array[1] = NULL;
-    code = ldap_modify_ext_s(ld, dn, mod_array, NULL, NULL);
+    if (sync_hedge_abandoned(op)) {
+        code = sync_error_generic(ctx, "status of %s already changed by"
+                                  " another attempt", display);
+        goto done;
+    }
+    SYNC_PROBE2(ldap_modify_entry, display, dn);
+    if (SYNC_FAULT(SYNC_FAULT_LDAP_MODIFY))
+        code = LDAP_SERVER_DOWN;
+    else
+        code = ldap_modify_ext_s(ld, dn, mod_array, NULL, NULL);
+    SYNC_PROBE2(ldap_modify_return, display, code);
     if (code != LDAP_SUCCESS) {
+        *soft = ldap_soft_error(code);
         code = sync_error_ldap(ctx, code, "LDAP modification for user \"%s\""
-                               " failed", target);
+                               " failed", display);
         goto done;
     }
 
     /* Success. */
     code = 0;
-    sync_syslog_info(config, "successfully %s account %s",
-                     enabled ? "enabled" : "disabled", target);
 
 done:
-    free(ldapuri);
-    free(ldapdn);
-    free(control);
-    krb5_cc_destroy(ctx, ccache);
-    if (target != NULL)
-        krb5_free_unparsed_name(ctx, target);
+    if (dn != NULL)
+        ldap_memfree(dn);
     if (res != NULL)
         ldap_msgfree(res);
     if (vals != NULL)
         ldap_value_free_len(vals);
-    if (ld == NULL)
+    if (ld != NULL)
         ldap_unbind_ext_s(ld, NULL, NULL);
     return code;
 }
+
+
+/*
+ * Obtain credentials for the target and point SASL at them for an LDAP bind,
+ * storing the credential cache in ccache.  If we have gss_krb5_ccache_name,
+ * we use a uniquely named credential cache and point GSSAPI at it for this
+ * thread only, so that this is safe in a thread with a Kerberos context of
+ * its own.  Otherwise, we have to point SASL at the shared memory cache
+ * through the environment.  The caller should call unset_ldap_creds when
+ * done.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+set_ldap_creds(kadm5_hook_modinfo *config, struct sync_target *target,
+               krb5_context ctx, krb5_ccache *ccache)
+{
+    krb5_error_code code;
+#ifdef HAVE_GSS_KRB5_CCACHE_NAME
+    char *name = NULL;
+    OM_uint32 major, minor;
+
+    code = get_creds(config, target, ctx, true, ccache);
+    if (code != 0)
+        return code;
+    if (asprintf(&name, "%s:%s", krb5_cc_get_type(ctx, *ccache),
+                 krb5_cc_get_name(ctx, *ccache)) < 0) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto fail;
+    }
+    major = gss_krb5_ccache_name(&minor, name, NULL);
+    free(name);
+    if (GSS_ERROR(major)) {
+        code = sync_error_generic(ctx, "cannot set GSSAPI ticket cache");
+        goto fail;
+    }
+    return 0;
+#else
+    code = get_creds(config, target, ctx, false, ccache);
+    if (code != 0)
+        return code;
+
+    /*
+     * This is changing the global environment for kadmind and is therefore
+     * quite ugly, but should hopefully be harmless.  Ideally OpenLDAP should
+     * provide some way of calling through to Cyrus SASL to set the ticket
+     * cache, but that's hard.
+     */
+    if (putenv((char *) "KRB5CCNAME=" CACHE_NAME) == 0)
+        return 0;
+    code = sync_error_system(ctx, "putenv of KRB5CCNAME failed");
+    goto fail;
+#endif
+
+fail:
+    krb5_cc_destroy(ctx, *ccache);
+    *ccache = NULL;
+    return code;
+}
+
+
+/*
+ * Undo set_ldap_creds and destroy the credential cache.
+ */
+static void
+unset_ldap_creds(krb5_context ctx, krb5_ccache ccache)
+{
+#ifdef HAVE_GSS_KRB5_CCACHE_NAME
+    OM_uint32 minor;
+
+    gss_krb5_ccache_name(&minor, NULL, NULL);
+#endif
+    krb5_cc_destroy(ctx, ccache);
+}
+
+
+/*
+ * Change the status of an account as one attempt against the given server.
+ * If we have gss_krb5_ccache_name, the attempt may run in a thread with a
+ * Kerberos context of its own as part of a hedged request or a change pushed
+ * to several targets.  Returns a Kerberos error code.
+ */
+krb5_error_code
+sync_ad_status_attempt(kadm5_hook_modinfo *config, struct sync_target *target,
+                       struct sync_op *op, const char *server, bool enabled,
+                       bool *soft)
+{
+    krb5_ccache ccache;
+    krb5_error_code code;
+
+    code = set_ldap_creds(config, target, op->ctx, &ccache);
+    if (code != 0)
+        return code;
+    code = ad_status(config, target, op, server, enabled, soft);
+    unset_ldap_creds(op->ctx, ccache);
+    return code;
+}
+
+
+/*
+ * Change the status of an account in an Active Directory target.  Takes the
+ * plugin configuration, the target, the operation (only the principal name
+ * is used, ignoring the realm), and a flag saying whether the account is
+ * enabled.  Returns a Kerberos error code.
+ *
+ * Setting the account status to the same value twice is harmless, so if a
+ * hedge server is configured and the change takes too long, it may also be
+ * sent to the hedge server.
+ */
+krb5_error_code
+sync_ad_status(kadm5_hook_modinfo *config, struct sync_target *target,
+               struct sync_op *op, bool enabled)
+{
+    krb5_context ctx = op->ctx;
+    const char *dc;
+    unsigned long delay;
+    uint64_t start;
+    bool soft = false;
+    krb5_error_code code;
+
+    /* Ensure the configuration is sane. */
+    CHECK_CONFIG(ad_admin_server);
+    CHECK_CONFIG(ad_ldap_base);
+
+    /* Wait for our turn if we're rate-limited. */
+    dc = sync_control_dc(target);
+    code = sync_control_acquire(config, ctx, dc);
+    if (code != 0)
+        return code;
+    start = ad_now();
+
+    /* Hedge the change if possible, or otherwise make it directly. */
+    delay = sync_hedge_delay(config, target, dc, SYNC_HEDGE_STATUS);
+    if (delay > 0)
+        code = sync_hedge_status(config, target, op, dc, delay, enabled,
+                                 &soft);
+    else
+        code = sync_ad_status_attempt(config, target, op,
+                                      target->ad_admin_server, enabled, &soft);
+    ad_result(config, target, op, enabled ? "enable" : "disable", dc, start,
+              delay == 0, code, soft);
+    return code;
+}
+
+
+/*
+ * Pass one account returned by an LDAP search to the callback.  Searches with
+ * the DirSync control only return changed attributes, so if the entry lacks
+ * its userPrincipalName or userAccountControl, read both back from the
+ * account.  Entries without exactly one of each are skipped.  Returns a
+ * Kerberos error code.
+ */
+static krb5_error_code
+ad_entry(LDAP *ld, krb5_context ctx, LDAPMessage *entry,
+         sync_ad_account_func callback, void *data)
+{
+    LDAPMessage *res = NULL;
+    struct berval **upn, **uac;
+    const char *attrs[] = { "userPrincipalName", "userAccountControl", NULL };
+    char *dn, *name, value[32];
+    unsigned int acctcontrol;
+    krb5_error_code code = 0;
+
+    /* Get both attributes, reading the account if either is missing. */
+    upn = ldap_get_values_len(ld, entry, "userPrincipalName");
+    uac = ldap_get_values_len(ld, entry, "userAccountControl");
+    if (upn == NULL || uac == NULL) {
+        if (upn != NULL)
+            ldap_value_free_len(upn);
+        if (uac != NULL)
+            ldap_value_free_len(uac);
+        upn = NULL;
+        uac = NULL;
+        dn = ldap_get_dn(ld, entry);
+        if (dn == NULL)
+            goto done;
+        code = ldap_search_ext_s(ld, dn, LDAP_SCOPE_BASE, "(objectClass=*)",
+                                 (char **) attrs, 0, NULL, NULL, NULL, 0,
+                                 &res);
+        if (code != LDAP_SUCCESS) {
+            code = sync_error_ldap(ctx, code, "LDAP search for \"%s\" failed",
+                                   dn);
+            ldap_memfree(dn);
+            goto done;
+        }
+        ldap_memfree(dn);
+        code = 0;
+        entry = ldap_first_entry(ld, res);
+        if (entry == NULL)
+            goto done;
+        upn = ldap_get_values_len(ld, entry, "userPrincipalName");
+        uac = ldap_get_values_len(ld, entry, "userAccountControl");
+    }
+    if (ldap_count_values_len(upn) != 1)
+        goto done;
+
+    /* Parse the account status. */
+    if (ldap_count_values_len(uac) != 1 || uac[0]->bv_len >= sizeof(value))
+        goto done;
+    memcpy(value, uac[0]->bv_val, uac[0]->bv_len);
+    value[uac[0]->bv_len] = '\0';
+    if (sscanf(value, "%u", &acctcontrol) != 1)
+        goto done;
+
+    /* Pass the account to the callback. */
+    name = strndup(upn[0]->bv_val, upn[0]->bv_len);
+    if (name == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    callback(data, name, (acctcontrol & UF_ACCOUNTDISABLE) != 0);
+    free(name);
+
+done:
+    if (upn != NULL)
+        ldap_value_free_len(upn);
+    if (uac != NULL)
+        ldap_value_free_len(uac);
+    if (res != NULL)
+        ldap_msgfree(res);
+    return code;
+}
+
+
+/*
+ * Page through every user account in an Active Directory target with a
+ * userPrincipalName, calling the callback for each one.  The caller is
+ * responsible for pointing SASL at credentials for the bind.  Returns a
+ * Kerberos error code.
+ */
+static krb5_error_code
+ad_accounts(struct sync_target *target, krb5_context ctx,
+            sync_ad_account_func callback, void *data)
+{
+    LDAP *ld = NULL;
+    LDAPMessage *res = NULL, *entry;
+    LDAPControl *page = NULL, *controls[2], **returned = NULL, *response;
+    struct berval cookie = { 0, NULL };
+    const char *attrs[] = { "userPrincipalName", "userAccountControl", NULL };
+    ber_int_t estimate;
+    int result;
+    bool soft = false;
+    krb5_error_code code;
+
+    code = ad_bind(ctx, target->ad_admin_server, &ld, &soft);
+    if (code != 0)
+        return code;
+    do {
+        code = ldap_create_page_control(ld, ACCOUNT_PAGE, &cookie, 0, &page);
+        if (code != LDAP_SUCCESS) {
+            code = sync_error_ldap(ctx, code, "cannot create LDAP control");
+            goto done;
+        }
+        controls[0] = page;
+        controls[1] = NULL;
+        code = ldap_search_ext_s(ld, target->ad_ldap_base, LDAP_SCOPE_SUBTREE,
+                                 ACCOUNT_FILTER, (char **) attrs, 0, controls,
+                                 NULL, NULL, 0, &res);
+        ldap_control_free(page);
+        page = NULL;
+        if (code != LDAP_SUCCESS) {
+            code = sync_error_ldap(ctx, code, "LDAP search for accounts"
+                                   " failed");
+            goto done;
+        }
+
+        /* Pass each account in this page to the callback. */
+        for (entry = ldap_first_entry(ld, res); entry != NULL;
+             entry = ldap_next_entry(ld, entry)) {
+            code = ad_entry(ld, ctx, entry, callback, data);
+            if (code != 0)
+                goto done;
+        }
+
+        /* Get the cookie for the next page, if there is one. */
+        code = ldap_parse_result(ld, res, &result, NULL, NULL, NULL,
+                                 &returned, 0);
+        if (code == LDAP_SUCCESS)
+            code = result;
+        if (code != LDAP_SUCCESS) {
+            code = sync_error_ldap(ctx, code, "LDAP search for accounts"
+                                   " failed");
+            goto done;
+        }
+        if (cookie.bv_val != NULL)
+            ber_memfree(cookie.bv_val);
+        cookie.bv_val = NULL;
+        cookie.bv_len = 0;
+        response = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS, returned,
+                                     NULL);
+        if (response != NULL)
+            ldap_parse_pageresponse_control(ld, response, &estimate, &cookie);
+        ldap_controls_free(returned);
+        returned = NULL;
+        ldap_msgfree(res);
+        res = NULL;
+    } while (cookie.bv_len > 0);
+
+done:
+    if (cookie.bv_val != NULL)
+        ber_memfree(cookie.bv_val);
+    if (returned != NULL)
+        ldap_controls_free(returned);
+    if (res != NULL)
+        ldap_msgfree(res);
+    ldap_unbind_ext_s(ld, NULL, NULL);
+    return code;
+}
+
+
+/*
+ * Call the callback for each user account in an Active Directory target,
+ * with its userPrincipalName and whether it is disabled.  The accounts are
+ * retrieved with a paged search, so only one page of them is held in memory
+ * at a time.  Returns a Kerberos error code.
+ */
+krb5_error_code
+sync_ad_accounts(kadm5_hook_modinfo *config, struct sync_target *target,
+                 krb5_context ctx, sync_ad_account_func callback, void *data)
+{
+    krb5_ccache ccache;
+    krb5_error_code code;
+
+    /* Ensure the configuration is sane. */
+    CHECK_CONFIG(ad_admin_server);
+    CHECK_CONFIG(ad_ldap_base);
+
+    /* Search with our credentials. */
+    code = set_ldap_creds(config, target, ctx, &ccache);
+    if (code != 0)
+        return code;
+    code = ad_accounts(target, ctx, callback, data);
+    unset_ldap_creds(ctx, ccache);
+    return code;
+}
+
+
+/*
+ * Build the DN of the root of the domain from the realm, which is where a
+ * DirSync search has to start.  Returns NULL on memory allocation failure.
+ */
+static char *
+ad_realm_dn(const char *realm)
+{
+    const char *r;
+    char *dn, *p;
+    size_t count = 1;
+
+    for (r = realm; *r != '\0'; r++)
+        if (*r == '.')
+            count++;
+    dn = malloc(strlen(realm) + 3 * count + 1);
+    if (dn == NULL)
+        return NULL;
+    memcpy(dn, "dc=", 3);
+    p = dn + 3;
+    for (r = realm; *r != '\0'; r++)
+        if (*r == '.') {
+            memcpy(p, ",dc=", 4);
+            p += 4;
+        } else {
+            *p++ = *r;
+        }
+    *p = '\0';
+    return dn;
+}
+
+
+/*
+ * Create a DirSync request control holding the given cookie.  Returns a
+ * Kerberos error code.
+ */
+static krb5_error_code
+ad_dirsync_control(krb5_context ctx, const void *cookie, size_t length,
+                   LDAPControl **control)
+{
+    BerElement *ber;
+    struct berval *value = NULL;
+    int code;
+
+    ber = ber_alloc_t(LBER_USE_DER);
+    if (ber == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    if (ber_printf(ber, "{iio}", (ber_int_t) DIRSYNC_OBJECT_SECURITY,
+                   (ber_int_t) 0, (cookie == NULL) ? "" : cookie,
+                   (ber_len_t) length) < 0
+        || ber_flatten(ber, &value) < 0) {
+        ber_free(ber, 1);
+        return sync_error_generic(ctx, "cannot encode DirSync control");
+    }
+    ber_free(ber, 1);
+    code = ldap_control_create(DIRSYNC_OID, 1, value, 1, control);
+    ber_bvfree(value);
+    if (code != LDAP_SUCCESS)
+        return sync_error_ldap(ctx, code, "cannot create LDAP control");
+    return 0;
+}
+
+
+/*
+ * Parse the DirSync response control from the controls returned with a
+ * search result, replacing the cookie with the new one and setting more if
+ * there are more changes to retrieve.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+ad_dirsync_response(krb5_context ctx, LDAPControl **returned, void **cookie,
+                    size_t *length, bool *more)
+{
+    LDAPControl *response;
+    BerElement *ber;
+    struct berval *value = NULL;
+    ber_int_t flag, unused;
+    void *copy;
+
+    response = ldap_control_find(DIRSYNC_OID, returned, NULL);
+    if (response == NULL)
+        return sync_error_generic(ctx, "no DirSync control in LDAP response");
+    ber = ber_init(&response->ldctl_value);
+    if (ber == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    if (ber_scanf(ber, "{iiO}", &flag, &unused, &value) == LBER_ERROR) {
+        ber_free(ber, 1);
+        return sync_error_generic(ctx, "cannot parse DirSync control");
+    }
+    ber_free(ber, 1);
+    copy = malloc(value->bv_len > 0 ? value->bv_len : 1);
+    if (copy == NULL) {
+        ber_bvfree(value);
+        return sync_error_system(ctx, "cannot allocate memory");
+    }
+    memcpy(copy, value->bv_val, value->bv_len);
+    free(*cookie);
+    *cookie = copy;
+    *length = value->bv_len;
+    *more = (flag != 0);
+    ber_bvfree(value);
+    return 0;
+}
+
+
+/*
+ * Search for the accounts changed since the search that returned the cookie
+ * using the DirSync control, repeating the search until Active Directory
+ * says there are no more changes.  Sets invalid if the first search failed
+ * and we passed in a cookie, in which case Active Directory probably rejected
+ * the cookie.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+ad_changes(struct sync_target *target, krb5_context ctx, void **cookie,
+           size_t *length, bool *invalid, sync_ad_account_func callback,
+           void *data)
+{
+    LDAP *ld = NULL;
+    LDAPMessage *res = NULL, *entry;
+    LDAPControl *control = NULL, *controls[2], **returned = NULL;
+    const char *attrs[] = { "userPrincipalName", "userAccountControl", NULL };
+    char *base = NULL;
+    int result;
+    bool more = false, first = true, soft = false;
+    krb5_error_code code;
+
+    code = ad_bind(ctx, target->ad_admin_server, &ld, &soft);
+    if (code != 0)
+        return code;
+    base = ad_realm_dn(target->ad_realm);
+    if (base == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    do {
+        code = ad_dirsync_control(ctx, *cookie, *length, &control);
+        if (code != 0)
+            goto done;
+        controls[0] = control;
+        controls[1] = NULL;
+        code = ldap_search_ext_s(ld, base, LDAP_SCOPE_SUBTREE, CHANGE_FILTER,
+                                 (char **) attrs, 0, controls, NULL, NULL, 0,
+                                 &res);
+        ldap_control_free(control);
+        if (code == LDAP_SUCCESS) {
+            code = ldap_parse_result(ld, res, &result, NULL, NULL, NULL,
+                                     &returned, 0);
+            if (code == LDAP_SUCCESS)
+                code = result;
+        }
+        if (code != LDAP_SUCCESS) {
+            *invalid = (first && *cookie != NULL && !ldap_soft_error(code));
+            code = sync_error_ldap(ctx, code, "LDAP DirSync search failed");
+            goto done;
+        }
+        first = false;
+
+        /* Pass each changed account to the callback. */
+        for (entry = ldap_first_entry(ld, res); entry != NULL;
+             entry = ldap_next_entry(ld, entry)) {
+            code = ad_entry(ld, ctx, entry, callback, data);
+            if (code != 0)
+                goto done;
+        }
+
+        /* Save the new cookie and see if there is more. */
+        code = ad_dirsync_response(ctx, returned, cookie, length, &more);
+        if (code != 0)
+            goto done;
+        ldap_controls_free(returned);
+        returned = NULL;
+        ldap_msgfree(res);
+        res = NULL;
+    } while (more);
+
+done:
+    free(base);
+    if (returned != NULL)
+        ldap_controls_free(returned);
+    if (res != NULL)
+        ldap_msgfree(res);
+    ldap_unbind_ext_s(ld, NULL, NULL);
+    return code;
+}
+
+
+/*
+ * The same as sync_ad_accounts, but only returning the accounts changed since
+ * the search that returned the cookie, using the DirSync control.  A NULL
+ * cookie returns every account.  The cookie is replaced by the new one, and
+ * invalid is set if Active Directory rejected the old one.  Returns a
+ * Kerberos error code.
+ */
+krb5_error_code
+sync_ad_changes(kadm5_hook_modinfo *config, struct sync_target *target,
+                krb5_context ctx, void **cookie, size_t *length, bool *invalid,
+                sync_ad_account_func callback, void *data)
+{
+    krb5_ccache ccache;
+    krb5_error_code code;
+
+    /* Ensure the configuration is sane. */
+    *invalid = false;
+    CHECK_CONFIG(ad_admin_server);
+    CHECK_CONFIG(ad_realm);
+
+    /* Search with our credentials. */
+    code = set_ldap_creds(config, target, ctx, &ccache);
+    if (code != 0)
+        return code;
+    code = ad_changes(target, ctx, cookie, length, invalid, callback, data);
+    unset_ldap_creds(ctx, ccache);
+    return code;
+}
+
+
+/*
+ * Build a search filter matching the accounts with the userPrincipalNames
+ * from start up to but not including end in upns.  Returns the newly
+ * allocated filter or NULL on memory allocation failure.
+ */
+static char *
+ad_lookup_filter(struct vector *upns, size_t start, size_t end)
+{
+    static const char prefix[] = "(&(objectClass=user)(|";
+    static const char clause[] = "(userPrincipalName=";
+    char *filter, *q;
+    size_t i, length;
+
+    length = strlen(prefix) + strlen("))") + 1;
+    for (i = start; i < end; i++)
+        length += strlen(clause) + 3 * strlen(upns->strings[i]) + 1;
+    filter = malloc(length);
+    if (filter == NULL)
+        return NULL;
+    q = filter + sprintf(filter, "%s", prefix);
+    for (i = start; i < end; i++) {
+        q += sprintf(q, "%s", clause);
+        q = ad_filter_escape(q, upns->strings[i]);
+        *q++ = ')';
+    }
+    strcpy(q, "))");
+    return filter;
+}
+
+
+/*
+ * Search for the given accounts, LOOKUP_BATCH of them at a time, and pass
+ * each one found to the callback.  The caller is responsible for pointing
+ * SASL at credentials for the bind.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+ad_lookup(struct sync_target *target, krb5_context ctx, struct vector *upns,
+          sync_ad_account_func callback, void *data)
+{
+    LDAP *ld = NULL;
+    LDAPMessage *res = NULL, *entry;
+    const char *attrs[] = { "userPrincipalName", "userAccountControl", NULL };
+    char *filter = NULL;
+    size_t start, end;
+    bool soft = false;
+    krb5_error_code code;
+
+    code = ad_bind(ctx, target->ad_admin_server, &ld, &soft);
+    if (code != 0)
+        return code;
+    for (start = 0; start < upns->count; start = end) {
+        end = start + LOOKUP_BATCH;
+        if (end > upns->count)
+            end = upns->count;
+        filter = ad_lookup_filter(upns, start, end);
+        if (filter == NULL) {
+            code = sync_error_system(ctx, "cannot allocate memory");
+            goto done;
+        }
+        code = ldap_search_ext_s(ld, target->ad_ldap_base, LDAP_SCOPE_SUBTREE,
+                                 filter, (char **) attrs, 0, NULL, NULL, NULL,
+                                 0, &res);
+        free(filter);
+        if (code != LDAP_SUCCESS) {
+            code = sync_error_ldap(ctx, code, "LDAP search for accounts"
+                                   " failed");
+            goto done;
+        }
+        for (entry = ldap_first_entry(ld, res); entry != NULL;
+             entry = ldap_next_entry(ld, entry)) {
+            code = ad_entry(ld, ctx, entry, callback, data);
+            if (code != 0)
+                goto done;
+        }
+        ldap_msgfree(res);
+        res = NULL;
+    }
+
+done:
+    if (res != NULL)
+        ldap_msgfree(res);
+    ldap_unbind_ext_s(ld, NULL, NULL);
+    return code;
+}
+
+
+/*
+ * Look up the status of the accounts with the given userPrincipalNames,
+ * passing each one found to the callback.  Accounts are searched for in
+ * batches to keep the number of searches small.  Returns a Kerberos error
+ * code.
+ */
+krb5_error_code
+sync_ad_lookup(kadm5_hook_modinfo *config, struct sync_target *target,
+               krb5_context ctx, struct vector *upns,
+               sync_ad_account_func callback, void *data)
+{
+    krb5_ccache ccache;
+    krb5_error_code code;
+
+    /* Ensure the configuration is sane. */
+    CHECK_CONFIG(ad_admin_server);
+    CHECK_CONFIG(ad_ldap_base);
+
+    /* Search with our credentials. */
+    if (upns->count == 0)
+        return 0;
+    code = set_ldap_creds(config, target, ctx, &ccache);
+    if (code != 0)
+        return code;
+    code = ad_lookup(target, ctx, upns, callback, data);
+    unset_ldap_creds(ctx, ccache);
+    return code;
+}
@@ -0,0 +1,346 @@
+/*
+ * Persistent cache of directory lookups.
+ *
+ * Some of the work done for a change is a lookup whose answer rarely
+ * changes: the DN of the Active Directory account for a userPrincipalName,
+ * whether that account exists at all, and that the ad_base_instance instance
+ * of a principal doesn't exist in the local KDC database.  If
+ * ad_cache_ttl is set, the answers are kept for that many seconds in a
+ * cache shared by kadmind, kpasswdd, and every krb5-sync process.
+ *
+ * The cache is a fixed-size hash table in a file in the queue directory,
+ * which each process maps into memory the first time it needs it and
+ * modifies while holding an flock on it, like the controller state.  Since
+ * the mapping is shared, every change is written back to the file by the
+ * kernel, and a restarted kadmind starts with the cache as it was left
+ * without reading or copying it.  Each entry carries the time at which it
+ * was stored, so entries older than the TTL are ignored and eventually
+ * replaced.  Negative entries, recording that an account doesn't exist,
+ * expire sooner so that new accounts are noticed quickly.
+ *
+ * The cache is an optimization, so any failure to map or lock it just
+ * disables it.  userAccountControl values are never cached, since account
+ * status changes have to modify the current value.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+
+/* Identify the format of the cache file so that we can change it later. */
+#define CACHE_MAGIC   0x6b736361U
+#define CACHE_VERSION 1
+
+/*
+ * Number of entries in the cache, which must be a power of two, and the
+ * number of slots after the hash slot in which an entry may be stored.
+ */
+#define CACHE_SLOTS 2048
+#define CACHE_PROBE 8
+
+/* Maximum lifetime of a negative entry, in seconds. */
+#define CACHE_NEGATIVE_TTL 60
+
+/* One entry, sized so that an entry is 512 bytes. */
+struct cache_entry {
+    uint64_t stored;            /* When the entry was stored, in seconds. */
+    uint32_t hash;
+    uint16_t kind;              /* 0 if the slot is empty. */
+    uint16_t negative;          /* Whether the key is known not to exist. */
+    char key[232];
+    char value[264];
+};
+
+/* The layout of the mapped cache file. */
+struct cache_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t unused;
+    struct cache_entry entry[CACHE_SLOTS];
+};
+
+/* Our handle on the mapped cache file. */
+struct sync_cache {
+    int fd;
+    pid_t pid;
+    struct cache_file *file;
+};
+
+/* Serializes the threads of this process, which share the flock. */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/*
+ * Unmap the cache file.
+ */
+void
+sync_cache_close(kadm5_hook_modinfo *config)
+{
+    if (config->cache == NULL)
+        return;
+    munmap(config->cache->file, sizeof(struct cache_file));
+    close(config->cache->fd);
+    free(config->cache);
+    config->cache = NULL;
+}
+
+
+/*
+ * Map the cache file into memory, creating and initializing it if needed,
+ * and lock it.  If we've already mapped it in this process, only lock it.  A
+ * mapping made by our parent process is discarded, since we share its file
+ * descriptor and therefore its flock.  Returns false if the cache is
+ * disabled or can't be mapped, in which case nothing is locked.
+ */
+static bool
+cache_lock(kadm5_hook_modinfo *config)
+{
+    struct sync_cache *cache;
+    struct cache_file *file;
+    struct stat st;
+    char *path = NULL;
+    void *map;
+
+    if (config->queue_dir == NULL || config->ad_cache_ttl <= 0)
+        return false;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&cache_mutex);
+#endif
+    if (config->cache != NULL && config->cache->pid != getpid())
+        sync_cache_close(config);
+    if (config->cache != NULL) {
+        flock(config->cache->fd, LOCK_EX);
+        return true;
+    }
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        goto fail;
+    cache->fd = -1;
+    if (asprintf(&path, "%s/.cache", config->queue_dir) < 0)
+        goto fail;
+    cache->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (cache->fd < 0)
+        goto fail;
+    if (flock(cache->fd, LOCK_EX) < 0 || fstat(cache->fd, &st) < 0)
+        goto fail;
+    if (st.st_size < (off_t) sizeof(struct cache_file))
+        if (ftruncate(cache->fd, sizeof(struct cache_file)) < 0)
+            goto fail;
+    map = mmap(NULL, sizeof(struct cache_file), PROT_READ | PROT_WRITE,
+               MAP_SHARED, cache->fd, 0);
+    if (map == MAP_FAILED)
+        goto fail;
+    file = map;
+    if (file->magic != CACHE_MAGIC || file->version != CACHE_VERSION
+        || file->slots != CACHE_SLOTS) {
+        memset(file, 0, sizeof(*file));
+        file->magic = CACHE_MAGIC;
+        file->version = CACHE_VERSION;
+        file->slots = CACHE_SLOTS;
+    }
+    cache->file = file;
+    cache->pid = getpid();
+    config->cache = cache;
+    free(path);
+    return true;
+
+fail:
+    if (cache != NULL && cache->fd >= 0)
+        close(cache->fd);
+    free(cache);
+    free(path);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&cache_mutex);
+#endif
+    return false;
+}
+
+
+/*
+ * Unlock the cache file.
+ */
+static void
+cache_unlock(kadm5_hook_modinfo *config)
+{
+    flock(config->cache->fd, LOCK_UN);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&cache_mutex);
+#endif
+}
+
+
+/*
+ * Hash the kind and key of an entry with FNV-1a.
+ */
+static uint32_t
+cache_hash(enum sync_cache_kind kind, const char *key)
+{
+    uint32_t hash = 2166136261U;
+    const unsigned char *p;
+
+    hash = (hash ^ (uint32_t) kind) * 16777619U;
+    for (p = (const unsigned char *) key; *p != '\0'; p++)
+        hash = (hash ^ *p) * 16777619U;
+    return hash;
+}
+
+
+/*
+ * Return the slot i slots after the slot for a hash.  Must be called with the
+ * cache locked.
+ */
+static struct cache_entry *
+cache_slot(kadm5_hook_modinfo *config, uint32_t hash, size_t i)
+{
+    return &config->cache->file->entry[(hash + i) & (CACHE_SLOTS - 1)];
+}
+
+
+/*
+ * Return true if an entry has expired or was stored in the future, which
+ * means that the clock went backwards.
+ */
+static bool
+cache_expired(kadm5_hook_modinfo *config, const struct cache_entry *entry,
+              uint64_t now)
+{
+    uint64_t ttl = (uint64_t) config->ad_cache_ttl;
+
+    if (entry->negative && ttl > CACHE_NEGATIVE_TTL)
+        ttl = CACHE_NEGATIVE_TTL;
+    return entry->stored > now || now - entry->stored >= ttl;
+}
+
+
+/*
+ * Find the entry for a key.  Must be called with the cache locked.  Returns
+ * NULL if the key isn't in the cache.
+ */
+static struct cache_entry *
+cache_find(kadm5_hook_modinfo *config, enum sync_cache_kind kind,
+           const char *key, uint32_t hash)
+{
+    struct cache_entry *entry;
+    size_t i;
+
+    for (i = 0; i < CACHE_PROBE; i++) {
+        entry = cache_slot(config, hash, i);
+        if (entry->kind == (uint16_t) kind && entry->hash == hash
+            && strncmp(entry->key, key, sizeof(entry->key)) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+
+/*
+ * Look up a key in the cache.  If there is an entry that hasn't expired,
+ * copy its value into the buffer, set negative to whether it records that
+ * the key doesn't exist, and return true.  Otherwise, return false.
+ */
+bool
+sync_cache_get(kadm5_hook_modinfo *config, enum sync_cache_kind kind,
+               const char *key, char *value, size_t size, bool *negative)
+{
+    struct cache_entry *entry;
+    bool found = false;
+
+    if (strlen(key) >= sizeof(entry->key) || !cache_lock(config))
+        return false;
+    entry = cache_find(config, kind, key, cache_hash(kind, key));
+    if (entry != NULL && !cache_expired(config, entry, (uint64_t) time(NULL))
+        && strlen(entry->value) < size) {
+        strcpy(value, entry->value);
+        *negative = entry->negative;
+        found = true;
+    }
+    cache_unlock(config);
+    sync_stats_cache(config, kind, found);
+    return found;
+}
+
+
+/*
+ * Store a value for a key in the cache, or record that the key doesn't exist
+ * if value is NULL.  The entry replaces any existing entry for the key,
+ * the first empty or expired slot, or the oldest entry, in that order.  Keys
+ * and values that don't fit in an entry aren't cached.
+ */
+void
+sync_cache_put(kadm5_hook_modinfo *config, enum sync_cache_kind kind,
+               const char *key, const char *value)
+{
+    struct cache_entry *entry, *slot;
+    uint32_t hash;
+    uint64_t now;
+    size_t i;
+
+    if (value == NULL)
+        value = "";
+    if (strlen(key) >= sizeof(entry->key)
+        || strlen(value) >= sizeof(entry->value))
+        return;
+    if (!cache_lock(config))
+        return;
+    now = (uint64_t) time(NULL);
+    hash = cache_hash(kind, key);
+    entry = cache_find(config, kind, key, hash);
+    for (i = 0; entry == NULL && i < CACHE_PROBE; i++) {
+        slot = cache_slot(config, hash, i);
+        if (slot->kind == 0 || cache_expired(config, slot, now))
+            entry = slot;
+    }
+    if (entry == NULL) {
+        entry = cache_slot(config, hash, 0);
+        for (i = 1; i < CACHE_PROBE; i++) {
+            slot = cache_slot(config, hash, i);
+            if (slot->stored < entry->stored)
+                entry = slot;
+        }
+    }
+    entry->stored = now;
+    entry->hash = hash;
+    entry->kind = (uint16_t) kind;
+    entry->negative = (value[0] == '\0');
+    strcpy(entry->key, key);
+    strcpy(entry->value, value);
+    cache_unlock(config);
+}
+
+
+/*
+ * Remove the entry for a key from the cache, if there is one.  Used when we
+ * find that a cached value is wrong.
+ */
+void
+sync_cache_remove(kadm5_hook_modinfo *config, enum sync_cache_kind kind,
+                  const char *key)
+{
+    struct cache_entry *entry;
+
+    if (strlen(key) >= sizeof(entry->key) || !cache_lock(config))
+        return;
+    entry = cache_find(config, kind, key, cache_hash(kind, key));
+    if (entry != NULL)
+        memset(entry, 0, sizeof(*entry));
+    cache_unlock(config);
+}
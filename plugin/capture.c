@@ -0,0 +1,216 @@
+/*
+ * Capture of the changes seen by the plugin for later replay.
+ *
+ * If the capture_file option is set, each change that kadmind passes to the
+ * plugin is appended to that file as a fixed-size binary record giving when
+ * it started, whether it was a password or status change, the shape of the
+ * principal, the outcome, and how long the plugin took, so that a real
+ * workload can be replayed against the test stand-ins with tests/bench/load.
+ * Passwords are never recorded, and principals are replaced by a keyed hash
+ * of their first component, so the same user always gets the same
+ * pseudonym within one capture file while their name isn't recorded.  The
+ * key is chosen at random when the file is created and kept in its header
+ * so that every process capturing to the same file agrees on it.
+ *
+ * Each record is written with a single write to a file opened for
+ * appending, so processes capturing to the same file don't need to lock it.
+ * The capture is supplemental, so records that can't be written are
+ * dropped.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+
+/* The state of the capture. */
+struct sync_capture {
+    int fd;
+    uint64_t key;
+};
+
+
+/*
+ * Choose a key for the pseudonyms in a new capture file, from /dev/urandom
+ * if possible and otherwise from the time and process ID.
+ */
+static uint64_t
+capture_key(void)
+{
+    uint64_t key = 0;
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &key, sizeof(key)) != sizeof(key))
+            key = 0;
+        close(fd);
+    }
+    if (key == 0)
+        key = (sync_stats_now() << 16) ^ (uint64_t) getpid();
+    return key;
+}
+
+
+/*
+ * Hash a string with the key of the capture file, using FNV-1a seeded with
+ * the key and the SplitMix64 finalizer so that similar names don't get
+ * similar pseudonyms.
+ */
+static uint64_t
+capture_hash(uint64_t key, const char *string, size_t length)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325) ^ key;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char) string[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    hash ^= hash >> 30;
+    hash *= UINT64_C(0xbf58476d1ce4e5b9);
+    hash ^= hash >> 27;
+    hash *= UINT64_C(0x94d049bb133111eb);
+    hash ^= hash >> 31;
+    return hash;
+}
+
+
+/*
+ * Open the capture file if the capture_file option is set, writing its
+ * header if it's new and otherwise taking the key from its header.  The
+ * file is locked while doing this so that two processes creating it at the
+ * same time agree on the key.  Returns a Kerberos status code, which is an
+ * error if the file can't be opened or isn't a capture file.
+ */
+krb5_error_code
+sync_capture_init(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_capture *capture;
+    struct sync_capture_header header;
+    struct stat st;
+    char *file = NULL;
+    krb5_error_code code;
+    int fd;
+
+    sync_config_string(ctx, "capture_file", &file);
+    if (file == NULL)
+        return 0;
+    fd = open(file, O_RDWR | O_APPEND | O_CREAT, 0600);
+    if (fd < 0) {
+        code = sync_error_system(ctx, "cannot open capture file %s", file);
+        free(file);
+        return code;
+    }
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+        code = sync_error_system(ctx, "cannot lock capture file %s", file);
+        goto fail;
+    }
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        header.magic = SYNC_CAPTURE_MAGIC;
+        header.version = SYNC_CAPTURE_VERSION;
+        header.key = capture_key();
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            code = sync_error_system(ctx, "cannot write capture file %s",
+                                     file);
+            goto fail;
+        }
+    } else if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+               || header.magic != SYNC_CAPTURE_MAGIC
+               || header.version != SYNC_CAPTURE_VERSION) {
+        code = sync_error_config(ctx, "%s is not a capture file of version"
+                                 " %d", file, SYNC_CAPTURE_VERSION);
+        goto fail;
+    }
+    flock(fd, LOCK_UN);
+    capture = calloc(1, sizeof(*capture));
+    if (capture == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto fail;
+    }
+    capture->fd = fd;
+    capture->key = header.key;
+    config->capture = capture;
+    free(file);
+    return 0;
+
+fail:
+    close(fd);
+    free(file);
+    return code;
+}
+
+
+/*
+ * Append a record of a change to the capture file, if there is one.  type is
+ * the kind of change, enabled is the new status for a status change, and
+ * start is when the plugin saw the change.  The shape of the principal is
+ * taken from the operation, whose principal was allowed if allowed is set.
+ */
+void
+sync_capture_record(kadm5_hook_modinfo *config, struct sync_op *op,
+                    enum sync_stats_type type, bool enabled, bool allowed,
+                    krb5_error_code code, uint64_t start)
+{
+    struct sync_capture *capture = config->capture;
+    struct sync_capture_record record;
+    uint64_t now;
+    size_t length;
+    int ncomp;
+
+    if (capture == NULL || op->user == NULL)
+        return;
+    now = sync_stats_now();
+    memset(&record, 0, sizeof(record));
+    record.time = start;
+    record.latency = (now > start) ? now - start : 0;
+    length = strcspn(op->user, "/");
+    record.user = capture_hash(capture->key, op->user, length);
+    record.length = (length > UINT8_MAX) ? UINT8_MAX : (uint8_t) length;
+    ncomp = krb5_principal_get_num_comp(op->ctx, op->principal);
+    record.components = (ncomp > UINT8_MAX) ? UINT8_MAX : (uint8_t) ncomp;
+    if (ncomp <= 1)
+        record.shape = SYNC_CAPTURE_BASE;
+    else if (allowed)
+        record.shape = SYNC_CAPTURE_INSTANCE;
+    else
+        record.shape = SYNC_CAPTURE_OTHER;
+    record.type = (uint8_t) type;
+    record.enabled = enabled;
+    record.queued = (op->queued > UINT8_MAX) ? UINT8_MAX : op->queued;
+    if (code != 0)
+        record.outcome = SYNC_CAPTURE_FAILED;
+    else if (!allowed)
+        record.outcome = SYNC_CAPTURE_SKIPPED;
+    else if (op->queued > 0)
+        record.outcome = SYNC_CAPTURE_QUEUED;
+    else
+        record.outcome = SYNC_CAPTURE_SUCCESS;
+    if (write(capture->fd, &record, sizeof(record)) != sizeof(record))
+        return;
+}
+
+
+/*
+ * Close the capture file.
+ */
+void
+sync_capture_close(kadm5_hook_modinfo *config)
+{
+    if (config->capture == NULL)
+        return;
+    close(config->capture->fd);
+    free(config->capture);
+    config->capture = NULL;
+}
@@ -0,0 +1,298 @@
+/*
+ * Obtaining credentials for Active Directory.
+ *
+ * Every change pushed to Active Directory needs a ticket-granting ticket for
+ * the target's ad_principal.  By default, we get a new one from the keytab
+ * for every change.  If ad_ccache is set, we instead look in that credential
+ * cache for a ticket that isn't about to expire, so that kadmind, kpasswdd,
+ * and krb5-sync processes can all share one set of tickets.  When the shared
+ * tickets are missing or near expiration, whichever process notices first
+ * refreshes them while holding a lock, and the others wait for it and then
+ * use the new tickets.  If the shared cache can't be refreshed, the new
+ * tickets are still used for the change and a warning is logged.
+ *
+ * FILE caches are locked with flock on a file named after the cache with
+ * .lock appended, and are replaced atomically by writing a temporary cache
+ * and renaming it over the shared cache so that readers never see a
+ * partially written cache.  Other cache types, such as KCM, are initialized
+ * in place without a lock, since the cache daemon serializes access and a
+ * lost race only costs an extra authentication.
+ *
+ * Callers never get a handle to the shared cache.  Instead, they get a copy
+ * of the credentials to store in a private memory cache, so service tickets
+ * are never written to the shared cache and it is never destroyed.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+
+#include <plugin/internal.h>
+#include <util/macros.h>
+
+/* Refresh shared tickets that expire within this many seconds. */
+#define CCACHE_MARGIN (5 * 60)
+
+
+/*
+ * Obtain initial credentials for princ from the target's keytab, storing them
+ * in creds.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+keytab_creds(struct sync_target *target, krb5_context ctx,
+             krb5_principal princ, krb5_creds *creds)
+{
+    krb5_error_code code;
+    krb5_keytab kt = NULL;
+    krb5_get_init_creds_opt *opts = NULL;
+    const char *realm UNUSED;
+
+    /* Resolve the keytab used to get credentials. */
+    code = krb5_kt_resolve(ctx, target->ad_keytab, &kt);
+    if (code != 0)
+        return code;
+
+    /* Set our credential acquisition options. */
+    code = krb5_get_init_creds_opt_alloc(ctx, &opts);
+    if (code != 0) {
+        krb5_kt_close(ctx, kt);
+        return code;
+    }
+    realm = krb5_principal_get_realm(ctx, princ);
+    krb5_get_init_creds_opt_set_default_flags(ctx, "krb5-sync", realm, opts);
+
+    /* Obtain credentials. */
+    memset(creds, 0, sizeof(*creds));
+    code = krb5_get_init_creds_keytab(ctx, creds, princ, kt, 0, NULL, opts);
+    krb5_get_init_creds_opt_free(ctx, opts);
+    krb5_kt_close(ctx, kt);
+    return code;
+}
+
+
+/*
+ * Look in the shared cache for a ticket-granting ticket for princ that won't
+ * expire within CCACHE_MARGIN, storing a copy of it in creds.  Returns true if
+ * one was found and false otherwise, including if the cache doesn't exist.
+ */
+static bool
+shared_valid(krb5_context ctx, krb5_ccache cache, krb5_principal princ,
+             krb5_creds *creds)
+{
+    krb5_creds mcreds;
+    krb5_principal tgs;
+    krb5_timestamp now;
+    const char *realm;
+    krb5_error_code code;
+
+    realm = krb5_principal_get_realm(ctx, princ);
+    if (realm == NULL)
+        return false;
+    code = krb5_build_principal(ctx, &tgs, strlen(realm), realm, "krbtgt",
+                                realm, (const char *) NULL);
+    if (code != 0)
+        return false;
+    memset(&mcreds, 0, sizeof(mcreds));
+    mcreds.client = princ;
+    mcreds.server = tgs;
+    code = krb5_cc_retrieve_cred(ctx, cache, 0, &mcreds, creds);
+    krb5_free_principal(ctx, tgs);
+    if (code != 0)
+        return false;
+    code = krb5_timeofday(ctx, &now);
+    if (code != 0 || creds->times.endtime - now < CCACHE_MARGIN) {
+        krb5_free_cred_contents(ctx, creds);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Lock the shared cache for a refresh if it is a FILE cache, storing the file
+ * descriptor of the lock in fd, or -1 if no lock was needed.  Returns a
+ * Kerberos status code.
+ */
+static krb5_error_code
+shared_lock(krb5_context ctx, krb5_ccache cache, int *fd)
+{
+    char *lockpath;
+    krb5_error_code code;
+
+    *fd = -1;
+    if (strcmp(krb5_cc_get_type(ctx, cache), "FILE") != 0)
+        return 0;
+    if (asprintf(&lockpath, "%s.lock", krb5_cc_get_name(ctx, cache)) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    *fd = open(lockpath, O_RDWR | O_CREAT, 0600);
+    if (*fd < 0) {
+        code = sync_error_system(ctx, "cannot open lock file %s", lockpath);
+        free(lockpath);
+        return code;
+    }
+    while (flock(*fd, LOCK_EX) < 0)
+        if (errno != EINTR) {
+            code = sync_error_system(ctx, "cannot flock lock file %s",
+                                     lockpath);
+            close(*fd);
+            *fd = -1;
+            free(lockpath);
+            return code;
+        }
+    free(lockpath);
+    return 0;
+}
+
+
+/*
+ * Store new credentials in the shared cache.  A FILE cache is written to a
+ * temporary file that is then renamed over the shared cache.  Returns a
+ * Kerberos status code.
+ */
+static krb5_error_code
+shared_store(krb5_context ctx, krb5_ccache cache, krb5_principal princ,
+             krb5_creds *creds)
+{
+    char *tmppath = NULL, *tmpname = NULL;
+    const char *path;
+    krb5_ccache tmp = NULL;
+    int fd;
+    krb5_error_code code;
+
+    /* Other cache types are initialized in place. */
+    if (strcmp(krb5_cc_get_type(ctx, cache), "FILE") != 0) {
+        code = krb5_cc_initialize(ctx, cache, princ);
+        if (code == 0)
+            code = krb5_cc_store_cred(ctx, cache, creds);
+        return code;
+    }
+
+    /* Create the temporary cache next to the shared one. */
+    path = krb5_cc_get_name(ctx, cache);
+    if (asprintf(&tmppath, "%s.XXXXXX", path) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    fd = mkstemp(tmppath);
+    if (fd < 0) {
+        code = sync_error_system(ctx, "cannot create %s", tmppath);
+        free(tmppath);
+        return code;
+    }
+    close(fd);
+    if (asprintf(&tmpname, "FILE:%s", tmppath) < 0) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto fail;
+    }
+
+    /* Write the credentials and rename the cache into place. */
+    code = krb5_cc_resolve(ctx, tmpname, &tmp);
+    if (code != 0)
+        goto fail;
+    code = krb5_cc_initialize(ctx, tmp, princ);
+    if (code == 0)
+        code = krb5_cc_store_cred(ctx, tmp, creds);
+    krb5_cc_close(ctx, tmp);
+    if (code != 0)
+        goto fail;
+    if (rename(tmppath, path) < 0) {
+        code = sync_error_system(ctx, "cannot rename %s to %s", tmppath,
+                                 path);
+        goto fail;
+    }
+    free(tmpname);
+    free(tmppath);
+    return 0;
+
+fail:
+    unlink(tmppath);
+    free(tmpname);
+    free(tmppath);
+    return code;
+}
+
+
+/*
+ * Log a warning that the shared cache couldn't be refreshed, with the error
+ * message for code.
+ */
+static void
+shared_warn(kadm5_hook_modinfo *config, struct sync_target *target,
+            krb5_context ctx, krb5_error_code code)
+{
+    const char *message;
+
+    message = krb5_get_error_message(ctx, code);
+    sync_syslog_warning(config, "krb5-sync: cannot refresh tickets in %s: %s",
+                        target->ad_ccache, message);
+    krb5_free_error_message(ctx, message);
+}
+
+
+/*
+ * Obtain credentials from the shared cache, refreshing it from the keytab if
+ * needed.  Another process may have refreshed the cache while we were
+ * waiting for the lock, so check again once we have it.  If the cache can't
+ * be locked or the new credentials can't be stored, such as when the cache
+ * directory isn't writable, log a warning and use new credentials from the
+ * keytab anyway, since they are still good for this change.  Returns a
+ * Kerberos status code.
+ */
+static krb5_error_code
+shared_creds(kadm5_hook_modinfo *config, struct sync_target *target,
+             krb5_context ctx, krb5_principal princ, krb5_creds *creds)
+{
+    krb5_ccache cache;
+    krb5_error_code code;
+    int fd;
+
+    code = krb5_cc_resolve(ctx, target->ad_ccache, &cache);
+    if (code != 0)
+        return code;
+    if (shared_valid(ctx, cache, princ, creds)) {
+        krb5_cc_close(ctx, cache);
+        return 0;
+    }
+    code = shared_lock(ctx, cache, &fd);
+    if (code != 0) {
+        shared_warn(config, target, ctx, code);
+        krb5_cc_close(ctx, cache);
+        return keytab_creds(target, ctx, princ, creds);
+    }
+    if (!shared_valid(ctx, cache, princ, creds)) {
+        code = keytab_creds(target, ctx, princ, creds);
+        if (code == 0) {
+            code = shared_store(ctx, cache, princ, creds);
+            if (code != 0) {
+                shared_warn(config, target, ctx, code);
+                code = 0;
+            }
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    krb5_cc_close(ctx, cache);
+    return code;
+}
+
+
+/*
+ * Obtain a ticket-granting ticket for the target's ad_principal, which has
+ * already been parsed into princ, and store it in creds.  The caller should
+ * free the contents of creds.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_ccache_creds(kadm5_hook_modinfo *config, struct sync_target *target,
+                  krb5_context ctx, krb5_principal princ, krb5_creds *creds)
+{
+    if (target->ad_ccache == NULL)
+        return keytab_creds(target, ctx, princ, creds);
+    return shared_creds(config, target, ctx, princ, creds);
+}
@@ -17,6 +17,10 @@
 #include <portable/system.h>
 
 #include <errno.h>
+#if defined(HAVE_KRB5_INIT_CONTEXT_PROFILE) && defined(HAVE_PROFILE_H)
+# include <profile.h>
+# define HAVE_CONTEXT_PROFILE 1
+#endif
 
 #include <plugin/internal.h>
 #include <util/macros.h>
@@ -161,6 +165,35 @@ sync_config_list(krb5_context ctx, const char *opt, struct vector **result)
 }
 
 
+/*
+ * Load a numeric option from Kerberos appdefaults.  Takes the Kerberos
+ * context, the option, and the result location.  The result location is left
+ * unchanged if the option isn't set, so the caller should initialize it to
+ * the default.  Returns a configuration error if the value isn't a
+ * non-negative integer.
+ */
+krb5_error_code
+sync_config_number(krb5_context ctx, const char *opt, long *result)
+{
+    char *value = NULL;
+    char *end;
+    long number;
+    krb5_error_code code = 0;
+
+    sync_config_string(ctx, opt, &value);
+    if (value == NULL)
+        return 0;
+    errno = 0;
+    number = strtol(value, &end, 10);
+    if (errno != 0 || *end != '\0' || end == value || number < 0)
+        code = sync_error_config(ctx, "invalid value for %s: %s", opt, value);
+    else
+        *result = number;
+    free(value);
+    return code;
+}
+
+
 /*
  * Load a string option from Kerberos appdefaults.  Takes the Kerberos
  * context, the option, and the result location.
@@ -191,3 +224,46 @@ sync_config_string(krb5_context ctx, const char *opt, char **result)
         krb5_free_string(ctx, value);
     }
 }
+
+
+/*
+ * Create a Kerberos context that reads the given krb5.conf file instead of
+ * the default configuration, or the default configuration if path is NULL.
+ * Returns KRB5_CONFIG_CANTOPEN if the Kerberos libraries provide no way to
+ * use a different configuration file.
+ */
+krb5_error_code
+sync_config_context(const char *path, krb5_context *ctx)
+{
+    krb5_error_code code;
+#if defined(HAVE_CONTEXT_PROFILE)
+    profile_t profile;
+#elif defined(HAVE_KRB5_SET_CONFIG_FILES)
+    char *files[2];
+#endif
+
+    *ctx = NULL;
+    if (path == NULL)
+        return krb5_init_context(ctx);
+#if defined(HAVE_CONTEXT_PROFILE)
+    code = profile_init_path(path, &profile);
+    if (code != 0)
+        return code;
+    code = krb5_init_context_profile(profile, 0, ctx);
+    profile_release(profile);
+#elif defined(HAVE_KRB5_SET_CONFIG_FILES)
+    code = krb5_init_context(ctx);
+    if (code != 0)
+        return code;
+    files[0] = (char *) path;
+    files[1] = NULL;
+    code = krb5_set_config_files(*ctx, files);
+    if (code != 0) {
+        krb5_free_context(*ctx);
+        *ctx = NULL;
+    }
+#else
+    code = KRB5_CONFIG_CANTOPEN;
+#endif
+    return code;
+}
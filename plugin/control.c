@@ -0,0 +1,646 @@
+/*
+ * Rate and concurrency control for Active Directory operations.
+ *
+ * Draining a large queue of changes can overwhelm the Active Directory domain
+ * controllers, and every change the drain makes competes with the live changes
+ * made by kadmind.  To avoid that, we keep a token bucket and an AIMD
+ * (additive increase, multiplicative decrease) concurrency window for each
+ * domain controller.  Live changes never wait but do consume tokens.  Queue
+ * drains wait until the bucket holds more than the share reserved for live
+ * changes, and the number of queued changes processed in parallel grows by
+ * one per window of successes and halves whenever the domain controller
+ * reports that it is busy or stops responding.
+ *
+ * The state has to be shared between kadmind, kpasswdd, and every krb5-sync
+ * process, so it is kept in a small file in the queue directory that each
+ * process maps into memory and modifies while holding an flock on it.  Since
+ * changes to several targets are made in parallel threads, which share the
+ * flock, we also hold a mutex.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/kadmin.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+
+/* Identify the format of the control file so that we can change it later. */
+#define CONTROL_MAGIC   0x6b73636cU
+#define CONTROL_VERSION 2
+
+/* Maximum number of domain controllers whose state we track. */
+#define CONTROL_MAX 32
+
+/* Minimum time between two decreases of the window, in microseconds. */
+#define CONTROL_HOLDOFF 1000000
+
+/*
+ * Number of latency samples kept for each domain controller, and the number
+ * required before we'll compute a percentile from them.
+ */
+#define CONTROL_SAMPLES     64
+#define CONTROL_MIN_SAMPLES 16
+
+/* The state for one domain controller. */
+struct control_dc {
+    char name[256];
+    double tokens;              /* Tokens currently in the bucket. */
+    double window;              /* Concurrency window for queue drains. */
+    uint64_t refilled;          /* Time of the last refill. */
+    uint64_t backoff;           /* Time of the last window decrease. */
+    uint64_t live;              /* Tokens taken by live changes. */
+    uint64_t drain;             /* Tokens taken by queue drains. */
+    uint64_t waits;             /* Times a queue drain had to wait. */
+    uint64_t successes;
+    uint64_t failures;
+    uint64_t backoffs;          /* Number of window decreases. */
+    uint64_t hedges;            /* Operations also sent to the hedge server. */
+    uint64_t hedge_wins;        /* Hedged operations the hedge server won. */
+    uint32_t nlatency;          /* Number of latency samples recorded. */
+    uint32_t latency[CONTROL_SAMPLES];  /* Recent latencies in microseconds. */
+};
+
+/* The layout of the mapped control file. */
+struct control_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t unused;
+    struct control_dc dc[CONTROL_MAX];
+};
+
+/* Our handle on the mapped control file. */
+struct sync_control {
+    int fd;
+    pid_t pid;
+    struct control_file *file;
+};
+
+/* Serializes the threads of this process, which share the flock. */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/*
+ * Return true if the controller is enabled.  It requires a queue directory in
+ * which to store its state and either a rate limit, a drain concurrency
+ * larger than one, or a hedge server for some target, which needs the
+ * latency samples.
+ */
+static bool
+control_enabled(kadm5_hook_modinfo *config)
+{
+    size_t i;
+
+    if (config->queue_dir == NULL)
+        return false;
+    if (config->ad_rate_limit > 0 || config->ad_drain_concurrency > 1)
+        return true;
+    for (i = 0; i < config->ad_targets_count; i++)
+        if (config->ad_targets[i].ad_hedge_server != NULL)
+            return true;
+    return false;
+}
+
+
+/*
+ * Return the current time in microseconds.  We use the wall clock rather than
+ * a monotonic clock since the state outlives reboots.  Callers have to cope
+ * with the clock going backwards.
+ */
+static uint64_t
+control_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + (uint64_t) tv.tv_usec;
+}
+
+
+/*
+ * Return the size of the token bucket, which defaults to the rate limit.
+ */
+static double
+control_burst(kadm5_hook_modinfo *config)
+{
+    if (config->ad_rate_burst > 0)
+        return (double) config->ad_rate_burst;
+    return (double) config->ad_rate_limit;
+}
+
+
+/*
+ * Unmap the control file.
+ */
+void
+sync_control_close(kadm5_hook_modinfo *config)
+{
+    if (config->control == NULL)
+        return;
+    munmap(config->control->file, sizeof(struct control_file));
+    close(config->control->fd);
+    free(config->control);
+    config->control = NULL;
+}
+
+
+/*
+ * Map the control file into memory, creating and initializing it if needed.
+ * If we've already mapped it in this process, do nothing.  A mapping made by
+ * our parent process is discarded, since we share its file descriptor and
+ * therefore its flock.
+ *
+ * The Kerberos context may be NULL, in which case the error message is not
+ * set.  This is used when reporting results, where we don't want to clobber
+ * the error message of the operation.  Returns a Kerberos status code.
+ * control_map_locked must be called with the mutex held, and control_map
+ * takes it.
+ */
+static krb5_error_code
+control_map_locked(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_control *control = NULL;
+    struct control_file *file;
+    struct stat st;
+    char *path = NULL;
+    void *map;
+    int oerrno;
+    krb5_error_code code;
+
+    if (config->control != NULL) {
+        if (config->control->pid == getpid())
+            return 0;
+        sync_control_close(config);
+    }
+    if (asprintf(&path, "%s/.control", config->queue_dir) < 0)
+        goto fail;
+    control = calloc(1, sizeof(*control));
+    if (control == NULL)
+        goto fail;
+    control->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (control->fd < 0)
+        goto fail;
+    if (flock(control->fd, LOCK_EX) < 0)
+        goto fail;
+    if (fstat(control->fd, &st) < 0)
+        goto fail;
+    if (st.st_size < (off_t) sizeof(struct control_file))
+        if (ftruncate(control->fd, sizeof(struct control_file)) < 0)
+            goto fail;
+    map = mmap(NULL, sizeof(struct control_file), PROT_READ | PROT_WRITE,
+               MAP_SHARED, control->fd, 0);
+    if (map == MAP_FAILED)
+        goto fail;
+    file = map;
+    if (file->magic != CONTROL_MAGIC || file->version != CONTROL_VERSION) {
+        memset(file, 0, sizeof(*file));
+        file->magic = CONTROL_MAGIC;
+        file->version = CONTROL_VERSION;
+    }
+    flock(control->fd, LOCK_UN);
+    control->file = file;
+    control->pid = getpid();
+    config->control = control;
+    free(path);
+    return 0;
+
+fail:
+    oerrno = errno;
+    code = KADM5_FAILURE;
+    if (ctx != NULL) {
+        if (path == NULL || control == NULL)
+            code = sync_error_system(ctx, "cannot allocate memory");
+        else
+            code = sync_error_system(ctx, "cannot map control file %s", path);
+    }
+    if (control != NULL && control->fd >= 0)
+        close(control->fd);
+    free(control);
+    free(path);
+    errno = oerrno;
+    return code;
+}
+
+static krb5_error_code
+control_map(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    krb5_error_code code;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&control_mutex);
+#endif
+    code = control_map_locked(config, ctx);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&control_mutex);
+#endif
+    return code;
+}
+
+
+/*
+ * Lock and unlock the control file.  The locking is advisory, so we ignore
+ * failures to lock rather than preventing changes.  They can only happen if
+ * the file descriptor is invalid.
+ */
+static void
+control_lock(kadm5_hook_modinfo *config)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&control_mutex);
+#endif
+    flock(config->control->fd, LOCK_EX);
+}
+
+static void
+control_unlock(kadm5_hook_modinfo *config)
+{
+    flock(config->control->fd, LOCK_UN);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&control_mutex);
+#endif
+}
+
+
+/*
+ * Find the state for a domain controller, creating it if needed.  Must be
+ * called with the control file locked.  Returns NULL if the domain controller
+ * isn't known and there is no room for a new one, in which case it's not
+ * limited.
+ */
+static struct control_dc *
+control_find(kadm5_hook_modinfo *config, const char *name, uint64_t now)
+{
+    struct control_file *file = config->control->file;
+    struct control_dc *dc;
+    char key[sizeof(dc->name)];
+    uint32_t i;
+
+    snprintf(key, sizeof(key), "%s", name);
+    for (i = 0; i < file->count && i < CONTROL_MAX; i++)
+        if (strcmp(file->dc[i].name, key) == 0)
+            return &file->dc[i];
+    if (file->count >= CONTROL_MAX)
+        return NULL;
+    dc = &file->dc[file->count];
+    memset(dc, 0, sizeof(*dc));
+    snprintf(dc->name, sizeof(dc->name), "%s", key);
+    dc->tokens = control_burst(config);
+    dc->window = 1;
+    dc->refilled = now;
+    file->count++;
+    return dc;
+}
+
+
+/*
+ * Add the tokens accumulated since the last refill to the bucket.
+ */
+static void
+control_refill(kadm5_hook_modinfo *config, struct control_dc *dc,
+               uint64_t now)
+{
+    double burst;
+
+    if (now > dc->refilled) {
+        dc->tokens += (double) (now - dc->refilled) / 1000000.0
+            * (double) config->ad_rate_limit;
+        burst = control_burst(config);
+        if (dc->tokens > burst)
+            dc->tokens = burst;
+    }
+    dc->refilled = now;
+}
+
+
+/*
+ * Return the name of the domain controller whose state is used for changes
+ * made to this target.  This is the configured admin server if there is one
+ * and otherwise the Active Directory realm.
+ */
+const char *
+sync_control_dc(struct sync_target *target)
+{
+    if (target->ad_admin_server != NULL)
+        return target->ad_admin_server;
+    if (target->ad_realm != NULL)
+        return target->ad_realm;
+    return target->name;
+}
+
+
+/*
+ * Take a token for an operation against the given domain controller.  Live
+ * changes never wait but may drive the bucket into debt, which the queue
+ * drain then has to repay.  Queue drains wait until taking a token would
+ * leave at least the live reserve in the bucket.  Returns a Kerberos status
+ * code, which is only an error if we cannot map the control file.
+ */
+krb5_error_code
+sync_control_acquire(kadm5_hook_modinfo *config, krb5_context ctx,
+                     const char *name)
+{
+    struct control_dc *dc;
+    struct timespec delay;
+    double burst, reserve, wait;
+    uint64_t now;
+    krb5_error_code code;
+
+    if (!control_enabled(config) || config->ad_rate_limit <= 0)
+        return 0;
+    code = control_map(config, ctx);
+    if (code != 0)
+        return code;
+    burst = control_burst(config);
+    reserve = 0;
+    if (config->drain) {
+        reserve = burst * (double) config->ad_live_reserve / 100.0;
+        if (reserve > burst - 1)
+            reserve = burst - 1;
+    }
+    while (true) {
+        control_lock(config);
+        now = control_now();
+        dc = control_find(config, name, now);
+        if (dc == NULL) {
+            control_unlock(config);
+            return 0;
+        }
+        control_refill(config, dc, now);
+        if (!config->drain || dc->tokens >= reserve + 1) {
+            dc->tokens -= 1;
+            if (dc->tokens < -burst)
+                dc->tokens = -burst;
+            if (config->drain)
+                dc->drain++;
+            else
+                dc->live++;
+            control_unlock(config);
+            return 0;
+        }
+        wait = (reserve + 1 - dc->tokens) / (double) config->ad_rate_limit;
+        dc->waits++;
+        control_unlock(config);
+        delay.tv_sec = (time_t) wait;
+        delay.tv_nsec = (long) ((wait - (double) delay.tv_sec) * 1e9);
+        nanosleep(&delay, NULL);
+    }
+}
+
+
+/*
+ * Report the outcome of an operation against a domain controller.  Successes
+ * grow the concurrency window by one over the window size, so by one per
+ * window of successes, up to ad_drain_concurrency.  Soft failures halve the
+ * window and empty the bucket, but only once per holdoff period since all the
+ * operations in flight will usually fail together.  Failures to map the
+ * control file are ignored here, since they will be reported by the next
+ * attempt to acquire a token.
+ */
+void
+sync_control_result(kadm5_hook_modinfo *config, const char *name,
+                    enum sync_outcome outcome)
+{
+    struct control_dc *dc;
+    double limit;
+    uint64_t now;
+
+    if (!control_enabled(config))
+        return;
+    if (control_map(config, NULL) != 0)
+        return;
+    control_lock(config);
+    now = control_now();
+    dc = control_find(config, name, now);
+    if (dc == NULL) {
+        control_unlock(config);
+        return;
+    }
+    limit = (config->ad_drain_concurrency > 1)
+        ? (double) config->ad_drain_concurrency : 1;
+    switch (outcome) {
+    case SYNC_OUTCOME_SUCCESS:
+        dc->successes++;
+        dc->window += 1 / dc->window;
+        if (dc->window > limit)
+            dc->window = limit;
+        break;
+    case SYNC_OUTCOME_SOFT:
+        dc->failures++;
+        if (now < dc->backoff || now - dc->backoff >= CONTROL_HOLDOFF) {
+            dc->window /= 2;
+            if (dc->window < 1)
+                dc->window = 1;
+            if (dc->tokens > 0)
+                dc->tokens = 0;
+            dc->backoff = now;
+            dc->backoffs++;
+            sync_syslog_notice(config, "krb5-sync: backing off from %s,"
+                               " concurrency now %lu", dc->name,
+                               (unsigned long) dc->window);
+        }
+        break;
+    case SYNC_OUTCOME_HARD:
+        dc->failures++;
+        break;
+    }
+    control_unlock(config);
+}
+
+
+/*
+ * Record the latency of a successful operation against a domain controller,
+ * in microseconds.  Only the most recent samples are kept.
+ */
+void
+sync_control_latency(kadm5_hook_modinfo *config, const char *name,
+                     unsigned long usec)
+{
+    struct control_dc *dc;
+
+    if (!control_enabled(config))
+        return;
+    if (control_map(config, NULL) != 0)
+        return;
+    control_lock(config);
+    dc = control_find(config, name, control_now());
+    if (dc != NULL) {
+        if (usec > UINT32_MAX)
+            usec = UINT32_MAX;
+        dc->latency[dc->nlatency % CONTROL_SAMPLES] = (uint32_t) usec;
+        dc->nlatency++;
+        if (dc->nlatency >= 2 * CONTROL_SAMPLES)
+            dc->nlatency -= CONTROL_SAMPLES;
+    }
+    control_unlock(config);
+}
+
+
+/*
+ * Compare two latency samples for qsort.
+ */
+static int
+compare_latency(const void *a, const void *b)
+{
+    const uint32_t *first = a;
+    const uint32_t *second = b;
+
+    return (*first > *second) - (*first < *second);
+}
+
+
+/*
+ * Return the given percentile of the recent latencies of successful
+ * operations against a domain controller, in microseconds, or 0 if we don't
+ * yet have enough samples to say.
+ */
+unsigned long
+sync_control_percentile(kadm5_hook_modinfo *config, const char *name,
+                        unsigned long percentile)
+{
+    struct control_dc *dc;
+    uint32_t samples[CONTROL_SAMPLES];
+    size_t n = 0, i;
+
+    if (!control_enabled(config))
+        return 0;
+    if (control_map(config, NULL) != 0)
+        return 0;
+    control_lock(config);
+    dc = control_find(config, name, control_now());
+    if (dc != NULL) {
+        n = (dc->nlatency < CONTROL_SAMPLES) ? dc->nlatency : CONTROL_SAMPLES;
+        memcpy(samples, dc->latency, n * sizeof(uint32_t));
+    }
+    control_unlock(config);
+    if (n < CONTROL_MIN_SAMPLES)
+        return 0;
+    qsort(samples, n, sizeof(uint32_t), compare_latency);
+    if (percentile > 100)
+        percentile = 100;
+    i = (n * percentile + 99) / 100;
+    return samples[(i > 0) ? i - 1 : 0];
+}
+
+
+/*
+ * Record that an operation against a domain controller was hedged, and
+ * whether the hedge server won.
+ */
+void
+sync_control_hedge(kadm5_hook_modinfo *config, const char *name, bool won)
+{
+    struct control_dc *dc;
+
+    if (!control_enabled(config))
+        return;
+    if (control_map(config, NULL) != 0)
+        return;
+    control_lock(config);
+    dc = control_find(config, name, control_now());
+    if (dc != NULL) {
+        dc->hedges++;
+        if (won)
+            dc->hedge_wins++;
+    }
+    control_unlock(config);
+}
+
+
+/*
+ * Return the number of queued changes that may be processed in parallel
+ * against the given domain controller.  This is always at least one, and is
+ * one if the controller is disabled or its state is unavailable.
+ */
+unsigned long
+sync_control_window(kadm5_hook_modinfo *config, const char *name)
+{
+    struct control_dc *dc;
+    unsigned long window = 1;
+
+    if (!control_enabled(config))
+        return 1;
+    if (control_map(config, NULL) != 0)
+        return 1;
+    control_lock(config);
+    dc = control_find(config, name, control_now());
+    if (dc != NULL && dc->window > 1)
+        window = (unsigned long) dc->window;
+    control_unlock(config);
+    return window;
+}
+
+
+/*
+ * Return a snapshot of the controller state for every domain controller.  If
+ * the controller is disabled, returns an empty list.  Returns a Kerberos
+ * status code.
+ */
+krb5_error_code
+sync_control_list(kadm5_hook_modinfo *config, krb5_context ctx,
+                  struct sync_control_info **result, size_t *count)
+{
+    struct control_file *file;
+    struct control_dc *dc;
+    struct sync_control_info *info;
+    size_t i, n;
+    krb5_error_code code;
+
+    *result = NULL;
+    *count = 0;
+    if (!control_enabled(config))
+        return 0;
+    code = control_map(config, ctx);
+    if (code != 0)
+        return code;
+    control_lock(config);
+    file = config->control->file;
+    n = (file->count < CONTROL_MAX) ? file->count : CONTROL_MAX;
+    if (n == 0) {
+        control_unlock(config);
+        return 0;
+    }
+    info = calloc(n, sizeof(*info));
+    if (info == NULL) {
+        control_unlock(config);
+        return sync_error_system(ctx, "cannot allocate memory");
+    }
+    for (i = 0; i < n; i++) {
+        dc = &file->dc[i];
+        if (config->ad_rate_limit > 0)
+            control_refill(config, dc, control_now());
+        memcpy(info[i].name, dc->name, sizeof(info[i].name));
+        info[i].tokens = dc->tokens;
+        info[i].window = dc->window;
+        info[i].live = dc->live;
+        info[i].drain = dc->drain;
+        info[i].waits = dc->waits;
+        info[i].successes = dc->successes;
+        info[i].failures = dc->failures;
+        info[i].backoffs = dc->backoffs;
+        info[i].hedges = dc->hedges;
+        info[i].hedge_wins = dc->hedge_wins;
+    }
+    control_unlock(config);
+    *result = info;
+    *count = n;
+    return 0;
+}
@@ -0,0 +1,500 @@
+/*
+ * Structured log events and the asynchronous log ring.
+ *
+ * Each message logged by the plugin is an event carrying the principal,
+ * trace ID, operation, target, domain controller, outcome, and latency of
+ * the change it's about, where known, along with the text of the message.
+ * Normally, events are logged to syslog immediately and only the text is
+ * used.  If the log_file option is set, events are instead appended to that
+ * file as JSON objects, one per line, with all of their fields.
+ *
+ * If the log_async option is set, events are instead put in a fixed-size
+ * ring in memory and written by a background thread, so that a slow syslog
+ * daemon or file system never holds up kadmind.  The ring is a bounded
+ * queue without locks: each slot carries a sequence number saying whether
+ * it's free for the producer at a given position or holds an event for the
+ * consumer, and producers claim positions with an atomic compare and swap.
+ * If the ring is full, the event is dropped and counted rather than waiting
+ * for room, and the background thread logs how many events were dropped.
+ *
+ * The background thread is started the first time a process logs an event,
+ * so a forked child of kadmind starts its own.  Events that a child
+ * inherits from its parent's ring are skipped, since the parent writes
+ * them.  Events still in the ring when the plugin is shut down are written
+ * by sync_close, but a process that exits without shutting down the plugin
+ * may lose the last events it logged.  Without threads or compiler support
+ * for atomic operations, events are always logged immediately.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#include <syslog.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+
+/* Number of events the ring holds, which must be a power of two. */
+#define EVENT_SLOTS 256
+
+/* How long the background thread sleeps when the ring is empty, in ms. */
+#define EVENT_INTERVAL 50
+
+/*
+ * Size of the buffer for one line of the log file, which holds any event
+ * even if every character of its fields has to be escaped.
+ */
+#define EVENT_LINE_SIZE 8192
+
+/* One event, with each field truncated to fit. */
+struct event_record {
+    uint64_t time;
+    uint64_t latency;
+    pid_t pid;
+    enum sync_log_level level;
+    char trace[SYNC_TRACE_SIZE];
+    char operation[16];
+    char outcome[16];
+    char target[64];
+    char principal[256];
+    char dc[256];
+    char message[512];
+};
+
+/*
+ * One slot of the ring.  seq is the position of the producer that may fill
+ * the slot, or one more than that position once it holds an event.
+ */
+struct event_slot {
+    uint64_t seq;
+    struct event_record record;
+};
+
+/*
+ * The event state.  fd is the log file, opened for appending, or -1 if there
+ * isn't one.  thread_pid is the process that started the running background
+ * thread, or 0 if there isn't one.  head is only used by the thread and tail
+ * by producers.  dropped counts the events dropped because the ring was
+ * full, of which reported have been logged.
+ */
+struct sync_events {
+    int fd;
+    bool async;
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+#endif
+    uint64_t thread_pid;
+    uint64_t stop;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    uint64_t reported;
+    struct event_slot slots[EVENT_SLOTS];
+};
+
+/*
+ * Atomic operations on the ring.  The fallbacks are never used, since the
+ * ring is only used with atomic operations, but let the code compile.
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+# define EVENT_ADD(p, n)   __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+# define EVENT_LOAD(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define EVENT_STORE(p, n) __atomic_store_n((p), (n), __ATOMIC_RELEASE)
+# define EVENT_CAS(p, o, n)                                             \
+    __atomic_compare_exchange_n((p), (o), (n), false, __ATOMIC_ACQ_REL, \
+                                __ATOMIC_ACQUIRE)
+#else
+# define EVENT_ADD(p, n)    (*(p) += (n))
+# define EVENT_LOAD(p)      (*(p))
+# define EVENT_STORE(p, n)  (*(p) = (n))
+# define EVENT_CAS(p, o, n) (*(p) == *(o) ? (*(p) = (n), true) : false)
+#endif
+
+/* The names of the log levels. */
+static const char *const event_level[] = {
+    "none", "warning", "notice", "info", "debug"
+};
+
+
+/*
+ * Set up structured events if the log_file or log_async options ask for
+ * them, opening the log file if there is one.  Takes ownership of file.
+ * Returns a Kerberos status code, which is an error if the log file can't be
+ * opened.
+ */
+krb5_error_code
+sync_event_init(kadm5_hook_modinfo *config, krb5_context ctx, char *file,
+                bool async)
+{
+    struct sync_events *events;
+    krb5_error_code code;
+    size_t i;
+
+#if !defined(HAVE_PTHREAD) || !defined(HAVE_ATOMIC_BUILTINS)
+    async = false;
+#endif
+    if (file == NULL && !async)
+        return 0;
+    events = calloc(1, sizeof(*events));
+    if (events == NULL) {
+        free(file);
+        return sync_error_system(ctx, "cannot allocate memory");
+    }
+    events->fd = -1;
+    if (file != NULL) {
+        events->fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0666);
+        if (events->fd < 0) {
+            code = sync_error_system(ctx, "cannot open log file %s", file);
+            free(file);
+            free(events);
+            return code;
+        }
+        free(file);
+    }
+    events->async = async;
+    for (i = 0; i < EVENT_SLOTS; i++)
+        events->slots[i].seq = i;
+    config->events = events;
+    return 0;
+}
+
+
+/*
+ * Append a string to a JSON line as a quoted string, escaping as needed.
+ * Stops at the end of the buffer, which the caller checks for.
+ */
+static void
+event_json_string(char *line, size_t size, size_t *used, const char *string)
+{
+    const unsigned char *p;
+    size_t n = *used;
+
+    if (n < size)
+        line[n++] = '"';
+    for (p = (const unsigned char *) string; *p != '\0' && n < size; p++) {
+        if (*p == '"' || *p == '\\') {
+            if (n + 2 > size)
+                break;
+            line[n++] = '\\';
+            line[n++] = (char) *p;
+        } else if (*p < 0x20) {
+            if (n + 6 > size)
+                break;
+            snprintf(line + n, size - n, "\\u%04x", *p);
+            n += 6;
+        } else {
+            line[n++] = (char) *p;
+        }
+    }
+    if (n < size)
+        line[n++] = '"';
+    *used = n;
+}
+
+
+/*
+ * Append a field to a JSON line if its value isn't empty.
+ */
+static void
+event_json_field(char *line, size_t size, size_t *used, const char *name,
+                 const char *value)
+{
+    int status;
+
+    if (value[0] == '\0' || *used >= size)
+        return;
+    status = snprintf(line + *used, size - *used, ",\"%s\":", name);
+    if (status < 0 || (size_t) status >= size - *used) {
+        *used = size;
+        return;
+    }
+    *used += (size_t) status;
+    event_json_string(line, size, used, value);
+}
+
+
+/*
+ * Write an event to the log file as a JSON object on one line.  The file is
+ * opened for appending and the line is written with one write, so lines from
+ * different threads and processes aren't interleaved.
+ */
+static void
+event_write_file(int fd, const struct event_record *record)
+{
+    char line[EVENT_LINE_SIZE];
+    size_t used, end;
+    int status;
+
+    status = snprintf(line, sizeof(line), "{\"time\":%llu.%06lu,"
+                      "\"level\":\"%s\"",
+                      (unsigned long long) (record->time / 1000000),
+                      (unsigned long) (record->time % 1000000),
+                      event_level[record->level]);
+    if (status < 0 || (size_t) status >= sizeof(line))
+        return;
+    used = (size_t) status;
+    end = sizeof(line) - 2;
+    event_json_field(line, end, &used, "trace", record->trace);
+    event_json_field(line, end, &used, "principal", record->principal);
+    event_json_field(line, end, &used, "operation", record->operation);
+    event_json_field(line, end, &used, "target", record->target);
+    event_json_field(line, end, &used, "dc", record->dc);
+    event_json_field(line, end, &used, "outcome", record->outcome);
+    if (record->latency > 0 && used < end) {
+        status = snprintf(line + used, end - used, ",\"latency\":%.6f",
+                          (double) record->latency / 1e6);
+        if (status > 0 && (size_t) status < end - used)
+            used += (size_t) status;
+    }
+    event_json_field(line, end, &used, "message", record->message);
+    if (used >= end)
+        return;
+    memcpy(line + used, "}\n", 2);
+    if (write(fd, line, used + 2) < 0)
+        return;
+}
+
+
+/*
+ * Write an event to the log file if there is one and otherwise to syslog.
+ */
+static void
+event_write(struct sync_events *events, const struct event_record *record)
+{
+    if (events->fd >= 0)
+        event_write_file(events->fd, record);
+    else
+        syslog(sync_log_priority(record->level), "%s", record->message);
+}
+
+
+/*
+ * Copy a string into a field of an event, truncating it if needed.
+ */
+static void
+event_copy(char *field, size_t size, const char *value)
+{
+    if (value == NULL)
+        field[0] = '\0';
+    else
+        snprintf(field, size, "%s", value);
+}
+
+
+/*
+ * Fill in an event from the operation, fields, and message.  Either op or
+ * fields may be NULL.
+ */
+static void __attribute__((__format__(printf, 5, 0)))
+event_fill(struct event_record *record, enum sync_log_level level,
+           struct sync_op *op, const struct sync_log_fields *fields,
+           const char *fmt, va_list args)
+{
+    static const struct sync_log_fields none = { NULL, NULL, NULL, NULL, 0 };
+
+    if (fields == NULL)
+        fields = &none;
+    record->time = sync_stats_now();
+    record->latency = fields->latency;
+    record->pid = getpid();
+    record->level = level;
+    event_copy(record->trace, sizeof(record->trace),
+               (op != NULL) ? op->trace : NULL);
+    event_copy(record->principal, sizeof(record->principal),
+               (op != NULL) ? op->name : NULL);
+    event_copy(record->operation, sizeof(record->operation),
+               fields->operation);
+    event_copy(record->target, sizeof(record->target), fields->target);
+    event_copy(record->dc, sizeof(record->dc), fields->dc);
+    event_copy(record->outcome, sizeof(record->outcome), fields->outcome);
+    vsnprintf(record->message, sizeof(record->message), fmt, args);
+}
+
+
+/*
+ * Write the events in the ring, skipping any left by a parent process, and
+ * log how many events have been dropped since the last report.  Only called
+ * by the background thread, or once it has stopped.  Returns the number of
+ * events taken from the ring.
+ */
+static size_t
+event_drain(kadm5_hook_modinfo *config, struct sync_events *events)
+{
+    struct event_slot *slot;
+    struct event_record report;
+    uint64_t dropped;
+    pid_t pid = getpid();
+    size_t count = 0;
+
+    for (;;) {
+        slot = &events->slots[events->head & (EVENT_SLOTS - 1)];
+        if (EVENT_LOAD(&slot->seq) != events->head + 1)
+            break;
+        if (slot->record.pid == pid)
+            event_write(events, &slot->record);
+        EVENT_STORE(&slot->seq, events->head + EVENT_SLOTS);
+        events->head++;
+        count++;
+    }
+    dropped = EVENT_LOAD(&events->dropped);
+    if (dropped != events->reported) {
+        memset(&report, 0, sizeof(report));
+        report.time = sync_stats_now();
+        report.pid = pid;
+        report.level = SYNC_LOG_WARNING;
+        snprintf(report.message, sizeof(report.message), "krb5-sync:"
+                 " dropped %llu log messages because the log buffer was"
+                 " full", (unsigned long long) (dropped - events->reported));
+        if (SYNC_LOG_ENABLED(config, SYNC_LOG_WARNING))
+            event_write(events, &report);
+        events->reported = dropped;
+    }
+    return count;
+}
+
+
+#ifdef HAVE_PTHREAD
+/*
+ * The background thread, which writes events from the ring until told to
+ * stop, sleeping briefly whenever the ring is empty.
+ */
+static void *
+event_thread(void *data)
+{
+    kadm5_hook_modinfo *config = data;
+    struct sync_events *events = config->events;
+    struct timespec interval;
+
+    interval.tv_sec = 0;
+    interval.tv_nsec = EVENT_INTERVAL * 1000000L;
+    while (!EVENT_LOAD(&events->stop))
+        if (event_drain(config, events) == 0)
+            nanosleep(&interval, NULL);
+    return NULL;
+}
+
+
+/*
+ * Make sure the background thread is running in this process, starting it
+ * if needed.  Returns false if it isn't and couldn't be started, in which
+ * case the caller should log the event immediately.
+ */
+static bool
+event_start(kadm5_hook_modinfo *config, struct sync_events *events)
+{
+    uint64_t pid = (uint64_t) getpid();
+    uint64_t old;
+
+    old = EVENT_LOAD(&events->thread_pid);
+    if (old == pid)
+        return true;
+    if (!EVENT_CAS(&events->thread_pid, &old, pid))
+        return EVENT_LOAD(&events->thread_pid) == pid;
+
+    /* A forked child doesn't report the events its parent dropped. */
+    events->reported = EVENT_LOAD(&events->dropped);
+    EVENT_STORE(&events->stop, 0);
+    if (pthread_create(&events->thread, NULL, event_thread, config) != 0) {
+        EVENT_STORE(&events->thread_pid, 0);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Put an event in the ring.  A producer claims the next position by
+ * advancing tail, fills in the slot for that position, and then marks it as
+ * holding an event.  If the slot hasn't yet been emptied by the background
+ * thread, the ring is full, and the event is dropped and counted.
+ */
+static void __attribute__((__format__(printf, 5, 0)))
+event_enqueue(kadm5_hook_modinfo *config, enum sync_log_level level,
+              struct sync_op *op, const struct sync_log_fields *fields,
+              const char *fmt, va_list args)
+{
+    struct sync_events *events = config->events;
+    struct event_slot *slot;
+    uint64_t pos, seq;
+    int64_t diff;
+
+    pos = EVENT_LOAD(&events->tail);
+    for (;;) {
+        slot = &events->slots[pos & (EVENT_SLOTS - 1)];
+        seq = EVENT_LOAD(&slot->seq);
+        diff = (int64_t) (seq - pos);
+        if (diff == 0) {
+            if (EVENT_CAS(&events->tail, &pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            EVENT_ADD(&events->dropped, 1);
+            sync_stats_dropped(config);
+            return;
+        } else {
+            pos = EVENT_LOAD(&events->tail);
+        }
+    }
+    event_fill(&slot->record, level, op, fields, fmt, args);
+    EVENT_STORE(&slot->seq, pos + 1);
+}
+#endif /* HAVE_PTHREAD */
+
+
+/*
+ * Log an event, either putting it in the ring or writing it immediately.
+ */
+void
+sync_event_put(kadm5_hook_modinfo *config, enum sync_log_level level,
+               struct sync_op *op, const struct sync_log_fields *fields,
+               const char *fmt, va_list args)
+{
+    struct sync_events *events = config->events;
+    struct event_record record;
+
+#ifdef HAVE_PTHREAD
+    if (events->async && event_start(config, events)) {
+        event_enqueue(config, level, op, fields, fmt, args);
+        return;
+    }
+#endif
+    event_fill(&record, level, op, fields, fmt, args);
+    event_write(events, &record);
+}
+
+
+/*
+ * Stop the background thread if this process started it, write any events
+ * left in the ring, and free the event state.
+ */
+void
+sync_event_close(kadm5_hook_modinfo *config)
+{
+    struct sync_events *events = config->events;
+
+    if (events == NULL)
+        return;
+#ifdef HAVE_PTHREAD
+    if (EVENT_LOAD(&events->thread_pid) == (uint64_t) getpid()) {
+        EVENT_STORE(&events->stop, 1);
+        pthread_join(events->thread, NULL);
+        EVENT_STORE(&events->thread_pid, 0);
+    }
+#endif
+    if (events->async)
+        event_drain(config, events);
+    if (events->fd >= 0)
+        close(events->fd);
+    free(events);
+    config->events = NULL;
+}
@@ -0,0 +1,201 @@
+/*
+ * Fault injection for testing recovery from failures.
+ *
+ * If configure is given --enable-fault-injection, calls to Active Directory
+ * and to the queue can be made to fail or to be slow, so that the fallback
+ * to the queue and the handling of failures when draining it can be tested
+ * without an outage.  Each point at which faults can be injected is
+ * configured with the setting fault_ followed by the name of the point, whose
+ * value is a list of any of:
+ *
+ *     probability=<p>   Fail each call with probability p, from 0 to 1
+ *     nth=<n>           Fail every nth call
+ *     latency=<ms>      Wait this many milliseconds before each call
+ *
+ * Calls are counted and random numbers drawn separately in each process,
+ * starting from fault_seed if it is set so that runs can be repeated.  The
+ * schedules are global to the process and are replaced by each call to
+ * sync_init, since some of the points are reached without the plugin
+ * configuration.  Without --enable-fault-injection, the SYNC_FAULT macro
+ * is always false and none of this is built.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+
+#ifdef HAVE_FAULT_INJECTION
+
+/* Counters shared between threads. */
+# ifdef HAVE_ATOMIC_BUILTINS
+#  define FAULT_NEXT(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+# else
+#  define FAULT_NEXT(p) (++*(p))
+# endif
+
+/* The schedule of faults for one point and the number of calls so far. */
+struct fault {
+    double probability;
+    unsigned long nth;
+    unsigned long latency;
+    uint64_t calls;
+};
+
+/* The names of the points, in the order of enum sync_fault_point. */
+static const char *const fault_names[SYNC_FAULT_POINTS] = {
+    "creds", "kpasswd", "ldap_bind", "ldap_search", "ldap_modify",
+    "queue_lock", "queue_open", "queue_write", "queue_unlink"
+};
+
+/* The schedules, the seed, and the number of random numbers drawn. */
+static struct fault faults[SYNC_FAULT_POINTS];
+static uint64_t fault_seed;
+static uint64_t fault_draws;
+
+
+/*
+ * Return a pseudorandom number between 0 and 1, the SplitMix64 output for
+ * the next draw after the seed.  Each draw only needs the counter, so this
+ * is safe to call from several threads.
+ */
+static double
+fault_random(void)
+{
+    uint64_t x;
+
+    x = fault_seed + FAULT_NEXT(&fault_draws) * UINT64_C(0x9e3779b97f4a7c15);
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    x ^= x >> 31;
+    return (double) (x >> 11) / (double) (UINT64_C(1) << 53);
+}
+
+
+/*
+ * If setting is key=value, point value at the value and return true.
+ */
+static bool
+fault_key(const char *setting, const char *key, const char **value)
+{
+    size_t length = strlen(key);
+
+    if (strncmp(setting, key, length) != 0 || setting[length] != '=')
+        return false;
+    *value = setting + length + 1;
+    return true;
+}
+
+
+/*
+ * Parse the settings for one point from the list in its option.  Returns a
+ * configuration error if a setting isn't recognized or its value is
+ * invalid.
+ */
+static krb5_error_code
+fault_parse(krb5_context ctx, const char *option, struct vector *settings,
+            struct fault *fault)
+{
+    const char *setting, *value;
+    char *end;
+    size_t i;
+
+    for (i = 0; i < settings->count; i++) {
+        setting = settings->strings[i];
+        errno = 0;
+        if (fault_key(setting, "probability", &value)) {
+            fault->probability = strtod(value, &end);
+            if (!(fault->probability >= 0 && fault->probability <= 1))
+                goto fail;
+        } else if (fault_key(setting, "nth", &value) && value[0] != '-')
+            fault->nth = strtoul(value, &end, 10);
+        else if (fault_key(setting, "latency", &value) && value[0] != '-')
+            fault->latency = strtoul(value, &end, 10);
+        else
+            goto fail;
+        if (errno != 0 || end == value || *end != '\0')
+            goto fail;
+    }
+    return 0;
+
+fail:
+    return sync_error_config(ctx, "invalid setting %s in %s",
+                             settings->strings[i], option);
+}
+
+
+/*
+ * Read the schedules of all the points from the configuration, replacing
+ * any from a previous call.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_fault_init(krb5_context ctx)
+{
+    struct vector *settings;
+    char option[64];
+    long seed = -1;
+    size_t i;
+    krb5_error_code code;
+
+    memset(faults, 0, sizeof(faults));
+    fault_draws = 0;
+    code = sync_config_number(ctx, "fault_seed", &seed);
+    if (code != 0)
+        return code;
+    if (seed >= 0)
+        fault_seed = (uint64_t) seed;
+    else
+        fault_seed = ((uint64_t) time(NULL) << 20) ^ (uint64_t) getpid();
+    for (i = 0; i < SYNC_FAULT_POINTS; i++) {
+        snprintf(option, sizeof(option), "fault_%s", fault_names[i]);
+        settings = NULL;
+        code = sync_config_list(ctx, option, &settings);
+        if (code == 0 && settings != NULL)
+            code = fault_parse(ctx, option, settings, &faults[i]);
+        sync_vector_free(settings);
+        if (code != 0) {
+            memset(faults, 0, sizeof(faults));
+            return code;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Called before a call at the given point.  Waits for the latency of the
+ * point, if any, and returns true, with errno set to EIO for the callers
+ * that report system errors, if the call should fail.
+ */
+bool
+sync_fault(enum sync_fault_point point)
+{
+    struct fault *fault = &faults[point];
+    struct timespec delay;
+    uint64_t calls;
+
+    if (fault->latency > 0) {
+        delay.tv_sec = (time_t) (fault->latency / 1000);
+        delay.tv_nsec = (long) (fault->latency % 1000) * 1000000;
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+            ;
+    }
+    calls = FAULT_NEXT(&fault->calls);
+    if ((fault->nth > 0 && calls % fault->nth == 0)
+        || (fault->probability > 0 && fault_random() < fault->probability)) {
+        errno = EIO;
+        return true;
+    }
+    return false;
+}
+
+#endif /* HAVE_FAULT_INJECTION */
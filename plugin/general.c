@@ -26,6 +26,7 @@
 #include <errno.h>
 
 #include <plugin/internal.h>
+#include <plugin/probes.h>
 #include <util/macros.h>
 
 
@@ -46,12 +47,15 @@ sync_init(krb5_context ctx, kadm5_hook_modinfo **result)
     if (config == NULL)
         return sync_error_system(ctx, "cannot allocate memory");
 
-    /* Get Active Directory connection information from krb5.conf. */
-    sync_config_string(ctx, "ad_keytab", &config->ad_keytab);
-    sync_config_string(ctx, "ad_principal", &config->ad_principal);
-    sync_config_string(ctx, "ad_realm", &config->ad_realm);
-    sync_config_string(ctx, "ad_admin_server", &config->ad_admin_server);
-    sync_config_string(ctx, "ad_ldap_base", &config->ad_ldap_base);
+    /*
+     * Get Active Directory connection information for each target from
+     * krb5.conf.
+     */
+    code = sync_target_init(config, ctx);
+    if (code != 0) {
+        sync_close(ctx, config);
+        return code;
+    }
 
     /* Get allowed instances from krb5.conf. */
     code = sync_config_list(ctx, "ad_instances", &config->ad_instances);
@@ -69,9 +73,72 @@ sync_init(krb5_context ctx, kadm5_hook_modinfo **result)
     /* Get the directory for queued changes from krb5.conf. */
     sync_config_string(ctx, "queue_dir", &config->queue_dir);
 
-    /* Whether to log informational and warning messages to syslog. */
-    config->syslog = true;
-    sync_config_boolean(ctx, "syslog", &config->syslog);
+    /* Get the rate and concurrency limits for changes to Active Directory. */
+    config->ad_drain_concurrency = 1;
+    config->ad_live_reserve = 25;
+    code = sync_config_number(ctx, "ad_rate_limit", &config->ad_rate_limit);
+    if (code == 0)
+        code = sync_config_number(ctx, "ad_rate_burst",
+                                  &config->ad_rate_burst);
+    if (code == 0)
+        code = sync_config_number(ctx, "ad_live_reserve",
+                                  &config->ad_live_reserve);
+    if (code == 0)
+        code = sync_config_number(ctx, "ad_drain_concurrency",
+                                  &config->ad_drain_concurrency);
+    if (code == 0 && config->ad_live_reserve > 100)
+        code = sync_error_config(ctx, "ad_live_reserve must be at most 100");
+    if (code != 0) {
+        sync_close(ctx, config);
+        return code;
+    }
+
+    /* Get when to send hedged requests to the second domain controller. */
+    config->ad_hedge_percentile = 95;
+    code = sync_config_number(ctx, "ad_hedge_percentile",
+                              &config->ad_hedge_percentile);
+    if (code == 0 && (config->ad_hedge_percentile < 1
+                      || config->ad_hedge_percentile > 100))
+        code = sync_error_config(ctx, "ad_hedge_percentile must be between"
+                                 " 1 and 100");
+    if (code != 0) {
+        sync_close(ctx, config);
+        return code;
+    }
+
+    /* Get how long to keep cached lookups. */
+    code = sync_config_number(ctx, "ad_cache_ttl", &config->ad_cache_ttl);
+    if (code != 0) {
+        sync_close(ctx, config);
+        return code;
+    }
+
+    /* Whether and how much to log to syslog. */
+    code = sync_syslog_init(config, ctx);
+    if (code != 0) {
+        sync_close(ctx, config);
+        return code;
+    }
+
+    /* Whether to keep statistics, which are mapped now if so. */
+    sync_config_boolean(ctx, "stats", &config->stats);
+    sync_stats_init(config);
+
+    /* Whether to capture changes for replay. */
+    code = sync_capture_init(config, ctx);
+    if (code != 0) {
+        sync_close(ctx, config);
+        return code;
+    }
+
+    /* The schedules of faults to inject, if built with fault injection. */
+#ifdef HAVE_FAULT_INJECTION
+    code = sync_fault_init(ctx);
+    if (code != 0) {
+        sync_close(ctx, config);
+        return code;
+    }
+#endif
 
     /* Initialized.  Set data and return. */
     *result = config;
@@ -80,20 +147,26 @@ sync_init(krb5_context ctx, kadm5_hook_modinfo **result)
 
 
 /*
- * Shut down the module.  This just means freeing our configuration struct,
- * since we don't store any other local state.
+ * Shut down the module.  This means waiting for any hedged attempts that are
+ * still running, writing any log events still waiting to be written,
+ * closing the capture file, unmapping the shared controller state, cache,
+ * and statistics, if any, and freeing our configuration struct.
  */
 void
 sync_close(krb5_context ctx UNUSED, kadm5_hook_modinfo *config)
 {
-    free(config->ad_admin_server);
+    sync_hedge_close(config);
+    sync_event_close(config);
+    sync_capture_close(config);
+    sync_cache_close(config);
+    sync_control_close(config);
+    sync_stats_close(config);
+    sync_target_free(config);
     free(config->ad_base_instance);
     sync_vector_free(config->ad_instances);
-    free(config->ad_keytab);
-    free(config->ad_ldap_base);
-    free(config->ad_principal);
-    free(config->ad_realm);
     free(config->queue_dir);
+    free(config->krb5_conf);
+    free(config->log_buffer);
     free(config);
 }
 
@@ -121,6 +194,42 @@ instance_allowed(kadm5_hook_modinfo *config, const char *instance)
 }
 
 
+/*
+ * Check whether the ad_base_instance instance of the principal of an
+ * operation exists.  Only the answer that it doesn't is cached, and so only
+ * for the short lifetime of negative entries.  A cached answer that it
+ * exists would keep password changes from being pushed for as long as
+ * ad_cache_ttl after the instance was deleted, while a stale negative answer
+ * only pushes the passwords of a newly created instance's base principal
+ * for at most a minute.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+instance_exists(kadm5_hook_modinfo *config, struct sync_op *op, bool *exists)
+{
+    const char *key;
+    char value[2];
+    bool negative;
+    krb5_error_code code;
+
+    key = sync_op_printf(op, "%s %s", config->ad_base_instance, op->name);
+    if (key == NULL)
+        return sync_error_system(op->ctx, "cannot allocate memory");
+    if (sync_cache_get(config, SYNC_CACHE_INSTANCE, key, value,
+                       sizeof(value), &negative)
+        && negative) {
+        *exists = false;
+        return 0;
+    }
+    code = sync_instance_exists(op->ctx, op->principal,
+                                config->ad_base_instance, exists);
+    if (code != 0)
+        return code;
+    if (!*exists)
+        sync_cache_put(config, SYNC_CACHE_INSTANCE, key, NULL);
+    return 0;
+}
+
+
 /*
  * Check the principal for which we're changing a password or the enable
  * status.  Takes a flag, which is true for a password change and false for
@@ -138,11 +247,10 @@ instance_allowed(kadm5_hook_modinfo *config, const char *instance)
  * Kerberos status code for more serious errors.  If we shouldn't proceed,
  * logs a debug-level message to syslog.
  */
-static krb5_error_code
-principal_allowed(kadm5_hook_modinfo *config, krb5_context ctx,
-                  krb5_principal principal, bool pwchange, bool *allowed)
+krb5_error_code
+sync_principal_allowed(kadm5_hook_modinfo *config, struct sync_op *op,
+                       bool pwchange, bool *allowed)
 {
-    char *display;
     krb5_error_code code;
     int ncomp;
     bool exists = false;
@@ -151,38 +259,29 @@ principal_allowed(kadm5_hook_modinfo *config, krb5_context ctx,
     *allowed = true;
 
     /* Get the number of components. */
-    ncomp = krb5_principal_get_num_comp(ctx, principal);
+    ncomp = krb5_principal_get_num_comp(op->ctx, op->principal);
 
     /*
      * If the principal is single-part, check against ad_base_instance.
      * Otherwise, if the principal is multi-part, check the instance.
      */
     if (pwchange && ncomp == 1 && config->ad_base_instance != NULL) {
-        code = sync_instance_exists(ctx, principal, config->ad_base_instance,
-                                    &exists);
+        code = instance_exists(config, op, &exists);
         if (code != 0)
             return code;
         if (exists) {
-            code = krb5_unparse_name(ctx, principal, &display);
-            if (code != 0)
-                return code;
             sync_syslog_debug(config, "krb5-sync: ignoring principal \"%s\""
-                              " because %s instance exists", display,
+                              " because %s instance exists", op->name,
                               config->ad_base_instance);
-            krb5_free_unparsed_name(ctx, display);
             *allowed = false;
         }
     } else if (ncomp > 1) {
         const char *instance;
 
-        instance = krb5_principal_get_comp_string(ctx, principal, 1);
+        instance = krb5_principal_get_comp_string(op->ctx, op->principal, 1);
         if (!instance_allowed(config, instance)) {
-            code = krb5_unparse_name(ctx, principal, &display);
-            if (code != 0)
-                return code;
             sync_syslog_debug(config, "krb5-sync: ignoring principal \"%s\""
-                              " with non-null instance", display);
-            krb5_free_unparsed_name(ctx, display);
+                              " with non-null instance", op->name);
             *allowed = false;
         }
     }
@@ -190,17 +289,157 @@ principal_allowed(kadm5_hook_modinfo *config, krb5_context ctx,
 }
 
 
+/*
+ * Returns true if we have the configuration required to push this kind of
+ * change to a target.  Targets without it are skipped.
+ */
+static bool
+target_configured(struct sync_target *target, bool pwchange)
+{
+    if (pwchange)
+        return target->ad_realm != NULL;
+    return target->ad_admin_server != NULL
+        && target->ad_keytab != NULL
+        && target->ad_ldap_base != NULL
+        && target->ad_principal != NULL
+        && target->ad_realm != NULL;
+}
+
+
+/*
+ * Returns true if we have the configuration required to push this kind of
+ * change to any target.
+ */
+static bool
+any_configured(kadm5_hook_modinfo *config, bool pwchange)
+{
+    size_t i;
+
+    for (i = 0; i < config->ad_targets_count; i++)
+        if (target_configured(&config->ad_targets[i], pwchange))
+            return true;
+    return false;
+}
+
+
+/*
+ * Push a change to every target to which the principal is routed.  If
+ * password is NULL, this is an account status change to enabled, and
+ * otherwise a password change.
+ *
+ * For each target, if a change is already queued for this user, or a hedged
+ * change of the same kind may still be made, or if we always queue, queue
+ * this change as well.  Otherwise, push the change, to all such targets
+ * concurrently, and queue it for each target for which it fails.  Returns a
+ * Kerberos status code, which is only an error if we could not queue a
+ * change.
+ */
+krb5_error_code
+sync_push(kadm5_hook_modinfo *config, struct sync_op *op,
+          const char *password, bool enabled)
+{
+    struct sync_target *target;
+    struct sync_result *results;
+    struct sync_log_fields fields = { NULL, NULL, NULL, "failed", 0 };
+    enum sync_stats_type type;
+    enum sync_hedge_op hedge;
+    const char *operation;
+    size_t count = 0, i, size;
+    bool conflict;
+    krb5_error_code code = 0;
+
+    if (password != NULL) {
+        operation = "password";
+        hedge = SYNC_HEDGE_CHPASS;
+    } else {
+        operation = enabled ? "enable" : "disable";
+        hedge = SYNC_HEDGE_STATUS;
+    }
+    size = config->ad_targets_count * sizeof(*results);
+    results = sync_op_alloc(op, size);
+    if (results == NULL)
+        return sync_error_system(op->ctx, "cannot allocate memory");
+    memset(results, 0, size);
+
+    /* Find the targets and check if we queue for each of them. */
+    for (i = 0; i < config->ad_targets_count; i++) {
+        target = &config->ad_targets[i];
+        if (!target_configured(target, password != NULL))
+            continue;
+        if (!sync_target_match(target, op))
+            continue;
+        code = sync_queue_conflict(config, op, target, operation, &conflict);
+        if (code != 0)
+            goto done;
+        if (!conflict)
+            conflict = sync_hedge_pending(config, target, op, hedge);
+        if (conflict || config->ad_queue_only) {
+            code = sync_queue_write(config, op, target, operation, password);
+            if (code != 0)
+                goto done;
+            continue;
+        }
+        results[count++].target = target;
+    }
+
+    /* Push the change and queue it for each target for which it failed. */
+    sync_target_push(config, op, password, enabled, results, count);
+    type = (password != NULL) ? SYNC_STATS_PASSWORD : SYNC_STATS_STATUS;
+    for (i = 0; i < count; i++) {
+        if (results[i].code == 0) {
+            sync_stats_lag(config, type, op->origin);
+            continue;
+        }
+        fields.operation = operation;
+        fields.target = results[i].target->name;
+        sync_log_event(config, SYNC_LOG_NOTICE, op, &fields, "krb5-sync: AD"
+                       " %s change in %s failed, queuing (trace %s): %s",
+                       (password != NULL) ? "password" : "status",
+                       results[i].target->name, op->trace,
+                       (results[i].message != NULL)
+                           ? results[i].message : "unknown error");
+        code = sync_queue_write(config, op, results[i].target, operation,
+                                password);
+        if (code != 0)
+            goto done;
+    }
+
+done:
+    sync_target_results_free(results, count);
+    return code;
+}
+
+
+/*
+ * Record a change handled by the plugin in the statistics.  A change that
+ * succeeded but was queued for some target is counted as queued.
+ */
+static void
+record_change(kadm5_hook_modinfo *config, struct sync_op *op,
+              enum sync_stats_type type, krb5_error_code code, uint64_t start)
+{
+    enum sync_stats_result result;
+
+    if (code != 0)
+        result = SYNC_STATS_FAILED;
+    else if (op->queued > 0)
+        result = SYNC_STATS_QUEUED;
+    else
+        result = SYNC_STATS_SUCCESS;
+    sync_stats_change(config, SYNC_STATS_LIVE, type, result, start);
+}
+
+
 /*
  * Actions to take before the password is changed in the local database.
  *
- * Push the new password to Active Directory if we have the necessary
- * configuration information and return any error it returns, but skip any
- * principals with a non-NULL instance since those are kept separately in each
- * realm.
+ * Push the new password to each Active Directory target if we have the
+ * necessary configuration information, but skip any principals with a
+ * non-NULL instance since those are kept separately in each realm.
  *
- * If a password change is already queued for this usequeue this password
- * change as well.  If the password change fails for a reason that may mean
- * that the user doesn't already exist, also queue this change.
+ * If a password change is already queued for this user in a target, queue
+ * this password change as well.  If the password change fails for a reason
+ * that may mean that the user doesn't already exist, also queue this change.
  *
  * If the new password is NULL, that means that the keys are being randomized.
  * Currently, we can't do anything in that case, so just skip it.
@@ -209,13 +448,13 @@ krb5_error_code
 sync_chpass(kadm5_hook_modinfo *config, krb5_context ctx,
             krb5_principal principal, const char *password)
 {
+    struct sync_op op;
     krb5_error_code code;
-    const char *message;
+    uint64_t start;
     bool allowed = false;
-    bool conflict = true;
 
     /* Do nothing if we don't have required configuration. */
-    if (config->ad_realm == NULL)
+    if (!any_configured(config, true))
         return 0;
 
     /* If there was no password, this is probably a key randomization. */
@@ -223,91 +462,62 @@ sync_chpass(kadm5_hook_modinfo *config, krb5_context ctx,
         return 0;
 
     /* Check if this principal should be synchronized. */
-    code = principal_allowed(config, ctx, principal, true, &allowed);
-    if (code != 0)
-        return code;
-    if (!allowed)
-        return 0;
-
-    /* Check if there was a queue conflict or if we always queue. */
-    code = sync_queue_conflict(config, ctx, principal, "password", &conflict);
-    if (code != 0)
-        return code;
-    if (conflict)
-        goto queue;
-    if (config->ad_queue_only)
-        goto queue;
-
-    /* Do the password change, and queue if it fails. */
-    code = sync_ad_chpass(config, ctx, principal, password);
-    if (code != 0) {
-        message = krb5_get_error_message(ctx, code);
-        sync_syslog_notice(config, "krb5-sync: AD password change failed,"
-                           " queuing: %s", message);
-        krb5_free_error_message(ctx, message);
-        goto queue;
-    }
-    return 0;
-
-queue:
-    return sync_queue_write(config, ctx, principal, "password", password);
+    start = sync_stats_now();
+    code = sync_op_init(&op, ctx, principal);
+    SYNC_PROBE1(chpass_entry, op.name);
+    if (code == 0)
+        code = sync_principal_allowed(config, &op, true, &allowed);
+
+    /* Do the password change, queuing it where needed. */
+    if (code == 0 && allowed)
+        code = sync_push(config, &op, password, true);
+    if (code != 0 || allowed)
+        record_change(config, &op, SYNC_STATS_PASSWORD, code, start);
+    sync_capture_record(config, &op, SYNC_STATS_PASSWORD, true, allowed, code,
+                        start);
+    SYNC_PROBE2(chpass_return, op.name, code);
+    sync_op_free(&op);
+    return code;
 }
 
 
 /*
  * Actions to take after the account status is changed in the local database.
  *
- * Push the new account status to Active Directory if so configured, but skip
- * principals with non-NULL instances.  Return any error that it returns.
+ * Push the new account status to each Active Directory target if so
+ * configured, but skip principals with non-NULL instances.
  *
- * If a status change is already queued, or if making the status change fails,
- * queue it for later processing.
+ * If a status change is already queued in a target, or if making the status
+ * change fails, queue it for later processing.
  */
 krb5_error_code
 sync_status(kadm5_hook_modinfo *config, krb5_context ctx,
             krb5_principal principal, bool enabled)
 {
+    struct sync_op op;
     krb5_error_code code;
-    const char *message;
+    uint64_t start;
     bool allowed = false;
-    bool conflict = true;
 
     /* Do nothing if we don't have the required configuration. */
-    if (config->ad_admin_server == NULL
-        || config->ad_keytab == NULL
-        || config->ad_ldap_base == NULL
-        || config->ad_principal == NULL
-        || config->ad_realm == NULL)
+    if (!any_configured(config, false))
         return 0;
 
     /* Check if this principal should be synchronized. */
-    code = principal_allowed(config, ctx, principal, false, &allowed);
-    if (code != 0)
-        return code;
-    if (!allowed)
-        return 0;
-
-    /* Check if there was a queue conflict or if we always queue. */
-    code = sync_queue_conflict(config, ctx, principal, "enable", &conflict);
-    if (code != 0)
-        return code;
-    if (conflict)
-        goto queue;
-    if (config->ad_queue_only)
-        goto queue;
-
-    /* Synchronize the status. */
-    code = sync_ad_status(config, ctx, principal, enabled);
-    if (code != 0) {
-        message = krb5_get_error_message(ctx, code);
-        sync_syslog_notice(config, "krb5-sync: AD status change failed,"
-                           " queuing: %s", message);
-        krb5_free_error_message(ctx, message);
-        goto queue;
-    }
-    return 0;
-
-queue:
-    return sync_queue_write(config, ctx, principal,
-                            enabled ? "enable" : "disable", NULL);
+    start = sync_stats_now();
+    code = sync_op_init(&op, ctx, principal);
+    SYNC_PROBE2(status_entry, op.name, (int) enabled);
+    if (code == 0)
+        code = sync_principal_allowed(config, &op, false, &allowed);
+
+    /* Synchronize the status, queuing it where needed. */
+    if (code == 0 && allowed)
+        code = sync_push(config, &op, NULL, enabled);
+    if (code != 0 || allowed)
+        record_change(config, &op, SYNC_STATS_STATUS, code, start);
+    sync_capture_record(config, &op, SYNC_STATS_STATUS, enabled, allowed,
+                        code, start);
+    SYNC_PROBE2(status_return, op.name, code);
+    sync_op_free(&op);
+    return code;
 }
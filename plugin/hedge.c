@@ -0,0 +1,606 @@
+/*
+ * Hedged requests to a second domain controller.
+ *
+ * A domain controller that occasionally stalls dominates the tail latency of
+ * changes to Active Directory.  If a hedge server is configured, we therefore
+ * run the change in a thread and, if it hasn't finished within a percentile
+ * of the recent latency of that domain controller, send the same change to
+ * the hedge server in a second thread.  Whichever attempt succeeds first
+ * wins.  The loser can't be stopped while it waits for a server, so it's
+ * left to finish on its own and its result is discarded.
+ *
+ * Both attempts may make the change, which is why only the operations in
+ * enum sync_hedge_op can be hedged: setting a password to the same value and
+ * setting the account status.  That only covers a repeat of the same change,
+ * though.  If the loser made its change after a later, different change for
+ * the same account, it would undo that change.  To prevent this, the loser
+ * checks with sync_hedge_abandoned just before making its change and gives
+ * up if the other attempt has already won, and, since it may already be past
+ * that check, sync_hedge_pending reports later changes to the same account
+ * as conflicting until the loser has finished so that they're queued.
+ *
+ * The latency of the usual domain controller is only sampled by its own
+ * attempt, since the time until the hedge server answered says nothing about
+ * it.  If that attempt gives up, the time until then is recorded, which is
+ * less than its real latency but more than the delay before hedging.
+ *
+ * Each attempt uses a Kerberos context and credential cache of its own,
+ * since neither may be shared between threads, and password changes to the
+ * hedge server use a separate krb5.conf file that points the Active
+ * Directory realm at it.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#include <sys/time.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+#include <util/macros.h>
+
+/* Whether we can point a Kerberos context at a different krb5.conf file. */
+#if defined(HAVE_KRB5_INIT_CONTEXT_PROFILE) && defined(HAVE_PROFILE_H)
+# define HAVE_HEDGE_CONTEXT 1
+#elif defined(HAVE_KRB5_SET_CONFIG_FILES)
+# define HAVE_HEDGE_CONTEXT 1
+#endif
+
+
+/*
+ * Return how long to wait for the usual domain controller before sending the
+ * operation to the hedge server as well, in microseconds.  Returns 0 if
+ * hedging isn't configured or isn't supported for this operation, or if we
+ * don't yet have enough latency samples to pick a delay.
+ */
+unsigned long
+sync_hedge_delay(kadm5_hook_modinfo *config, struct sync_target *target,
+                 const char *dc, enum sync_hedge_op op)
+{
+    unsigned long percentile;
+    bool supported = false;
+
+    if (target->ad_hedge_server == NULL)
+        return 0;
+    switch (op) {
+    case SYNC_HEDGE_CHPASS:
+#if defined(HAVE_PTHREAD) && defined(HAVE_HEDGE_CONTEXT)
+        supported = (target->ad_hedge_krb5_conf != NULL);
+#endif
+        break;
+    case SYNC_HEDGE_STATUS:
+#if defined(HAVE_PTHREAD) && defined(HAVE_GSS_KRB5_CCACHE_NAME)
+        supported = true;
+#endif
+        break;
+    }
+    if (!supported)
+        return 0;
+    percentile = (unsigned long) config->ad_hedge_percentile;
+    return sync_control_percentile(config, dc, percentile);
+}
+
+
+#ifdef HAVE_PTHREAD
+
+/* One attempt of a hedged operation. */
+struct sync_hedge_attempt {
+    struct hedge *hedge;
+    bool started;
+    bool done;
+    bool abandoned;
+    bool soft;
+    krb5_error_code code;
+    char *message;
+};
+
+/*
+ * The state shared between the caller and the attempts of a hedged
+ * operation.  Everything the attempts need is copied here, since the loser
+ * may still be running after the caller returns.  Freed when the last
+ * reference is released.
+ */
+struct hedge {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned int refs;
+    unsigned int active;
+    struct hedge *next;
+    kadm5_hook_modinfo *config;
+    struct sync_target *target;
+    const char *dc;
+    enum sync_hedge_op op;
+    char *principal;
+    char trace[SYNC_TRACE_SIZE];
+    uint64_t origin;
+    char *password;
+    bool enabled;
+    struct sync_hedge_attempt attempts[2];
+    struct sync_hedge_attempt *winner;
+};
+
+/*
+ * The number of attempts still running, so that we can wait for them, and the
+ * hedged operations that they belong to, so that we can find conflicts.
+ */
+static pthread_mutex_t running_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t running_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long running = 0;
+static struct hedge *pending = NULL;
+
+
+/*
+ * Allocate the state for a new hedged operation, holding one reference for
+ * the caller.  Returns NULL on failure to allocate memory.
+ */
+static struct hedge *
+hedge_new(kadm5_hook_modinfo *config, struct sync_target *target,
+          const char *dc, enum sync_hedge_op op)
+{
+    struct hedge *hedge;
+    size_t i;
+
+    hedge = calloc(1, sizeof(*hedge));
+    if (hedge == NULL)
+        return NULL;
+    if (pthread_mutex_init(&hedge->mutex, NULL) != 0) {
+        free(hedge);
+        return NULL;
+    }
+    if (pthread_cond_init(&hedge->cond, NULL) != 0) {
+        pthread_mutex_destroy(&hedge->mutex);
+        free(hedge);
+        return NULL;
+    }
+    hedge->refs = 1;
+    hedge->config = config;
+    hedge->target = target;
+    hedge->dc = dc;
+    hedge->op = op;
+    for (i = 0; i < ARRAY_SIZE(hedge->attempts); i++)
+        hedge->attempts[i].hedge = hedge;
+    return hedge;
+}
+
+
+/*
+ * Release a reference to the state of a hedged operation, freeing it if this
+ * was the last one.  The password is cleared before it's freed.
+ */
+static void
+hedge_release(struct hedge *hedge)
+{
+    bool last;
+    size_t i;
+
+    pthread_mutex_lock(&hedge->mutex);
+    hedge->refs--;
+    last = (hedge->refs == 0);
+    pthread_mutex_unlock(&hedge->mutex);
+    if (!last)
+        return;
+    pthread_cond_destroy(&hedge->cond);
+    pthread_mutex_destroy(&hedge->mutex);
+    free(hedge->principal);
+    if (hedge->password != NULL) {
+        memset(hedge->password, 0, strlen(hedge->password));
+        free(hedge->password);
+    }
+    for (i = 0; i < ARRAY_SIZE(hedge->attempts); i++)
+        free(hedge->attempts[i].message);
+    free(hedge);
+}
+
+
+/*
+ * Record that one of the attempts of a hedged operation has stopped, removing
+ * the operation from the pending list once none are left.  Must be called
+ * with running_mutex held.
+ */
+static void
+hedge_stopped(struct hedge *hedge)
+{
+    struct hedge **p;
+
+    hedge->active--;
+    if (hedge->active > 0)
+        return;
+    for (p = &pending; *p != NULL; p = &(*p)->next)
+        if (*p == hedge) {
+            *p = hedge->next;
+            break;
+        }
+}
+
+
+/*
+ * Create the Kerberos context for an attempt from the same krb5.conf as the
+ * configuration.  Password changes sent to the hedge server use a context
+ * built from ad_hedge_krb5_conf instead.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+attempt_context(struct hedge *hedge, bool second, krb5_context *ctx)
+{
+    if (!second || hedge->op != SYNC_HEDGE_CHPASS)
+        return sync_config_context(hedge->config->krb5_conf, ctx);
+    return sync_config_context(hedge->target->ad_hedge_krb5_conf, ctx);
+}
+
+
+/*
+ * The thread running one attempt of a hedged operation.  Records the result
+ * in the attempt, wakes up the caller, and releases its reference to the
+ * shared state.
+ */
+static void *
+attempt_thread(void *data)
+{
+    struct sync_hedge_attempt *attempt = data;
+    struct hedge *hedge = attempt->hedge;
+    kadm5_hook_modinfo *config = hedge->config;
+    struct sync_target *target = hedge->target;
+    bool second = (attempt == &hedge->attempts[1]);
+    const char *server, *message;
+    struct sync_op op;
+    krb5_context ctx;
+    krb5_principal principal = NULL;
+    krb5_error_code code;
+    uint64_t start, now;
+    bool soft = false, have_op = false;
+
+    start = sync_stats_now();
+    code = attempt_context(hedge, second, &ctx);
+    if (code == 0)
+        code = krb5_parse_name(ctx, hedge->principal, &principal);
+    if (code == 0) {
+        have_op = true;
+        code = sync_op_init(&op, ctx, principal);
+    }
+    if (code == 0) {
+        sync_op_trace(&op, hedge->trace, hedge->origin);
+        op.hedge = attempt;
+        if (hedge->op == SYNC_HEDGE_CHPASS)
+            code = sync_ad_chpass_attempt(config, target, &op,
+                                          hedge->password, &soft);
+        else {
+            server = second ? target->ad_hedge_server
+                            : target->ad_admin_server;
+            code = sync_ad_status_attempt(config, target, &op, server,
+                                          hedge->enabled, &soft);
+        }
+    }
+
+    /* Record the result and wake up the caller. */
+    pthread_mutex_lock(&hedge->mutex);
+    attempt->code = code;
+    attempt->soft = soft;
+    if (code != 0 && ctx == NULL)
+        attempt->message = strdup("cannot create Kerberos context");
+    else if (code != 0) {
+        message = krb5_get_error_message(ctx, code);
+        attempt->message = strdup(message);
+        krb5_free_error_message(ctx, message);
+    } else if (hedge->winner == NULL)
+        hedge->winner = attempt;
+    attempt->done = true;
+    pthread_cond_broadcast(&hedge->cond);
+    pthread_mutex_unlock(&hedge->mutex);
+
+    /* Sample the latency of the usual domain controller. */
+    now = sync_stats_now();
+    if (!second && (code == 0 || attempt->abandoned) && now > start)
+        sync_control_latency(config, hedge->dc,
+                             (unsigned long) (now - start));
+
+    /* Clean up. */
+    if (have_op)
+        sync_op_free(&op);
+    if (principal != NULL)
+        krb5_free_principal(ctx, principal);
+    if (ctx != NULL)
+        krb5_free_context(ctx);
+
+    /* Once the last attempt is done, changes no longer conflict. */
+    pthread_mutex_lock(&running_mutex);
+    running--;
+    hedge_stopped(hedge);
+    pthread_cond_broadcast(&running_cond);
+    pthread_mutex_unlock(&running_mutex);
+    hedge_release(hedge);
+    return NULL;
+}
+
+
+/*
+ * Start an attempt in a new, detached thread.  Must be called with the
+ * hedge mutex held.  Returns 0 on success and an errno value on failure.
+ */
+static int
+attempt_start(struct sync_hedge_attempt *attempt)
+{
+    struct hedge *hedge = attempt->hedge;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int status;
+
+    status = pthread_attr_init(&attr);
+    if (status != 0)
+        return status;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    hedge->refs++;
+    pthread_mutex_lock(&running_mutex);
+    running++;
+    if (hedge->active++ == 0) {
+        hedge->next = pending;
+        pending = hedge;
+    }
+    pthread_mutex_unlock(&running_mutex);
+    status = pthread_create(&thread, &attr, attempt_thread, attempt);
+    pthread_attr_destroy(&attr);
+    if (status != 0) {
+        hedge->refs--;
+        pthread_mutex_lock(&running_mutex);
+        running--;
+        hedge_stopped(hedge);
+        pthread_mutex_unlock(&running_mutex);
+        return status;
+    }
+    attempt->started = true;
+    return 0;
+}
+
+
+/*
+ * Return true if a hedged operation is finished: either an attempt has
+ * succeeded or all of the attempts that were started have failed.  Must be
+ * called with the hedge mutex held.
+ */
+static bool
+hedge_finished(struct hedge *hedge)
+{
+    size_t i;
+
+    if (hedge->winner != NULL)
+        return true;
+    for (i = 0; i < ARRAY_SIZE(hedge->attempts); i++)
+        if (hedge->attempts[i].started && !hedge->attempts[i].done)
+            return false;
+    return true;
+}
+
+
+/*
+ * Run a hedged operation, releasing the caller's reference to its state.
+ * Start the first attempt, wait up to delay microseconds for it, and then
+ * start the second attempt against the hedge server.  The result is that of
+ * the first attempt to succeed or, if none succeed, that of the first
+ * attempt.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+hedge_run(kadm5_hook_modinfo *config, krb5_context ctx, const char *dc,
+          unsigned long delay, struct hedge *hedge, bool *soft)
+{
+    struct sync_hedge_attempt *result;
+    struct timeval now;
+    struct timespec deadline;
+    krb5_error_code code;
+    bool hedged = false;
+    int status;
+
+    /* Start the first attempt. */
+    pthread_mutex_lock(&hedge->mutex);
+    status = attempt_start(&hedge->attempts[0]);
+    if (status != 0) {
+        pthread_mutex_unlock(&hedge->mutex);
+        hedge_release(hedge);
+        errno = status;
+        return sync_error_system(ctx, "cannot create thread");
+    }
+
+    /* Wait for it until the deadline and then start the hedge attempt. */
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + (time_t) (delay / 1000000);
+    deadline.tv_nsec = (now.tv_usec + (long) (delay % 1000000)) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (!hedge->attempts[0].done) {
+        status = pthread_cond_timedwait(&hedge->cond, &hedge->mutex,
+                                        &deadline);
+        if (status == ETIMEDOUT)
+            break;
+    }
+    if (!hedge->attempts[0].done) {
+        sync_syslog_debug(config, "krb5-sync: no response from %s after"
+                          " %lums, also trying %s", dc, delay / 1000,
+                          hedge->target->ad_hedge_server);
+        hedged = (attempt_start(&hedge->attempts[1]) == 0);
+    }
+
+    /* Wait for the result. */
+    while (!hedge_finished(hedge))
+        pthread_cond_wait(&hedge->cond, &hedge->mutex);
+    result = hedge->winner;
+    if (result == NULL)
+        result = &hedge->attempts[0];
+    code = result->code;
+    *soft = result->soft;
+    if (code != 0)
+        krb5_set_error_message(ctx, code, "%s", result->message != NULL
+                               ? result->message : "hedged change failed");
+    pthread_mutex_unlock(&hedge->mutex);
+
+    /* Count the hedge. */
+    if (hedged)
+        sync_control_hedge(config, dc, result == &hedge->attempts[1]);
+    hedge_release(hedge);
+    return code;
+}
+
+
+/*
+ * Make a hedged password change.  The principal name and password are
+ * copied, since the losing attempt may outlive the operation.  Returns a
+ * Kerberos status code.
+ */
+krb5_error_code
+sync_hedge_chpass(kadm5_hook_modinfo *config, struct sync_target *target,
+                  struct sync_op *op, const char *dc, unsigned long delay,
+                  const char *password, bool *soft)
+{
+    struct hedge *hedge;
+
+    hedge = hedge_new(config, target, dc, SYNC_HEDGE_CHPASS);
+    if (hedge == NULL)
+        return sync_error_system(op->ctx, "cannot allocate memory");
+    hedge->principal = strdup(op->name);
+    memcpy(hedge->trace, op->trace, sizeof(hedge->trace));
+    hedge->origin = op->origin;
+    hedge->password = strdup(password);
+    if (hedge->principal == NULL || hedge->password == NULL) {
+        hedge_release(hedge);
+        return sync_error_system(op->ctx, "cannot allocate memory");
+    }
+    return hedge_run(config, op->ctx, dc, delay, hedge, soft);
+}
+
+
+/*
+ * Make a hedged account status change.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_hedge_status(kadm5_hook_modinfo *config, struct sync_target *target,
+                  struct sync_op *op, const char *dc, unsigned long delay,
+                  bool enabled, bool *soft)
+{
+    struct hedge *hedge;
+
+    hedge = hedge_new(config, target, dc, SYNC_HEDGE_STATUS);
+    if (hedge == NULL)
+        return sync_error_system(op->ctx, "cannot allocate memory");
+    hedge->principal = strdup(op->name);
+    memcpy(hedge->trace, op->trace, sizeof(hedge->trace));
+    hedge->origin = op->origin;
+    if (hedge->principal == NULL) {
+        hedge_release(hedge);
+        return sync_error_system(op->ctx, "cannot allocate memory");
+    }
+    hedge->enabled = enabled;
+    return hedge_run(config, op->ctx, dc, delay, hedge, soft);
+}
+
+
+/*
+ * Called by an attempt just before it makes its change.  Returns true, and
+ * marks the attempt as abandoned, if the other attempt of the same operation
+ * has already succeeded, in which case the change must not be made.
+ */
+bool
+sync_hedge_abandoned(struct sync_op *op)
+{
+    struct sync_hedge_attempt *attempt = op->hedge;
+    struct hedge *hedge;
+    bool abandoned;
+
+    if (attempt == NULL)
+        return false;
+    hedge = attempt->hedge;
+    pthread_mutex_lock(&hedge->mutex);
+    abandoned = (hedge->winner != NULL && hedge->winner != attempt);
+    attempt->abandoned = abandoned;
+    pthread_mutex_unlock(&hedge->mutex);
+    return abandoned;
+}
+
+
+/*
+ * Return true if a hedged operation of the same type for the same principal
+ * and target still has an attempt running, which may yet make its change.
+ */
+bool
+sync_hedge_pending(kadm5_hook_modinfo *config, struct sync_target *target,
+                   struct sync_op *op, enum sync_hedge_op type)
+{
+    struct hedge *hedge;
+    bool found = false;
+
+    pthread_mutex_lock(&running_mutex);
+    for (hedge = pending; hedge != NULL; hedge = hedge->next)
+        if (hedge->config == config && hedge->target == target
+            && hedge->op == type && strcmp(hedge->principal, op->name) == 0) {
+            found = true;
+            break;
+        }
+    pthread_mutex_unlock(&running_mutex);
+    return found;
+}
+
+
+/*
+ * Wait for any attempts that are still running, since they use the
+ * configuration that the caller is about to free.
+ */
+void
+sync_hedge_close(kadm5_hook_modinfo *config UNUSED)
+{
+    pthread_mutex_lock(&running_mutex);
+    while (running > 0)
+        pthread_cond_wait(&running_cond, &running_mutex);
+    pthread_mutex_unlock(&running_mutex);
+}
+
+#else /* !HAVE_PTHREAD */
+
+/*
+ * Without threads, sync_hedge_delay always returns 0 and these functions are
+ * never called.
+ */
+krb5_error_code
+sync_hedge_chpass(kadm5_hook_modinfo *config UNUSED,
+                  struct sync_target *target UNUSED, struct sync_op *op,
+                  const char *dc UNUSED, unsigned long delay UNUSED,
+                  const char *password UNUSED, bool *soft UNUSED)
+{
+    return sync_error_generic(op->ctx, "hedged requests not supported");
+}
+
+krb5_error_code
+sync_hedge_status(kadm5_hook_modinfo *config UNUSED,
+                  struct sync_target *target UNUSED, struct sync_op *op,
+                  const char *dc UNUSED, unsigned long delay UNUSED,
+                  bool enabled UNUSED, bool *soft UNUSED)
+{
+    return sync_error_generic(op->ctx, "hedged requests not supported");
+}
+
+bool
+sync_hedge_abandoned(struct sync_op *op UNUSED)
+{
+    return false;
+}
+
+bool
+sync_hedge_pending(kadm5_hook_modinfo *config UNUSED,
+                   struct sync_target *target UNUSED,
+                   struct sync_op *op UNUSED, enum sync_hedge_op type UNUSED)
+{
+    return false;
+}
+
+void
+sync_hedge_close(kadm5_hook_modinfo *config UNUSED)
+{
+}
+
+#endif /* !HAVE_PTHREAD */
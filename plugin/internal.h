@@ -24,6 +24,174 @@
 typedef struct kadm5_hook_modinfo_st kadm5_hook_modinfo;
 #endif
 
+/*
+ * Opaque structs holding the mapped shared state, cache, and statistics, and
+ * the state for structured log events and the capture file.
+ */
+struct sync_cache;
+struct sync_capture;
+struct sync_control;
+struct sync_events;
+struct sync_stats_file;
+
+/* The kinds of entries in the persistent lookup cache. */
+enum sync_cache_kind {
+    SYNC_CACHE_DN = 1,          /* userPrincipalName to DN in a target. */
+    SYNC_CACHE_INSTANCE = 2     /* That a principal's instance is missing. */
+};
+
+/*
+ * Classification of the result of an Active Directory operation for the
+ * controller.  Soft failures are ones that indicate that the domain
+ * controller is overloaded or unreachable and that we should back off.
+ */
+enum sync_outcome {
+    SYNC_OUTCOME_SUCCESS,
+    SYNC_OUTCOME_SOFT,
+    SYNC_OUTCOME_HARD
+};
+
+/* A snapshot of the controller state for one domain controller. */
+struct sync_control_info {
+    char name[256];
+    double tokens;
+    double window;
+    unsigned long live;
+    unsigned long drain;
+    unsigned long waits;
+    unsigned long successes;
+    unsigned long failures;
+    unsigned long backoffs;
+    unsigned long hedges;
+    unsigned long hedge_wins;
+};
+
+/*
+ * Statistics shared between processes.  Changes are counted by where they
+ * came from, whether they change the password or the account status, and
+ * their outcome, where queued means that the change was queued for at least
+ * one target.  Operations against domain controllers are counted by their
+ * enum sync_outcome.
+ */
+enum sync_stats_source {
+    SYNC_STATS_LIVE,            /* Changes from kadmind or kpasswdd. */
+    SYNC_STATS_DRAIN            /* Changes applied from the queue. */
+};
+enum sync_stats_type {
+    SYNC_STATS_PASSWORD,
+    SYNC_STATS_STATUS
+};
+enum sync_stats_result {
+    SYNC_STATS_SUCCESS,
+    SYNC_STATS_QUEUED,
+    SYNC_STATS_FAILED
+};
+#define SYNC_STATS_SOURCES  2
+#define SYNC_STATS_TYPES    2
+#define SYNC_STATS_RESULTS  3
+#define SYNC_STATS_OUTCOMES 3
+#define SYNC_STATS_KINDS    3   /* enum sync_cache_kind starts at 1. */
+
+/* Number of histogram buckets and of domain controllers tracked. */
+#define SYNC_STATS_BUCKETS 32
+#define SYNC_STATS_DCS     32
+
+/*
+ * A histogram of latencies in microseconds, or milliseconds for propagation
+ * lag.  bucket[i] counts the latencies larger than 2^(i-1) and at most 2^i,
+ * except that the last bucket has no upper bound.
+ */
+struct sync_stats_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t bucket[SYNC_STATS_BUCKETS];
+};
+
+/* The statistics for one domain controller. */
+struct sync_stats_dc {
+    char name[256];
+    uint64_t outcomes[SYNC_STATS_OUTCOMES];
+    struct sync_stats_histogram latency;
+};
+
+/*
+ * All of the statistics, as stored in the stats file and as returned by
+ * sync_stats_read.  lag is the time from when the plugin first saw a change
+ * until it was applied to a target.  dc_count is only set in a snapshot.
+ */
+struct sync_stats {
+    uint64_t changes[SYNC_STATS_SOURCES][SYNC_STATS_TYPES][SYNC_STATS_RESULTS];
+    struct sync_stats_histogram latency[SYNC_STATS_SOURCES][SYNC_STATS_TYPES];
+    struct sync_stats_histogram lag[SYNC_STATS_TYPES];
+    struct sync_stats_histogram lock_wait;
+    uint64_t cache_hits[SYNC_STATS_KINDS];
+    uint64_t cache_misses[SYNC_STATS_KINDS];
+    uint64_t queue_writes;
+    uint64_t log_dropped;
+    uint64_t dc_count;
+    struct sync_stats_dc dc[SYNC_STATS_DCS];
+};
+
+/*
+ * The format of the file written if capture_file is set, which is a header
+ * followed by one record per change, all in host byte order.  key is the key
+ * of the hash used for the pseudonyms of users.  In each record, time is
+ * when the plugin saw the change and latency how long it took, both in
+ * microseconds, user is the pseudonym of the first component of the
+ * principal and length its length, type is an enum sync_stats_type, enabled
+ * is the new status of a status change, outcome is an enum
+ * sync_capture_outcome, shape is an enum sync_capture_shape, and queued is
+ * the number of targets for which the change was queued.
+ */
+#define SYNC_CAPTURE_MAGIC   0x6b736370U
+#define SYNC_CAPTURE_VERSION 1
+enum sync_capture_outcome {
+    SYNC_CAPTURE_SUCCESS,
+    SYNC_CAPTURE_QUEUED,
+    SYNC_CAPTURE_FAILED,
+    SYNC_CAPTURE_SKIPPED        /* The principal isn't synchronized. */
+};
+enum sync_capture_shape {
+    SYNC_CAPTURE_BASE,          /* No instance. */
+    SYNC_CAPTURE_INSTANCE,      /* An instance listed in ad_instances. */
+    SYNC_CAPTURE_OTHER          /* Any other instance. */
+};
+struct sync_capture_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+};
+struct sync_capture_record {
+    uint64_t time;
+    uint64_t latency;
+    uint64_t user;
+    uint8_t type;
+    uint8_t enabled;
+    uint8_t outcome;
+    uint8_t shape;
+    uint8_t components;
+    uint8_t length;
+    uint8_t queued;
+    uint8_t reserved;
+};
+
+/*
+ * The points at which faults can be injected if built with fault injection,
+ * each configured with the setting fault_ followed by its name in lowercase.
+ */
+enum sync_fault_point {
+    SYNC_FAULT_CREDS,           /* Getting credentials for a target. */
+    SYNC_FAULT_KPASSWD,         /* A password change with kpasswd. */
+    SYNC_FAULT_LDAP_BIND,
+    SYNC_FAULT_LDAP_SEARCH,     /* A search for the account to change. */
+    SYNC_FAULT_LDAP_MODIFY,
+    SYNC_FAULT_QUEUE_LOCK,
+    SYNC_FAULT_QUEUE_OPEN,      /* Creating a queue file. */
+    SYNC_FAULT_QUEUE_WRITE,     /* Each write to a new queue file. */
+    SYNC_FAULT_QUEUE_UNLINK,    /* Removing a queue file once applied. */
+    SYNC_FAULT_POINTS
+};
+
 /* Used to store a list of strings, managed by the sync_vector_* functions. */
 struct vector {
     size_t count;
@@ -31,6 +199,103 @@ struct vector {
     char **strings;
 };
 
+/*
+ * An Active Directory domain or forest to which changes are pushed.  The
+ * target named ad takes its settings from the top-level options, and other
+ * targets from options prefixed with the target name and a period, falling
+ * back on the top-level options.  The name is also used as the domain field
+ * of queued changes.  ad_match is a list of fnmatch patterns for the
+ * principals, without the realm, that are pushed to this target, or NULL to
+ * push every principal.  ad_match and ad_ccache are never inherited.
+ */
+struct sync_target {
+    char *name;
+    char *ad_admin_server;
+    char *ad_ccache;
+    char *ad_hedge_krb5_conf;
+    char *ad_hedge_server;
+    char *ad_keytab;
+    char *ad_ldap_base;
+    struct vector *ad_match;
+    char *ad_principal;
+    char *ad_realm;
+};
+
+/*
+ * The result of pushing a change to one target.  message is the error
+ * message if code is non-zero.
+ */
+struct sync_result {
+    struct sync_target *target;
+    krb5_error_code code;
+    char *message;
+};
+
+/*
+ * Levels of messages logged to syslog, in increasing order of detail.  Only
+ * messages at or below the level set by the log_level option are logged.
+ */
+enum sync_log_level {
+    SYNC_LOG_NONE,
+    SYNC_LOG_WARNING,
+    SYNC_LOG_NOTICE,
+    SYNC_LOG_INFO,
+    SYNC_LOG_DEBUG
+};
+
+/*
+ * The fields of a structured log event beyond the principal and trace ID,
+ * which come from the operation.  Any of the strings may be NULL, and
+ * latency is in microseconds, or 0 if not known.
+ */
+struct sync_log_fields {
+    const char *operation;
+    const char *target;
+    const char *dc;
+    const char *outcome;
+    uint64_t latency;
+};
+
+/* Size of the buffer for a trace ID, which is 16 hex digits. */
+#define SYNC_TRACE_SIZE 17
+
+/*
+ * The state of one change, shared by all of the stages that handle it.  name
+ * is the unparsed principal, user is the principal without the realm, and
+ * key is user with slashes changed to periods, used to name queue files.
+ * trace identifies the change in logs and origin is when the plugin first
+ * saw it, in microseconds since the epoch, both kept in the queue file if
+ * the change is queued.  The Active Directory principal for each target is
+ * converted the first time it is needed.  queued counts the targets for
+ * which the change was queued.  hedge is the attempt of a hedged operation
+ * that the change belongs to, if any.  Memory that lives only as long as the
+ * change is allocated from an arena that starts in storage.  Managed by the
+ * sync_op_* functions.
+ */
+struct sync_hedge_attempt;
+struct sync_op_block;
+struct sync_op {
+    krb5_context ctx;
+    krb5_principal principal;
+    char *name;
+    const char *user;
+    const char *key;
+    char trace[SYNC_TRACE_SIZE];
+    uint64_t origin;
+    krb5_principal *ad_principals;
+    char **ad_names;
+    size_t ad_count;
+    unsigned long queued;
+    struct sync_hedge_attempt *hedge;
+    struct sync_op_block *blocks;
+    size_t used;
+    union {
+        char data[512];
+        void *pointer;
+        double number;
+    } storage;
+};
+
 /*
  * Local configuration information for the module.  This contains all the
  * parameters that are read from the krb5-sync sub-section of the appdefaults
@@ -41,16 +306,41 @@ struct vector {
  * at least the MIT plugin.
  */
 struct kadm5_hook_modinfo_st {
-    char *ad_admin_server;
     char *ad_base_instance;
+    long ad_cache_ttl;
+    long ad_drain_concurrency;
+    long ad_hedge_percentile;
     struct vector *ad_instances;
-    char *ad_keytab;
-    char *ad_ldap_base;
-    char *ad_principal;
+    long ad_live_reserve;
     bool ad_queue_only;
-    char *ad_realm;
+    long ad_rate_burst;
+    long ad_rate_limit;
+    struct sync_target *ad_targets;
+    size_t ad_targets_count;
+    enum sync_log_level log_level;
     char *queue_dir;
+    bool stats;
     bool syslog;
+
+    /*
+     * Internal state rather than configuration.  drain is set by the
+     * command-line tool so that its changes don't use the share of the rate
+     * limit reserved for kadmind.  krb5_conf is set by the library to the
+     * krb5.conf file the configuration was read from, if it isn't the
+     * default, so that threads create their contexts from it.  log_buffer
+     * holds formatted syslog messages and is reused for each one, events is
+     * the state for structured log events if they're used, and capture is
+     * the state for the capture file if there is one.
+     */
+    bool drain;
+    char *krb5_conf;
+    struct sync_cache *cache;
+    struct sync_control *control;
+    struct sync_stats_file *stats_file;
+    char *log_buffer;
+    size_t log_size;
+    struct sync_events *events;
+    struct sync_capture *capture;
 };
 
 BEGIN_DECLS
@@ -72,13 +362,191 @@ krb5_error_code sync_chpass(kadm5_hook_modinfo *, krb5_context,
 krb5_error_code sync_status(kadm5_hook_modinfo *, krb5_context,
                             krb5_principal, bool enabled);
 
-/* Password changing in Active Directory. */
-krb5_error_code sync_ad_chpass(kadm5_hook_modinfo *, krb5_context,
-                               krb5_principal, const char *password);
+/*
+ * Sets allowed to whether changes to the principal of this operation are
+ * synchronized, following ad_instances and, for password changes,
+ * ad_base_instance.
+ */
+krb5_error_code sync_principal_allowed(kadm5_hook_modinfo *, struct sync_op *,
+                                       bool pwchange, bool *allowed)
+    __attribute__((__nonnull__));
+
+/*
+ * Push a change to every target to which the principal is routed, queuing
+ * it where needed.  If password is NULL, the change is an account status
+ * change to enabled, and otherwise a password change.
+ */
+krb5_error_code sync_push(kadm5_hook_modinfo *, struct sync_op *,
+                          const char *password, bool enabled)
+    __attribute__((__nonnull__(1, 2)));
+
+/* Password changing in an Active Directory target. */
+krb5_error_code sync_ad_chpass(kadm5_hook_modinfo *, struct sync_target *,
+                               struct sync_op *, const char *password);
 
-/* Account status update in Active Directory. */
-krb5_error_code sync_ad_status(kadm5_hook_modinfo *, krb5_context,
-                               krb5_principal, bool enabled);
+/* Account status update in an Active Directory target. */
+krb5_error_code sync_ad_status(kadm5_hook_modinfo *, struct sync_target *,
+                               struct sync_op *, bool enabled);
+
+/*
+ * Convert a local principal to the corresponding principal in an Active
+ * Directory target, which the caller should free.
+ */
+krb5_error_code sync_ad_principal(kadm5_hook_modinfo *, struct sync_target *,
+                                  krb5_context, krb5_const_principal,
+                                  krb5_principal *)
+    __attribute__((__nonnull__));
+
+/*
+ * Call the function for each user account in an Active Directory target,
+ * with its userPrincipalName and whether it is disabled.  The accounts are
+ * retrieved with a paged LDAP search, so only one page of them is held in
+ * memory at a time.
+ */
+typedef void (*sync_ad_account_func)(void *, const char *upn, bool disabled);
+krb5_error_code sync_ad_accounts(kadm5_hook_modinfo *, struct sync_target *,
+                                 krb5_context, sync_ad_account_func, void *)
+    __attribute__((__nonnull__(1, 2, 3, 4)));
+
+/*
+ * The same, but using the DirSync control so that only the accounts that
+ * changed since the search that returned the cookie are returned.  cookie
+ * and length hold that cookie, or NULL to return every account, and are
+ * replaced by the new cookie, which the caller should free.  If Active
+ * Directory rejects the cookie, invalid is set and the caller should start
+ * over without one.
+ */
+krb5_error_code sync_ad_changes(kadm5_hook_modinfo *, struct sync_target *,
+                                krb5_context, void **cookie, size_t *length,
+                                bool *invalid, sync_ad_account_func, void *)
+    __attribute__((__nonnull__(1, 2, 3, 4, 5, 6, 7)));
+
+/*
+ * The same, but only for the accounts with the given userPrincipalNames,
+ * which are looked up in batches.
+ */
+krb5_error_code sync_ad_lookup(kadm5_hook_modinfo *, struct sync_target *,
+                               krb5_context, struct vector *upns,
+                               sync_ad_account_func, void *)
+    __attribute__((__nonnull__(1, 2, 3, 4, 5)));
+
+/*
+ * The same changes made as one attempt, without the controller or hedging.
+ * The status change is made against the given server.  Both set soft if the
+ * failure should make us back off.  The password change always uses a
+ * credential cache of its own and is safe to call in a thread with its own
+ * Kerberos context.  The status change is only safe to call in a thread if
+ * HAVE_GSS_KRB5_CCACHE_NAME is defined, since otherwise it has to point
+ * SASL at its credentials through the environment.
+ */
+krb5_error_code sync_ad_chpass_attempt(kadm5_hook_modinfo *,
+                                       struct sync_target *, struct sync_op *,
+                                       const char *password, bool *soft);
+krb5_error_code sync_ad_status_attempt(kadm5_hook_modinfo *,
+                                       struct sync_target *, struct sync_op *,
+                                       const char *server, bool enabled,
+                                       bool *soft);
+
+/*
+ * Obtain a ticket-granting ticket for the target's ad_principal, already
+ * parsed, from the shared credential cache if ad_ccache is set and from the
+ * keytab otherwise.  If new credentials can't be stored in the shared cache,
+ * a warning is logged and they are still returned.  The caller should free
+ * the contents of the credentials.
+ */
+krb5_error_code sync_ccache_creds(kadm5_hook_modinfo *, struct sync_target *,
+                                  krb5_context, krb5_principal, krb5_creds *)
+    __attribute__((__nonnull__));
+
+/*
+ * Hedged requests.  sync_hedge_delay returns how long to wait, in
+ * microseconds, for the usual domain controller before also sending the
+ * operation to the hedge server, or 0 if the operation shouldn't be hedged.
+ * Only the operations listed in enum sync_hedge_op may be hedged, since
+ * they're idempotent and it's therefore safe for both to complete.  The next
+ * two functions run a hedged operation and set soft if the failure should
+ * make us back off.
+ *
+ * sync_hedge_abandoned is called by an attempt just before it makes its
+ * change and returns true if the change must not be made because another
+ * attempt already made it.  sync_hedge_pending returns true if a hedged
+ * operation of that type for the same principal and target may still make
+ * its change, in which case a later change must be queued rather than made
+ * so that the earlier one can't land after it.  sync_hedge_close waits for
+ * any hedged attempts still running.
+ */
+enum sync_hedge_op {
+    SYNC_HEDGE_CHPASS,
+    SYNC_HEDGE_STATUS
+};
+unsigned long sync_hedge_delay(kadm5_hook_modinfo *, struct sync_target *,
+                               const char *dc, enum sync_hedge_op);
+krb5_error_code sync_hedge_chpass(kadm5_hook_modinfo *, struct sync_target *,
+                                  struct sync_op *, const char *dc,
+                                  unsigned long delay, const char *password,
+                                  bool *soft);
+krb5_error_code sync_hedge_status(kadm5_hook_modinfo *, struct sync_target *,
+                                  struct sync_op *, const char *dc,
+                                  unsigned long delay, bool enabled,
+                                  bool *soft);
+bool sync_hedge_abandoned(struct sync_op *)
+    __attribute__((__nonnull__));
+bool sync_hedge_pending(kadm5_hook_modinfo *, struct sync_target *,
+                        struct sync_op *, enum sync_hedge_op)
+    __attribute__((__nonnull__));
+void sync_hedge_close(kadm5_hook_modinfo *);
+
+/*
+ * The persistent cache of lookups, shared between all processes using the
+ * same queue directory and used only if ad_cache_ttl is set.
+ * sync_cache_get copies the value for a key into the buffer and sets
+ * negative if the key is known not to exist, returning false if there is no
+ * current entry.  sync_cache_put stores a value or, if it is NULL, records
+ * that the key doesn't exist, and sync_cache_remove discards an entry.
+ */
+bool sync_cache_get(kadm5_hook_modinfo *, enum sync_cache_kind,
+                    const char *key, char *value, size_t size,
+                    bool *negative)
+    __attribute__((__nonnull__));
+void sync_cache_put(kadm5_hook_modinfo *, enum sync_cache_kind,
+                    const char *key, const char *value)
+    __attribute__((__nonnull__(1, 3)));
+void sync_cache_remove(kadm5_hook_modinfo *, enum sync_cache_kind,
+                       const char *key)
+    __attribute__((__nonnull__));
+void sync_cache_close(kadm5_hook_modinfo *)
+    __attribute__((__nonnull__));
+
+/*
+ * Capture changes to the file set by capture_file, if any.  sync_capture_init
+ * opens the file and is called from sync_init.  sync_capture_record appends
+ * a change that started at start and whose principal was allowed or not,
+ * given the status code of the change.
+ */
+krb5_error_code sync_capture_init(kadm5_hook_modinfo *, krb5_context)
+    __attribute__((__nonnull__));
+void sync_capture_record(kadm5_hook_modinfo *, struct sync_op *,
+                         enum sync_stats_type, bool enabled, bool allowed,
+                         krb5_error_code, uint64_t start)
+    __attribute__((__nonnull__));
+void sync_capture_close(kadm5_hook_modinfo *)
+    __attribute__((__nonnull__));
+
+/*
+ * Inject faults for testing.  sync_fault_init reads the schedules from the
+ * configuration and is called from sync_init.  SYNC_FAULT is called before
+ * the call at a point and is true if that call should fail, in which case
+ * the caller fails as if the call had, and it may first wait to add latency.
+ * Without --enable-fault-injection, it is always false.
+ */
+#ifdef HAVE_FAULT_INJECTION
+krb5_error_code sync_fault_init(krb5_context)
+    __attribute__((__nonnull__));
+bool sync_fault(enum sync_fault_point);
+# define SYNC_FAULT(point) sync_fault(point)
+#else
+# define SYNC_FAULT(point) false
+#endif
 
 /*
  * Sets exists true to true if the principal has only one component and
@@ -89,16 +557,170 @@ krb5_error_code sync_ad_status(kadm5_hook_modinfo *, krb5_context,
 krb5_error_code sync_instance_exists(krb5_context, krb5_principal,
                                      const char *instance, bool *exists);
 
-/* Returns true if there is a queue conflict for this operation. */
-krb5_error_code sync_queue_conflict(kadm5_hook_modinfo *, krb5_context,
-                                    krb5_principal, const char *operation,
-                                    bool *conflict);
+/*
+ * Manage the state of an operation.  sync_op_init unparses the principal,
+ * which must outlive the operation, and assigns a new trace ID, and
+ * sync_op_free must be called even if it fails.  sync_op_trace replaces the
+ * trace ID and origin with those of a queued change.  sync_op_alloc and
+ * sync_op_printf allocate memory that is freed with the operation and return
+ * NULL on failure.  sync_op_ad_principal and sync_op_ad_name return the
+ * principal of the operation in an Active Directory target, which belongs to
+ * the operation.
+ */
+krb5_error_code sync_op_init(struct sync_op *, krb5_context, krb5_principal)
+    __attribute__((__nonnull__));
+void sync_op_trace(struct sync_op *, const char *trace, uint64_t origin)
+    __attribute__((__nonnull__));
+void *sync_op_alloc(struct sync_op *, size_t)
+    __attribute__((__nonnull__));
+char *sync_op_printf(struct sync_op *, const char *format, ...)
+    __attribute__((__nonnull__, __format__(printf, 2, 3)));
+krb5_error_code sync_op_ad_principal(kadm5_hook_modinfo *, struct sync_op *,
+                                     struct sync_target *, krb5_principal *)
+    __attribute__((__nonnull__));
+krb5_error_code sync_op_ad_name(kadm5_hook_modinfo *, struct sync_op *,
+                                struct sync_target *, const char **)
+    __attribute__((__nonnull__));
+void sync_op_free(struct sync_op *)
+    __attribute__((__nonnull__));
+
+/*
+ * Lock and unlock the queue directory.  sync_queue_lock stores the file
+ * descriptor of the lock, which must be passed to sync_queue_unlock.
+ */
+krb5_error_code sync_queue_lock(kadm5_hook_modinfo *, krb5_context, int *);
+void sync_queue_unlock(int);
 
-/* Writes an operation to the queue. */
-krb5_error_code sync_queue_write(kadm5_hook_modinfo *, krb5_context,
-                                 krb5_principal, const char *operation,
+/*
+ * Returns true if there is a queue conflict for this operation in this
+ * target.
+ */
+krb5_error_code sync_queue_conflict(kadm5_hook_modinfo *, struct sync_op *,
+                                    struct sync_target *,
+                                    const char *operation, bool *conflict);
+
+/* Writes an operation for this target to the queue. */
+krb5_error_code sync_queue_write(kadm5_hook_modinfo *, struct sync_op *,
+                                 struct sync_target *, const char *operation,
                                  const char *password);
 
+/*
+ * Load the Active Directory targets from krb5.conf and free them again.
+ * sync_target_find returns the target with the given name or NULL if there
+ * is no such target.
+ */
+krb5_error_code sync_target_init(kadm5_hook_modinfo *, krb5_context)
+    __attribute__((__nonnull__));
+void sync_target_free(kadm5_hook_modinfo *)
+    __attribute__((__nonnull__));
+struct sync_target *sync_target_find(kadm5_hook_modinfo *, const char *name)
+    __attribute__((__nonnull__));
+
+/*
+ * Returns true if the principal of the operation should be pushed to the
+ * target according to its ad_match rules.
+ */
+bool sync_target_match(struct sync_target *, struct sync_op *)
+    __attribute__((__nonnull__));
+
+/*
+ * Push a change to each of the targets in the results array, concurrently if
+ * there is more than one and threads are available, and store the result for
+ * each in the array.  If password is NULL, the change is an account status
+ * change to enabled, and otherwise a password change.  The caller should
+ * free the messages with sync_target_results_free.
+ */
+void sync_target_push(kadm5_hook_modinfo *, struct sync_op *,
+                      const char *password, bool enabled,
+                      struct sync_result *, size_t count)
+    __attribute__((__nonnull__(1, 2)));
+void sync_target_results_free(struct sync_result *, size_t count);
+
+/*
+ * The rate and concurrency controller for Active Directory operations, whose
+ * state is shared between all processes using the same queue directory.
+ * sync_control_dc returns the name of the domain controller of a target used
+ * for the controller state.  sync_control_acquire takes a token from that
+ * domain controller's bucket, waiting if needed when draining the queue.
+ * sync_control_result feeds the outcome of an operation back into the
+ * controller, and sync_control_window returns the number of queued changes
+ * that may currently be processed in parallel.
+ */
+const char *sync_control_dc(struct sync_target *)
+    __attribute__((__nonnull__));
+krb5_error_code sync_control_acquire(kadm5_hook_modinfo *, krb5_context,
+                                     const char *dc)
+    __attribute__((__nonnull__));
+void sync_control_result(kadm5_hook_modinfo *, const char *dc,
+                         enum sync_outcome)
+    __attribute__((__nonnull__));
+unsigned long sync_control_window(kadm5_hook_modinfo *, const char *dc)
+    __attribute__((__nonnull__));
+
+/*
+ * Latency tracking for hedged requests.  sync_control_latency records the
+ * latency of a successful operation in microseconds, and
+ * sync_control_percentile returns the given percentile of the recent
+ * latencies or 0 if there aren't enough samples.  sync_control_hedge counts
+ * a hedged operation and whether the hedge server won.
+ */
+void sync_control_latency(kadm5_hook_modinfo *, const char *dc,
+                          unsigned long usec)
+    __attribute__((__nonnull__));
+unsigned long sync_control_percentile(kadm5_hook_modinfo *, const char *dc,
+                                      unsigned long percentile)
+    __attribute__((__nonnull__));
+void sync_control_hedge(kadm5_hook_modinfo *, const char *dc, bool won)
+    __attribute__((__nonnull__));
+void sync_control_close(kadm5_hook_modinfo *)
+    __attribute__((__nonnull__));
+
+/*
+ * Return a newly allocated array holding a snapshot of the controller state
+ * for each known domain controller, storing the number of entries in count.
+ * The caller should free the array.
+ */
+krb5_error_code sync_control_list(kadm5_hook_modinfo *, krb5_context,
+                                  struct sync_control_info **,
+                                  size_t *count)
+    __attribute__((__nonnull__));
+
+/*
+ * Statistics shared between all processes using the same queue directory,
+ * kept only if the stats option is set.  sync_stats_init maps them and is
+ * called from sync_init.  The recording functions take the start time of
+ * the operation, as returned by sync_stats_now, and do nothing if the
+ * statistics aren't enabled.  sync_stats_lag records that a change that
+ * originated at the given time was applied to a target.  sync_stats_read
+ * copies all of the statistics into a snapshot.
+ */
+void sync_stats_init(kadm5_hook_modinfo *)
+    __attribute__((__nonnull__));
+void sync_stats_close(kadm5_hook_modinfo *)
+    __attribute__((__nonnull__));
+uint64_t sync_stats_now(void);
+void sync_stats_change(kadm5_hook_modinfo *, enum sync_stats_source,
+                       enum sync_stats_type, enum sync_stats_result,
+                       uint64_t start)
+    __attribute__((__nonnull__));
+void sync_stats_dc(kadm5_hook_modinfo *, const char *dc, enum sync_outcome,
+                   uint64_t start)
+    __attribute__((__nonnull__));
+void sync_stats_lag(kadm5_hook_modinfo *, enum sync_stats_type,
+                    uint64_t origin)
+    __attribute__((__nonnull__));
+void sync_stats_lock(kadm5_hook_modinfo *, uint64_t start)
+    __attribute__((__nonnull__));
+void sync_stats_cache(kadm5_hook_modinfo *, enum sync_cache_kind, bool hit)
+    __attribute__((__nonnull__));
+void sync_stats_queued(kadm5_hook_modinfo *)
+    __attribute__((__nonnull__));
+void sync_stats_dropped(kadm5_hook_modinfo *)
+    __attribute__((__nonnull__));
+krb5_error_code sync_stats_read(kadm5_hook_modinfo *, krb5_context,
+                                struct sync_stats *)
+    __attribute__((__nonnull__));
+
 /*
  * Manage vectors, which are counted lists of strings.  The functions that
  * return a boolean return false if memory allocation fails.
@@ -134,9 +756,18 @@ void sync_config_boolean(krb5_context, const char *, bool *)
     __attribute__((__nonnull__));
 krb5_error_code sync_config_list(krb5_context, const char *, struct vector **)
     __attribute__((__nonnull__));
+krb5_error_code sync_config_number(krb5_context, const char *, long *)
+    __attribute__((__nonnull__));
 void sync_config_string(krb5_context, const char *, char **)
     __attribute__((__nonnull__));
 
+/*
+ * Create a Kerberos context that reads the given krb5.conf file, or the
+ * default configuration if it is NULL.
+ */
+krb5_error_code sync_config_context(const char *path, krb5_context *)
+    __attribute__((__nonnull__(2)));
+
 /*
  * Store a configuration, generic, or system error in the Kerberos context,
  * appending the strerror results to the message in the _system case and the
@@ -151,7 +782,18 @@ krb5_error_code sync_error_ldap(krb5_context, int, const char *format, ...)
 krb5_error_code sync_error_system(krb5_context, const char *format, ...)
     __attribute__((__nonnull__, __format__(printf, 2, 3)));
 
-/* Log messages to syslog if configured to do so. */
+/*
+ * Log messages to syslog if configured to do so.  sync_syslog_init reads the
+ * syslog and log_level options.  Messages are formatted into a buffer kept
+ * in the configuration, which sync_close frees.  SYNC_LOG_ENABLED says
+ * whether a message at a level would be logged, and should be checked before
+ * doing any work only needed for a message.  sync_log_priority returns the
+ * syslog priority for a level.
+ */
+#define SYNC_LOG_ENABLED(config, level) ((config)->log_level >= (level))
+int sync_log_priority(enum sync_log_level);
+krb5_error_code sync_syslog_init(kadm5_hook_modinfo *, krb5_context)
+    __attribute__((__nonnull__));
 void sync_syslog_debug(kadm5_hook_modinfo *, const char *format, ...)
     __attribute__((__nonnull__, __format__(printf, 2, 3)));
 void sync_syslog_info(kadm5_hook_modinfo *, const char *format, ...)
@@ -161,6 +803,34 @@ void sync_syslog_notice(kadm5_hook_modinfo *, const char *format, ...)
 void sync_syslog_warning(kadm5_hook_modinfo *, const char *format, ...)
     __attribute__((__nonnull__, __format__(printf, 2, 3)));
 
+/*
+ * Log a message as a structured event with the principal and trace ID of
+ * the operation and the given fields, either of which may be NULL.  Unless
+ * log_file or log_async is set, this is the same as the sync_syslog_*
+ * functions.
+ */
+void sync_log_event(kadm5_hook_modinfo *, enum sync_log_level,
+                    struct sync_op *, const struct sync_log_fields *,
+                    const char *format, ...)
+    __attribute__((__nonnull__(1, 5), __format__(printf, 5, 6)));
+
+/*
+ * Structured log events, written to the log_file file or syslog and, if
+ * log_async is set, through a ring emptied by a background thread.
+ * sync_event_init is called by sync_syslog_init and takes ownership of the
+ * file name.  sync_event_put logs an event whose level has already been
+ * checked, and sync_event_close writes any events still in the ring.
+ */
+krb5_error_code sync_event_init(kadm5_hook_modinfo *, krb5_context,
+                                char *file, bool async)
+    __attribute__((__nonnull__(1, 2)));
+void sync_event_put(kadm5_hook_modinfo *, enum sync_log_level,
+                    struct sync_op *, const struct sync_log_fields *,
+                    const char *format, va_list)
+    __attribute__((__nonnull__(1, 5), __format__(printf, 5, 0)));
+void sync_event_close(kadm5_hook_modinfo *)
+    __attribute__((__nonnull__));
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 
@@ -7,6 +7,12 @@
  * anything.  In those cases, we log directly to syslog unless the syslog
  * configuration option is set to false.
  *
+ * Messages more detailed than the log_level option are dropped before they
+ * are formatted, so debug messages cost only a comparison unless they're
+ * wanted.  Messages that are logged are formatted into a buffer kept with
+ * the plugin configuration and reused for every message, rather than
+ * allocating memory for each one.
+ *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 2015 Russ Allbery <eagle@eyrie.org>
  * Copyright 2013
@@ -16,36 +22,143 @@
  */
 
 #include <config.h>
+#include <portable/krb5.h>
 #include <portable/system.h>
 
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 #include <syslog.h>
 
 #include <plugin/internal.h>
+#include <util/macros.h>
+
+/* Initial size of the buffer for formatting messages. */
+#define LOG_BUFFER_SIZE 256
+
+/* The names of the log levels for the log_level option. */
+static const struct {
+    const char *name;
+    enum sync_log_level level;
+} log_levels[] = {
+    /* clang-format off */
+    { "warning", SYNC_LOG_WARNING },
+    { "notice",  SYNC_LOG_NOTICE  },
+    { "info",    SYNC_LOG_INFO    },
+    { "debug",   SYNC_LOG_DEBUG   },
+    /* clang-format on */
+};
+
+/*
+ * Protects the message buffer, since attempts running in threads may log at
+ * the same time.
+ */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/*
+ * Read the syslog, log_level, log_file, and log_async options into the
+ * configuration and set up structured events if needed.  If syslog is false
+ * and there is no log file, nothing is logged regardless of log_level.
+ * Returns a Kerberos status code, which is an error if log_level isn't a
+ * known level or the log file can't be opened.
+ */
+krb5_error_code
+sync_syslog_init(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    char *level = NULL;
+    char *file = NULL;
+    bool async = false;
+    krb5_error_code code;
+    size_t i;
+
+    config->syslog = true;
+    sync_config_boolean(ctx, "syslog", &config->syslog);
+    config->log_level = SYNC_LOG_INFO;
+    sync_config_string(ctx, "log_level", &level);
+    if (level != NULL) {
+        for (i = 0; i < ARRAY_SIZE(log_levels); i++)
+            if (strcmp(level, log_levels[i].name) == 0)
+                break;
+        if (i == ARRAY_SIZE(log_levels)) {
+            code = sync_error_config(ctx, "unknown log_level %s", level);
+            free(level);
+            return code;
+        }
+        config->log_level = log_levels[i].level;
+        free(level);
+    }
+    sync_config_string(ctx, "log_file", &file);
+    sync_config_boolean(ctx, "log_async", &async);
+    if (!config->syslog && file == NULL)
+        config->log_level = SYNC_LOG_NONE;
+    return sync_event_init(config, ctx, file, async);
+}
+
+
+/*
+ * Return the syslog priority for a log level.
+ */
+int
+sync_log_priority(enum sync_log_level level)
+{
+    static const int priority[] = {
+        LOG_DEBUG, LOG_WARNING, LOG_NOTICE, LOG_INFO, LOG_DEBUG
+    };
+
+    return priority[level];
+}
 
 
 /*
  * Log a message to syslog.  This is a helper function used to implement all
- * of the syslog logging functions.  If we can't allocate memory for the
- * message to log, we just do nothing, since these functions are only used for
- * supplemental logging.
+ * of the syslog logging functions, which have already checked the level.
+ * If structured events are in use, the message is logged as an event with
+ * no fields.  Otherwise, the buffer is grown if the message doesn't fit.  If
+ * we can't allocate memory for the message to log, we just do nothing,
+ * since these functions are only used for supplemental logging.
  */
 static void __attribute__((__format__(printf, 3, 0)))
-log_syslog(kadm5_hook_modinfo *config, int priority, const char *fmt,
-           va_list args)
+log_syslog(kadm5_hook_modinfo *config, enum sync_log_level level,
+           const char *fmt, va_list args)
 {
-    char *message;
-    int status;
+    va_list args_copy;
+    char *buffer;
+    size_t size;
+    int length;
 
-    /* If configured not to log, do nothing. */
-    if (!config->syslog)
+    if (config->events != NULL) {
+        sync_event_put(config, level, NULL, NULL, fmt, args);
         return;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&log_mutex);
+#endif
+    va_copy(args_copy, args);
+    length = vsnprintf(config->log_buffer, config->log_size, fmt, args_copy);
+    va_end(args_copy);
+    if (length < 0)
+        goto done;
+    if ((size_t) length >= config->log_size) {
+        size = (size_t) length + 1;
+        if (size < LOG_BUFFER_SIZE)
+            size = LOG_BUFFER_SIZE;
+        buffer = realloc(config->log_buffer, size);
+        if (buffer == NULL)
+            goto done;
+        config->log_buffer = buffer;
+        config->log_size = size;
+        vsnprintf(buffer, size, fmt, args);
+    }
+    syslog(sync_log_priority(level), "%s", config->log_buffer);
 
-    /* Log the message. */
-    status = vasprintf(&message, fmt, args);
-    if (status < 0)
-        return;
-    syslog(priority, "%s", message);
-    free(message);
+done:
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&log_mutex);
+#endif
+    return;
 }
 
 
@@ -57,11 +170,35 @@ log_syslog(kadm5_hook_modinfo *config, int priority, const char *fmt,
     sync_syslog_ ## name(kadm5_hook_modinfo *c, const char *f, ...)     \
     {                                                                   \
         va_list args;                                                   \
+        if (!SYNC_LOG_ENABLED(c, SYNC_LOG_ ## type))                    \
+            return;                                                     \
         va_start(args, f);                                              \
-        log_syslog(c, LOG_ ## type, f, args);                           \
+        log_syslog(c, SYNC_LOG_ ## type, f, args);                      \
         va_end(args);                                                   \
     }
 SYSLOG_FUNCTION(debug,   DEBUG)
 SYSLOG_FUNCTION(info,    INFO)
 SYSLOG_FUNCTION(notice,  NOTICE)
 SYSLOG_FUNCTION(warning, WARNING)
+
+
+/*
+ * Log a message as a structured event.  Without a log file or the
+ * asynchronous ring, only the message is logged, to syslog.
+ */
+void
+sync_log_event(kadm5_hook_modinfo *config, enum sync_log_level level,
+               struct sync_op *op, const struct sync_log_fields *fields,
+               const char *fmt, ...)
+{
+    va_list args;
+
+    if (!SYNC_LOG_ENABLED(config, level))
+        return;
+    va_start(args, fmt);
+    if (config->events != NULL)
+        sync_event_put(config, level, op, fields, fmt, args);
+    else
+        log_syslog(config, level, fmt, args);
+    va_end(args);
+}
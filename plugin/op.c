@@ -0,0 +1,306 @@
+/*
+ * Per-operation state.
+ *
+ * Every change passes through several stages (checking the principal,
+ * matching it against targets, checking and writing the queue, and pushing
+ * it to Active Directory), and each of them needs some form of the principal
+ * name.  Rather than having each stage unparse the principal and allocate
+ * its own paths and prefixes, the change carries a struct sync_op that holds
+ * the names derived from the principal and a small arena from which the
+ * stages allocate anything that lives only as long as the change.  The
+ * arena starts with storage embedded in the operation, so a typical change
+ * makes no heap allocations of its own other than the one unparse of the
+ * principal, and everything is freed in one step by sync_op_free.
+ *
+ * Each change is also given a trace ID and the time at which the plugin saw
+ * it, which follow it into the queue so that the logs of every attempt to
+ * apply it can be tied together and the lag until it reaches Active
+ * Directory can be measured.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <plugin/internal.h>
+
+/* The alignment of arena allocations. */
+#define OP_ALIGN (2 * sizeof(void *))
+
+/* Counter that distinguishes trace IDs generated by the same process. */
+static uint64_t op_counter = 0;
+
+/* A block of arena storage allocated once the embedded storage is used up. */
+struct sync_op_block {
+    struct sync_op_block *next;
+    size_t size;
+    size_t used;
+    union {
+        void *pointer;
+        double number;
+    } data[1];
+};
+
+
+/*
+ * Allocate memory from the arena of an operation, aligned for any of the
+ * types we store there.  The memory is freed by sync_op_free.  Returns NULL
+ * if memory allocation fails.
+ */
+void *
+sync_op_alloc(struct sync_op *op, size_t size)
+{
+    struct sync_op_block *block;
+    size_t total;
+    char *result;
+
+    size = (size + OP_ALIGN - 1) & ~(OP_ALIGN - 1);
+    if (size <= sizeof(op->storage) - op->used) {
+        result = op->storage.data + op->used;
+        op->used += size;
+        return result;
+    }
+    block = op->blocks;
+    if (block != NULL && size <= block->size - block->used) {
+        result = (char *) block->data + block->used;
+        block->used += size;
+        return result;
+    }
+    total = (size > sizeof(op->storage)) ? size : sizeof(op->storage);
+    block = malloc(offsetof(struct sync_op_block, data) + total);
+    if (block == NULL)
+        return NULL;
+    block->next = op->blocks;
+    block->size = total;
+    block->used = size;
+    op->blocks = block;
+    return block->data;
+}
+
+
+/*
+ * Format a string into the arena of an operation.  Returns NULL if memory
+ * allocation fails.
+ */
+char *
+sync_op_printf(struct sync_op *op, const char *format, ...)
+{
+    va_list args;
+    char *result;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length < 0)
+        return NULL;
+    result = sync_op_alloc(op, (size_t) length + 1);
+    if (result == NULL)
+        return NULL;
+    va_start(args, format);
+    vsnprintf(result, (size_t) length + 1, format, args);
+    va_end(args);
+    return result;
+}
+
+
+/*
+ * Mix the bits of a 64-bit value (the finalizer of SplitMix64), so that
+ * trace IDs generated close together don't look alike.
+ */
+static uint64_t
+op_mix(uint64_t value)
+{
+    value ^= value >> 30;
+    value *= UINT64_C(0xbf58476d1ce4e5b9);
+    value ^= value >> 27;
+    value *= UINT64_C(0x94d049bb133111eb);
+    value ^= value >> 31;
+    return value;
+}
+
+
+/*
+ * Assign a new trace ID to an operation, derived from its origin time, the
+ * process ID, and a per-process counter.
+ */
+static void
+op_trace_new(struct sync_op *op)
+{
+    uint64_t count, id;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+    count = __atomic_fetch_add(&op_counter, 1, __ATOMIC_RELAXED);
+#else
+    count = op_counter++;
+#endif
+    id = op_mix(op->origin) ^ op_mix(((uint64_t) getpid() << 32) + count);
+    snprintf(op->trace, sizeof(op->trace), "%016llx",
+             (unsigned long long) id);
+}
+
+
+/*
+ * Initialize the state of an operation on a principal.  The principal is
+ * unparsed once, and the name without the realm is the part of that before
+ * the first unescaped @, since an @ in a component is always escaped.  The
+ * queue key is the same with any slashes changed to periods.  The current
+ * time is the origin of the change.  Returns a Kerberos status code.
+ * sync_op_free must be called even on failure.
+ */
+krb5_error_code
+sync_op_init(struct sync_op *op, krb5_context ctx, krb5_principal principal)
+{
+    krb5_error_code code;
+    char *user, *key;
+    size_t length, i;
+
+    memset(op, 0, offsetof(struct sync_op, storage));
+    op->ctx = ctx;
+    op->principal = principal;
+    op->origin = sync_stats_now();
+    op_trace_new(op);
+    code = krb5_unparse_name(ctx, principal, &op->name);
+    if (code != 0)
+        return code;
+    for (length = 0; op->name[length] != '\0'; length++) {
+        if (op->name[length] == '@')
+            break;
+        if (op->name[length] == '\\' && op->name[length + 1] != '\0')
+            length++;
+    }
+    user = sync_op_alloc(op, length + 1);
+    key = sync_op_alloc(op, length + 1);
+    if (user == NULL || key == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    memcpy(user, op->name, length);
+    user[length] = '\0';
+    for (i = 0; i <= length; i++)
+        key[i] = (user[i] == '/') ? '.' : user[i];
+    op->user = user;
+    op->key = key;
+    return 0;
+}
+
+
+/*
+ * Replace the trace ID and origin of an operation with those of a queued
+ * change that it applies.
+ */
+void
+sync_op_trace(struct sync_op *op, const char *trace, uint64_t origin)
+{
+    snprintf(op->trace, sizeof(op->trace), "%s", trace);
+    op->origin = origin;
+}
+
+
+/*
+ * Find the cached Active Directory principal of an operation for a target,
+ * allocating the cache the first time.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+op_ad_slot(kadm5_hook_modinfo *config, struct sync_op *op,
+           struct sync_target *target, size_t *slot)
+{
+    size_t size;
+
+    if (op->ad_principals == NULL) {
+        size = config->ad_targets_count * sizeof(krb5_principal);
+        op->ad_principals = sync_op_alloc(op, size);
+        op->ad_names = sync_op_alloc(op, size);
+        if (op->ad_principals == NULL || op->ad_names == NULL) {
+            op->ad_principals = NULL;
+            return sync_error_system(op->ctx, "cannot allocate memory");
+        }
+        memset(op->ad_principals, 0, size);
+        memset(op->ad_names, 0, size);
+        op->ad_count = config->ad_targets_count;
+    }
+    *slot = (size_t) (target - config->ad_targets);
+    if (*slot >= op->ad_count)
+        return sync_error_generic(op->ctx, "unknown target %s", target->name);
+    return 0;
+}
+
+
+/*
+ * Set ad_principal to the principal of an operation in an Active Directory
+ * target, converting it the first time.  The result is owned by the
+ * operation.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_op_ad_principal(kadm5_hook_modinfo *config, struct sync_op *op,
+                     struct sync_target *target, krb5_principal *ad_principal)
+{
+    krb5_error_code code;
+    size_t slot;
+
+    code = op_ad_slot(config, op, target, &slot);
+    if (code != 0)
+        return code;
+    if (op->ad_principals[slot] == NULL) {
+        code = sync_ad_principal(config, target, op->ctx, op->principal,
+                                 &op->ad_principals[slot]);
+        if (code != 0)
+            return code;
+    }
+    *ad_principal = op->ad_principals[slot];
+    return 0;
+}
+
+
+/*
+ * The same, but set name to the unparsed Active Directory principal.
+ */
+krb5_error_code
+sync_op_ad_name(kadm5_hook_modinfo *config, struct sync_op *op,
+                struct sync_target *target, const char **name)
+{
+    krb5_principal ad_principal;
+    krb5_error_code code;
+    size_t slot;
+
+    code = sync_op_ad_principal(config, op, target, &ad_principal);
+    if (code != 0)
+        return code;
+    slot = (size_t) (target - config->ad_targets);
+    if (op->ad_names[slot] == NULL) {
+        code = krb5_unparse_name(op->ctx, ad_principal, &op->ad_names[slot]);
+        if (code != 0)
+            return code;
+    }
+    *name = op->ad_names[slot];
+    return 0;
+}
+
+
+/*
+ * Free the state of an operation, including everything allocated from its
+ * arena.  The principal belongs to the caller and is not freed.
+ */
+void
+sync_op_free(struct sync_op *op)
+{
+    struct sync_op_block *block, *next;
+    size_t i;
+
+    for (i = 0; i < op->ad_count; i++) {
+        if (op->ad_names[i] != NULL)
+            krb5_free_unparsed_name(op->ctx, op->ad_names[i]);
+        if (op->ad_principals[i] != NULL)
+            krb5_free_principal(op->ctx, op->ad_principals[i]);
+    }
+    if (op->name != NULL)
+        krb5_free_unparsed_name(op->ctx, op->name);
+    for (block = op->blocks; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    memset(op, 0, offsetof(struct sync_op, storage));
+}
@@ -0,0 +1,38 @@
+/*
+ * Static tracing probes for the krb5-sync plugin.
+ *
+ * If configure finds sys/sdt.h, the SYNC_PROBE macros define USDT probes
+ * with the provider krb5_sync, which can be attached to with perf, bpftrace,
+ * or SystemTap.  An unattached probe is a single no-op instruction, so the
+ * probes are always built in unless configure is given --disable-probes.
+ * Otherwise, the macros expand to nothing and their arguments are never
+ * evaluated.
+ *
+ * The names and arguments of the probes are documented in README and are
+ * part of the interface of the plugin, so change them only with care.
+ * Arguments should be values we already have, never anything computed only
+ * for the probe.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef PLUGIN_PROBES_H
+#define PLUGIN_PROBES_H 1
+
+#include <config.h>
+
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+# define SYNC_PROBE1(n, a)       DTRACE_PROBE1(krb5_sync, n, a)
+# define SYNC_PROBE2(n, a, b)    DTRACE_PROBE2(krb5_sync, n, a, b)
+# define SYNC_PROBE3(n, a, b, c) DTRACE_PROBE3(krb5_sync, n, a, b, c)
+#else
+# define SYNC_PROBE1(n, a)       do { } while (0)
+# define SYNC_PROBE2(n, a, b)    do { } while (0)
+# define SYNC_PROBE3(n, a, b, c) do { } while (0)
+#endif
+
+#endif /* !PLUGIN_PROBES_H */
@@ -20,12 +20,12 @@
 #include <portable/system.h>
 
 #include <dirent.h>
-#include <errno.h>
 #include <fcntl.h>
 #include <sys/file.h>
 #include <time.h>
 
 #include <plugin/internal.h>
+#include <plugin/probes.h>
 
 /*
  * Maximum number of queue files we will permit for a given user and action
@@ -34,11 +34,20 @@
 #define MAX_QUEUE     100
 #define MAX_QUEUE_STR "99"
 
+/* Size of the buffer for a queue timestamp, such as 20260101T000000Z. */
+#define QUEUE_TIMESTAMP_SIZE 17
+
+/* Size of the buffer for the trace and origin lines of a queue file. */
+#define QUEUE_METADATA_SIZE 64
+
 /* Write out a string, checking that all of it was written. */
 #define WRITE_CHECK(fd, s)                                              \
     do {                                                                \
         ssize_t result;                                                 \
-        result = write((fd), (s), strlen(s));                           \
+        if (SYNC_FAULT(SYNC_FAULT_QUEUE_WRITE))                         \
+            result = -1;                                                \
+        else                                                            \
+            result = write((fd), (s), strlen(s));                       \
         if (result < 0 || (size_t) result != strlen(s)) {               \
             code = sync_error_system(ctx, "cannot write queue file");   \
             goto fail;                                                  \
@@ -47,110 +56,128 @@
 
 
 /*
- * Lock the queue directory and stores the file descriptor of the lock in the
- * secon argument.  This must be passed into unlock_queue when the queue
- * should be unlocked.  Returns a Kerberos status code.
+ * Open and lock the given lock file, storing the file descriptor in the last
+ * argument.  Returns a Kerberos status code.
  *
  * We have to use flock for compatibility with the Perl krb5-sync-backend
  * script.  Perl makes it very annoying to use fcntl locking on Linux.
  */
 static krb5_error_code
-lock_queue(kadm5_hook_modinfo *config, krb5_context ctx, int *result)
+queue_lock_path(kadm5_hook_modinfo *config, krb5_context ctx,
+                const char *lockpath, int *result)
 {
-    char *lockpath = NULL;
-    int fd = -1;
+    int fd;
+    uint64_t start;
     krb5_error_code code;
 
-    if (asprintf(&lockpath, "%s/.lock", config->queue_dir) < 0)
-        return sync_error_system(ctx, "cannot allocate memory");
+    SYNC_PROBE1(queue_lock_entry, lockpath);
     fd = open(lockpath, O_RDWR | O_CREAT, 0644);
     if (fd < 0) {
         code = sync_error_system(ctx, "cannot open lock file %s", lockpath);
-        goto fail;
+        SYNC_PROBE2(queue_lock_return, lockpath, code);
+        return code;
     }
-    if (flock(fd, LOCK_EX) < 0) {
+    start = sync_stats_now();
+    if (SYNC_FAULT(SYNC_FAULT_QUEUE_LOCK) || flock(fd, LOCK_EX) < 0) {
         code = sync_error_system(ctx, "cannot flock lock file %s", lockpath);
-        goto fail;
+        SYNC_PROBE2(queue_lock_return, lockpath, code);
+        close(fd);
+        return code;
     }
-    free(lockpath);
+    sync_stats_lock(config, start);
+    SYNC_PROBE2(queue_lock_return, lockpath, 0);
     *result = fd;
     return 0;
+}
 
-fail:
+
+/*
+ * Lock the queue directory and stores the file descriptor of the lock in the
+ * secon argument.  This must be passed into sync_queue_unlock when the queue
+ * should be unlocked.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_queue_lock(kadm5_hook_modinfo *config, krb5_context ctx, int *result)
+{
+    char *lockpath = NULL;
+    krb5_error_code code;
+
+    if (asprintf(&lockpath, "%s/.lock", config->queue_dir) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    code = queue_lock_path(config, ctx, lockpath, result);
     free(lockpath);
-    if (fd >= 0)
-        close(fd);
     return code;
 }
 
 
+/*
+ * The same, but for an operation, allocating the path of the lock file from
+ * the arena of the operation.
+ */
+static krb5_error_code
+queue_lock_op(kadm5_hook_modinfo *config, struct sync_op *op, int *result)
+{
+    char *lockpath;
+
+    lockpath = sync_op_printf(op, "%s/.lock", config->queue_dir);
+    if (lockpath == NULL)
+        return sync_error_system(op->ctx, "cannot allocate memory");
+    return queue_lock_path(config, op->ctx, lockpath, result);
+}
+
+
 /*
  * Unlock the queue directory.  Takes the file descriptor of the open lock
- * file, returned by lock_queue.  We assume that this function will never
+ * file, returned by sync_queue_lock.  We assume that this function will never
  * fail.
  */
-static void
-unlock_queue(int fd)
+void
+sync_queue_unlock(int fd)
 {
+    SYNC_PROBE1(queue_unlock, fd);
     close(fd);
 }
 
 
 /*
- * Given a Kerberos principal, a context, and an operation, generate the
- * prefix for queue files as a newly allocated string.  Returns a Kerberos
+ * Given an operation, a target, and the name of the change, generate the
+ * prefix for queue files in the arena of the operation.  Returns a Kerberos
  * status code.
  */
 static krb5_error_code
-queue_prefix(krb5_context ctx, krb5_principal principal,
+queue_prefix(struct sync_op *op, struct sync_target *target,
              const char *operation, char **prefix)
 {
-    char *user = NULL;
-    char *p;
-    int oerrno;
-    krb5_error_code code;
-
     /* Enable and disable should go into the same queue. */
     if (strcmp(operation, "disable") == 0)
         operation = "enable";
 
     /*
      * The first part of the queue file is the principal with the realm
-     * stripped and any slashes converted to periods.
+     * stripped and any slashes converted to periods, which is the key of
+     * the operation.  Add to that the domain and operation.  The domain is
+     * the name of the Active Directory target, which is ad unless multiple
+     * targets are configured (afs used to be possible, but that support was
+     * dropped).
      */
-    code = krb5_unparse_name_flags(ctx, principal,
-                                   KRB5_PRINCIPAL_UNPARSE_NO_REALM, &user);
-    if (code != 0)
-        return code;
-    while ((p = strchr(user, '/')) != NULL)
-        *p = '.';
-
-    /*
-     * Add to that the domain and operation.  The domain is currently always
-     * forced to ad (afs used to be possible, but that support was dropped),
-     * but retained for possible future use.
-     */
-    if (asprintf(prefix, "%s-ad-%s-", user, operation) < 0) {
-        oerrno = errno;
-        krb5_free_unparsed_name(ctx, user);
-        errno = oerrno;
-        return sync_error_system(ctx, "cannot create queue prefix");
-    }
-    krb5_free_unparsed_name(ctx, user);
+    *prefix = sync_op_printf(op, "%s-%s-%s-", op->key, target->name,
+                             operation);
+    if (*prefix == NULL)
+        return sync_error_system(op->ctx, "cannot create queue prefix");
     return 0;
 }
 
 
 /*
- * Generate a timestamp from the current date and store it in the argument.
- * Uses the ISO timestamp format.  Returns a Kerberos status code.
+ * Generate a timestamp from the current date and store it in the buffer,
+ * which must be at least QUEUE_TIMESTAMP_SIZE long.  Uses the ISO timestamp
+ * format.  Returns a Kerberos status code.
  */
 static krb5_error_code
-queue_timestamp(krb5_context ctx, char **timestamp)
+queue_timestamp(krb5_context ctx, char *timestamp)
 {
     struct tm now;
     time_t seconds;
-    int status;
 
     seconds = time(NULL);
     if (seconds == (time_t) -1)
@@ -159,40 +186,42 @@ queue_timestamp(krb5_context ctx, char **timestamp)
         return sync_error_system(ctx, "cannot get broken-down time");
     now.tm_mon++;
     now.tm_year += 1900;
-    status = asprintf(timestamp, "%04d%02d%02dT%02d%02d%02dZ", now.tm_year,
-                      now.tm_mon, now.tm_mday, now.tm_hour, now.tm_min,
-                      now.tm_sec);
-    if (status < 0)
-        return sync_error_system(ctx, "cannot create timestamp");
-    else
-        return 0;
+    snprintf(timestamp, QUEUE_TIMESTAMP_SIZE, "%04d%02d%02dT%02d%02d%02dZ",
+             now.tm_year % 10000, now.tm_mon % 100, now.tm_mday % 100,
+             now.tm_hour % 100, now.tm_min % 100, now.tm_sec % 100);
+    return 0;
 }
 
 
 /*
- * Given a Kerberos context, a principal (assumed to have no instance), and an
- * operation, check whether there are any existing queued actions for that
- * combination, storing the result in the final boolean variable.  Returns a
- * Kerberos status code.
+ * Given an operation (whose principal is assumed to have no instance), a
+ * target, and the name of the change, check whether there are any existing
+ * queued actions for that combination, storing the result in the final
+ * boolean variable.  Returns a Kerberos status code.
  */
 krb5_error_code
-sync_queue_conflict(kadm5_hook_modinfo *config, krb5_context ctx,
-                    krb5_principal principal, const char *operation,
+sync_queue_conflict(kadm5_hook_modinfo *config, struct sync_op *op,
+                    struct sync_target *target, const char *operation,
                     bool *conflict)
 {
+    krb5_context ctx = op->ctx;
     int lock = -1;
-    char *prefix = NULL;
+    char *prefix;
+    size_t length;
     DIR *queue = NULL;
     struct dirent *entry;
     krb5_error_code code;
 
-    if (config->queue_dir == NULL)
-        return sync_error_config(ctx, "configuration setting queue_dir"
+    if (config->queue_dir == NULL) {
+        code = sync_error_config(ctx, "configuration setting queue_dir"
                                  " missing");
-    code = queue_prefix(ctx, principal, operation, &prefix);
+        goto fail;
+    }
+    code = queue_prefix(op, target, operation, &prefix);
     if (code != 0)
-        return code;
-    code = lock_queue(config, ctx, &lock);
+        goto fail;
+    length = strlen(prefix);
+    code = queue_lock_op(config, op, &lock);
     if (code != 0)
         goto fail;
     queue = opendir(config->queue_dir);
@@ -202,97 +231,118 @@ sync_queue_conflict(kadm5_hook_modinfo *config, krb5_context ctx,
     }
     *conflict = false;
     while ((entry = readdir(queue)) != NULL) {
-        if (strncmp(prefix, entry->d_name, strlen(prefix)) == 0) {
+        if (strncmp(prefix, entry->d_name, length) == 0) {
             *conflict = true;
             break;
         }
     }
-    unlock_queue(lock);
+    sync_queue_unlock(lock);
     closedir(queue);
-    free(prefix);
     return 0;
 
 fail:
     if (lock >= 0)
-        unlock_queue(lock);
+        sync_queue_unlock(lock);
     if (queue != NULL)
         closedir(queue);
-    free(prefix);
     return code;
 }
 
 
 /*
- * Queue an action.  Takes the plugin configuration, the Kerberos context, the
- * principal, the operation, and a password (which may be NULL for enable and
- * disable).  Returns a Kerberos error code.
+ * Queue an action.  Takes the plugin configuration, the operation, the
+ * target, the name of the change, and a password (which may be NULL for
+ * enable and disable).  Returns a Kerberos error code.
+ *
+ * After the change itself, the queue file has a line with the trace ID of
+ * the operation and one with its origin in seconds and microseconds since
+ * the epoch, which older versions of krb5-sync ignore.
  */
 krb5_error_code
-sync_queue_write(kadm5_hook_modinfo *config, krb5_context ctx,
-                 krb5_principal principal, const char *operation,
+sync_queue_write(kadm5_hook_modinfo *config, struct sync_op *op,
+                 struct sync_target *target, const char *operation,
                  const char *password)
 {
-    char *prefix = NULL, *timestamp = NULL, *path = NULL, *user = NULL;
+    krb5_context ctx = op->ctx;
+    char *prefix, *path = NULL, *suffix;
+    char timestamp[QUEUE_TIMESTAMP_SIZE];
+    char metadata[QUEUE_METADATA_SIZE];
+    struct sync_log_fields fields = { NULL, NULL, NULL, "queued", 0 };
     unsigned int i;
     krb5_error_code code;
     int lock = -1, fd = -1;
 
-    if (config->queue_dir == NULL)
-        return sync_error_config(ctx, "configuration setting queue_dir"
+    SYNC_PROBE3(queue_write_entry, op->name, target->name, operation);
+    if (config->queue_dir == NULL) {
+        code = sync_error_config(ctx, "configuration setting queue_dir"
                                  " missing");
-    code = queue_prefix(ctx, principal, operation, &prefix);
+        goto fail;
+    }
+    code = queue_prefix(op, target, operation, &prefix);
     if (code != 0)
-        return code;
+        goto fail;
 
     /*
      * Lock the queue before the timestamp so that another writer coming up
      * at the same time can't get an earlier timestamp.
      */
-    code = lock_queue(config, ctx, &lock);
+    code = queue_lock_op(config, op, &lock);
     if (code != 0)
         goto fail;
-    code = queue_timestamp(ctx, &timestamp);
+    code = queue_timestamp(ctx, timestamp);
     if (code != 0)
         goto fail;
 
-    /* Find a unique filename for the queue file. */
-    for (i = 0; i < MAX_QUEUE; i++) {
-        free(path);
-        path = NULL;
-        code = asprintf(&path, "%s/%s%s-%02d", config->queue_dir, prefix,
-                        timestamp, i);
-        if (code < 0) {
-            code = sync_error_system(ctx, "cannot create queue file name");
-            goto fail;
-        }
-        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
-        if (fd >= 0)
-            break;
+    /*
+     * Find a unique filename for the queue file.  The path is allocated once
+     * and only the count at the end is rewritten for each attempt.
+     */
+    path = sync_op_printf(op, "%s/%s%s-%s", config->queue_dir, prefix,
+                          timestamp, MAX_QUEUE_STR);
+    if (path == NULL) {
+        code = sync_error_system(ctx, "cannot create queue file name");
+        goto fail;
     }
-
-    /* Get the username from the principal without the realm. */
-    code = krb5_unparse_name_flags(ctx, principal,
-                                   KRB5_PRINCIPAL_UNPARSE_NO_REALM, &user);
-    if (code != 0)
+    suffix = path + strlen(path) - strlen(MAX_QUEUE_STR);
+    if (!SYNC_FAULT(SYNC_FAULT_QUEUE_OPEN))
+        for (i = 0; i < MAX_QUEUE; i++) {
+            snprintf(suffix, sizeof(MAX_QUEUE_STR), "%02u", i);
+            fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+            if (fd >= 0)
+                break;
+        }
+    if (fd < 0) {
+        code = sync_error_system(ctx, "cannot create queue file %s", path);
         goto fail;
+    }
 
-    /* Write out the queue data (with hard-coded "ad" domain). */
-    WRITE_CHECK(fd, user);
-    WRITE_CHECK(fd, "\nad\n");
+    /* Write out the queue data, with the target as the domain. */
+    WRITE_CHECK(fd, op->user);
+    WRITE_CHECK(fd, "\n");
+    WRITE_CHECK(fd, target->name);
+    WRITE_CHECK(fd, "\n");
     WRITE_CHECK(fd, operation);
     WRITE_CHECK(fd, "\n");
     if (password != NULL) {
         WRITE_CHECK(fd, password);
         WRITE_CHECK(fd, "\n");
     }
+    snprintf(metadata, sizeof(metadata), "trace %s\norigin %llu.%06lu\n",
+             op->trace, (unsigned long long) (op->origin / 1000000),
+             (unsigned long) (op->origin % 1000000));
+    WRITE_CHECK(fd, metadata);
 
     /* We're done. */
     close(fd);
-    unlock_queue(lock);
-    krb5_free_unparsed_name(ctx, user);
-    free(prefix);
-    free(timestamp);
-    free(path);
+    sync_queue_unlock(lock);
+    op->queued++;
+    sync_stats_queued(config);
+    fields.operation = operation;
+    fields.target = target->name;
+    sync_log_event(config, SYNC_LOG_INFO, op, &fields, "krb5-sync: queued %s"
+                   " change for %s in %s (trace %s)", operation, op->name,
+                   target->name, op->trace);
+    SYNC_PROBE2(queue_write_return, op->name, 0);
     return 0;
 
 fail:
@@ -302,11 +352,7 @@ fail:
         close(fd);
     }
     if (lock >= 0)
-        unlock_queue(lock);
-    if (user != NULL)
-        krb5_free_unparsed_name(ctx, user);
-    free(prefix);
-    free(timestamp);
-    free(path);
+        sync_queue_unlock(lock);
+    SYNC_PROBE2(queue_write_return, op->name, code);
     return code;
 }
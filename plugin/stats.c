@@ -0,0 +1,398 @@
+/*
+ * Counters and latency histograms shared between processes.
+ *
+ * If the stats option is set, the plugin and the krb5-sync utility count
+ * changes by source, type, and outcome and record their latency, the lag
+ * from when the plugin first saw each change until it reached Active
+ * Directory, the time spent waiting for the queue lock, lookup cache hits
+ * and misses, log messages dropped because the log ring was full, and the
+ * outcome and latency of operations against each domain controller.  The
+ * statistics are kept in a file in the queue directory that every process
+ * maps into memory at initialization, so krb5-sync -S can read them without
+ * involving kadmind.
+ *
+ * Nothing is locked when updating the statistics.  Every counter is updated
+ * with an atomic add, and the slot for a new domain controller is claimed by
+ * changing its state with an atomic compare and swap, so kadmind never waits
+ * to update them.  Since the mapping is shared, it remains valid in forked
+ * children, which update the same statistics as their parent.  Without
+ * compiler support for atomic operations, the statistics are disabled.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <plugin/internal.h>
+
+/* Identify the format of the stats file so that we can change it later. */
+#define STATS_MAGIC   0x6b737374U
+#define STATS_VERSION 3
+
+/* The states of a domain controller slot. */
+#define STATS_SLOT_EMPTY   0
+#define STATS_SLOT_CLAIMED 1
+#define STATS_SLOT_READY   2
+
+/*
+ * How many times to check a slot claimed by another process for its name
+ * before giving up on it, in case that process died while claiming it.
+ */
+#define STATS_CLAIM_TRIES 100
+
+/* The layout of the mapped stats file. */
+struct sync_stats_file {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t state[SYNC_STATS_DCS];     /* State of each dc slot. */
+    struct sync_stats stats;
+};
+
+/*
+ * Atomic operations on the counters, which are all uint64_t.  The fallbacks
+ * are never used, since the file is never mapped without atomic operations,
+ * but let the code compile.
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+# define STATS_ADD(p, n)   __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+# define STATS_LOAD(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define STATS_STORE(p, n) __atomic_store_n((p), (n), __ATOMIC_RELEASE)
+# define STATS_CAS(p, o, n)                                             \
+    __atomic_compare_exchange_n((p), (o), (n), false, __ATOMIC_ACQ_REL, \
+                                __ATOMIC_ACQUIRE)
+#else
+# define STATS_ADD(p, n)    (*(p) += (n))
+# define STATS_LOAD(p)      (*(p))
+# define STATS_STORE(p, n)  (*(p) = (n))
+# define STATS_CAS(p, o, n) (*(p) == *(o) ? (*(p) = (n), true) : false)
+#endif
+
+
+/*
+ * Map the stats file into memory, creating and initializing it if needed.
+ * Called from sync_init, before any threads can use the configuration.  The
+ * statistics are supplemental, so if the file can't be mapped, they are
+ * silently disabled.
+ */
+void
+sync_stats_init(kadm5_hook_modinfo *config)
+{
+    struct sync_stats_file *file;
+    struct stat st;
+    char *path;
+    void *map;
+    int fd;
+
+#ifndef HAVE_ATOMIC_BUILTINS
+    config->stats = false;
+#endif
+    if (!config->stats || config->queue_dir == NULL)
+        return;
+    if (asprintf(&path, "%s/.stats", config->queue_dir) < 0)
+        return;
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    free(path);
+    if (fd < 0)
+        return;
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0)
+        goto done;
+    if (st.st_size < (off_t) sizeof(struct sync_stats_file))
+        if (ftruncate(fd, sizeof(struct sync_stats_file)) < 0)
+            goto done;
+    map = mmap(NULL, sizeof(struct sync_stats_file), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto done;
+    file = map;
+    if (file->magic != STATS_MAGIC || file->version != STATS_VERSION) {
+        memset(file, 0, sizeof(*file));
+        file->magic = STATS_MAGIC;
+        file->version = STATS_VERSION;
+    }
+    config->stats_file = file;
+
+done:
+    close(fd);
+}
+
+
+/*
+ * Unmap the stats file.
+ */
+void
+sync_stats_close(kadm5_hook_modinfo *config)
+{
+    if (config->stats_file == NULL)
+        return;
+    munmap(config->stats_file, sizeof(struct sync_stats_file));
+    config->stats_file = NULL;
+}
+
+
+/*
+ * Return the current time in microseconds, used as the start time of the
+ * latencies passed to the other functions.
+ */
+uint64_t
+sync_stats_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + (uint64_t) tv.tv_usec;
+}
+
+
+/*
+ * Record a latency in a histogram.  The bucket is the smallest power of two
+ * microseconds that is at least the latency.
+ */
+static void
+stats_record(struct sync_stats_histogram *histogram, uint64_t usec)
+{
+    size_t i = 0;
+
+    while (i < SYNC_STATS_BUCKETS - 1 && ((uint64_t) 1 << i) < usec)
+        i++;
+    STATS_ADD(&histogram->bucket[i], 1);
+    STATS_ADD(&histogram->sum, usec);
+    STATS_ADD(&histogram->count, 1);
+}
+
+
+/*
+ * Return the time elapsed since start, or 0 if the clock went backwards.
+ */
+static uint64_t
+stats_elapsed(uint64_t start)
+{
+    uint64_t now;
+
+    now = sync_stats_now();
+    return (now > start) ? now - start : 0;
+}
+
+
+/*
+ * Find the slot for a domain controller, claiming an empty slot for it if
+ * needed.  Slots are claimed in order, so two processes adding the same
+ * domain controller compete for the same slot and the loser finds the name
+ * there once the winner has stored it.  Returns NULL if there is no room.
+ */
+static struct sync_stats_dc *
+stats_find(struct sync_stats_file *file, const char *name)
+{
+    struct sync_stats_dc *dc;
+    uint64_t state;
+    size_t i, tries;
+
+    for (i = 0; i < SYNC_STATS_DCS; i++) {
+        dc = &file->stats.dc[i];
+        state = STATS_LOAD(&file->state[i]);
+        if (state == STATS_SLOT_EMPTY) {
+            if (STATS_CAS(&file->state[i], &state, STATS_SLOT_CLAIMED)) {
+                snprintf(dc->name, sizeof(dc->name), "%s", name);
+                STATS_STORE(&file->state[i], STATS_SLOT_READY);
+                return dc;
+            }
+        }
+        for (tries = 0; state == STATS_SLOT_CLAIMED; tries++) {
+            if (tries >= STATS_CLAIM_TRIES)
+                break;
+            sched_yield();
+            state = STATS_LOAD(&file->state[i]);
+        }
+        if (state != STATS_SLOT_READY)
+            continue;
+        if (strncmp(dc->name, name, sizeof(dc->name) - 1) == 0)
+            return dc;
+    }
+    return NULL;
+}
+
+
+/*
+ * Copy a histogram into a snapshot.
+ */
+static void
+stats_copy(struct sync_stats_histogram *to, struct sync_stats_histogram *from)
+{
+    size_t i;
+
+    to->count = STATS_LOAD(&from->count);
+    to->sum = STATS_LOAD(&from->sum);
+    for (i = 0; i < SYNC_STATS_BUCKETS; i++)
+        to->bucket[i] = STATS_LOAD(&from->bucket[i]);
+}
+
+
+/*
+ * Record a change handled by the plugin or applied from the queue, with its
+ * outcome and the time at which it started.
+ */
+void
+sync_stats_change(kadm5_hook_modinfo *config, enum sync_stats_source source,
+                  enum sync_stats_type type, enum sync_stats_result result,
+                  uint64_t start)
+{
+    struct sync_stats *stats;
+
+    if (config->stats_file == NULL)
+        return;
+    stats = &config->stats_file->stats;
+    STATS_ADD(&stats->changes[source][type][result], 1);
+    stats_record(&stats->latency[source][type], stats_elapsed(start));
+}
+
+
+/*
+ * Record the outcome of an operation against a domain controller and the
+ * time at which it started.
+ */
+void
+sync_stats_dc(kadm5_hook_modinfo *config, const char *name,
+              enum sync_outcome outcome, uint64_t start)
+{
+    struct sync_stats_dc *dc;
+
+    if (config->stats_file == NULL)
+        return;
+    dc = stats_find(config->stats_file, name);
+    if (dc == NULL)
+        return;
+    STATS_ADD(&dc->outcomes[outcome], 1);
+    stats_record(&dc->latency, stats_elapsed(start));
+}
+
+
+/*
+ * Record that a change that originated at the given time was applied to a
+ * target.  A change may sit in the queue for days, so the lag is kept in
+ * milliseconds.
+ */
+void
+sync_stats_lag(kadm5_hook_modinfo *config, enum sync_stats_type type,
+               uint64_t origin)
+{
+    if (config->stats_file == NULL)
+        return;
+    stats_record(&config->stats_file->stats.lag[type],
+                 stats_elapsed(origin) / 1000);
+}
+
+
+/*
+ * Record that we waited for the queue lock since start.
+ */
+void
+sync_stats_lock(kadm5_hook_modinfo *config, uint64_t start)
+{
+    if (config->stats_file == NULL)
+        return;
+    stats_record(&config->stats_file->stats.lock_wait, stats_elapsed(start));
+}
+
+
+/*
+ * Record a lookup in the persistent cache and whether it was a hit.
+ */
+void
+sync_stats_cache(kadm5_hook_modinfo *config, enum sync_cache_kind kind,
+                 bool hit)
+{
+    struct sync_stats *stats;
+
+    if (config->stats_file == NULL)
+        return;
+    stats = &config->stats_file->stats;
+    if (hit)
+        STATS_ADD(&stats->cache_hits[kind], 1);
+    else
+        STATS_ADD(&stats->cache_misses[kind], 1);
+}
+
+
+/*
+ * Record that a change was written to the queue.
+ */
+void
+sync_stats_queued(kadm5_hook_modinfo *config)
+{
+    if (config->stats_file == NULL)
+        return;
+    STATS_ADD(&config->stats_file->stats.queue_writes, 1);
+}
+
+
+/*
+ * Record that a log message was dropped because the log ring was full.
+ */
+void
+sync_stats_dropped(kadm5_hook_modinfo *config)
+{
+    if (config->stats_file == NULL)
+        return;
+    STATS_ADD(&config->stats_file->stats.log_dropped, 1);
+}
+
+
+/*
+ * Copy the current statistics into a snapshot.  Each counter is read
+ * atomically, but other processes may update the statistics while they are
+ * copied.  Returns a Kerberos status code, which is an error if the
+ * statistics are not enabled.
+ */
+krb5_error_code
+sync_stats_read(kadm5_hook_modinfo *config, krb5_context ctx,
+                struct sync_stats *snapshot)
+{
+    struct sync_stats_file *file = config->stats_file;
+    struct sync_stats *stats;
+    size_t i, j, k, n = 0;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    if (file == NULL)
+        return sync_error_config(ctx, "statistics are not enabled");
+    stats = &file->stats;
+    for (i = 0; i < SYNC_STATS_SOURCES; i++)
+        for (j = 0; j < SYNC_STATS_TYPES; j++) {
+            for (k = 0; k < SYNC_STATS_RESULTS; k++)
+                snapshot->changes[i][j][k]
+                    = STATS_LOAD(&stats->changes[i][j][k]);
+            stats_copy(&snapshot->latency[i][j], &stats->latency[i][j]);
+        }
+    for (i = 0; i < SYNC_STATS_TYPES; i++)
+        stats_copy(&snapshot->lag[i], &stats->lag[i]);
+    stats_copy(&snapshot->lock_wait, &stats->lock_wait);
+    for (i = 0; i < SYNC_STATS_KINDS; i++) {
+        snapshot->cache_hits[i] = STATS_LOAD(&stats->cache_hits[i]);
+        snapshot->cache_misses[i] = STATS_LOAD(&stats->cache_misses[i]);
+    }
+    snapshot->queue_writes = STATS_LOAD(&stats->queue_writes);
+    snapshot->log_dropped = STATS_LOAD(&stats->log_dropped);
+    for (i = 0; i < SYNC_STATS_DCS; i++) {
+        if (STATS_LOAD(&file->state[i]) != STATS_SLOT_READY)
+            continue;
+        memcpy(snapshot->dc[n].name, stats->dc[i].name,
+               sizeof(snapshot->dc[n].name));
+        for (j = 0; j < SYNC_STATS_OUTCOMES; j++)
+            snapshot->dc[n].outcomes[j]
+                = STATS_LOAD(&stats->dc[i].outcomes[j]);
+        stats_copy(&snapshot->dc[n].latency, &stats->dc[i].latency);
+        n++;
+    }
+    snapshot->dc_count = n;
+    return 0;
+}
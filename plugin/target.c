@@ -0,0 +1,418 @@
+/*
+ * Multiple Active Directory targets.
+ *
+ * Changes may be pushed to more than one Active Directory domain or forest.
+ * Each is configured as a named target, and each target has rules that say
+ * which principals are pushed to it.  A change that goes to several targets
+ * is pushed to all of them concurrently, each in a thread with a Kerberos
+ * context of its own, and the result is recorded separately for each target
+ * so that only the targets that failed queue the change.
+ *
+ * The target named ad is configured with the top-level options, which keeps
+ * configurations from before targets existed working unchanged.  Other
+ * targets are configured with options prefixed by the target name and a
+ * period, such as forest2.ad_realm, and fall back on the top-level options
+ * for any that aren't set other than ad_ccache and ad_match.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include <plugin/internal.h>
+
+/* The name of the target configured with the top-level options. */
+#define DEFAULT_TARGET "ad"
+
+/*
+ * Whether a change may be pushed to several targets in parallel threads.
+ * Account status changes may only be made in a thread if we can point
+ * GSSAPI at a per-thread credential cache.
+ */
+#ifdef HAVE_PTHREAD
+# define HAVE_PUSH_THREADS 1
+# ifdef HAVE_GSS_KRB5_CCACHE_NAME
+#  define HAVE_PUSH_STATUS_THREADS 1
+# endif
+#endif
+
+
+/*
+ * Load a string option for a target.  The top-level option is used unless
+ * this is a named target for which the prefixed option is also set.  Returns
+ * a Kerberos status code.
+ */
+static krb5_error_code
+target_string(krb5_context ctx, struct sync_target *target, const char *opt,
+              char **result)
+{
+    char *name;
+
+    sync_config_string(ctx, opt, result);
+    if (strcmp(target->name, DEFAULT_TARGET) == 0)
+        return 0;
+    if (asprintf(&name, "%s.%s", target->name, opt) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    sync_config_string(ctx, name, result);
+    free(name);
+    return 0;
+}
+
+
+/*
+ * Load an option for a target that isn't inherited from the top-level
+ * options, since the top-level option is the setting for the target named ad.
+ * Returns a Kerberos status code.
+ */
+static krb5_error_code
+target_own(krb5_context ctx, struct sync_target *target, const char *opt,
+           char **string, struct vector **list)
+{
+    char *name;
+    krb5_error_code code = 0;
+
+    if (strcmp(target->name, DEFAULT_TARGET) == 0)
+        name = strdup(opt);
+    else if (asprintf(&name, "%s.%s", target->name, opt) < 0)
+        name = NULL;
+    if (name == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    if (string != NULL)
+        sync_config_string(ctx, name, string);
+    else
+        code = sync_config_list(ctx, name, list);
+    free(name);
+    return code;
+}
+
+
+/*
+ * Load the configuration of one target.  The ad_match rules and the shared
+ * credential cache aren't inherited, since the cache holds tickets for one
+ * target's principal.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+target_load(krb5_context ctx, struct sync_target *target, const char *name)
+{
+    const char *p;
+    krb5_error_code code;
+
+    /* Target names are used in queue file names, so restrict them. */
+    for (p = name; *p != '\0'; p++)
+        if (!isalnum((unsigned char) *p) && *p != '_')
+            return sync_error_config(ctx, "invalid target name %s", name);
+    target->name = strdup(name);
+    if (target->name == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+
+    /* Load the options. */
+    code = target_string(ctx, target, "ad_admin_server",
+                         &target->ad_admin_server);
+    if (code == 0)
+        code = target_own(ctx, target, "ad_ccache", &target->ad_ccache, NULL);
+    if (code == 0)
+        code = target_string(ctx, target, "ad_hedge_krb5_conf",
+                             &target->ad_hedge_krb5_conf);
+    if (code == 0)
+        code = target_string(ctx, target, "ad_hedge_server",
+                             &target->ad_hedge_server);
+    if (code == 0)
+        code = target_string(ctx, target, "ad_keytab", &target->ad_keytab);
+    if (code == 0)
+        code = target_string(ctx, target, "ad_ldap_base",
+                             &target->ad_ldap_base);
+    if (code == 0)
+        code = target_string(ctx, target, "ad_principal",
+                             &target->ad_principal);
+    if (code == 0)
+        code = target_string(ctx, target, "ad_realm", &target->ad_realm);
+    if (code == 0)
+        code = target_own(ctx, target, "ad_match", NULL, &target->ad_match);
+    return code;
+}
+
+
+/*
+ * Load the targets listed in ad_targets, or only the target named ad if that
+ * isn't set.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_target_init(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct vector *names = NULL;
+    size_t count, i;
+    krb5_error_code code;
+
+    code = sync_config_list(ctx, "ad_targets", &names);
+    if (code != 0)
+        return code;
+    if (names != NULL && names->count == 0) {
+        sync_vector_free(names);
+        names = NULL;
+    }
+    count = (names == NULL) ? 1 : names->count;
+    config->ad_targets = calloc(count, sizeof(struct sync_target));
+    if (config->ad_targets == NULL) {
+        sync_vector_free(names);
+        return sync_error_system(ctx, "cannot allocate memory");
+    }
+    for (i = 0; i < count; i++) {
+        const char *name = (names == NULL) ? DEFAULT_TARGET
+                                           : names->strings[i];
+
+        if (sync_target_find(config, name) != NULL) {
+            code = sync_error_config(ctx, "duplicate target %s", name);
+            break;
+        }
+        config->ad_targets_count++;
+        code = target_load(ctx, &config->ad_targets[i], name);
+        if (code != 0)
+            break;
+    }
+    sync_vector_free(names);
+    return code;
+}
+
+
+/*
+ * Free the targets.
+ */
+void
+sync_target_free(kadm5_hook_modinfo *config)
+{
+    struct sync_target *target;
+    size_t i;
+
+    for (i = 0; i < config->ad_targets_count; i++) {
+        target = &config->ad_targets[i];
+        free(target->name);
+        free(target->ad_admin_server);
+        free(target->ad_ccache);
+        free(target->ad_hedge_krb5_conf);
+        free(target->ad_hedge_server);
+        free(target->ad_keytab);
+        free(target->ad_ldap_base);
+        sync_vector_free(target->ad_match);
+        free(target->ad_principal);
+        free(target->ad_realm);
+    }
+    free(config->ad_targets);
+    config->ad_targets = NULL;
+    config->ad_targets_count = 0;
+}
+
+
+/*
+ * Return the target with the given name, or NULL if there is none.
+ */
+struct sync_target *
+sync_target_find(kadm5_hook_modinfo *config, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < config->ad_targets_count; i++)
+        if (config->ad_targets[i].name != NULL
+            && strcmp(config->ad_targets[i].name, name) == 0)
+            return &config->ad_targets[i];
+    return NULL;
+}
+
+
+/*
+ * Check whether a principal is pushed to a target.  The ad_match patterns
+ * are matched against the principal without the realm, and a target with no
+ * patterns gets every principal.
+ */
+bool
+sync_target_match(struct sync_target *target, struct sync_op *op)
+{
+    size_t i;
+
+    if (target->ad_match == NULL || target->ad_match->count == 0)
+        return true;
+    for (i = 0; i < target->ad_match->count; i++)
+        if (fnmatch(target->ad_match->strings[i], op->user, 0) == 0)
+            return true;
+    return false;
+}
+
+
+/*
+ * Push a change to one target in the current thread and store the result.
+ */
+static void
+push_one(kadm5_hook_modinfo *config, struct sync_op *op, const char *password,
+         bool enabled, struct sync_result *result)
+{
+    const char *message;
+
+    if (password != NULL)
+        result->code = sync_ad_chpass(config, result->target, op, password);
+    else
+        result->code = sync_ad_status(config, result->target, op, enabled);
+    if (result->code != 0) {
+        message = krb5_get_error_message(op->ctx, result->code);
+        result->message = strdup(message);
+        krb5_free_error_message(op->ctx, message);
+    }
+}
+
+
+#ifdef HAVE_PUSH_THREADS
+
+/* The state of a change pushed to one target in a thread. */
+struct push {
+    kadm5_hook_modinfo *config;
+    const char *principal;
+    const char *trace;
+    uint64_t origin;
+    const char *password;
+    bool enabled;
+    struct sync_result *result;
+    pthread_t thread;
+    bool started;
+};
+
+
+/*
+ * The thread pushing a change to one target.  Kerberos contexts may not be
+ * shared between threads, so create our own from the same krb5.conf as the
+ * configuration, along with an operation using it.
+ */
+static void *
+push_thread(void *data)
+{
+    struct push *push = data;
+    struct sync_op op;
+    krb5_context ctx;
+    krb5_principal principal;
+    krb5_error_code code;
+    const char *message;
+
+    code = sync_config_context(push->config->krb5_conf, &ctx);
+    if (code != 0) {
+        push->result->code = code;
+        push->result->message = strdup("cannot create Kerberos context");
+        return NULL;
+    }
+    code = krb5_parse_name(ctx, push->principal, &principal);
+    if (code != 0)
+        goto fail;
+    code = sync_op_init(&op, ctx, principal);
+    if (code != 0) {
+        sync_op_free(&op);
+        krb5_free_principal(ctx, principal);
+        goto fail;
+    }
+    sync_op_trace(&op, push->trace, push->origin);
+    push_one(push->config, &op, push->password, push->enabled, push->result);
+    sync_op_free(&op);
+    krb5_free_principal(ctx, principal);
+    krb5_free_context(ctx);
+    return NULL;
+
+fail:
+    push->result->code = code;
+    message = krb5_get_error_message(ctx, code);
+    push->result->message = strdup(message);
+    krb5_free_error_message(ctx, message);
+    krb5_free_context(ctx);
+    return NULL;
+}
+
+
+/*
+ * Push a change to each target in its own thread and wait for all of them.
+ * If we can't start a thread, we push that change in the current thread
+ * instead.  Returns false if we couldn't set up the threads at all, in which
+ * case the caller should push the changes one after the other.
+ */
+static bool
+push_threads(kadm5_hook_modinfo *config, struct sync_op *op,
+             const char *password, bool enabled, struct sync_result *results,
+             size_t count)
+{
+    struct push *pushes;
+    size_t i;
+
+    pushes = sync_op_alloc(op, count * sizeof(*pushes));
+    if (pushes == NULL)
+        return false;
+    memset(pushes, 0, count * sizeof(*pushes));
+    for (i = 0; i < count; i++) {
+        pushes[i].config = config;
+        pushes[i].principal = op->name;
+        pushes[i].trace = op->trace;
+        pushes[i].origin = op->origin;
+        pushes[i].password = password;
+        pushes[i].enabled = enabled;
+        pushes[i].result = &results[i];
+        if (pthread_create(&pushes[i].thread, NULL, push_thread,
+                           &pushes[i]) == 0)
+            pushes[i].started = true;
+        else
+            push_one(config, op, password, enabled, &results[i]);
+    }
+    for (i = 0; i < count; i++)
+        if (pushes[i].started)
+            pthread_join(pushes[i].thread, NULL);
+    return true;
+}
+
+#endif /* HAVE_PUSH_THREADS */
+
+
+/*
+ * Push a change to each target in the results array and store the results.
+ * A single target is handled in the current thread.
+ */
+void
+sync_target_push(kadm5_hook_modinfo *config, struct sync_op *op,
+                 const char *password, bool enabled,
+                 struct sync_result *results, size_t count)
+{
+    size_t i;
+
+#ifdef HAVE_PUSH_THREADS
+# ifdef HAVE_PUSH_STATUS_THREADS
+    bool threads = true;
+# else
+    bool threads = (password != NULL);
+# endif
+
+    if (count > 1 && threads)
+        if (push_threads(config, op, password, enabled, results, count))
+            return;
+#endif
+    for (i = 0; i < count; i++)
+        push_one(config, op, password, enabled, &results[i]);
+}
+
+
+/*
+ * Free the error messages in an array of results.
+ */
+void
+sync_target_results_free(struct sync_result *results, size_t count)
+{
+    size_t i;
+
+    if (results == NULL)
+        return;
+    for (i = 0; i < count; i++) {
+        free(results[i].message);
+        results[i].message = NULL;
+    }
+}
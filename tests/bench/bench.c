@@ -0,0 +1,227 @@
+/*
+ * Helper functions for the krb5-sync benchmarks.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <tests/bench/bench.h>
+#include <tests/tap/basic.h>
+
+
+/*
+ * Return the current time in microseconds.
+ */
+uint64_t
+bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + (uint64_t) tv.tv_usec;
+}
+
+
+/*
+ * Allocate the shared latency array.
+ */
+uint64_t *
+bench_latencies(size_t count)
+{
+    uint64_t *latencies;
+    size_t i;
+
+    if (count == 0)
+        count = 1;
+    latencies = mmap(NULL, count * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (latencies == MAP_FAILED)
+        sysbail("cannot map shared memory for latencies");
+    for (i = 0; i < count; i++)
+        latencies[i] = BENCH_FAILED;
+    return latencies;
+}
+
+
+/*
+ * Free the shared latency array.
+ */
+void
+bench_latencies_free(uint64_t *latencies, size_t count)
+{
+    if (latencies == NULL)
+        return;
+    if (count == 0)
+        count = 1;
+    munmap(latencies, count * sizeof(uint64_t));
+}
+
+
+/*
+ * The body of one benchmark process.  Sets up and tells the parent whether
+ * that worked by writing a byte to the ready pipe, which is zero on success.
+ * Then waits for the parent to close the start pipe and makes every procs'th
+ * operation starting with its own number, waiting for the start time of
+ * each if the benchmark has a rate or schedule.
+ */
+static void __attribute__((__noreturn__))
+bench_child(const struct bench_ops *ops, void *data, unsigned int proc,
+            unsigned int procs, size_t count, uint64_t *latencies, int ready,
+            int start)
+{
+    void *state;
+    size_t i;
+    uint64_t begin, before, after, when;
+    struct timespec delay;
+    char byte = 0;
+    ssize_t status;
+
+    state = ops->setup(data);
+    if (state == NULL)
+        byte = 1;
+    if (write(ready, &byte, 1) != 1 || state == NULL)
+        _exit(1);
+    do {
+        status = read(start, &byte, 1);
+    } while (status < 0 && errno == EINTR);
+    begin = bench_now();
+    for (i = proc; i < count; i += procs) {
+        if (ops->schedule != NULL || ops->rate > 0) {
+            if (ops->schedule != NULL)
+                when = begin + ops->schedule[i];
+            else
+                when = begin + (uint64_t) i * 1000000 / ops->rate;
+            before = bench_now();
+            if (when > before) {
+                delay.tv_sec = (time_t) ((when - before) / 1000000);
+                delay.tv_nsec = (long) ((when - before) % 1000000) * 1000;
+                while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+                    ;
+            }
+        }
+        before = bench_now();
+        if (ops->op(state, i)) {
+            after = bench_now();
+            latencies[i] = (after > before) ? after - before : 0;
+        }
+    }
+    if (ops->cleanup != NULL)
+        ops->cleanup(state);
+    _exit(0);
+}
+
+
+/*
+ * Run a benchmark in forked processes and return the elapsed time.
+ */
+uint64_t
+bench_fork(const struct bench_ops *ops, void *data, unsigned int procs,
+           size_t count, uint64_t *latencies)
+{
+    pid_t *children;
+    int ready[2], start[2];
+    unsigned int i, failed = 0;
+    uint64_t begin;
+    char byte;
+    int status;
+
+    if (procs == 0)
+        procs = 1;
+    if (pipe(ready) < 0 || pipe(start) < 0)
+        sysbail("cannot create pipes");
+    children = bcalloc(procs, sizeof(pid_t));
+    fflush(stdout);
+    for (i = 0; i < procs; i++) {
+        children[i] = fork();
+        if (children[i] < 0)
+            sysbail("cannot fork");
+        else if (children[i] == 0) {
+            close(ready[0]);
+            close(start[1]);
+            bench_child(ops, data, i, procs, count, latencies, ready[1],
+                        start[0]);
+        }
+    }
+    close(ready[1]);
+    close(start[0]);
+
+    /*
+     * Wait for every process to be ready and then start them all at once.
+     * If any failed, stop the rest before starting them.
+     */
+    for (i = 0; i < procs; i++)
+        if (read(ready[0], &byte, 1) != 1 || byte != 0)
+            failed++;
+    close(ready[0]);
+    if (failed > 0)
+        for (i = 0; i < procs; i++)
+            kill(children[i], SIGTERM);
+    begin = bench_now();
+    close(start[1]);
+    for (i = 0; i < procs; i++) {
+        if (waitpid(children[i], &status, 0) != children[i])
+            sysbail("cannot wait for benchmark process");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    }
+    free(children);
+    if (failed > 0)
+        bail("%u benchmark processes failed", failed);
+    return bench_now() - begin;
+}
+
+
+/*
+ * Comparison function for sorting latencies with qsort.
+ */
+static int
+bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+
+/*
+ * Report the results of a run.  Failed operations sort to the end, so the
+ * nearest-rank percentiles are taken over the ones that succeeded.
+ */
+void
+bench_report(const char *name, const char *params, uint64_t *latencies,
+             size_t count, uint64_t elapsed)
+{
+    size_t good;
+    double seconds;
+    uint64_t p50 = 0, p99 = 0;
+
+    qsort(latencies, count, sizeof(uint64_t), bench_compare);
+    for (good = 0; good < count; good++)
+        if (latencies[good] == BENCH_FAILED)
+            break;
+    if (good > 0) {
+        p50 = latencies[(good * 50 + 99) / 100 - 1];
+        p99 = latencies[(good * 99 + 99) / 100 - 1];
+    }
+    seconds = (double) elapsed / 1000000.0;
+    printf("%s%s%s count=%lu errors=%lu seconds=%.6f rate=%.1f p50_us=%lu"
+           " p99_us=%lu\n", name, (params == NULL) ? "" : " ",
+           (params == NULL) ? "" : params, (unsigned long) count,
+           (unsigned long) (count - good), seconds,
+           (elapsed > 0) ? (double) good / seconds : 0.0, (unsigned long) p50,
+           (unsigned long) p99);
+    fflush(stdout);
+}
@@ -0,0 +1,83 @@
+/*
+ * Helper functions for the krb5-sync benchmarks.
+ *
+ * The benchmarks run operations in forked processes, record the latency of
+ * each in shared memory, and report the results as one line of key=value
+ * pairs per run so that they're easy to compare.  Each benchmark is run
+ * from the tests directory with SOURCE and BUILD set, as make bench does.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef BENCH_BENCH_H
+#define BENCH_BENCH_H 1
+
+#include <config.h>
+#include <portable/stdbool.h>
+#include <portable/macros.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The latency recorded for an operation that failed. */
+#define BENCH_FAILED UINT64_MAX
+
+/*
+ * A benchmark run by bench_fork.  setup is called once in each process
+ * before timing starts and returns the state for that process, or NULL on
+ * failure after reporting the error with diag.  op is called
+ * for each operation with that state and the index of the operation and
+ * returns true if it succeeded, and cleanup, if not NULL, frees the state
+ * after timing stops.  If rate is not zero, operations are started at that
+ * many per second across all processes rather than as fast as possible.  If
+ * schedule is not NULL, it instead gives the start time of each operation in
+ * microseconds after timing starts.  Either way, the time spent waiting for
+ * an operation's start time isn't part of its latency.
+ */
+struct bench_ops {
+    void *(*setup)(void *data);
+    bool (*op)(void *state, size_t index);
+    void (*cleanup)(void *state);
+    unsigned long rate;
+    const uint64_t *schedule;
+};
+
+BEGIN_DECLS
+
+/* Return the current time in microseconds. */
+uint64_t bench_now(void);
+
+/*
+ * Allocate an array of count latencies in memory shared with forked
+ * processes, initialized to BENCH_FAILED, and free it again.
+ */
+uint64_t *bench_latencies(size_t count)
+    __attribute__((__malloc__));
+void bench_latencies_free(uint64_t *, size_t count);
+
+/*
+ * Run count operations spread over procs forked processes, recording the
+ * latency of each in latencies.  Timing starts once every process has been
+ * set up.  Returns the elapsed wall-clock time in microseconds and calls bail
+ * if any process fails.
+ */
+uint64_t bench_fork(const struct bench_ops *, void *data, unsigned int procs,
+                    size_t count, uint64_t *latencies)
+    __attribute__((__nonnull__(1, 5)));
+
+/*
+ * Report the results of a run on standard output as a line with the name of
+ * the benchmark, its parameters, and the throughput, error count, and median
+ * and 99th percentile latency in microseconds.  params may be NULL.  Sorts
+ * latencies in place.
+ */
+void bench_report(const char *name, const char *params, uint64_t *latencies,
+                  size_t count, uint64_t elapsed)
+    __attribute__((__nonnull__(1, 3)));
+
+END_DECLS
+
+#endif /* BENCH_BENCH_H */
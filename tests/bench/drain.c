@@ -0,0 +1,777 @@
+/*
+ * Benchmark of draining a backlog of queued changes.
+ *
+ * Fills the queue with a given number of changes, shaped like a real backlog
+ * after an Active Directory outage, and times how long each way of draining
+ * it takes to empty it: krb5-sync-backend process, which runs krb5-sync -f
+ * for one file at a time, and krb5-sync -q both serially and in parallel
+ * with ad_drain_concurrency set.  Password changes go to the kpasswd
+ * stand-in, if a test realm is configured, and status changes to the LDAP
+ * stand-in, both of which wait for the given latency before answering, so
+ * the results show how well each drain hides the latency of Active
+ * Directory.
+ *
+ * The queue is filled the same way on every run, like the one used by the
+ * queue benchmark, so that results can be compared across commits.  Reports
+ * one line per drain with the rate at which it applied changes, the time to
+ * empty the queue, and the time from the start of the drain until each
+ * change was applied.  Then checks that every change was applied exactly
+ * once, that changes for the same user, target, and operation were applied
+ * in the order in which they were queued, that the accounts in the LDAP
+ * stand-in ended up with the status of the last queued change, and that the
+ * queue is empty, and exits with status 1 if a check failed.
+ *
+ * The changes are applied with the same code as krb5-sync, linked into this
+ * program so that it can use the LDAP stand-in.  krb5-sync-backend runs a
+ * copy of itself that runs this program instead of krb5-sync, and is skipped
+ * if the Perl modules that it needs aren't installed.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+#include <tests/bench/bench.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/directory.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/kpasswd.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+#include <tools/internal.h>
+#include <util/messages.h>
+
+/* The principal for which we store tickets without a test realm. */
+#define PRINCIPAL "service/krb5-sync@EXAMPLE.COM"
+
+/* The Active Directory realm without a test realm, from data/krb5.conf. */
+#define AD_REALM "AD.EXAMPLE.COM"
+
+/* userAccountControl for a normal account and the disabled flag. */
+#define NORMAL   0x200
+#define DISABLED 0x2
+
+/* The line in krb5-sync-backend that sets the program it runs. */
+#define SYNC_LINE "my $SYNC = '/usr/sbin/krb5-sync';"
+
+/* The default drains to run. */
+#define VARIANTS "process,serial,parallel"
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: drain [-h] [-c <concurrency>] [-l <latency>] [-n <count>]\n\
+             [-v <variants>]\n\
+\n\
+  -c <concurrency>  ad_drain_concurrency for the parallel drain (default: 8)\n\
+  -h                Show this help\n\
+  -l <latency>      Latency of the stand-ins in milliseconds (default: 10)\n\
+  -n <count>        Number of queued changes (default: 1000)\n\
+  -v <variants>     Comma-separated drains to run, from process, serial,\n\
+                    and parallel (default: " VARIANTS ")\n";
+
+/* A queued change. */
+struct entry {
+    unsigned long user;
+    bool instance;
+    bool password;
+    bool enable;
+};
+
+/* The parameters of the run. */
+struct params {
+    struct entry *entries;
+    size_t count;
+    unsigned long users;
+    const char *realm;
+    const char *backend;
+    const char *log;
+    const char *directory;
+};
+
+/* The results of checking a drain. */
+struct check {
+    unsigned long applied;
+    unsigned long duplicates;
+    unsigned long order;
+    unsigned long unparsed;
+    unsigned long status;
+};
+
+/* The state of the random number generator used to fill the queue. */
+static uint64_t seed;
+
+/* The log of applied changes, written by the notice handler. */
+static int log_fd = -1;
+
+
+/*
+ * Return a pseudorandom number between 0 and 1.  This is a linear
+ * congruential generator, which is good enough to shape the queue and gives
+ * the same queue everywhere.
+ */
+static double
+random_fraction(void)
+{
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (double) (seed >> 11) / (double) (1ULL << 53);
+}
+
+
+/*
+ * Return the index of the group of changes that have to be applied in order
+ * that an entry belongs to, which is one per user, instance, and operation.
+ */
+static size_t
+entry_group(const struct entry *entry)
+{
+    return (entry->user * 2 + entry->instance) * 2 + entry->password;
+}
+
+
+/*
+ * Log a message from krb5-sync, which is a notice for each change applied,
+ * with the time in front of it.  Each message is written with a single write
+ * to a file opened for appending, so messages from all the processes
+ * applying changes end up in the order in which they were written.
+ */
+static void __attribute__((__format__(printf, 2, 0)))
+log_notice(size_t len UNUSED, const char *format, va_list args,
+           int err UNUSED)
+{
+    char message[BUFSIZ], line[BUFSIZ + 32];
+    int length;
+
+    vsnprintf(message, sizeof(message), format, args);
+    length = snprintf(line, sizeof(line), "%llu %s\n",
+                      (unsigned long long) bench_now(), message);
+    if (length < 0 || (size_t) length >= sizeof(line))
+        return;
+    if (write(log_fd, line, (size_t) length) < length)
+        return;
+}
+
+
+/*
+ * Open the log of applied changes and send the notices from krb5-sync to it.
+ */
+static void
+log_start(const char *path)
+{
+    log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if (log_fd < 0)
+        sysbail("cannot open %s", path);
+    message_handlers_notice(1, log_notice);
+}
+
+
+/*
+ * Apply one change when run by krb5-sync-backend process in place of
+ * krb5-sync, taking the log and the directory from the environment.  This
+ * does what krb5-sync -f does.
+ */
+static int
+apply_command(const char *path)
+{
+    const char *log, *directory;
+    krb5_context ctx;
+    kadm5_hook_modinfo *config;
+    krb5_error_code code;
+
+    log = getenv("DRAIN_LOG");
+    directory = getenv("DRAIN_DIRECTORY");
+    if (log == NULL || directory == NULL)
+        return 1;
+    directory_attach(directory);
+    log_start(log);
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail("cannot initialize Kerberos context");
+    code = sync_init(ctx, &config);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize plugin");
+    config->drain = true;
+    process_queue_file(config, ctx, path);
+    sync_close(ctx, config);
+    krb5_free_context(ctx);
+    directory_stop();
+    return 0;
+}
+
+
+/*
+ * Remove all files from the queue directory, including the state of the
+ * rate and concurrency controller, leaving the directory.
+ */
+static void
+empty_queue(void)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char *path;
+
+    dir = opendir("queue");
+    if (dir == NULL)
+        sysbail("cannot open queue");
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0
+            || strcmp(entry->d_name, "..") == 0)
+            continue;
+        basprintf(&path, "queue/%s", entry->d_name);
+        if (unlink(path) < 0)
+            sysbail("cannot remove %s", path);
+        free(path);
+    }
+    closedir(dir);
+}
+
+
+/*
+ * Return the number of changes left in the queue.
+ */
+static unsigned long
+queue_count(void)
+{
+    DIR *dir;
+    struct dirent *entry;
+    unsigned long count = 0;
+
+    dir = opendir("queue");
+    if (dir == NULL)
+        sysbail("cannot open queue");
+    while ((entry = readdir(dir)) != NULL)
+        if (entry->d_name[0] != '.')
+            count++;
+    closedir(dir);
+    return count;
+}
+
+
+/*
+ * Draw the changes to queue.  The user of each change is drawn so that
+ * low-numbered users have many changes and there are about two changes per
+ * user on average, one in ten changes is for an instance, and, if passwords
+ * is true, four in five changes are password changes.  Status changes for
+ * each user and instance alternate between disabling and enabling the
+ * account, starting with disabling it, so that applying any two of them out
+ * of order leaves the account with the wrong status.
+ */
+static void
+draw_entries(struct params *params, bool passwords)
+{
+    struct entry *entry;
+    unsigned char *disabled;
+    double fraction;
+    size_t i;
+
+    params->entries = bcalloc(params->count, sizeof(struct entry));
+    params->users = (unsigned long) (params->count / 2 + 1);
+    disabled = bcalloc(params->users * 2, 1);
+    seed = 1;
+    for (i = 0; i < params->count; i++) {
+        entry = &params->entries[i];
+        fraction = random_fraction();
+        entry->user = (unsigned long) (params->users * fraction * fraction
+                                       * fraction);
+        entry->instance = (random_fraction() < 0.1);
+        entry->password = (random_fraction() < 0.8) && passwords;
+        if (!entry->password) {
+            disabled[entry->user * 2 + entry->instance] ^= 1;
+            entry->enable = !disabled[entry->user * 2 + entry->instance];
+        }
+    }
+    free(disabled);
+}
+
+
+/*
+ * Fill the queue with the changes, as the plugin would have queued them.
+ * Each change is one second older than the next, ending a day ago, and its
+ * trace ID is its index so that the log shows which change was applied.
+ */
+static void
+fill_queue(const struct params *params)
+{
+    const struct entry *entry;
+    struct tm tm;
+    char timestamp[32];
+    char *path, *data, *operation;
+    time_t when;
+    size_t i;
+    int fd;
+
+    for (i = 0; i < params->count; i++) {
+        entry = &params->entries[i];
+        when = time(NULL) - 24 * 60 * 60 - (time_t) (params->count - i);
+        if (gmtime_r(&when, &tm) == NULL)
+            sysbail("cannot get broken-down time");
+        strftime(timestamp, sizeof(timestamp), "%Y%m%dT%H%M%SZ", &tm);
+        basprintf(&path, "queue/drain%lu%s-ad-%s-%s-00", entry->user,
+                  entry->instance ? ".root" : "",
+                  entry->password ? "password" : "enable", timestamp);
+        if (entry->password)
+            operation = bstrdup("password\ndrain-password");
+        else
+            operation = bstrdup(entry->enable ? "enable" : "disable");
+        basprintf(&data, "drain%lu%s\nad\n%s\ntrace %lu\norigin %lld.0\n",
+                  entry->user, entry->instance ? "/root" : "", operation,
+                  (unsigned long) i, (long long) when);
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            sysbail("cannot create %s", path);
+        if (write(fd, data, strlen(data)) < (ssize_t) strlen(data))
+            sysbail("cannot write to %s", path);
+        if (close(fd) < 0)
+            sysbail("cannot flush %s", path);
+        free(operation);
+        free(data);
+        free(path);
+    }
+}
+
+
+/*
+ * Start the LDAP stand-in with an enabled account for each user and its
+ * instance, and share it in a file so that krb5-sync-backend can use it.
+ */
+static void
+fill_directory(const struct params *params,
+               const struct directory_options *options)
+{
+    char *upn, *dn;
+    unsigned long i;
+
+    directory_start(options);
+    for (i = 0; i < params->users; i++) {
+        basprintf(&upn, "drain%lu@%s", i, params->realm);
+        basprintf(&dn, "CN=drain%lu,OU=Accounts,DC=ad,DC=example,DC=com", i);
+        directory_add(upn, dn, NORMAL);
+        free(upn);
+        free(dn);
+        basprintf(&upn, "drain%lu/root@%s", i, params->realm);
+        basprintf(&dn, "CN=drain%lu.root,OU=Accounts,DC=ad,DC=example,"
+                  "DC=com", i);
+        directory_add(upn, dn, NORMAL);
+        free(upn);
+        free(dn);
+    }
+    directory_share(params->directory);
+}
+
+
+/*
+ * Run krb5-sync-backend with the given command on the queue, discarding its
+ * output, and return its exit status.
+ */
+static int
+run_backend(const char *backend, const char *command)
+{
+    pid_t child;
+    int fd, status;
+
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        fd = open("/dev/null", O_RDWR);
+        if (fd < 0)
+            _exit(255);
+        if (dup2(fd, 0) < 0 || dup2(fd, 1) < 0 || dup2(fd, 2) < 0)
+            _exit(255);
+        execl(backend, backend, command, "-d", "queue", (char *) NULL);
+        _exit(255);
+    }
+    if (waitpid(child, &status, 0) < 0)
+        sysbail("cannot wait for krb5-sync-backend");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 255;
+}
+
+
+/*
+ * Copy krb5-sync-backend into the current directory, changing it to run the
+ * given program rather than krb5-sync.  Returns false if it can't be found or
+ * doesn't set the program where we expect.
+ */
+static bool
+copy_backend(const char *program)
+{
+    char *path, *data, *line, *copy;
+    struct stat st;
+    ssize_t status;
+    int fd;
+
+    path = test_file_path("../tools/krb5-sync-backend");
+    if (path == NULL)
+        return false;
+    fd = open(path, O_RDONLY);
+    test_file_path_free(path);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        return false;
+    data = bmalloc((size_t) st.st_size + 1);
+    status = read(fd, data, (size_t) st.st_size);
+    close(fd);
+    if (status != st.st_size) {
+        free(data);
+        return false;
+    }
+    data[st.st_size] = '\0';
+    line = strstr(data, SYNC_LINE);
+    if (line == NULL) {
+        free(data);
+        return false;
+    }
+    *line = '\0';
+    basprintf(&copy, "%smy $SYNC = '%s';%s", data, program,
+              line + strlen(SYNC_LINE));
+    free(data);
+    fd = open("krb5-sync-backend", O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd < 0)
+        sysbail("cannot create krb5-sync-backend");
+    if (write(fd, copy, strlen(copy)) < (ssize_t) strlen(copy))
+        sysbail("cannot write krb5-sync-backend");
+    if (close(fd) < 0)
+        sysbail("cannot flush krb5-sync-backend");
+    free(copy);
+    return true;
+}
+
+
+/*
+ * Drain the queue with krb5-sync -q, with the given ad_drain_concurrency.
+ * Returns the number of changes that failed.
+ */
+static unsigned long
+drain_native(unsigned long concurrency)
+{
+    krb5_context ctx;
+    kadm5_hook_modinfo *config;
+    krb5_error_code code;
+    unsigned long failed;
+
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail("cannot initialize Kerberos context");
+    code = sync_init(ctx, &config);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize plugin");
+    config->drain = true;
+    config->ad_drain_concurrency = (long) concurrency;
+    failed = drain_queue(config, ctx);
+    sync_close(ctx, config);
+    krb5_free_context(ctx);
+    return failed;
+}
+
+
+/*
+ * Read the log of applied changes, recording when each was applied relative
+ * to start in latencies, and check that each was applied once and in order
+ * within its group.
+ */
+static void
+check_log(const struct params *params, uint64_t start, uint64_t *latencies,
+          struct check *check)
+{
+    FILE *log;
+    char line[BUFSIZ];
+    unsigned long long when;
+    unsigned long index;
+    size_t group;
+    long *last;
+    char *trace;
+
+    last = bcalloc(params->users * 4, sizeof(long));
+    for (group = 0; group < params->users * 4; group++)
+        last[group] = -1;
+    log = fopen(params->log, "r");
+    if (log == NULL)
+        sysbail("cannot open %s", params->log);
+    while (fgets(line, sizeof(line), log) != NULL) {
+        trace = strstr(line, "(trace ");
+        if (sscanf(line, "%llu ", &when) != 1 || trace == NULL
+            || sscanf(trace, "(trace %lu)", &index) != 1
+            || index >= params->count) {
+            check->unparsed++;
+            continue;
+        }
+        check->applied++;
+        if (latencies[index] != BENCH_FAILED) {
+            check->duplicates++;
+            continue;
+        }
+        latencies[index] = (when > start) ? when - start : 0;
+        group = entry_group(&params->entries[index]);
+        if (last[group] > (long) index)
+            check->order++;
+        else
+            last[group] = (long) index;
+    }
+    fclose(log);
+    free(last);
+}
+
+
+/*
+ * Check that every account in the LDAP stand-in has the status of the last
+ * change queued for it.
+ */
+static void
+check_directory(const struct params *params, struct check *check)
+{
+    const struct entry *entry;
+    unsigned char *expected;
+    unsigned long i;
+    char *upn;
+    bool disabled;
+
+    expected = bcalloc(params->users * 2, 1);
+    for (i = 0; i < params->count; i++) {
+        entry = &params->entries[i];
+        if (!entry->password)
+            expected[entry->user * 2 + entry->instance] = !entry->enable;
+    }
+    for (i = 0; i < params->users * 2; i++) {
+        basprintf(&upn, "drain%lu%s@%s", i / 2, (i % 2) ? "/root" : "",
+                  params->realm);
+        disabled = (directory_control(upn) & DISABLED) != 0;
+        if (disabled != (expected[i] != 0))
+            check->status++;
+        free(upn);
+    }
+    free(expected);
+}
+
+
+/*
+ * Run one drain of a freshly filled queue and report the results.  Returns
+ * the number of problems found.
+ */
+static unsigned long
+run(const struct params *params, const struct directory_options *options,
+    const char *variant, unsigned long concurrency)
+{
+    struct directory_counts counts;
+    struct check check;
+    uint64_t *latencies, start, elapsed;
+    unsigned long failed, remaining;
+    char *label;
+
+    empty_queue();
+    fill_queue(params);
+    fill_directory(params, options);
+    if (truncate(params->log, 0) < 0)
+        sysbail("cannot truncate %s", params->log);
+
+    /* Drain the queue. */
+    start = bench_now();
+    if (strcmp(variant, "process") == 0)
+        failed = (run_backend(params->backend, "process") == 0) ? 0 : 1;
+    else
+        failed = drain_native(concurrency);
+    elapsed = bench_now() - start;
+
+    /* Report and check the results. */
+    memset(&check, 0, sizeof(check));
+    latencies = bench_latencies(params->count);
+    check_log(params, start, latencies, &check);
+    check_directory(params, &check);
+    remaining = queue_count();
+    basprintf(&label, "variant=%s concurrency=%lu latency_ms=%lu users=%lu",
+              variant, concurrency, options->latency, params->users);
+    bench_report("drain", label, latencies, params->count, elapsed);
+    directory_counts(&counts);
+    printf("# drain: failed=%lu remaining=%lu binds=%lu searches=%lu"
+           " modifies=%lu\n", failed, remaining, counts.binds,
+           counts.searches, counts.modifies);
+    printf("# check: applied=%lu duplicates=%lu out_of_order=%lu"
+           " wrong_status=%lu unparsed=%lu\n", check.applied,
+           check.duplicates, check.order, check.status, check.unparsed);
+    free(label);
+    bench_latencies_free(latencies, params->count);
+    directory_stop();
+    unlink(params->directory);
+    return failed + remaining + check.duplicates + check.order + check.status
+        + check.unparsed;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct params params;
+    struct directory_options dir_options;
+    struct kpasswd_options kpw_options;
+    struct kpasswd_server *server = NULL;
+    struct kerberos_config *krbconf = NULL;
+    char *tmpdir, *path, *keytab, *base, *krb5_config, *program, *variants;
+    char *variant, *env_log, *env_directory;
+    const char *const settings[] = { "ad_ccache", "FILE:ad-ccache", NULL };
+    const char *env;
+    unsigned long concurrency = 8, latency = 10, problems = 0;
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    int option;
+
+    /* If run by krb5-sync-backend process, apply a change. */
+    if (argc == 3 && strcmp(argv[1], "-f") == 0)
+        return apply_command(argv[2]);
+
+    /* Parse the command-line options. */
+    memset(&params, 0, sizeof(params));
+    params.count = 1000;
+    params.realm = AD_REALM;
+    variants = bstrdup(VARIANTS);
+    while ((option = getopt(argc, argv, "c:hl:n:v:")) != EOF) {
+        switch (option) {
+        case 'c': concurrency = strtoul(optarg, NULL, 10);      break;
+        case 'l': latency = strtoul(optarg, NULL, 10);          break;
+        case 'n': params.count = strtoul(optarg, NULL, 10);     break;
+
+        case 'v':
+            free(variants);
+            variants = bstrdup(optarg);
+            break;
+        case 'h':
+            printf("%s", usage_message);
+            exit(0);
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(1);
+        }
+    }
+    if (concurrency == 0 || params.count == 0) {
+        fprintf(stderr, "%s", usage_message);
+        exit(1);
+    }
+    program = realpath(argv[0], NULL);
+    if (program == NULL)
+        sysbail("cannot find path to %s", argv[0]);
+
+    /* Work in a temporary directory, with a queue. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+    memset(&dir_options, 0, sizeof(dir_options));
+    dir_options.latency = latency;
+    memset(&kpw_options, 0, sizeof(kpw_options));
+    kpw_options.latency = latency;
+    kpw_options.workers = (unsigned int) concurrency;
+
+    /*
+     * With a test realm, point the plugin at a kpasswd stand-in.  Otherwise,
+     * only status changes are queued, and the plugin uses a fake ticket in a
+     * shared cache for them.
+     */
+    path = test_file_path("config/keytab");
+    keytab = test_file_path("config/kpasswd-keytab");
+    if (path != NULL && keytab != NULL) {
+        krbconf = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+        params.realm = strchr(krbconf->principal, '@');
+        if (params.realm == NULL)
+            bail("test principal %s has no realm", krbconf->principal);
+        params.realm++;
+        test_file_path_free(path);
+        path = test_file_path("config/krb5.conf");
+        env = getenv("KRB5_CONFIG");
+        if (path != NULL)
+            base = bstrdup(path);
+        else if (env != NULL && env[0] != '\0')
+            base = bstrdup(env);
+        else
+            base = bstrdup("/etc/krb5.conf");
+        server = kpasswd_start(keytab, params.realm, &kpw_options);
+        krb5_config = kpasswd_config(server, tmpdir, krbconf->keytab,
+                                     krbconf->principal, base);
+        free(base);
+    } else {
+        printf("# skip password changes: test realm not configured\n");
+        test_file_path_free(path);
+        sync_make_config(tmpdir, settings);
+        basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+        if (putenv(krb5_config) < 0)
+            sysbail("cannot set KRB5_CONFIG in the environment");
+        code = krb5_init_context(&ctx);
+        if (code != 0)
+            bail_krb5(ctx, code, "cannot initialize Kerberos context");
+        code = krb5_parse_name(ctx, PRINCIPAL, &princ);
+        if (code != 0)
+            bail_krb5(ctx, code, "cannot parse principal %s", PRINCIPAL);
+        sync_ccache_store(ctx, "FILE:ad-ccache", princ, 60 * 60);
+        krb5_free_principal(ctx, princ);
+        krb5_free_context(ctx);
+    }
+    test_file_path_free(path);
+    test_file_path_free(keytab);
+
+    /*
+     * Tell copies of this program run by krb5-sync-backend where to find the
+     * log and the directory, and use a copy of krb5-sync-backend if it works.
+     */
+    basprintf(&env_log, "DRAIN_LOG=%s/log", tmpdir);
+    basprintf(&env_directory, "DRAIN_DIRECTORY=%s/directory", tmpdir);
+    if (putenv(env_log) < 0 || putenv(env_directory) < 0)
+        sysbail("cannot set environment variables");
+    params.log = strchr(env_log, '=') + 1;
+    params.directory = strchr(env_directory, '=') + 1;
+    if (copy_backend(program)
+        && run_backend("./krb5-sync-backend", "list") == 0)
+        params.backend = "./krb5-sync-backend";
+    else
+        printf("# skip process: krb5-sync-backend does not run\n");
+    log_start(params.log);
+
+    /* Run each of the drains on the same queue. */
+    draw_entries(&params, server != NULL);
+    for (variant = strtok(variants, ","); variant != NULL;
+         variant = strtok(NULL, ",")) {
+        if (strcmp(variant, "process") == 0) {
+            if (params.backend != NULL)
+                problems += run(&params, &dir_options, variant, 1);
+        } else if (strcmp(variant, "serial") == 0)
+            problems += run(&params, &dir_options, variant, 1);
+        else if (strcmp(variant, "parallel") == 0)
+            problems += run(&params, &dir_options, variant, concurrency);
+        else
+            bail("unknown drain %s", variant);
+    }
+
+    /* Clean up. */
+    empty_queue();
+    free(params.entries);
+    free(variants);
+    free(program);
+    close(log_fd);
+    if (server != NULL)
+        kpasswd_stop(server);
+    putenv((char *) "KRB5_CONFIG=");
+    putenv((char *) "DRAIN_LOG=");
+    putenv((char *) "DRAIN_DIRECTORY=");
+    free(krb5_config);
+    free(env_log);
+    free(env_directory);
+    rmdir("queue");
+    unlink("log");
+    unlink("krb5-sync-backend");
+    unlink("ad-ccache");
+    unlink("krb5.conf");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    if (krbconf != NULL)
+        kerberos_cleanup();
+    return (problems > 0) ? 1 : 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * Benchmark for pushing password changes to Active Directory.
+ *
+ * Runs the kpasswd stand-in from the test suite and pushes password changes
+ * to it from several processes at once, either directly with sync_ad_chpass
+ * or through sync_push, which is what kadmind calls and which also checks
+ * the queue for conflicts.  Reports the throughput and the median and 99th
+ * percentile latency.
+ *
+ * This needs the same test realm as the kpasswd test: config/keytab and
+ * config/principal for the principal that pushes changes, and
+ * config/kpasswd-keytab with the keys for kadmin/changepw.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/bench/bench.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/kpasswd.h>
+#include <tests/tap/string.h>
+
+/* The account whose password we change and its new password. */
+#define USER     "kpasswd-bench"
+#define PASSWORD "kpasswd-bench-password"
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: kpasswd [-hpu] [-c <clients>] [-l <latency>] [-n <count>]\n\
+               [-w <workers>]\n\
+\n\
+  -c <clients>  Number of client processes (default: 4)\n\
+  -h            Show this help\n\
+  -l <latency>  Milliseconds the server waits before replying (default: 0)\n\
+  -n <count>    Number of password changes (default: 1000)\n\
+  -p            Push changes with sync_push rather than sync_ad_chpass\n\
+  -u            Only listen on UDP so that clients use it\n\
+  -w <workers>  Number of server processes (default: same as clients)\n";
+
+/* The benchmark parameters, shared by all the clients. */
+struct params {
+    const char *principal;
+    bool push;
+};
+
+/* The state of one client process. */
+struct client {
+    krb5_context ctx;
+    kadm5_hook_modinfo *config;
+    struct sync_target *ad;
+    krb5_principal princ;
+    bool push;
+};
+
+
+/*
+ * Set up a client process with its own Kerberos context and plugin.  Returns
+ * NULL on failure.
+ */
+static void *
+client_setup(void *data)
+{
+    struct params *params = data;
+    struct client *client;
+    krb5_error_code code;
+
+    client = bcalloc(1, sizeof(struct client));
+    client->push = params->push;
+    code = krb5_init_context(&client->ctx);
+    if (code != 0) {
+        diag("cannot initialize Kerberos context");
+        return NULL;
+    }
+    code = sync_init(client->ctx, &client->config);
+    if (code != 0) {
+        diag_krb5(client->ctx, code, "cannot initialize plugin");
+        return NULL;
+    }
+    client->ad = sync_target_find(client->config, "ad");
+    if (client->ad == NULL) {
+        diag("cannot find ad target");
+        return NULL;
+    }
+    code = krb5_parse_name(client->ctx, params->principal, &client->princ);
+    if (code != 0) {
+        diag_krb5(client->ctx, code, "cannot parse %s", params->principal);
+        return NULL;
+    }
+    return client;
+}
+
+
+/*
+ * Push one password change.
+ */
+static bool
+client_op(void *state, size_t index UNUSED)
+{
+    struct client *client = state;
+    struct sync_op op;
+    krb5_error_code code;
+
+    code = sync_op_init(&op, client->ctx, client->princ);
+    if (code == 0) {
+        if (client->push)
+            code = sync_push(client->config, &op, PASSWORD, true);
+        else
+            code = sync_ad_chpass(client->config, client->ad, &op, PASSWORD);
+    }
+    sync_op_free(&op);
+    return code == 0;
+}
+
+
+/*
+ * Free a client process's resources.
+ */
+static void
+client_cleanup(void *state)
+{
+    struct client *client = state;
+
+    krb5_free_principal(client->ctx, client->princ);
+    sync_close(client->ctx, client->config);
+    krb5_free_context(client->ctx);
+    free(client);
+}
+
+
+/*
+ * Remove the queue directory along with any changes that were queued because
+ * they failed.
+ */
+static void
+remove_queue(void)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char *path;
+
+    dir = opendir("queue");
+    if (dir == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0
+            || strcmp(entry->d_name, "..") == 0)
+            continue;
+        basprintf(&path, "queue/%s", entry->d_name);
+        unlink(path);
+        free(path);
+    }
+    closedir(dir);
+    rmdir("queue");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct bench_ops ops = {
+        client_setup, client_op, client_cleanup, 0, NULL
+    };
+    struct kerberos_config *krbconf;
+    struct kpasswd_options options;
+    struct kpasswd_server *server;
+    struct kpasswd_counts counts;
+    struct params params;
+    char *keytab, *tmpdir, *base, *krb5_config, *principal, *path, *label;
+    const char *env, *realm;
+    unsigned long clients = 4, count = 1000, workers = 0;
+    uint64_t *latencies, elapsed;
+    int option;
+
+    /* Parse the command-line options. */
+    memset(&options, 0, sizeof(options));
+    memset(&params, 0, sizeof(params));
+    while ((option = getopt(argc, argv, "c:hl:n:puw:")) != EOF) {
+        switch (option) {
+        case 'c': clients = strtoul(optarg, NULL, 10);          break;
+        case 'l': options.latency = strtoul(optarg, NULL, 10);  break;
+        case 'n': count = strtoul(optarg, NULL, 10);            break;
+        case 'p': params.push = true;                           break;
+        case 'u': options.udp_only = true;                      break;
+        case 'w': workers = strtoul(optarg, NULL, 10);          break;
+
+        case 'h':
+            printf("%s", usage_message);
+            exit(0);
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(1);
+        }
+    }
+    if (clients == 0 || count == 0) {
+        fprintf(stderr, "%s", usage_message);
+        exit(1);
+    }
+    options.workers = (unsigned int) ((workers == 0) ? clients : workers);
+
+    /* Skip the benchmark unless a test realm is configured. */
+    path = test_file_path("config/keytab");
+    keytab = test_file_path("config/kpasswd-keytab");
+    if (path == NULL || keytab == NULL) {
+        printf("# skip kpasswd: test realm not configured\n");
+        exit(0);
+    }
+    test_file_path_free(path);
+    krbconf = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    realm = strchr(krbconf->principal, '@');
+    if (realm == NULL)
+        bail("test principal %s has no realm", krbconf->principal);
+    realm++;
+
+    /* The krb5.conf file that knows about the test realm. */
+    path = test_file_path("config/krb5.conf");
+    env = getenv("KRB5_CONFIG");
+    if (path != NULL)
+        base = bstrdup(path);
+    else if (env != NULL && env[0] != '\0')
+        base = bstrdup(env);
+    else
+        base = bstrdup("/etc/krb5.conf");
+    test_file_path_free(path);
+
+    /* Work in a temporary directory, with a queue for sync_push. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Start the server and point the plugin at it. */
+    server = kpasswd_start(keytab, realm, &options);
+    krb5_config = kpasswd_config(server, tmpdir, krbconf->keytab,
+                                 krbconf->principal, base);
+
+    /* Run the benchmark. */
+    basprintf(&principal, "%s@%s", USER, realm);
+    params.principal = principal;
+    latencies = bench_latencies(count);
+    elapsed = bench_fork(&ops, &params, (unsigned int) clients, count,
+                         latencies);
+    kpasswd_counts(server, &counts);
+    basprintf(&label, "clients=%lu workers=%u latency_ms=%lu transport=%s",
+              clients, options.workers, options.latency,
+              options.udp_only ? "udp" : "default");
+    bench_report(params.push ? "kpasswd-push" : "kpasswd-chpass", label,
+                 latencies, count, elapsed);
+    printf("# server: requests=%lu udp=%lu tcp=%lu rejected=%lu\n",
+           counts.requests, counts.udp, counts.tcp, counts.rejected);
+
+    /* Clean up. */
+    free(label);
+    bench_latencies_free(latencies, count);
+    free(principal);
+    kpasswd_stop(server);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    free(base);
+    remove_queue();
+    unlink("krb5.conf");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(keytab);
+    kerberos_cleanup();
+    return 0;
+}
@@ -0,0 +1,290 @@
+/*
+ * Benchmark for pushing account status changes to Active Directory.
+ *
+ * Links in the LDAP stand-in from the test library in place of the real LDAP
+ * library and changes the status of accounts in it from several processes at
+ * once, either directly with sync_ad_status or with sync_status, which is
+ * what kadmind calls and which also checks the queue for conflicts.  Reports
+ * the throughput, the median and 99th percentile latency, and the number of
+ * LDAP round trips per change.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <ldap.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/bench/bench.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/directory.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* The principal for which we store tickets, from data/krb5.conf. */
+#define PRINCIPAL "service/krb5-sync@EXAMPLE.COM"
+
+/* userAccountControl for a normal account. */
+#define NORMAL 0x200
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: ldap [-hp] [-c <clients>] [-e <every>] [-l <latency>] [-n <count>]\n\
+            [-u <users>]\n\
+\n\
+  -c <clients>  Number of client processes (default: 4)\n\
+  -e <every>    Make every <every>th modify fail as busy (default: never)\n\
+  -h            Show this help\n\
+  -l <latency>  Milliseconds each LDAP round trip takes (default: 0)\n\
+  -n <count>    Number of status changes (default: 1000)\n\
+  -p            Push changes with sync_status rather than sync_ad_status\n\
+  -u <users>    Number of accounts to change (default: 100)\n";
+
+/* The benchmark parameters, shared by all the clients. */
+struct params {
+    unsigned long users;
+    bool push;
+};
+
+/* The state of one client process. */
+struct client {
+    krb5_context ctx;
+    kadm5_hook_modinfo *config;
+    struct sync_target *ad;
+    krb5_principal *princs;
+    unsigned long users;
+    bool push;
+};
+
+
+/*
+ * Set up a client process with its own Kerberos context and plugin, and parse
+ * the principals of all the users.  Returns NULL on failure.
+ */
+static void *
+client_setup(void *data)
+{
+    struct params *params = data;
+    struct client *client;
+    krb5_error_code code;
+    char *name;
+    unsigned long i;
+
+    client = bcalloc(1, sizeof(struct client));
+    client->push = params->push;
+    client->users = params->users;
+    code = krb5_init_context(&client->ctx);
+    if (code != 0) {
+        diag("cannot initialize Kerberos context");
+        return NULL;
+    }
+    code = sync_init(client->ctx, &client->config);
+    if (code != 0) {
+        diag_krb5(client->ctx, code, "cannot initialize plugin");
+        return NULL;
+    }
+    client->ad = sync_target_find(client->config, "ad");
+    if (client->ad == NULL) {
+        diag("cannot find ad target");
+        return NULL;
+    }
+    client->princs = bcalloc(params->users, sizeof(krb5_principal));
+    for (i = 0; i < params->users; i++) {
+        basprintf(&name, "bench%lu@EXAMPLE.COM", i);
+        code = krb5_parse_name(client->ctx, name, &client->princs[i]);
+        if (code != 0) {
+            diag_krb5(client->ctx, code, "cannot parse %s", name);
+            free(name);
+            return NULL;
+        }
+        free(name);
+    }
+    return client;
+}
+
+
+/*
+ * Change the status of one account.  Each pass over the accounts disables
+ * them if the previous pass enabled them and vice versa.
+ */
+static bool
+client_op(void *state, size_t index)
+{
+    struct client *client = state;
+    struct sync_op op;
+    krb5_principal princ;
+    krb5_error_code code;
+    bool enabled;
+
+    princ = client->princs[index % client->users];
+    enabled = ((index / client->users) % 2 == 1);
+    if (client->push)
+        return sync_status(client->config, client->ctx, princ, enabled) == 0;
+    code = sync_op_init(&op, client->ctx, princ);
+    if (code == 0)
+        code = sync_ad_status(client->config, client->ad, &op, enabled);
+    sync_op_free(&op);
+    return code == 0;
+}
+
+
+/*
+ * Free a client process's resources.
+ */
+static void
+client_cleanup(void *state)
+{
+    struct client *client = state;
+    unsigned long i;
+
+    for (i = 0; i < client->users; i++)
+        krb5_free_principal(client->ctx, client->princs[i]);
+    free(client->princs);
+    sync_close(client->ctx, client->config);
+    krb5_free_context(client->ctx);
+    free(client);
+}
+
+
+/*
+ * Remove the queue directory along with any changes that were queued because
+ * they failed.
+ */
+static void
+remove_queue(void)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char *path;
+
+    dir = opendir("queue");
+    if (dir == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0
+            || strcmp(entry->d_name, "..") == 0)
+            continue;
+        basprintf(&path, "queue/%s", entry->d_name);
+        unlink(path);
+        free(path);
+    }
+    closedir(dir);
+    rmdir("queue");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct bench_ops ops = {
+        client_setup, client_op, client_cleanup, 0, NULL
+    };
+    struct directory_options options;
+    struct directory_counts counts;
+    struct params params;
+    char *tmpdir, *krb5_config, *upn, *dn, *label;
+    const char *const settings[] = { "ad_ccache", "FILE:ad-ccache", NULL };
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    unsigned long clients = 4, count = 1000, i, trips;
+    uint64_t *latencies, elapsed;
+    int option;
+
+    /* Parse the command-line options. */
+    memset(&options, 0, sizeof(options));
+    memset(&params, 0, sizeof(params));
+    params.users = 100;
+    while ((option = getopt(argc, argv, "c:e:hl:n:pu:")) != EOF) {
+        switch (option) {
+        case 'c': clients = strtoul(optarg, NULL, 10);              break;
+        case 'e': options.error_every = strtoul(optarg, NULL, 10);  break;
+        case 'l': options.latency = strtoul(optarg, NULL, 10);      break;
+        case 'n': count = strtoul(optarg, NULL, 10);                break;
+        case 'p': params.push = true;                               break;
+        case 'u': params.users = strtoul(optarg, NULL, 10);         break;
+
+        case 'h':
+            printf("%s", usage_message);
+            exit(0);
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(1);
+        }
+    }
+    if (clients == 0 || count == 0 || params.users == 0) {
+        fprintf(stderr, "%s", usage_message);
+        exit(1);
+    }
+    options.error_ops = DIRECTORY_MODIFY;
+    options.error_code = LDAP_BUSY;
+
+    /* Work in a temporary directory, with a queue for sync_status. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with a shared credential cache. */
+    sync_make_config(tmpdir, settings);
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+
+    /* Store tickets for the plugin and fill the directory. */
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    code = krb5_parse_name(ctx, PRINCIPAL, &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal %s", PRINCIPAL);
+    sync_ccache_store(ctx, "FILE:ad-ccache", princ, 60 * 60);
+    krb5_free_principal(ctx, princ);
+    krb5_free_context(ctx);
+    directory_start(&options);
+    for (i = 0; i < params.users; i++) {
+        basprintf(&upn, "bench%lu@AD.EXAMPLE.COM", i);
+        basprintf(&dn, "CN=bench%lu,OU=Accounts,DC=ad,DC=example,DC=com", i);
+        directory_add(upn, dn, NORMAL);
+        free(upn);
+        free(dn);
+    }
+
+    /* Run the benchmark. */
+    latencies = bench_latencies(count);
+    elapsed = bench_fork(&ops, &params, (unsigned int) clients, count,
+                         latencies);
+    directory_counts(&counts);
+    basprintf(&label, "clients=%lu latency_ms=%lu users=%lu error_every=%lu",
+              clients, options.latency, params.users, options.error_every);
+    bench_report(params.push ? "ldap-push" : "ldap-status", label, latencies,
+                 count, elapsed);
+    trips = counts.binds + counts.searches + counts.modifies;
+    printf("# directory: binds=%lu searches=%lu modifies=%lu errors=%lu"
+           " round_trips=%.2f\n", counts.binds, counts.searches,
+           counts.modifies, counts.errors, (double) trips / (double) count);
+
+    /* Clean up. */
+    free(label);
+    bench_latencies_free(latencies, count);
+    directory_stop();
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    remove_queue();
+    unlink("ad-ccache");
+    unlink("krb5.conf");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,421 @@
+/*
+ * Allocation and leak accounting for the plugin in a long-running kadmind.
+ *
+ * Links in the LDAP stand-in and the allocation counting from the test
+ * library and makes the same change over and over in one process, the way
+ * kadmind calls the plugin for months, for each of several kinds of change:
+ * status changes that succeed, that fail because Active Directory is busy or
+ * down, and that fail because the account doesn't exist, and, if a test
+ * realm is configured, password changes against the kpasswd stand-in with
+ * every other one rejected.  After warming up, it counts the allocations,
+ * open descriptors and sockets, and LDAP handles, results, DNs, and values
+ * before and after the changes and reports, for each kind of change, the
+ * allocations made per change and any net growth.  Any growth is a leak and
+ * makes the benchmark fail.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <ldap.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/bench/bench.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/directory.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/kpasswd.h>
+#include <tests/tap/leak.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* The principal for which we store tickets without a test realm. */
+#define PRINCIPAL "service/krb5-sync@EXAMPLE.COM"
+
+/* The Active Directory realm without a test realm, from data/krb5.conf. */
+#define AD_REALM "AD.EXAMPLE.COM"
+
+/* userAccountControl for a normal account. */
+#define NORMAL 0x200
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: leak [-h] [-n <count>] [-u <users>] [-w <warmup>]\n\
+\n\
+  -h            Show this help\n\
+  -n <count>    Number of changes of each kind (default: 1000000)\n\
+  -u <users>    Number of accounts to change (default: 100)\n\
+  -w <warmup>   Changes of each kind before counting (default: 1000)\n";
+
+/* The kinds of change, each run and reported separately. */
+enum kind {
+    KIND_STATUS,
+    KIND_BUSY,
+    KIND_DOWN,
+    KIND_MISSING,
+    KIND_CHPASS,
+    KIND_MAX
+};
+static const char *const kinds[KIND_MAX] = {
+    "status", "status-busy", "status-down", "status-missing", "chpass"
+};
+
+/* The plugin state for a run of one kind of change. */
+struct run {
+    enum kind kind;
+    krb5_context ctx;
+    kadm5_hook_modinfo *config;
+    krb5_principal *princs;
+    krb5_principal missing;
+    unsigned long users;
+};
+
+
+/*
+ * Remove any changes that were queued because they failed, so that the next
+ * change for the same user is tried again rather than queued behind them.
+ */
+static void
+clear_queue(bool remove)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char *path;
+
+    dir = opendir("queue");
+    if (dir == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0
+            || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (!remove && strcmp(entry->d_name, ".lock") == 0)
+            continue;
+        basprintf(&path, "queue/%s", entry->d_name);
+        unlink(path);
+        free(path);
+    }
+    closedir(dir);
+    if (remove)
+        rmdir("queue");
+}
+
+
+/*
+ * Set up the plugin for a run with a new Kerberos context, and parse the
+ * principals of all the users.
+ */
+static void
+run_init(struct run *run, enum kind kind, unsigned long users)
+{
+    krb5_error_code code;
+    char *name;
+    unsigned long i;
+
+    memset(run, 0, sizeof(*run));
+    run->kind = kind;
+    run->users = users;
+    code = krb5_init_context(&run->ctx);
+    if (code != 0)
+        bail("cannot initialize Kerberos context");
+    code = sync_init(run->ctx, &run->config);
+    if (code != 0)
+        bail_krb5(run->ctx, code, "cannot initialize plugin");
+    run->princs = bcalloc(users, sizeof(krb5_principal));
+    for (i = 0; i < users; i++) {
+        basprintf(&name, "leak%lu", i);
+        code = krb5_parse_name(run->ctx, name, &run->princs[i]);
+        if (code != 0)
+            bail_krb5(run->ctx, code, "cannot parse %s", name);
+        free(name);
+    }
+    code = krb5_parse_name(run->ctx, "missing", &run->missing);
+    if (code != 0)
+        bail_krb5(run->ctx, code, "cannot parse missing");
+}
+
+
+/*
+ * Make one change of the kind for the run.  Each pass over the accounts
+ * disables them if the previous pass enabled them and vice versa.  Returns
+ * true if the plugin reported success, which includes queuing the change.
+ */
+static bool
+run_op(struct run *run, size_t index)
+{
+    krb5_principal princ;
+    krb5_error_code code;
+    bool enabled;
+    char password[32];
+
+    princ = run->princs[index % run->users];
+    enabled = ((index / run->users) % 2 == 1);
+    switch (run->kind) {
+    case KIND_STATUS:
+    case KIND_BUSY:
+    case KIND_DOWN:
+        code = sync_status(run->config, run->ctx, princ, enabled);
+        break;
+    case KIND_MISSING:
+        code = sync_status(run->config, run->ctx, run->missing, enabled);
+        break;
+    case KIND_CHPASS:
+        snprintf(password, sizeof(password), "leak%lu",
+                 (unsigned long) index);
+        code = sync_chpass(run->config, run->ctx, princ, password);
+        break;
+    case KIND_MAX:
+    default:
+        bail("unknown kind of change %d", (int) run->kind);
+    }
+    if (run->kind != KIND_STATUS)
+        clear_queue(false);
+    return code == 0;
+}
+
+
+/*
+ * Free the resources for a run.
+ */
+static void
+run_free(struct run *run)
+{
+    unsigned long i;
+
+    for (i = 0; i < run->users; i++)
+        krb5_free_principal(run->ctx, run->princs[i]);
+    free(run->princs);
+    krb5_free_principal(run->ctx, run->missing);
+    sync_close(run->ctx, run->config);
+    krb5_free_context(run->ctx);
+}
+
+
+/*
+ * Make warmup and then count changes of the given kind with the plugin
+ * configured by the current krb5.conf, report the allocations per change and
+ * any growth, and return true if nothing grew.
+ */
+static bool
+measure(enum kind kind, unsigned long users, unsigned long warmup,
+        unsigned long count, uint64_t *latencies)
+{
+    struct run run;
+    struct leak_counts before, after;
+    struct directory_counts dir_before, dir_after;
+    uint64_t start, op_start, elapsed;
+    unsigned long i;
+    long blocks, bytes, fds, sockets;
+    long handles, messages, dns, values;
+    bool counted;
+    char *label;
+
+    run_init(&run, kind, users);
+    for (i = 0; i < warmup; i++)
+        run_op(&run, i);
+    directory_counts(&dir_before);
+    counted = leak_counts(&before);
+    start = bench_now();
+    for (i = 0; i < count; i++) {
+        op_start = bench_now();
+        if (run_op(&run, warmup + i))
+            latencies[i] = bench_now() - op_start;
+        else
+            latencies[i] = BENCH_FAILED;
+    }
+    elapsed = bench_now() - start;
+    leak_counts(&after);
+    directory_counts(&dir_after);
+    run_free(&run);
+
+    /* Report the results. */
+    basprintf(&label, "users=%lu warmup=%lu", users, warmup);
+    bench_report(kinds[kind], label, latencies, count, elapsed);
+    free(label);
+    blocks = after.blocks - before.blocks;
+    bytes = after.bytes - before.bytes;
+    fds = after.fds - before.fds;
+    sockets = after.sockets - before.sockets;
+    handles = dir_after.handles - dir_before.handles;
+    messages = dir_after.messages - dir_before.messages;
+    dns = dir_after.dns - dir_before.dns;
+    values = dir_after.values - dir_before.values;
+    if (counted)
+        printf("# profile: allocs_per_op=%.2f frees_per_op=%.2f\n",
+               (double) (after.allocs - before.allocs) / (double) count,
+               (double) (after.frees - before.frees) / (double) count);
+    else
+        printf("# profile: allocations not counted on this platform\n");
+    printf("# growth: blocks=%ld bytes=%ld fds=%ld sockets=%ld"
+           " ldap_handles=%ld ldap_messages=%ld ldap_dns=%ld"
+           " ldap_values=%ld\n", blocks, bytes, fds, sockets, handles,
+           messages, dns, values);
+    return blocks <= 0 && fds <= 0 && sockets <= 0 && handles <= 0
+        && messages <= 0 && dns <= 0 && values <= 0;
+}
+
+
+/*
+ * Restart the directory with errors of the given kind, or none, and fill it
+ * with the accounts.
+ */
+static void
+restart_directory(const char *realm, unsigned long users, unsigned int ops,
+                  int error)
+{
+    struct directory_options options;
+    char *upn, *dn;
+    unsigned long i;
+
+    memset(&options, 0, sizeof(options));
+    if (ops != 0) {
+        options.error_every = (ops == DIRECTORY_BIND) ? 1 : 2;
+        options.error_ops = ops;
+        options.error_code = error;
+    }
+    directory_stop();
+    directory_start(&options);
+    for (i = 0; i < users; i++) {
+        basprintf(&upn, "leak%lu@%s", i, realm);
+        basprintf(&dn, "CN=leak%lu,OU=Accounts,DC=ad,DC=example,DC=com", i);
+        directory_add(upn, dn, NORMAL);
+        free(upn);
+        free(dn);
+    }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct kerberos_config *krbconf = NULL;
+    struct kpasswd_server *server = NULL;
+    struct kpasswd_options kpw_options;
+    char *tmpdir, *path, *keytab, *base, *krb5_config;
+    const char *const settings[] = { "ad_ccache", "FILE:ad-ccache", NULL };
+    const char *env, *realm = AD_REALM;
+    unsigned long count = 1000000, users = 100, warmup = 1000;
+    uint64_t *latencies;
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    bool okay = true;
+    int option;
+
+    /* Parse the command-line options. */
+    while ((option = getopt(argc, argv, "hn:u:w:")) != EOF) {
+        switch (option) {
+        case 'n': count = strtoul(optarg, NULL, 10);    break;
+        case 'u': users = strtoul(optarg, NULL, 10);    break;
+        case 'w': warmup = strtoul(optarg, NULL, 10);   break;
+
+        case 'h':
+            printf("%s", usage_message);
+            exit(0);
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(1);
+        }
+    }
+    if (count == 0 || users == 0) {
+        fprintf(stderr, "%s", usage_message);
+        exit(1);
+    }
+
+    /* Work in a temporary directory, with a queue. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /*
+     * With a test realm, point the plugin at a kpasswd stand-in that rejects
+     * every other change.  Otherwise, the plugin can only make status
+     * changes, using a fake ticket in a shared cache.
+     */
+    path = test_file_path("config/keytab");
+    keytab = test_file_path("config/kpasswd-keytab");
+    if (path != NULL && keytab != NULL) {
+        krbconf = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+        realm = strchr(krbconf->principal, '@');
+        if (realm == NULL)
+            bail("test principal %s has no realm", krbconf->principal);
+        realm++;
+        test_file_path_free(path);
+        path = test_file_path("config/krb5.conf");
+        env = getenv("KRB5_CONFIG");
+        if (path != NULL)
+            base = bstrdup(path);
+        else if (env != NULL && env[0] != '\0')
+            base = bstrdup(env);
+        else
+            base = bstrdup("/etc/krb5.conf");
+        memset(&kpw_options, 0, sizeof(kpw_options));
+        kpw_options.workers = 1;
+        kpw_options.error_every = 2;
+        kpw_options.error_code = KRB5_KPASSWD_SOFTERROR;
+        server = kpasswd_start(keytab, realm, &kpw_options);
+        krb5_config = kpasswd_config(server, tmpdir, krbconf->keytab,
+                                     krbconf->principal, base);
+        free(base);
+    } else {
+        printf("# skip chpass: test realm not configured\n");
+        test_file_path_free(path);
+        sync_make_config(tmpdir, settings);
+        basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+        if (putenv(krb5_config) < 0)
+            sysbail("cannot set KRB5_CONFIG in the environment");
+        code = krb5_init_context(&ctx);
+        if (code != 0)
+            bail_krb5(ctx, code, "cannot initialize Kerberos context");
+        code = krb5_parse_name(ctx, PRINCIPAL, &princ);
+        if (code != 0)
+            bail_krb5(ctx, code, "cannot parse principal %s", PRINCIPAL);
+        sync_ccache_store(ctx, "FILE:ad-ccache", princ, 60 * 60);
+        krb5_free_principal(ctx, princ);
+        krb5_free_context(ctx);
+    }
+    test_file_path_free(path);
+    test_file_path_free(keytab);
+
+    /* Measure each kind of change against a directory set up for it. */
+    latencies = bench_latencies(count);
+    restart_directory(realm, users, 0, LDAP_SUCCESS);
+    okay = measure(KIND_STATUS, users, warmup, count, latencies) && okay;
+    restart_directory(realm, users, DIRECTORY_MODIFY, LDAP_BUSY);
+    okay = measure(KIND_BUSY, users, warmup, count, latencies) && okay;
+    restart_directory(realm, users, DIRECTORY_BIND, LDAP_SERVER_DOWN);
+    okay = measure(KIND_DOWN, users, warmup, count, latencies) && okay;
+    restart_directory(realm, users, 0, LDAP_SUCCESS);
+    okay = measure(KIND_MISSING, users, warmup, count, latencies) && okay;
+    if (server != NULL)
+        okay = measure(KIND_CHPASS, users, warmup, count, latencies) && okay;
+
+    /* Clean up. */
+    bench_latencies_free(latencies, count);
+    directory_stop();
+    if (server != NULL)
+        kpasswd_stop(server);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    clear_queue(true);
+    unlink("ad-ccache");
+    unlink("krb5.conf");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    if (krbconf != NULL)
+        kerberos_cleanup();
+    if (!okay)
+        printf("# leak: FAILED\n");
+    return okay ? 0 : 1;
+}
@@ -0,0 +1,820 @@
+/*
+ * Load generator for the kadmind hook entry points of the plugin.
+ *
+ * Loads the built plugin with dlopen and drives it through the same vtable
+ * that kadmind uses, the MIT kadm5_hook_sync_initvt interface or the Heimdal
+ * kadm5_hook_v0 table, from several processes that each stand in for a
+ * kadmind.  Each change calls the hook for both the precommit and
+ * postcommit stages, as kadmind does.  Password changes and principal
+ * creations go to the kpasswd stand-in, if a test realm is configured, and
+ * status changes from principal modifications go to the LDAP stand-in,
+ * which is linked into this program and replaces the LDAP library for the
+ * plugin as well.
+ *
+ * The stand-ins can be healthy, slow, partly failing, or down, and changes
+ * that fail are queued by the plugin as usual.  Reports the latency that the
+ * plugin adds to each change, the number of changes queued and how fast the
+ * queue grew, and the requests that the stand-ins saw.
+ *
+ * Rather than a synthetic mix of changes, it can also replay a file written
+ * by the plugin with capture_file set, starting each change at the same
+ * offset from the start of the capture or a fraction of it.  Each user in the
+ * capture is given an account in the directory, and principals are given an
+ * instance that the plugin synchronizes or one that it skips to match what
+ * happened to the captured change.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/kadmin.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <ldap.h>
+#include <sys/stat.h>
+#ifdef HAVE_KRB5_KADM5_HOOK_PLUGIN_H
+# include <krb5/kadm5_hook_plugin.h>
+#endif
+
+#include <plugin/internal.h>
+#include <tests/bench/bench.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/directory.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/kpasswd.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* The principal for which we store tickets without a test realm. */
+#define PRINCIPAL "service/krb5-sync@EXAMPLE.COM"
+
+/* The Active Directory realm without a test realm, from data/krb5.conf. */
+#define AD_REALM "AD.EXAMPLE.COM"
+
+/* userAccountControl for a normal account. */
+#define NORMAL 0x200
+
+/*
+ * Instances, listed in ad_instances in data/krb5.conf or not, given to the
+ * principals of replayed changes to instances and of skipped changes.
+ */
+#define INSTANCE_SYNCED  "root"
+#define INSTANCE_SKIPPED "skip"
+
+/*
+ * The Heimdal hook table, duplicated from the module like the Heimdal module
+ * test does, with the names changed so that it doesn't conflict with the MIT
+ * header.
+ */
+enum heimdal_stage {
+    HEIMDAL_STAGE_PRECOMMIT  = 0,
+    HEIMDAL_STAGE_POSTCOMMIT = 1
+};
+struct heimdal_hook {
+    const char *name;
+    int version;
+    const char *vendor;
+
+    krb5_error_code (*init)(krb5_context, void **);
+    void (*fini)(krb5_context, void *);
+
+    krb5_error_code (*chpass)(krb5_context, void *, enum heimdal_stage,
+                              krb5_principal, const char *);
+    krb5_error_code (*create)(krb5_context, void *, enum heimdal_stage,
+                              kadm5_principal_ent_t, uint32_t mask,
+                              const char *password);
+    krb5_error_code (*modify)(krb5_context, void *, enum heimdal_stage,
+                              kadm5_principal_ent_t, uint32_t mask);
+};
+
+/* The kinds of changes that kadmind makes. */
+enum change {
+    CHANGE_CHPASS,
+    CHANGE_CREATE,
+    CHANGE_MODIFY
+};
+
+/* The failure scenarios for the stand-ins. */
+enum scenario {
+    SCENARIO_HEALTHY,           /* Everything works */
+    SCENARIO_SLOW,              /* Every request waits for latency */
+    SCENARIO_PARTIAL,           /* Every every'th request fails */
+    SCENARIO_DOWN               /* Nothing answers */
+};
+static const char *const scenarios[] = {
+    "healthy", "slow", "partial", "down", NULL
+};
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: load [-hH] [-c <clients>] [-e <every>] [-l <latency>] [-m <mix>]\n\
+            [-n <count>] [-r <rate>] [-s <scenario>] [-u <users>]\n\
+            [-t <capture> [-x <speed>]]\n\
+\n\
+  -c <clients>   Number of kadmind processes (default: 4)\n\
+  -e <every>     Every <every>th request fails if partial (default: 3)\n\
+  -h             Show this help\n\
+  -H             Use the Heimdal hook table even if MIT is available\n\
+  -l <latency>   Milliseconds each request takes if slow (default: 100)\n\
+  -m <mix>       Weights of chpass:create:modify (default: 60:10:30)\n\
+  -n <count>     Number of changes (default: 1000)\n\
+  -r <rate>      Changes per second, or 0 for no limit (default: 0)\n\
+  -s <scenario>  healthy, slow, partial, or down (default: healthy)\n\
+  -t <capture>   Replay the changes in a capture file instead of the mix\n\
+  -u <users>     Number of accounts to change (default: 100)\n\
+  -x <speed>     How many times faster than captured to replay (default: 1)\n";
+
+/*
+ * The benchmark parameters, shared by all the clients.  If a capture is being
+ * replayed, records holds its records sorted by time, and users holds the
+ * index of the user of each.
+ */
+struct params {
+    const char *plugin;
+    bool heimdal;
+    unsigned long users;
+    unsigned long mix[3];
+    struct sync_capture_record *records;
+    unsigned long *record_users;
+};
+
+/* The state of one client process. */
+struct client {
+    void *handle;
+    krb5_context ctx;
+    void *data;
+    struct heimdal_hook *heimdal;
+#ifdef HAVE_KRB5_KADM5_HOOK_PLUGIN_H
+    kadm5_hook_vftable_1 mit;
+#endif
+    krb5_principal *princs;
+    struct params *params;
+};
+
+
+/*
+ * Choose the kind of change for the operation with the given index according
+ * to the weights of the mix, spreading each kind over the run.
+ */
+static enum change
+change_kind(const struct params *params, size_t index)
+{
+    unsigned long total, pick;
+
+    total = params->mix[0] + params->mix[1] + params->mix[2];
+    pick = (unsigned long) (((uint64_t) index * 2654435761U) % total);
+    if (pick < params->mix[0])
+        return CHANGE_CHPASS;
+    else if (pick < params->mix[0] + params->mix[1])
+        return CHANGE_CREATE;
+    else
+        return CHANGE_MODIFY;
+}
+
+
+/*
+ * Load the plugin and initialize it through its hook table.  Returns NULL on
+ * failure.
+ */
+static void *
+client_setup(void *data)
+{
+    struct params *params = data;
+    struct client *client;
+#ifdef HAVE_KRB5_KADM5_HOOK_PLUGIN_H
+    krb5_error_code (*initvt)(krb5_context, int, int, krb5_plugin_vtable);
+#endif
+    krb5_error_code code;
+    char *name;
+    unsigned long i;
+
+    client = bcalloc(1, sizeof(struct client));
+    client->params = params;
+    code = krb5_init_context(&client->ctx);
+    if (code != 0) {
+        diag("cannot initialize Kerberos context");
+        return NULL;
+    }
+    client->handle = dlopen(params->plugin, RTLD_NOW);
+    if (client->handle == NULL) {
+        diag("cannot dlopen %s: %s", params->plugin, dlerror());
+        return NULL;
+    }
+    if (params->heimdal) {
+        client->heimdal = dlsym(client->handle, "kadm5_hook_v0");
+        if (client->heimdal == NULL) {
+            diag("cannot get kadm5_hook_v0 symbol: %s", dlerror());
+            return NULL;
+        }
+        code = client->heimdal->init(client->ctx, &client->data);
+    } else {
+#ifdef HAVE_KRB5_KADM5_HOOK_PLUGIN_H
+        initvt = dlsym(client->handle, "kadm5_hook_sync_initvt");
+        if (initvt == NULL) {
+            diag("cannot get kadm5_hook_sync_initvt symbol: %s", dlerror());
+            return NULL;
+        }
+        code = initvt(client->ctx, 1, 0, (krb5_plugin_vtable) &client->mit);
+        if (code == 0)
+            code = client->mit.init(client->ctx,
+                                    (kadm5_hook_modinfo **) &client->data);
+#else
+        code = KRB5_PLUGIN_VER_NOTSUPP;
+#endif
+    }
+    if (code != 0) {
+        diag_krb5(client->ctx, code, "cannot initialize plugin");
+        return NULL;
+    }
+    client->princs = bcalloc(params->users, sizeof(krb5_principal));
+    for (i = 0; i < params->users; i++) {
+        basprintf(&name, "load%lu", i);
+        code = krb5_parse_name(client->ctx, name, &client->princs[i]);
+        if (code != 0) {
+            diag_krb5(client->ctx, code, "cannot parse %s", name);
+            free(name);
+            return NULL;
+        }
+        free(name);
+    }
+    return client;
+}
+
+
+/*
+ * Call the hook for one change and stage.
+ */
+static krb5_error_code
+client_hook(struct client *client, enum change kind, bool post,
+            kadm5_principal_ent_t entry, const char *password)
+{
+    struct heimdal_hook *hook = client->heimdal;
+    enum heimdal_stage stage;
+#ifdef HAVE_KRB5_KADM5_HOOK_PLUGIN_H
+    kadm5_hook_vftable_1 *vt = &client->mit;
+    kadm5_hook_modinfo *data = client->data;
+    int mit_stage;
+#endif
+
+    if (hook != NULL) {
+        stage = post ? HEIMDAL_STAGE_POSTCOMMIT : HEIMDAL_STAGE_PRECOMMIT;
+        switch (kind) {
+        case CHANGE_CHPASS:
+            return hook->chpass(client->ctx, client->data, stage,
+                                entry->principal, password);
+        case CHANGE_CREATE:
+            return hook->create(client->ctx, client->data, stage, entry,
+                                KADM5_PRINCIPAL | KADM5_ATTRIBUTES, password);
+        case CHANGE_MODIFY:
+        default:
+            return hook->modify(client->ctx, client->data, stage, entry,
+                                KADM5_ATTRIBUTES);
+        }
+    }
+#ifdef HAVE_KRB5_KADM5_HOOK_PLUGIN_H
+    if (post)
+        mit_stage = KADM5_HOOK_STAGE_POSTCOMMIT;
+    else
+        mit_stage = KADM5_HOOK_STAGE_PRECOMMIT;
+    switch (kind) {
+    case CHANGE_CHPASS:
+        return vt->chpass(client->ctx, data, mit_stage, entry->principal,
+                          false, 0, NULL, password);
+    case CHANGE_CREATE:
+        return vt->create(client->ctx, data, mit_stage, entry,
+                          KADM5_PRINCIPAL | KADM5_ATTRIBUTES, 0, NULL,
+                          password);
+    case CHANGE_MODIFY:
+    default:
+        return vt->modify(client->ctx, data, mit_stage, entry,
+                          KADM5_ATTRIBUTES);
+    }
+#else
+    return KRB5_PLUGIN_VER_NOTSUPP;
+#endif
+}
+
+
+/*
+ * Make one change, calling the hook for both stages.  Each pass over the
+ * accounts disables them with modify if the previous pass enabled them and
+ * vice versa, and creations are created enabled.  When replaying, the change
+ * is the one in the capture record instead, which needs its own principal if
+ * the captured one had an instance or was skipped.
+ */
+static bool
+client_op(void *state, size_t index)
+{
+    struct client *client = state;
+    struct params *params = client->params;
+    struct sync_capture_record *record;
+    kadm5_principal_ent_rec entry;
+    enum change kind;
+    krb5_principal princ = NULL;
+    krb5_error_code code;
+    const char *instance = NULL;
+    char *password, *name;
+    unsigned long user;
+
+    memset(&entry, 0, sizeof(entry));
+    if (params->records == NULL) {
+        kind = change_kind(params, index);
+        entry.principal = client->princs[index % params->users];
+        if (kind == CHANGE_MODIFY && (index / params->users) % 2 == 0)
+            entry.attributes = KRB5_KDB_DISALLOW_ALL_TIX;
+    } else {
+        record = &params->records[index];
+        user = params->record_users[index];
+        if (record->type == SYNC_STATS_PASSWORD)
+            kind = CHANGE_CHPASS;
+        else
+            kind = CHANGE_MODIFY;
+        if (!record->enabled)
+            entry.attributes = KRB5_KDB_DISALLOW_ALL_TIX;
+        if (record->outcome == SYNC_CAPTURE_SKIPPED
+            || record->shape == SYNC_CAPTURE_OTHER)
+            instance = INSTANCE_SKIPPED;
+        else if (record->shape == SYNC_CAPTURE_INSTANCE)
+            instance = INSTANCE_SYNCED;
+        if (instance == NULL)
+            entry.principal = client->princs[user];
+        else {
+            basprintf(&name, "load%lu/%s", user, instance);
+            code = krb5_parse_name(client->ctx, name, &princ);
+            free(name);
+            if (code != 0)
+                return false;
+            entry.principal = princ;
+        }
+    }
+    basprintf(&password, "load-password-%lu", (unsigned long) index);
+    code = client_hook(client, kind, false, &entry, password);
+    if (code == 0)
+        code = client_hook(client, kind, true, &entry, password);
+    free(password);
+    if (princ != NULL)
+        krb5_free_principal(client->ctx, princ);
+    return code == 0;
+}
+
+
+/*
+ * Shut down the plugin and free a client process's resources.
+ */
+static void
+client_cleanup(void *state)
+{
+    struct client *client = state;
+    unsigned long i;
+
+    for (i = 0; i < client->params->users; i++)
+        krb5_free_principal(client->ctx, client->princs[i]);
+    free(client->princs);
+    if (client->heimdal != NULL)
+        client->heimdal->fini(client->ctx, client->data);
+#ifdef HAVE_KRB5_KADM5_HOOK_PLUGIN_H
+    else
+        client->mit.fini(client->ctx, client->data);
+#endif
+    dlclose(client->handle);
+    krb5_free_context(client->ctx);
+    free(client);
+}
+
+
+/*
+ * Count the changes in the queue and, if remove is set, remove the queue.
+ */
+static unsigned long
+queue_count(bool remove)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char *path;
+    unsigned long count = 0;
+
+    dir = opendir("queue");
+    if (dir == NULL)
+        return 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0
+            || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (entry->d_name[0] != '.')
+            count++;
+        if (remove) {
+            basprintf(&path, "queue/%s", entry->d_name);
+            unlink(path);
+            free(path);
+        }
+    }
+    closedir(dir);
+    if (remove)
+        rmdir("queue");
+    return count;
+}
+
+
+/*
+ * Parse the mix of changes, which is three weights separated by colons.
+ * Returns false if it's invalid.
+ */
+static bool
+parse_mix(const char *string, unsigned long *mix)
+{
+    char *end;
+    size_t i;
+
+    for (i = 0; i < 3; i++) {
+        mix[i] = strtoul(string, &end, 10);
+        if (end == string || *end != (i < 2 ? ':' : '\0'))
+            return false;
+        string = end + 1;
+    }
+    return mix[0] + mix[1] + mix[2] > 0;
+}
+
+
+/*
+ * Comparison functions for sorting capture records by time and pseudonyms of
+ * users with qsort.
+ */
+static int
+compare_records(const void *a, const void *b)
+{
+    const struct sync_capture_record *x = a;
+    const struct sync_capture_record *y = b;
+
+    return (x->time < y->time) ? -1 : (x->time > y->time) ? 1 : 0;
+}
+
+static int
+compare_users(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+
+/*
+ * Read the records from a capture file into params, sorted by the time of
+ * the change, since each record is written when the change finishes.
+ * Returns the number of records and calls bail on failure.
+ */
+static size_t
+capture_read(const char *path, struct params *params)
+{
+    struct sync_capture_header header;
+    struct sync_capture_record record;
+    size_t count = 0, size = 1024;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        sysbail("cannot open %s", path);
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || header.magic != SYNC_CAPTURE_MAGIC
+        || header.version != SYNC_CAPTURE_VERSION)
+        bail("%s is not a capture file of version %d", path,
+             SYNC_CAPTURE_VERSION);
+    params->records = bcalloc(size, sizeof(record));
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (count == size) {
+            size *= 2;
+            params->records = breallocarray(params->records, size,
+                                            sizeof(record));
+        }
+        params->records[count++] = record;
+    }
+    if (ferror(file))
+        sysbail("cannot read %s", path);
+    fclose(file);
+    qsort(params->records, count, sizeof(record), compare_records);
+    return count;
+}
+
+
+/*
+ * Prepare the records of a capture for replay.  Drops the password changes
+ * if passwords is false, since they need a test realm, and numbers the
+ * users in the rest in the order of their pseudonyms, setting the number of
+ * users in params.  Returns the number of records left.
+ */
+static size_t
+capture_prepare(struct params *params, size_t count, bool passwords)
+{
+    struct sync_capture_record *records = params->records;
+    uint64_t *users, *found;
+    size_t i, kept = 0, total = 0;
+
+    for (i = 0; i < count; i++)
+        if (passwords || records[i].type != SYNC_STATS_PASSWORD)
+            records[kept++] = records[i];
+    if (kept == 0)
+        bail("no changes left to replay");
+    users = bcalloc(kept, sizeof(uint64_t));
+    for (i = 0; i < kept; i++)
+        users[i] = records[i].user;
+    qsort(users, kept, sizeof(uint64_t), compare_users);
+    for (i = 0; i < kept; i++)
+        if (total == 0 || users[total - 1] != users[i])
+            users[total++] = users[i];
+    params->record_users = bcalloc(kept, sizeof(unsigned long));
+    for (i = 0; i < kept; i++) {
+        found = bsearch(&records[i].user, users, total, sizeof(uint64_t),
+                        compare_users);
+        params->record_users[i] = (unsigned long) (found - users);
+    }
+    params->users = total;
+    free(users);
+    return kept;
+}
+
+
+/*
+ * Report the changes in the capture being replayed the same way as the
+ * replay, so that the two can be compared, along with their outcomes.  The
+ * elapsed time is from the start of the first change to the start of the
+ * last.
+ */
+static void
+capture_report(const struct params *params, size_t count, const char *label)
+{
+    const struct sync_capture_record *records = params->records;
+    unsigned long outcomes[4] = { 0, 0, 0, 0 };
+    unsigned long passwords = 0;
+    uint64_t *latencies;
+    size_t i;
+
+    latencies = bench_latencies(count);
+    for (i = 0; i < count; i++) {
+        if (records[i].outcome != SYNC_CAPTURE_FAILED)
+            latencies[i] = records[i].latency;
+        if (records[i].outcome < 4)
+            outcomes[records[i].outcome]++;
+        if (records[i].type == SYNC_STATS_PASSWORD)
+            passwords++;
+    }
+    bench_report("capture", label, latencies, count,
+                 records[count - 1].time - records[0].time);
+    printf("# capture: password=%lu status=%lu success=%lu queued=%lu"
+           " failed=%lu skipped=%lu\n", passwords,
+           (unsigned long) count - passwords,
+           outcomes[SYNC_CAPTURE_SUCCESS], outcomes[SYNC_CAPTURE_QUEUED],
+           outcomes[SYNC_CAPTURE_FAILED], outcomes[SYNC_CAPTURE_SKIPPED]);
+    bench_latencies_free(latencies, count);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct bench_ops ops = {
+        client_setup, client_op, client_cleanup, 0, NULL
+    };
+    struct directory_options dir_options;
+    struct directory_counts dir_counts;
+    struct kpasswd_options kpw_options;
+    struct kpasswd_counts kpw_counts;
+    struct kpasswd_server *server = NULL;
+    struct kerberos_config *krbconf = NULL;
+    struct params params;
+    enum scenario scenario = SCENARIO_HEALTHY;
+    char *tmpdir, *path, *keytab, *base, *krb5_config, *upn, *dn, *label;
+    const char *const settings[] = { "ad_ccache", "FILE:ad-ccache", NULL };
+    const char *env, *capture = NULL, *realm = AD_REALM;
+    unsigned long clients = 4, count = 1000, every = 3, latency = 100, i;
+    unsigned long queued;
+    uint64_t *latencies, *schedule = NULL, elapsed;
+    double speed = 1.0;
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    int option;
+
+    /* Parse the command-line options. */
+    memset(&params, 0, sizeof(params));
+    params.users = 100;
+    parse_mix("60:10:30", params.mix);
+    while ((option = getopt(argc, argv, "c:e:hHl:m:n:r:s:t:u:x:")) != EOF) {
+        switch (option) {
+        case 'c': clients = strtoul(optarg, NULL, 10);          break;
+        case 'e': every = strtoul(optarg, NULL, 10);            break;
+        case 'H': params.heimdal = true;                        break;
+        case 'l': latency = strtoul(optarg, NULL, 10);          break;
+        case 'n': count = strtoul(optarg, NULL, 10);            break;
+        case 'r': ops.rate = strtoul(optarg, NULL, 10);         break;
+        case 't': capture = optarg;                             break;
+        case 'u': params.users = strtoul(optarg, NULL, 10);     break;
+        case 'x': speed = strtod(optarg, NULL);                 break;
+
+        case 'm':
+            if (!parse_mix(optarg, params.mix))
+                bail("invalid mix %s", optarg);
+            break;
+        case 's':
+            for (i = 0; scenarios[i] != NULL; i++)
+                if (strcmp(optarg, scenarios[i]) == 0)
+                    break;
+            if (scenarios[i] == NULL)
+                bail("unknown scenario %s", optarg);
+            scenario = (enum scenario) i;
+            break;
+        case 'h':
+            printf("%s", usage_message);
+            exit(0);
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(1);
+        }
+    }
+    if (clients == 0 || count == 0 || params.users == 0 || every == 0
+        || !(speed > 0.0)) {
+        fprintf(stderr, "%s", usage_message);
+        exit(1);
+    }
+#ifndef HAVE_KRB5_KADM5_HOOK_PLUGIN_H
+    params.heimdal = true;
+#endif
+
+    /* Read the capture to replay, if any, before changing directories. */
+    if (capture != NULL)
+        count = capture_read(capture, &params);
+
+    /* Find the plugin, which has to have been built as sync.so. */
+    path = test_file_path("../plugin/.libs/sync.so");
+    if (path == NULL) {
+        printf("# skip load: unknown plugin naming scheme\n");
+        exit(0);
+    }
+    params.plugin = path;
+
+    /* Set up the stand-ins for the scenario. */
+    memset(&dir_options, 0, sizeof(dir_options));
+    memset(&kpw_options, 0, sizeof(kpw_options));
+    kpw_options.workers = (unsigned int) clients;
+    if (scenario == SCENARIO_SLOW) {
+        dir_options.latency = latency;
+        kpw_options.latency = latency;
+    } else if (scenario == SCENARIO_PARTIAL || scenario == SCENARIO_DOWN) {
+        dir_options.error_every = (scenario == SCENARIO_DOWN) ? 1 : every;
+        dir_options.error_ops = DIRECTORY_BIND;
+        dir_options.error_code = LDAP_SERVER_DOWN;
+        kpw_options.error_every = every;
+        kpw_options.error_code = KRB5_KPASSWD_SOFTERROR;
+    }
+
+    /* Work in a temporary directory, with a queue. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /*
+     * With a test realm, point the plugin at a kpasswd stand-in, which is
+     * stopped again if it's supposed to be down.  Otherwise, the plugin can
+     * only make status changes, using a fake ticket in a shared cache.
+     */
+    path = test_file_path("config/keytab");
+    keytab = test_file_path("config/kpasswd-keytab");
+    if (path != NULL && keytab != NULL) {
+        krbconf = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+        realm = strchr(krbconf->principal, '@');
+        if (realm == NULL)
+            bail("test principal %s has no realm", krbconf->principal);
+        realm++;
+        test_file_path_free(path);
+        path = test_file_path("config/krb5.conf");
+        env = getenv("KRB5_CONFIG");
+        if (path != NULL)
+            base = bstrdup(path);
+        else if (env != NULL && env[0] != '\0')
+            base = bstrdup(env);
+        else
+            base = bstrdup("/etc/krb5.conf");
+        server = kpasswd_start(keytab, realm, &kpw_options);
+        krb5_config = kpasswd_config(server, tmpdir, krbconf->keytab,
+                                     krbconf->principal, base);
+        free(base);
+        if (scenario == SCENARIO_DOWN) {
+            kpasswd_stop(server);
+            server = NULL;
+        }
+    } else {
+        printf("# skip chpass and create: test realm not configured\n");
+        params.mix[0] = 0;
+        params.mix[1] = 0;
+        if (params.mix[2] == 0 && capture == NULL)
+            bail("no changes left in the mix");
+        test_file_path_free(path);
+        sync_make_config(tmpdir, settings);
+        basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+        if (putenv(krb5_config) < 0)
+            sysbail("cannot set KRB5_CONFIG in the environment");
+        code = krb5_init_context(&ctx);
+        if (code != 0)
+            bail_krb5(ctx, code, "cannot initialize Kerberos context");
+        code = krb5_parse_name(ctx, PRINCIPAL, &princ);
+        if (code != 0)
+            bail_krb5(ctx, code, "cannot parse principal %s", PRINCIPAL);
+        sync_ccache_store(ctx, "FILE:ad-ccache", princ, 60 * 60);
+        krb5_free_principal(ctx, princ);
+        krb5_free_context(ctx);
+    }
+    test_file_path_free(path);
+    test_file_path_free(keytab);
+
+    /*
+     * When replaying, start each change at its offset from the first in the
+     * capture, divided by the speed.
+     */
+    if (capture != NULL) {
+        count = capture_prepare(&params, count, krbconf != NULL);
+        schedule = bcalloc(count, sizeof(uint64_t));
+        for (i = 0; i < count; i++)
+            schedule[i] = (uint64_t) ((double) (params.records[i].time
+                                                - params.records[0].time)
+                                      / speed);
+        ops.schedule = schedule;
+    }
+
+    /* Fill the directory, including the instances that replays use. */
+    directory_start(&dir_options);
+    for (i = 0; i < params.users; i++) {
+        basprintf(&upn, "load%lu@%s", i, realm);
+        basprintf(&dn, "CN=load%lu,OU=Accounts,DC=ad,DC=example,DC=com", i);
+        directory_add(upn, dn, NORMAL);
+        free(upn);
+        free(dn);
+        if (capture == NULL)
+            continue;
+        basprintf(&upn, "load%lu/%s@%s", i, INSTANCE_SYNCED, realm);
+        basprintf(&dn, "CN=load%lu.%s,OU=Accounts,DC=ad,DC=example,DC=com",
+                  i, INSTANCE_SYNCED);
+        directory_add(upn, dn, NORMAL);
+        free(upn);
+        free(dn);
+    }
+
+    /* Run the load. */
+    latencies = bench_latencies(count);
+    elapsed = bench_fork(&ops, &params, (unsigned int) clients, count,
+                         latencies);
+    queued = queue_count(false);
+    if (capture != NULL) {
+        basprintf(&label, "hook=%s scenario=%s clients=%lu speed=%g"
+                  " users=%lu", params.heimdal ? "heimdal" : "mit",
+                  scenarios[scenario], clients, speed, params.users);
+        capture_report(&params, count, label);
+        bench_report("replay", label, latencies, count, elapsed);
+    } else {
+        basprintf(&label, "hook=%s scenario=%s clients=%lu rate=%lu"
+                  " mix=%lu:%lu:%lu users=%lu",
+                  params.heimdal ? "heimdal" : "mit", scenarios[scenario],
+                  clients, ops.rate, params.mix[0], params.mix[1],
+                  params.mix[2], params.users);
+        bench_report("load", label, latencies, count, elapsed);
+    }
+    printf("# queue: entries=%lu growth_per_s=%.1f\n", queued,
+           (double) queued * 1000000.0 / (double) elapsed);
+    directory_counts(&dir_counts);
+    printf("# directory: binds=%lu searches=%lu modifies=%lu errors=%lu\n",
+           dir_counts.binds, dir_counts.searches, dir_counts.modifies,
+           dir_counts.errors);
+    if (server != NULL) {
+        kpasswd_counts(server, &kpw_counts);
+        printf("# kpasswd: requests=%lu errors=%lu rejected=%lu\n",
+               kpw_counts.requests, kpw_counts.errors, kpw_counts.rejected);
+    }
+
+    /* Clean up. */
+    free(label);
+    bench_latencies_free(latencies, count);
+    free(schedule);
+    free(params.records);
+    free(params.record_users);
+    directory_stop();
+    if (server != NULL)
+        kpasswd_stop(server);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    queue_count(true);
+    unlink("ad-ccache");
+    unlink("krb5.conf");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    test_file_path_free((char *) params.plugin);
+    if (krbconf != NULL)
+        kerberos_cleanup();
+    return 0;
+}
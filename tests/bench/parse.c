@@ -0,0 +1,270 @@
+/*
+ * Benchmark for parsing queue files.
+ *
+ * Generates a given number of queue files, shaped like the queue used by the
+ * queue benchmark, and times how long krb5-sync takes to parse all of them:
+ * first from memory with queue_file_parse alone, and then from disk with
+ * queue_file_read followed by queue_file_parse, which is what krb5-sync does
+ * for each file that it drains.  Half of the files are in the format written
+ * by older versions, without a trace ID or origin, and half are in the
+ * current format.  Each round parses every file once, and the results are
+ * reported as one line per way of parsing with the latency of a round,
+ * followed by the average time to parse one file in nanoseconds.  Exits
+ * with status 1 if any file fails to parse.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <tests/bench/bench.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <tools/internal.h>
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: parse [-h] [-n <count>] [-r <rounds>]\n\
+\n\
+  -h            Show this help\n\
+  -n <count>    Number of queue files (default: 10000)\n\
+  -r <rounds>   Number of times to parse all of them (default: 20)\n";
+
+/* A generated queue file. */
+struct file {
+    char *path;
+    char *data;
+    size_t length;
+};
+
+/* The benchmark parameters. */
+struct params {
+    struct file *files;
+    size_t count;
+    bool disk;
+    char *buffer;
+};
+
+/* The state of the random number generator used to shape the files. */
+static uint64_t seed;
+
+
+/*
+ * Return a pseudorandom number between 0 and 1.  This is the same generator
+ * as the queue benchmark uses, so the files look like its queue.
+ */
+static double
+random_fraction(void)
+{
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (double) (seed >> 11) / (double) (1ULL << 53);
+}
+
+
+/*
+ * Generate count queue files and write them to the queue directory, returning
+ * them in a newly allocated array.  Most changes are password changes, some
+ * are for instances, and low-numbered users have many changes.
+ */
+static struct file *
+make_files(size_t count)
+{
+    struct file *files, *file;
+    unsigned long users, user;
+    double fraction;
+    bool instance, password;
+    const char *action;
+    char *change;
+    size_t i;
+    int fd;
+
+    files = bcalloc(count, sizeof(struct file));
+    users = (unsigned long) (count / 2 + 1);
+    seed = 1;
+    for (i = 0; i < count; i++) {
+        file = &files[i];
+        fraction = random_fraction();
+        user = (unsigned long) (users * fraction * fraction * fraction);
+        instance = (random_fraction() < 0.1);
+        password = (random_fraction() < 0.8);
+        action = (random_fraction() < 0.5) ? "enable" : "disable";
+        if (password)
+            basprintf(&change, "bench%lu%s\nad\npassword\nbench-password\n",
+                      user, instance ? "/root" : "");
+        else
+            basprintf(&change, "bench%lu%s\nad\n%s\n", user,
+                      instance ? "/root" : "", action);
+        if (i % 2 == 0)
+            file->data = change;
+        else {
+            basprintf(&file->data, "%strace %016lx\norigin %lu.%06lu\n",
+                      change, (unsigned long) i, 1760000000UL + i,
+                      (unsigned long) (i * 7919 % 1000000));
+            free(change);
+        }
+        file->length = strlen(file->data);
+        basprintf(&file->path, "queue/parse%lu", (unsigned long) i);
+        fd = open(file->path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            sysbail("cannot create %s", file->path);
+        if (write(fd, file->data, file->length) < (ssize_t) file->length)
+            sysbail("cannot write to %s", file->path);
+        if (close(fd) < 0)
+            sysbail("cannot flush %s", file->path);
+    }
+    return files;
+}
+
+
+/*
+ * Parse one file, either by copying it from memory into the buffer that
+ * krb5-sync would have read it into or by reading it from disk.  Returns true
+ * if it parsed as a change that krb5-sync knows how to apply.
+ */
+static bool
+parse_file(struct params *params, struct file *file)
+{
+    struct queue_change change;
+    const char *error;
+    char *data;
+    size_t length;
+    uint64_t mtime;
+
+    if (params->disk) {
+        data = queue_file_read(file->path, &length, &mtime);
+        if (data == NULL)
+            return false;
+    } else {
+        data = params->buffer;
+        length = file->length;
+        memcpy(data, file->data, length);
+    }
+    error = queue_file_parse(data, length, &change);
+    if (params->disk)
+        free(data);
+    return error == NULL && change.type != QUEUE_UNKNOWN;
+}
+
+
+/*
+ * Set up the process, which only needs the parameters.
+ */
+static void *
+parse_setup(void *data)
+{
+    return data;
+}
+
+
+/*
+ * Run one round, parsing every file.
+ */
+static bool
+parse_round(void *state, size_t index UNUSED)
+{
+    struct params *params = state;
+    bool okay = true;
+    size_t i;
+
+    for (i = 0; i < params->count; i++)
+        if (!parse_file(params, &params->files[i]))
+            okay = false;
+    return okay;
+}
+
+
+/*
+ * Time rounds rounds of parsing the files in one process and report the
+ * results.  Returns the number of rounds with errors.
+ */
+static unsigned long
+run(struct params *params, const char *name, size_t rounds)
+{
+    struct bench_ops ops = { parse_setup, parse_round, NULL, 0, NULL };
+    uint64_t *latencies, elapsed;
+    unsigned long errors = 0;
+    char *label;
+    size_t i;
+
+    latencies = bench_latencies(rounds);
+    elapsed = bench_fork(&ops, params, 1, rounds, latencies);
+    for (i = 0; i < rounds; i++)
+        if (latencies[i] == BENCH_FAILED)
+            errors++;
+    basprintf(&label, "files=%lu", (unsigned long) params->count);
+    bench_report(name, label, latencies, rounds, elapsed);
+    printf("# %s: ns_per_file=%.1f\n", name,
+           (double) elapsed * 1000 / ((double) rounds * params->count));
+    free(label);
+    bench_latencies_free(latencies, rounds);
+    return errors;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct params params;
+    char *tmpdir;
+    unsigned long count = 10000, rounds = 20, errors;
+    size_t i;
+    int option;
+
+    /* Parse the command-line options. */
+    while ((option = getopt(argc, argv, "hn:r:")) != EOF) {
+        switch (option) {
+        case 'n': count = strtoul(optarg, NULL, 10);    break;
+        case 'r': rounds = strtoul(optarg, NULL, 10);   break;
+
+        case 'h':
+            printf("%s", usage_message);
+            exit(0);
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(1);
+        }
+    }
+    if (count == 0 || rounds == 0) {
+        fprintf(stderr, "%s", usage_message);
+        exit(1);
+    }
+
+    /* Generate the files in a temporary directory. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+    memset(&params, 0, sizeof(params));
+    params.count = count;
+    params.files = make_files(count);
+    params.buffer = bmalloc((size_t) QUEUE_FILE_MAX + 2);
+
+    /* Parse them from memory and then from disk. */
+    errors = run(&params, "parse-memory", rounds);
+    params.disk = true;
+    errors += run(&params, "parse-disk", rounds);
+
+    /* Clean up. */
+    for (i = 0; i < count; i++) {
+        if (unlink(params.files[i].path) < 0)
+            sysbail("cannot remove %s", params.files[i].path);
+        free(params.files[i].path);
+        free(params.files[i].data);
+    }
+    free(params.files);
+    free(params.buffer);
+    if (rmdir("queue") < 0)
+        sysbail("cannot remove queue");
+    if (chdir("..") < 0)
+        sysbail("cannot cd to ..");
+    test_tmpdir_free(tmpdir);
+    return (errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,514 @@
+/*
+ * Benchmark for the queue of changes that failed.
+ *
+ * Fills a queue directory with a given number of changes and times the
+ * operations that have to read it: sync_queue_conflict for keys with and
+ * without queued changes, sync_queue_write, the locked and sorted scan with
+ * which krb5-sync -q starts draining the queue, and the list and purge
+ * commands of krb5-sync-backend.  Each is run first from one process and
+ * then from several at once, which contend for the queue lock.  Reports one
+ * line per operation, queue size, and number of processes.
+ *
+ * The queued changes look like a real queue: a few users have many changes
+ * and most have one or two, most are password changes, and some are for
+ * instances.  The queue is filled the same way on every run so that results
+ * can be compared.  The krb5-sync-backend results are skipped if the Perl
+ * modules that it needs aren't installed.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+#include <tests/bench/bench.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* The default queue sizes to test. */
+#define SIZES "0,1000,10000,100000"
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: queue [-h] [-c <clients>] [-n <count>] [-r <rounds>] [-s <sizes>]\n\
+\n\
+  -c <clients>  Number of processes for contended runs (default: 4)\n\
+  -h            Show this help\n\
+  -n <count>    Number of conflict checks and writes (default: 200)\n\
+  -r <rounds>   Number of scans, lists, and purges (default: 10)\n\
+  -s <sizes>    Comma-separated queue sizes (default: " SIZES ")\n";
+
+/* The operations that we time. */
+enum bench_type {
+    BENCH_MISS,                 /* sync_queue_conflict, nothing queued */
+    BENCH_HIT,                  /* sync_queue_conflict, change queued */
+    BENCH_WRITE,                /* sync_queue_write */
+    BENCH_SCAN,                 /* Locked, sorted scan like krb5-sync -q */
+    BENCH_LIST,                 /* krb5-sync-backend list */
+    BENCH_PURGE                 /* krb5-sync-backend purge, nothing old */
+};
+
+/* A queued change. */
+struct entry {
+    unsigned long user;
+    bool instance;
+    bool password;
+};
+
+/* The benchmark parameters, shared by all the processes. */
+struct params {
+    enum bench_type type;
+    struct entry *entries;
+    size_t size;
+    unsigned long round;
+    const char *backend;
+};
+
+/* The state of one process. */
+struct client {
+    struct params *params;
+    krb5_context ctx;
+    kadm5_hook_modinfo *config;
+    struct sync_target *ad;
+};
+
+/* The state of the random number generator used to fill the queue. */
+static uint64_t seed;
+
+
+/*
+ * Return a pseudorandom number between 0 and 1.  This is a linear
+ * congruential generator, which is good enough to shape the queue and gives
+ * the same queue everywhere.
+ */
+static double
+random_fraction(void)
+{
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (double) (seed >> 11) / (double) (1ULL << 53);
+}
+
+
+/*
+ * Remove all files from the queue directory, leaving the directory.
+ */
+static void
+empty_queue(void)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char *path;
+
+    dir = opendir("queue");
+    if (dir == NULL)
+        sysbail("cannot open queue");
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0
+            || strcmp(entry->d_name, "..") == 0)
+            continue;
+        basprintf(&path, "queue/%s", entry->d_name);
+        if (unlink(path) < 0)
+            sysbail("cannot remove %s", path);
+        free(path);
+    }
+    closedir(dir);
+}
+
+
+/*
+ * Fill the queue with size changes and return them in a newly allocated
+ * array.  The user of each change is drawn so that low-numbered users have
+ * many changes and there are about two changes per user on average.  Each
+ * change is one second older than the next, ending a day ago, and has that
+ * as its modification time.
+ */
+static struct entry *
+fill_queue(size_t size)
+{
+    struct entry *entries, *entry;
+    struct timespec times[2];
+    struct tm tm;
+    char timestamp[32];
+    char *path, *user, *data;
+    unsigned long users;
+    double fraction;
+    time_t when;
+    size_t i;
+    int fd;
+
+    entries = bcalloc(size == 0 ? 1 : size, sizeof(struct entry));
+    users = (unsigned long) (size / 2 + 1);
+    seed = 1;
+    for (i = 0; i < size; i++) {
+        entry = &entries[i];
+        fraction = random_fraction();
+        entry->user = (unsigned long) (users * fraction * fraction * fraction);
+        entry->instance = (random_fraction() < 0.1);
+        entry->password = (random_fraction() < 0.8);
+        when = time(NULL) - 24 * 60 * 60 - (time_t) (size - i);
+        if (gmtime_r(&when, &tm) == NULL)
+            sysbail("cannot get broken-down time");
+        strftime(timestamp, sizeof(timestamp), "%Y%m%dT%H%M%SZ", &tm);
+        basprintf(&user, "bench%lu%s", entry->user,
+                  entry->instance ? "/root" : "");
+        basprintf(&path, "queue/bench%lu%s-ad-%s-%s-00", entry->user,
+                  entry->instance ? ".root" : "",
+                  entry->password ? "password" : "enable", timestamp);
+        if (entry->password)
+            basprintf(&data, "%s\nad\npassword\nbench-password\n", user);
+        else
+            basprintf(&data, "%s\nad\n%s\n", user,
+                      random_fraction() < 0.5 ? "enable" : "disable");
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            sysbail("cannot create %s", path);
+        if (write(fd, data, strlen(data)) < (ssize_t) strlen(data))
+            sysbail("cannot write to %s", path);
+        times[0].tv_sec = when;
+        times[0].tv_nsec = 0;
+        times[1] = times[0];
+        if (futimens(fd, times) < 0)
+            sysbail("cannot set times of %s", path);
+        if (close(fd) < 0)
+            sysbail("cannot flush %s", path);
+        free(data);
+        free(path);
+        free(user);
+    }
+    return entries;
+}
+
+
+/*
+ * Run krb5-sync-backend with the given command and optional argument on the
+ * queue, discarding its output, and return its exit status.
+ */
+static int
+run_backend(const char *backend, const char *command, const char *argument)
+{
+    pid_t child;
+    int fd, status;
+
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        fd = open("/dev/null", O_RDWR);
+        if (fd < 0)
+            _exit(255);
+        if (dup2(fd, 0) < 0 || dup2(fd, 1) < 0 || dup2(fd, 2) < 0)
+            _exit(255);
+        execl(backend, backend, command, "-d", "queue", argument,
+              (char *) NULL);
+        _exit(255);
+    }
+    if (waitpid(child, &status, 0) < 0)
+        sysbail("cannot wait for krb5-sync-backend");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 255;
+}
+
+
+/*
+ * Set up a process with its own Kerberos context and plugin.  Returns NULL on
+ * failure.
+ */
+static void *
+client_setup(void *data)
+{
+    struct client *client;
+    krb5_error_code code;
+
+    client = bcalloc(1, sizeof(struct client));
+    client->params = data;
+    code = krb5_init_context(&client->ctx);
+    if (code != 0) {
+        diag("cannot initialize Kerberos context");
+        return NULL;
+    }
+    code = sync_init(client->ctx, &client->config);
+    if (code != 0) {
+        diag_krb5(client->ctx, code, "cannot initialize plugin");
+        return NULL;
+    }
+    client->ad = sync_target_find(client->config, "ad");
+    if (client->ad == NULL) {
+        diag("cannot find ad target");
+        return NULL;
+    }
+    return client;
+}
+
+
+/*
+ * Read the queue the way that krb5-sync -q does before draining it: lock it,
+ * read the names of all the files that don't start with a period, unlock it,
+ * and sort the names.
+ */
+static bool
+client_scan(struct client *client)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char **files = NULL;
+    size_t i, n = 0, size = 0;
+    int lock;
+
+    if (sync_queue_lock(client->config, client->ctx, &lock) != 0)
+        return false;
+    dir = opendir(client->config->queue_dir);
+    if (dir == NULL) {
+        sync_queue_unlock(lock);
+        return false;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (n == size) {
+            size = (size == 0) ? 64 : size * 2;
+            files = breallocarray(files, size, sizeof(char *));
+        }
+        files[n++] = bstrdup(entry->d_name);
+    }
+    closedir(dir);
+    sync_queue_unlock(lock);
+    if (n > 0)
+        sync_sort_strings(files, n);
+    for (i = 0; i < n; i++)
+        free(files[i]);
+    free(files);
+    return true;
+}
+
+
+/*
+ * Run one operation.  Conflict checks that should find a queued change pick
+ * one of the queued changes, spread over the queue, and writes use a new
+ * user for each write so that they never run out of file names.
+ */
+static bool
+client_op(void *state, size_t index)
+{
+    struct client *client = state;
+    struct params *params = client->params;
+    struct entry *entry;
+    struct sync_op op;
+    krb5_principal princ;
+    krb5_error_code code;
+    const char *operation = "password";
+    char *name;
+    bool conflict = (params->type == BENCH_HIT);
+
+    switch (params->type) {
+    case BENCH_SCAN:
+        return client_scan(client);
+    case BENCH_LIST:
+        return run_backend(params->backend, "list", NULL) == 0;
+    case BENCH_PURGE:
+        return run_backend(params->backend, "purge", "36500") == 0;
+    case BENCH_HIT:
+        entry = &params->entries[(index * 7919) % params->size];
+        basprintf(&name, "bench%lu%s@EXAMPLE.COM", entry->user,
+                  entry->instance ? "/root" : "");
+        if (!entry->password)
+            operation = "enable";
+        break;
+    case BENCH_MISS:
+        basprintf(&name, "absent%lu@EXAMPLE.COM", (unsigned long) index);
+        break;
+    case BENCH_WRITE:
+    default:
+        basprintf(&name, "new%lu-%lu@EXAMPLE.COM", params->round,
+                  (unsigned long) index);
+        break;
+    }
+    code = krb5_parse_name(client->ctx, name, &princ);
+    free(name);
+    if (code != 0)
+        return false;
+    code = sync_op_init(&op, client->ctx, princ);
+    if (code == 0) {
+        if (params->type == BENCH_WRITE)
+            code = sync_queue_write(client->config, &op, client->ad,
+                                    operation, "bench-password");
+        else
+            code = sync_queue_conflict(client->config, &op, client->ad,
+                                       operation, &conflict);
+    }
+    sync_op_free(&op);
+    krb5_free_principal(client->ctx, princ);
+    return code == 0 && conflict == (params->type == BENCH_HIT);
+}
+
+
+/*
+ * Free a process's resources.
+ */
+static void
+client_cleanup(void *state)
+{
+    struct client *client = state;
+
+    sync_close(client->ctx, client->config);
+    krb5_free_context(client->ctx);
+    free(client);
+}
+
+
+/*
+ * Time count operations of the given type, first from one process and then
+ * from clients processes, and report the results.
+ */
+static void
+run(struct params *params, const char *name, unsigned long clients,
+    size_t count)
+{
+    struct bench_ops ops = {
+        client_setup, client_op, client_cleanup, 0, NULL
+    };
+    unsigned long procs[2];
+    uint64_t *latencies, elapsed;
+    char *label;
+    size_t i;
+
+    procs[0] = 1;
+    procs[1] = clients;
+    for (i = 0; i < 2; i++) {
+        if (i == 1 && clients == 1)
+            break;
+        params->round++;
+        latencies = bench_latencies(count);
+        elapsed = bench_fork(&ops, params, (unsigned int) procs[i], count,
+                             latencies);
+        basprintf(&label, "size=%lu clients=%lu", (unsigned long) params->size,
+                  procs[i]);
+        bench_report(name, label, latencies, count, elapsed);
+        free(label);
+        bench_latencies_free(latencies, count);
+    }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct params params;
+    char *tmpdir, *path, *krb5_config, *sizes, *size, *end;
+    char *backend = NULL;
+    unsigned long clients = 4, count = 200, rounds = 10;
+    uint64_t *latencies, elapsed;
+    int option;
+
+    /* Parse the command-line options. */
+    sizes = bstrdup(SIZES);
+    while ((option = getopt(argc, argv, "c:hn:r:s:")) != EOF) {
+        switch (option) {
+        case 'c': clients = strtoul(optarg, NULL, 10);  break;
+        case 'n': count = strtoul(optarg, NULL, 10);    break;
+        case 'r': rounds = strtoul(optarg, NULL, 10);   break;
+
+        case 's':
+            free(sizes);
+            sizes = bstrdup(optarg);
+            break;
+        case 'h':
+            printf("%s", usage_message);
+            exit(0);
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(1);
+        }
+    }
+    if (clients == 0 || count == 0 || rounds == 0) {
+        fprintf(stderr, "%s", usage_message);
+        exit(1);
+    }
+
+    /* Work in a temporary directory with our own krb5.conf and queue. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+    sync_make_config(tmpdir, NULL);
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+
+    /* See if krb5-sync-backend works. */
+    path = test_file_path("../tools/krb5-sync-backend");
+    if (path != NULL && run_backend(path, "list", NULL) == 0)
+        backend = path;
+    else {
+        printf("# skip list and purge: krb5-sync-backend does not run\n");
+        test_file_path_free(path);
+    }
+
+    /* Run the benchmarks for each size of queue. */
+    memset(&params, 0, sizeof(params));
+    params.backend = backend;
+    for (size = strtok(sizes, ","); size != NULL; size = strtok(NULL, ",")) {
+        params.size = strtoul(size, &end, 10);
+        if (*end != '\0')
+            bail("invalid queue size %s", size);
+        params.entries = fill_queue(params.size);
+        params.type = BENCH_MISS;
+        run(&params, "queue-conflict-miss", clients, count);
+        if (params.size > 0) {
+            params.type = BENCH_HIT;
+            run(&params, "queue-conflict-hit", clients, count);
+        }
+        params.type = BENCH_SCAN;
+        run(&params, "queue-scan", clients, rounds);
+        if (backend != NULL) {
+            params.type = BENCH_LIST;
+            run(&params, "queue-list", clients, rounds);
+            params.type = BENCH_PURGE;
+            run(&params, "queue-purge", clients, rounds);
+        }
+        params.type = BENCH_WRITE;
+        run(&params, "queue-write", clients, count);
+
+        /* Time a purge that empties the queue. */
+        if (backend != NULL && params.size > 0) {
+            latencies = bench_latencies(1);
+            elapsed = bench_now();
+            if (run_backend(backend, "purge", "0") == 0)
+                latencies[0] = bench_now() - elapsed;
+            elapsed = bench_now() - elapsed;
+            basprintf(&path, "size=%lu clients=1",
+                      (unsigned long) params.size);
+            bench_report("queue-purge-all", path, latencies, 1, elapsed);
+            free(path);
+            bench_latencies_free(latencies, 1);
+        }
+        empty_queue();
+        free(params.entries);
+    }
+
+    /* Clean up. */
+    free(sizes);
+    if (backend != NULL)
+        test_file_path_free(backend);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    rmdir("queue");
+    unlink("krb5.conf");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,857 @@
+/*
+ * Stress test of the queue lock shared by the plugin and krb5-sync-backend.
+ *
+ * Runs several simulated kadmind processes that call sync_chpass and
+ * sync_status with ad_queue_only set, so that every change is queued, while
+ * other processes drain the queue and krb5-sync-backend list and purge run
+ * in loops.  The queue is drained both by processes that do what
+ * krb5-sync-backend process does using the plugin's queue lock and, if the
+ * Perl modules krb5-sync-backend needs are installed, by krb5-sync-backend
+ * process itself.  Either way, each queued change is applied by a stand-in
+ * for Active Directory that appends it to a log and removes the queue file,
+ * and that can be told to fail some of the time.
+ *
+ * Once the queue is empty, checks the log against the changes the writers
+ * queued: every queued change must have been applied exactly once, and
+ * changes for the same user and operation must have been applied in the
+ * order in which they were made.  Reports the latency of the writers, the
+ * time the drain processes waited for the queue lock, the latency of each
+ * krb5-sync-backend command, and the time to empty the queue once the
+ * writers finished, and exits with status 1 if a check failed.
+ *
+ * krb5-sync-backend runs a copy of itself that runs this program instead of
+ * krb5-sync to apply changes.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <plugin/internal.h>
+#include <tests/bench/bench.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* The maximum number of latencies recorded by each looping process. */
+#define LOOP_MAX 100000
+
+/* The line in krb5-sync-backend that sets the program it runs. */
+#define SYNC_LINE "my $SYNC = '/usr/sbin/krb5-sync';"
+
+/* The roles of the looping processes. */
+enum role {
+    ROLE_DRAIN,                 /* Drain the queue with the plugin's lock */
+    ROLE_PROCESS,               /* krb5-sync-backend process */
+    ROLE_LIST,                  /* krb5-sync-backend list */
+    ROLE_PURGE                  /* krb5-sync-backend purge */
+};
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: stress [-h] [-d <drains>] [-e <every>] [-k <keys>] [-l <lists>]\n\
+              [-n <count>] [-p <processes>] [-u <purges>] [-w <writers>]\n\
+\n\
+  -d <drains>     Number of processes draining the queue (default: 2)\n\
+  -e <every>      Fail about every <every>th change applied (default: 0)\n\
+  -h              Show this help\n\
+  -k <keys>       Number of users for each writer (default: 64)\n\
+  -l <lists>      Number of krb5-sync-backend list loops (default: 1)\n\
+  -n <count>      Number of changes made by each writer (default: 2000)\n\
+  -p <processes>  Number of krb5-sync-backend process loops (default: 1)\n\
+  -u <purges>     Number of krb5-sync-backend purge loops (default: 1)\n\
+  -w <writers>    Number of simulated kadmind processes (default: 4)\n";
+
+/*
+ * The state shared by all the processes.  done is set once all the writers
+ * have finished.  Each looping process records its latencies in its own part
+ * of the latencies array in struct params and the number of them in counts.
+ */
+struct shared {
+    volatile sig_atomic_t done;
+    unsigned long counts[];
+};
+
+/* The parameters of the run, shared by all the processes. */
+struct params {
+    unsigned long writers;
+    unsigned long count;
+    unsigned long keys;
+    unsigned long every;
+    unsigned long loops;
+    const char *backend;
+    struct shared *shared;
+    unsigned char *acked;
+    uint64_t *writes;
+    uint64_t *latencies;
+};
+
+/* A change applied by the Active Directory stand-in, read from the log. */
+struct applied {
+    unsigned long writer;
+    unsigned long key;
+    unsigned long index;
+    bool password;
+    uint64_t origin;
+    char trace[64];
+};
+
+
+/*
+ * Return the user for change index of writer.  Each writer has its own users
+ * so that the order in which it made changes is the order in which they
+ * have to be applied.
+ */
+static char *
+change_user(const struct params *params, unsigned long writer,
+            unsigned long index)
+{
+    char *user;
+
+    basprintf(&user, "stress%luk%lu", writer, index % params->keys);
+    return user;
+}
+
+
+/*
+ * Whether change index is a password change rather than a status change.
+ * One in four changes is a status change.
+ */
+static bool
+change_password(unsigned long index)
+{
+    return index % 4 != 3;
+}
+
+
+/*
+ * Apply a queued change as Active Directory would, by appending it to the
+ * log and removing the queue file.  The caller must hold the queue lock.
+ * Fails if it's time to fail based on the given counter.  Returns true if
+ * the change was applied.
+ */
+static bool
+apply(const char *path, const char *log, unsigned long every,
+      unsigned long counter)
+{
+    char data[BUFSIZ], line[BUFSIZ];
+    char *fields[6], *p;
+    ssize_t status;
+    size_t n;
+    int fd;
+
+    if (every > 0 && counter % every == every - 1)
+        return false;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    status = read(fd, data, sizeof(data) - 1);
+    close(fd);
+    if (status <= 0)
+        return false;
+    data[status] = '\0';
+
+    /* Split the file into lines, which may not include the password. */
+    memset(fields, 0, sizeof(fields));
+    for (n = 0, p = data; n < 6 && *p != '\0'; n++) {
+        fields[n] = p;
+        p = strchr(p, '\n');
+        if (p == NULL)
+            break;
+        *p++ = '\0';
+    }
+    if (fields[2] == NULL)
+        return false;
+    if (strcmp(fields[2], "password") != 0) {
+        memmove(&fields[4], &fields[3], 2 * sizeof(char *));
+        fields[3] = (char *) "-";
+    }
+    if (fields[4] == NULL || fields[5] == NULL)
+        return false;
+
+    /* Log the change and remove the queue file. */
+    snprintf(line, sizeof(line), "%s %s %s %s %s\n", fields[0], fields[2],
+             fields[3], fields[4], fields[5]);
+    fd = open(log, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (fd < 0)
+        return false;
+    status = write(fd, line, strlen(line));
+    close(fd);
+    if (status < (ssize_t) strlen(line))
+        return false;
+    return unlink(path) == 0;
+}
+
+
+/*
+ * Apply one change when run by krb5-sync-backend process in place of
+ * krb5-sync, taking the log and failure rate from the environment.  Since
+ * this is a new process for each change, failures are chosen by the
+ * microsecond.
+ */
+static int
+apply_command(const char *path)
+{
+    const char *log, *every;
+
+    log = getenv("STRESS_LOG");
+    every = getenv("STRESS_EVERY");
+    if (log == NULL || every == NULL)
+        return 1;
+    if (!apply(path, log, strtoul(every, NULL, 10), bench_now()))
+        return 1;
+    return 0;
+}
+
+
+/*
+ * Run krb5-sync-backend with the given command and optional argument on the
+ * queue, discarding its output, and return its exit status.
+ */
+static int
+run_backend(const char *backend, const char *command, const char *argument)
+{
+    pid_t child;
+    int fd, status;
+
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        fd = open("/dev/null", O_RDWR);
+        if (fd < 0)
+            _exit(255);
+        if (dup2(fd, 0) < 0 || dup2(fd, 1) < 0 || dup2(fd, 2) < 0)
+            _exit(255);
+        execl(backend, backend, command, "-d", "queue", argument,
+              (char *) NULL);
+        _exit(255);
+    }
+    if (waitpid(child, &status, 0) < 0)
+        sysbail("cannot wait for krb5-sync-backend");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 255;
+}
+
+
+/*
+ * Copy krb5-sync-backend into the current directory, changing it to run the
+ * given program rather than krb5-sync.  Returns false if it can't be found or
+ * doesn't set the program where we expect.
+ */
+static bool
+copy_backend(const char *program)
+{
+    char *path, *data, *line, *copy;
+    struct stat st;
+    ssize_t status;
+    int fd;
+
+    path = test_file_path("../tools/krb5-sync-backend");
+    if (path == NULL)
+        return false;
+    fd = open(path, O_RDONLY);
+    test_file_path_free(path);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        return false;
+    data = bmalloc((size_t) st.st_size + 1);
+    status = read(fd, data, (size_t) st.st_size);
+    close(fd);
+    if (status != st.st_size) {
+        free(data);
+        return false;
+    }
+    data[st.st_size] = '\0';
+    line = strstr(data, SYNC_LINE);
+    if (line == NULL) {
+        free(data);
+        return false;
+    }
+    *line = '\0';
+    basprintf(&copy, "%smy $SYNC = '%s';%s", data, program,
+              line + strlen(SYNC_LINE));
+    free(data);
+    fd = open("krb5-sync-backend", O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd < 0)
+        sysbail("cannot create krb5-sync-backend");
+    if (write(fd, copy, strlen(copy)) < (ssize_t) strlen(copy))
+        sysbail("cannot write krb5-sync-backend");
+    if (close(fd) < 0)
+        sysbail("cannot flush krb5-sync-backend");
+    free(copy);
+    return true;
+}
+
+
+/*
+ * Set up a Kerberos context and the plugin, calling bail on failure.
+ */
+static void
+plugin_setup(krb5_context *ctx, kadm5_hook_modinfo **config)
+{
+    krb5_error_code code;
+
+    code = krb5_init_context(ctx);
+    if (code != 0)
+        bail("cannot initialize Kerberos context");
+    code = sync_init(*ctx, config);
+    if (code != 0)
+        bail_krb5(*ctx, code, "cannot initialize plugin");
+}
+
+
+/*
+ * Make the changes of one writer, recording the latency of each and whether
+ * the plugin accepted it.  Status changes for each user alternate between
+ * disabling and enabling.
+ */
+static void
+writer(struct params *params, unsigned long writer)
+{
+    krb5_context ctx;
+    kadm5_hook_modinfo *config;
+    krb5_principal princ;
+    krb5_error_code code;
+    unsigned long i, slot;
+    uint64_t before;
+    char *user, *password;
+
+    plugin_setup(&ctx, &config);
+    for (i = 0; i < params->count; i++) {
+        slot = writer * params->count + i;
+        user = change_user(params, writer, i);
+        code = krb5_parse_name(ctx, user, &princ);
+        if (code != 0)
+            bail_krb5(ctx, code, "cannot parse %s", user);
+        before = bench_now();
+        if (change_password(i)) {
+            basprintf(&password, "p%lu", i);
+            code = sync_chpass(config, ctx, princ, password);
+            free(password);
+        } else {
+            code = sync_status(config, ctx, princ,
+                               (i / params->keys) % 2 == 1);
+        }
+        if (code == 0) {
+            params->writes[slot] = bench_now() - before;
+            params->acked[slot] = 1;
+        }
+        krb5_free_principal(ctx, princ);
+        free(user);
+    }
+    sync_close(ctx, config);
+    krb5_free_context(ctx);
+}
+
+
+/*
+ * Take the queue lock, recording how long that took.
+ */
+static int
+drain_lock(struct params *params, kadm5_hook_modinfo *config,
+           krb5_context ctx, unsigned long loop)
+{
+    unsigned long *count = &params->shared->counts[loop];
+    uint64_t before;
+    krb5_error_code code;
+    int lock;
+
+    before = bench_now();
+    code = sync_queue_lock(config, ctx, &lock);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot lock queue");
+    if (*count < LOOP_MAX)
+        params->latencies[loop * LOOP_MAX + (*count)++] = bench_now() - before;
+    return lock;
+}
+
+
+/*
+ * Make one pass over the queue the way that krb5-sync-backend process does:
+ * read the sorted queue under the lock, then, for each file that still
+ * exists, apply it under the lock, skipping later changes with the same
+ * user, target, and operation once one fails.  Returns true if the queue was
+ * empty.
+ */
+static bool
+drain_pass(struct params *params, kadm5_hook_modinfo *config,
+           krb5_context ctx, unsigned long loop, unsigned long *counter)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char **files = NULL, **failed;
+    char *path, *end;
+    size_t i, j, n = 0, size = 0, nfailed = 0;
+    struct stat st;
+    bool skip;
+    int lock;
+
+    lock = drain_lock(params, config, ctx, loop);
+    dir = opendir("queue");
+    if (dir == NULL)
+        sysbail("cannot open queue");
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (n == size) {
+            size = (size == 0) ? 64 : size * 2;
+            files = breallocarray(files, size, sizeof(char *));
+        }
+        files[n++] = bstrdup(entry->d_name);
+    }
+    closedir(dir);
+    sync_queue_unlock(lock);
+    if (n == 0) {
+        free(files);
+        return true;
+    }
+    sync_sort_strings(files, n);
+    failed = bcalloc(n, sizeof(char *));
+    for (i = 0; i < n; i++) {
+        end = strchr(files[i], '-');
+        if (end != NULL)
+            end = strchr(end + 1, '-');
+        if (end != NULL)
+            end = strchr(end + 1, '-');
+        if (end == NULL)
+            bail("invalid queue file name %s", files[i]);
+        *end = '\0';
+        skip = false;
+        for (j = 0; j < nfailed; j++)
+            if (strcmp(failed[j], files[i]) == 0)
+                skip = true;
+        *end = '-';
+        if (skip)
+            continue;
+        lock = drain_lock(params, config, ctx, loop);
+        basprintf(&path, "queue/%s", files[i]);
+        if (stat(path, &st) == 0
+            && !apply(path, "log", params->every, (*counter)++)) {
+            *end = '\0';
+            failed[nfailed++] = files[i];
+        }
+        sync_queue_unlock(lock);
+        free(path);
+    }
+    for (i = 0; i < n; i++)
+        free(files[i]);
+    free(files);
+    free(failed);
+    return false;
+}
+
+
+/*
+ * Run one looping process until the writers have finished and, for the
+ * processes that drain the queue, the queue is empty.  Records the latency
+ * of each krb5-sync-backend command, or each wait for the lock when draining
+ * with the plugin.
+ */
+static void
+loop(struct params *params, enum role role, unsigned long loop)
+{
+    krb5_context ctx;
+    kadm5_hook_modinfo *config;
+    unsigned long *count = &params->shared->counts[loop];
+    unsigned long counter = 0;
+    uint64_t before, latency;
+    bool done, empty;
+
+    if (role == ROLE_DRAIN)
+        plugin_setup(&ctx, &config);
+    do {
+        done = params->shared->done;
+        before = bench_now();
+        switch (role) {
+        case ROLE_DRAIN:
+            empty = drain_pass(params, config, ctx, loop, &counter);
+            break;
+        case ROLE_PROCESS:
+            empty = (run_backend(params->backend, "process", NULL) == 0);
+            break;
+        case ROLE_LIST:
+            if (run_backend(params->backend, "list", NULL) != 0)
+                bail("krb5-sync-backend list failed");
+            empty = true;
+            break;
+        case ROLE_PURGE:
+        default:
+            if (run_backend(params->backend, "purge", "36500") != 0)
+                bail("krb5-sync-backend purge failed");
+            empty = true;
+            break;
+        }
+        latency = bench_now() - before;
+        if (role != ROLE_DRAIN && *count < LOOP_MAX)
+            params->latencies[loop * LOOP_MAX + (*count)++] = latency;
+        if (empty && !done)
+            usleep(1000);
+    } while (!done || !empty);
+    if (role == ROLE_DRAIN) {
+        sync_close(ctx, config);
+        krb5_free_context(ctx);
+    }
+}
+
+
+/*
+ * Report the latencies of the looping processes with the given role.
+ */
+static void
+report_loops(struct params *params, enum role *roles, enum role role,
+             const char *name, const char *label, uint64_t elapsed)
+{
+    uint64_t *latencies;
+    unsigned long i, j, n = 0;
+
+    for (i = 0; i < params->loops; i++)
+        if (roles[i] == role)
+            n += params->shared->counts[i];
+    if (n == 0)
+        return;
+    latencies = bcalloc(n, sizeof(uint64_t));
+    n = 0;
+    for (i = 0; i < params->loops; i++)
+        if (roles[i] == role)
+            for (j = 0; j < params->shared->counts[i]; j++)
+                latencies[n++] = params->latencies[i * LOOP_MAX + j];
+    bench_report(name, label, latencies, n, elapsed);
+    free(latencies);
+}
+
+
+/*
+ * Parse one line of the log into a struct applied.  Returns false if the
+ * line is invalid.
+ */
+static bool
+parse_applied(const struct params *params, char *line, struct applied *out)
+{
+    char user[64], operation[16], password[64];
+    unsigned long seconds, micro;
+
+    if (sscanf(line, "%63s %15s %63s trace %63s origin %lu.%lu", user,
+               operation, password, out->trace, &seconds, &micro) != 6)
+        return false;
+    if (sscanf(user, "stress%luk%lu", &out->writer, &out->key) != 2)
+        return false;
+    if (out->writer >= params->writers || out->key >= params->keys)
+        return false;
+    out->password = (strcmp(operation, "password") == 0);
+    if (out->password) {
+        if (sscanf(password, "p%lu", &out->index) != 1)
+            return false;
+        if (out->index >= params->count)
+            return false;
+    }
+    out->origin = (uint64_t) seconds * 1000000 + micro;
+    return true;
+}
+
+
+/*
+ * Check the log of applied changes against the changes that the writers
+ * made.  Every password change that was accepted must have been applied
+ * once, every status change accepted for a user must have been applied, no
+ * change may be applied twice, and the changes for each user and operation
+ * must be applied in the order they were made, which for one writer is the
+ * order of their origin times.  Reports the counts and returns the number of
+ * problems.
+ */
+static unsigned long
+check_log(const struct params *params)
+{
+    FILE *log;
+    char line[BUFSIZ];
+    struct applied change;
+    unsigned long *applied, *status;
+    uint64_t *last;
+    char **traces;
+    size_t i, slots, n = 0, size = 0, j;
+    unsigned long acked = 0, lost = 0, duplicated = 0, misordered = 0;
+    unsigned long invalid = 0, total = 0;
+
+    slots = params->writers * params->count;
+    applied = bcalloc(slots, sizeof(unsigned long));
+    status = bcalloc(params->writers * params->keys, sizeof(unsigned long));
+    last = bcalloc(params->writers * params->keys * 2, sizeof(uint64_t));
+    traces = NULL;
+    log = fopen("log", "r");
+    while (log != NULL && fgets(line, sizeof(line), log) != NULL) {
+        total++;
+        if (!parse_applied(params, line, &change)) {
+            invalid++;
+            continue;
+        }
+        if (change.password)
+            applied[change.writer * params->count + change.index]++;
+        else
+            status[change.writer * params->keys + change.key]++;
+        j = (change.writer * params->keys + change.key) * 2
+            + (change.password ? 1 : 0);
+        if (change.origin < last[j])
+            misordered++;
+        last[j] = change.origin;
+        if (n == size) {
+            size = (size == 0) ? 1024 : size * 2;
+            traces = breallocarray(traces, size, sizeof(char *));
+        }
+        traces[n++] = bstrdup(change.trace);
+    }
+    if (log != NULL)
+        fclose(log);
+
+    /* Compare with the changes that were accepted. */
+    for (i = 0; i < slots; i++) {
+        if (!params->acked[i])
+            continue;
+        acked++;
+        if (!change_password(i % params->count)) {
+            j = (i / params->count) * params->keys
+                + (i % params->count) % params->keys;
+            if (status[j] > 0)
+                status[j]--;
+            else
+                lost++;
+        } else if (applied[i] == 0)
+            lost++;
+        else if (applied[i] > 1)
+            duplicated += applied[i] - 1;
+    }
+    for (j = 0; j < params->writers * params->keys; j++)
+        duplicated += status[j];
+    if (n > 0) {
+        sync_sort_strings(traces, n);
+        for (i = 1; i < n; i++)
+            if (strcmp(traces[i - 1], traces[i]) == 0)
+                duplicated++;
+    }
+    printf("# invariants: acked=%lu applied=%lu lost=%lu duplicated=%lu"
+           " misordered=%lu invalid=%lu\n", acked, total, lost, duplicated,
+           misordered, invalid);
+    for (i = 0; i < n; i++)
+        free(traces[i]);
+    free(traces);
+    free(applied);
+    free(status);
+    free(last);
+    return lost + duplicated + misordered + invalid;
+}
+
+
+/*
+ * Fork a process to run the given function and return its PID.
+ */
+static pid_t
+spawn(struct params *params, enum role role, unsigned long index, bool write)
+{
+    pid_t child;
+
+    fflush(stdout);
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        if (write)
+            writer(params, index);
+        else
+            loop(params, role, index);
+        _exit(0);
+    }
+    return child;
+}
+
+
+/*
+ * Wait for all of the given processes, calling bail if any failed.
+ */
+static void
+reap(pid_t *children, unsigned long count)
+{
+    unsigned long i;
+    int status;
+
+    for (i = 0; i < count; i++) {
+        if (waitpid(children[i], &status, 0) != children[i])
+            sysbail("cannot wait for process");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            bail("stress process %lu failed", i);
+    }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct params params;
+    enum role *roles;
+    pid_t *writers, *loops;
+    char *tmpdir, *krb5_config, *program, *env_log, *env_every;
+    char *label;
+    const char *const settings[] = { "ad_queue_only", "true", NULL };
+    unsigned long drains = 2, processes = 1, lists = 1, purges = 1, i, n;
+    unsigned long problems;
+    uint64_t start, finish, drained;
+    size_t shared_size;
+    int option;
+
+    /* If run by krb5-sync-backend process, apply a change. */
+    if (argc == 3 && strcmp(argv[1], "-f") == 0)
+        return apply_command(argv[2]);
+
+    /* Parse the command-line options. */
+    memset(&params, 0, sizeof(params));
+    params.writers = 4;
+    params.count = 2000;
+    params.keys = 64;
+    while ((option = getopt(argc, argv, "d:e:hk:l:n:p:u:w:")) != EOF) {
+        switch (option) {
+        case 'd': drains = strtoul(optarg, NULL, 10);           break;
+        case 'e': params.every = strtoul(optarg, NULL, 10);     break;
+        case 'k': params.keys = strtoul(optarg, NULL, 10);      break;
+        case 'l': lists = strtoul(optarg, NULL, 10);            break;
+        case 'n': params.count = strtoul(optarg, NULL, 10);     break;
+        case 'p': processes = strtoul(optarg, NULL, 10);        break;
+        case 'u': purges = strtoul(optarg, NULL, 10);           break;
+        case 'w': params.writers = strtoul(optarg, NULL, 10);   break;
+
+        case 'h':
+            printf("%s", usage_message);
+            exit(0);
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(1);
+        }
+    }
+    if (params.writers == 0 || params.count == 0 || params.keys == 0) {
+        fprintf(stderr, "%s", usage_message);
+        exit(1);
+    }
+    program = realpath(argv[0], NULL);
+    if (program == NULL)
+        sysbail("cannot find path to %s", argv[0]);
+
+    /* Work in a temporary directory with a queue and ad_queue_only set. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+    sync_make_config(tmpdir, settings);
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    basprintf(&env_log, "STRESS_LOG=%s/log", tmpdir);
+    basprintf(&env_every, "STRESS_EVERY=%lu", params.every);
+    if (putenv(krb5_config) < 0 || putenv(env_log) < 0
+        || putenv(env_every) < 0)
+        sysbail("cannot set environment variables");
+
+    /* Use a copy of krb5-sync-backend if it works. */
+    if (copy_backend(program)
+        && run_backend("./krb5-sync-backend", "list", NULL) == 0)
+        params.backend = "./krb5-sync-backend";
+    else {
+        printf("# skip krb5-sync-backend: it does not run\n");
+        processes = 0;
+        lists = 0;
+        purges = 0;
+    }
+    if (drains + processes == 0)
+        bail("nothing would drain the queue");
+
+    /* Set up the shared state. */
+    params.loops = drains + processes + lists + purges;
+    shared_size = sizeof(struct shared) + params.loops * sizeof(long);
+    params.shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    params.acked = mmap(NULL, params.writers * params.count,
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    if (params.shared == MAP_FAILED || params.acked == MAP_FAILED)
+        sysbail("cannot map shared memory");
+    memset(params.shared, 0, shared_size);
+    memset(params.acked, 0, params.writers * params.count);
+    params.writes = bench_latencies(params.writers * params.count);
+    params.latencies = bench_latencies(params.loops * LOOP_MAX);
+
+    /* Start the looping processes and then the writers. */
+    roles = bcalloc(params.loops, sizeof(enum role));
+    for (i = 0; i < params.loops; i++) {
+        if (i < drains)
+            roles[i] = ROLE_DRAIN;
+        else if (i < drains + processes)
+            roles[i] = ROLE_PROCESS;
+        else if (i < drains + processes + lists)
+            roles[i] = ROLE_LIST;
+        else
+            roles[i] = ROLE_PURGE;
+    }
+    loops = bcalloc(params.loops, sizeof(pid_t));
+    for (i = 0; i < params.loops; i++)
+        loops[i] = spawn(&params, roles[i], i, false);
+    start = bench_now();
+    writers = bcalloc(params.writers, sizeof(pid_t));
+    for (i = 0; i < params.writers; i++)
+        writers[i] = spawn(&params, ROLE_DRAIN, i, true);
+
+    /* Wait for the writers, tell the loops, and wait for them to finish. */
+    reap(writers, params.writers);
+    finish = bench_now();
+    params.shared->done = 1;
+    reap(loops, params.loops);
+    drained = bench_now() - finish;
+
+    /* Report the results. */
+    basprintf(&label, "writers=%lu keys=%lu drains=%lu processes=%lu"
+              " lists=%lu purges=%lu every=%lu", params.writers, params.keys,
+              drains, processes, lists, purges, params.every);
+    n = params.writers * params.count;
+    bench_report("stress-write", label, params.writes, n, finish - start);
+    report_loops(&params, roles, ROLE_DRAIN, "stress-lock-wait", label,
+                 finish - start + drained);
+    report_loops(&params, roles, ROLE_PROCESS, "stress-process", label,
+                 finish - start + drained);
+    report_loops(&params, roles, ROLE_LIST, "stress-list", label,
+                 finish - start + drained);
+    report_loops(&params, roles, ROLE_PURGE, "stress-purge", label,
+                 finish - start + drained);
+    printf("# drain: seconds=%.6f\n", (double) drained / 1000000.0);
+    problems = check_log(&params);
+
+    /* Clean up. */
+    free(label);
+    free(roles);
+    free(loops);
+    free(writers);
+    bench_latencies_free(params.writes, n);
+    bench_latencies_free(params.latencies, params.loops * LOOP_MAX);
+    munmap(params.acked, params.writers * params.count);
+    munmap(params.shared, shared_size);
+    putenv((char *) "KRB5_CONFIG=");
+    putenv((char *) "STRESS_LOG=");
+    putenv((char *) "STRESS_EVERY=");
+    free(krb5_config);
+    free(env_log);
+    free(env_every);
+    free(program);
+    unlink("queue/.lock");
+    rmdir("queue");
+    unlink("log");
+    unlink("krb5-sync-backend");
+    unlink("krb5.conf");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    return (problems > 0) ? 1 : 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Fuzzing harness for parsing queue files.
+ *
+ * Defines LLVMFuzzerTestOneInput for libFuzzer, which passes each input to
+ * queue_file_parse the way krb5-sync would see it after reading a queue
+ * file.  Built with -DLIBFUZZER and -fsanitize=fuzzer, libFuzzer provides
+ * main.  Otherwise, main parses each file named on the command line, or
+ * standard input if there are none, so the same program works with AFL and
+ * for reproducing a crash.  The seed corpus is tests/data/queue.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include <tools/internal.h>
+
+/* Declare the entry point to keep the compiler warnings quiet. */
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+
+/*
+ * Parse one input.  The parser needs a byte after the data, so copy the
+ * input into a buffer of exactly that size so that reads past it are caught
+ * by AddressSanitizer.  Always returns 0, as libFuzzer requires.
+ */
+int
+LLVMFuzzerTestOneInput(const uint8_t *input, size_t size)
+{
+    struct queue_change change;
+    char *data;
+
+    data = malloc(size + 1);
+    if (data == NULL)
+        abort();
+    if (size > 0)
+        memcpy(data, input, size);
+    queue_file_parse(data, size, &change);
+    free(data);
+    return 0;
+}
+
+
+#ifndef LIBFUZZER
+
+/*
+ * Read all of the given file descriptor into a newly allocated buffer,
+ * storing its length in size.  Exits on failure.
+ */
+static uint8_t *
+read_input(int fd, const char *name, size_t *size)
+{
+    uint8_t *data = NULL;
+    size_t length = 0;
+    size_t allocated = 0;
+    ssize_t status;
+
+    do {
+        if (length == allocated) {
+            allocated = (allocated == 0) ? BUFSIZ : allocated * 2;
+            data = realloc(data, allocated);
+            if (data == NULL) {
+                fprintf(stderr, "queue: cannot allocate memory\n");
+                exit(1);
+            }
+        }
+        status = read(fd, data + length, allocated - length);
+        if (status < 0 && errno != EINTR) {
+            fprintf(stderr, "queue: cannot read %s: %s\n", name,
+                    strerror(errno));
+            exit(1);
+        }
+        if (status > 0)
+            length += (size_t) status;
+    } while (status != 0);
+    *size = length;
+    return data;
+}
+
+
+/*
+ * Parse each file named on the command line, or standard input if there are
+ * none.
+ */
+int
+main(int argc, char *argv[])
+{
+    uint8_t *data;
+    size_t size;
+    int fd, i;
+
+    if (argc < 2) {
+        data = read_input(STDIN_FILENO, "standard input", &size);
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+        return 0;
+    }
+    for (i = 1; i < argc; i++) {
+        fd = open(argv[i], O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "queue: cannot open %s: %s\n", argv[i],
+                    strerror(errno));
+            exit(1);
+        }
+        data = read_input(fd, argv[i], &size);
+        close(fd);
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+    }
+    return 0;
+}
+
+#endif /* !LIBFUZZER */
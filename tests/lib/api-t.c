@@ -0,0 +1,150 @@
+/*
+ * Tests for the krb5-sync library interface.
+ *
+ * Force queuing, since we have no Active Directory to talk to, and then check
+ * that changes made through a handle are queued and that errors are returned
+ * as error objects.  The handle reads its configuration from a file rather
+ * than the environment.  Then configure two targets without queuing, so that
+ * changes are pushed in threads, and check that the threads also read that
+ * file instead of the broken default configuration.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <lib/krb5-sync.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+
+int
+main(void)
+{
+    char *path, *tmpdir, *krb5_config;
+    const char *const settings[] = { "ad_queue_only", "true", NULL };
+    const char *const targets[] = {
+        "ad_targets", "ad forest2",
+        "forest2.ad_realm", "FOREST2.EXAMPLE.COM",
+        "forest2.ad_admin_server", "dc.forest2.example.com",
+        "log_file", "log.json",
+        NULL
+    };
+    FILE *file;
+    struct krb5_sync *sync;
+    struct krb5_sync_error *error;
+    struct krb5_sync_change changes[3];
+    size_t failed;
+
+    /* Define the plan. */
+    plan(58);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with ad_queue_only set. */
+    sync_make_config(tmpdir, settings);
+
+    /* Create a handle using that krb5.conf file. */
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    sync = krb5_sync_new(path, &error);
+    ok(sync != NULL, "krb5_sync_new succeeds");
+    ok(error == NULL, "...with no error");
+    if (sync == NULL)
+        bail("cannot create handle: %s", krb5_sync_error_message(error));
+
+    /* Single changes are queued. */
+    error = krb5_sync_password(sync, "test@EXAMPLE.COM", "foobar");
+    ok(error == NULL, "krb5_sync_password succeeds");
+    sync_queue_check_password("queue", "test", "foobar");
+    error = krb5_sync_status(sync, "test@EXAMPLE.COM", 1);
+    ok(error == NULL, "krb5_sync_status enable succeeds");
+    sync_queue_check_enable("queue", "test", true);
+
+    /* Invalid arguments return an error object. */
+    error = krb5_sync_password(sync, "test@EXAMPLE.COM", NULL);
+    ok(error != NULL, "krb5_sync_password without a password fails");
+    is_int(EINVAL, krb5_sync_error_code(error), "...with the right code");
+    is_string("no password given", krb5_sync_error_message(error),
+              "...and the right message");
+    krb5_sync_error_free(error);
+
+    /* A batch sets the error for each change. */
+    changes[0].op = KRB5_SYNC_DISABLE;
+    changes[0].principal = "test@EXAMPLE.COM";
+    changes[0].password = NULL;
+    changes[1].op = KRB5_SYNC_ENABLE;
+    changes[1].principal = NULL;
+    changes[1].password = NULL;
+    changes[2].op = KRB5_SYNC_PASSWORD;
+    changes[2].principal = "test@EXAMPLE.COM";
+    changes[2].password = "foobar";
+    failed = krb5_sync_submit(sync, changes, 3);
+    is_int(1, failed, "krb5_sync_submit reports one failure");
+    ok(changes[0].error == NULL, "...the first change succeeded");
+    ok(changes[1].error != NULL, "...the second change failed");
+    is_string("no principal given", krb5_sync_error_message(changes[1].error),
+              "...with the right message");
+    ok(changes[2].error == NULL, "...and the third change succeeded");
+    krb5_sync_error_free(changes[1].error);
+    sync_queue_check_enable("queue", "test", false);
+    sync_queue_check_password("queue", "test", "foobar");
+    krb5_sync_free(sync);
+
+    /*
+     * Break the default configuration and configure two targets, to which
+     * password changes are pushed in threads.  There is no keytab, so the
+     * changes fail and are queued, but not because the threads couldn't
+     * create their Kerberos contexts.
+     */
+    file = fopen("broken.conf", "w");
+    if (file == NULL)
+        sysbail("cannot create broken.conf");
+    fputs("[libdefaults\n", file);
+    fclose(file);
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/broken.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    sync_make_config(tmpdir, targets);
+    sync = krb5_sync_new(path, &error);
+    ok(sync != NULL, "krb5_sync_new with two targets succeeds");
+    if (sync == NULL)
+        bail("cannot create handle: %s", krb5_sync_error_message(error));
+    error = krb5_sync_password(sync, "test@EXAMPLE.COM", "foobar");
+    ok(error == NULL, "krb5_sync_password succeeds");
+    sync_queue_check_target("queue", "ad", "test", "password", "foobar");
+    sync_queue_check_target("queue", "forest2", "test", "password", "foobar");
+    ok(sync_log_count("log.json", "failed, queuing") > 0,
+       "...and the failures are logged");
+    is_int(0, sync_log_count("log.json", "cannot create Kerberos context"),
+           "...with the threads using the configuration file");
+    krb5_sync_free(sync);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    unlink("broken.conf");
+    unlink("log.json");
+
+    /* Unwind the queue and be sure all the right files exist. */
+    ok(unlink("queue/.lock") == 0, "Lock file still exists");
+    ok(rmdir("queue") == 0, "No other files in queue directory");
+
+    /* Clean up. */
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
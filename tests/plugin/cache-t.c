@@ -0,0 +1,196 @@
+/*
+ * Tests for the persistent lookup cache in the krb5-sync plugin.
+ *
+ * Store and retrieve entries directly, since we have no Active Directory or
+ * KDC database whose lookups would fill the cache, and check that entries
+ * survive reinitializing the plugin and expire after the TTL.  Rather than
+ * waiting out the TTL, the tests change the times stored in the cache file.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* The userPrincipalName and DN used for most tests. */
+#define UPN "test@AD.EXAMPLE.COM"
+#define DN  "CN=test,ou=Accounts,dc=ad,dc=example,dc=com"
+
+/* The TTL of cache entries, in seconds. */
+#define TTL 3600
+
+/*
+ * The layout of the cache file, which must match plugin/cache.c: a header
+ * giving the number of slots, followed by fixed-size entries that start with
+ * the time at which they were stored.
+ */
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t unused;
+};
+struct cache_entry {
+    uint64_t stored;
+    uint32_t hash;
+    uint16_t kind;
+    uint16_t negative;
+    char key[232];
+    char value[264];
+};
+
+
+/*
+ * Move the time at which every entry in the cache file was stored back by
+ * the given number of seconds, or forward if it is negative.  The plugin
+ * maps the file shared, so it sees the change without being reinitialized.
+ */
+static void
+age_cache(const char *path, long seconds)
+{
+    struct cache_header header;
+    struct cache_entry entry;
+    off_t offset;
+    uint32_t i;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+        sysbail("cannot open %s", path);
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+        sysbail("cannot read %s", path);
+    for (i = 0; i < header.slots; i++) {
+        offset = sizeof(header) + (off_t) i * sizeof(entry);
+        if (pread(fd, &entry, sizeof(entry), offset) != sizeof(entry))
+            sysbail("cannot read %s", path);
+        if (entry.kind == 0)
+            continue;
+        entry.stored -= (uint64_t) seconds;
+        if (pwrite(fd, &entry, sizeof(entry), offset) != sizeof(entry))
+            sysbail("cannot write %s", path);
+    }
+    close(fd);
+}
+
+
+int
+main(void)
+{
+    char *path, *tmpdir, *krb5_config;
+    const char *const settings[] = { "ad_cache_ttl", "3600", NULL };
+    char value[512], longkey[512];
+    krb5_context ctx;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    bool negative;
+
+    /* Define the plan. */
+    plan(22);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with a one-hour cache TTL. */
+    sync_make_config(tmpdir, settings);
+
+    /* Point KRB5_CONFIG at the newly-generated krb5.conf file. */
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    is_int(TTL, config->ad_cache_ttl, "...and ad_cache_ttl is set");
+
+    /* Store and retrieve positive and negative entries. */
+    ok(!sync_cache_get(config, SYNC_CACHE_DN, UPN, value, sizeof(value),
+                       &negative), "Empty cache has no entry");
+    sync_cache_put(config, SYNC_CACHE_DN, UPN, DN);
+    ok(sync_cache_get(config, SYNC_CACHE_DN, UPN, value, sizeof(value),
+                      &negative), "Stored entry is found");
+    is_string(DN, value, "...with the right value");
+    ok(!negative, "...and is not negative");
+    sync_cache_put(config, SYNC_CACHE_DN, "other@AD.EXAMPLE.COM", NULL);
+    ok(sync_cache_get(config, SYNC_CACHE_DN, "other@AD.EXAMPLE.COM", value,
+                      sizeof(value), &negative), "Negative entry is found");
+    ok(negative, "...and is negative");
+    ok(!sync_cache_get(config, SYNC_CACHE_INSTANCE, UPN, value, sizeof(value),
+                       &negative), "Entries are separated by kind");
+    ok(!sync_cache_get(config, SYNC_CACHE_DN, UPN, value, 8, &negative),
+       "Values too large for the buffer are not returned");
+
+    /* Keys that are too long aren't cached. */
+    memset(longkey, 'a', sizeof(longkey) - 1);
+    longkey[sizeof(longkey) - 1] = '\0';
+    sync_cache_put(config, SYNC_CACHE_DN, longkey, DN);
+    ok(!sync_cache_get(config, SYNC_CACHE_DN, longkey, value, sizeof(value),
+                       &negative), "Long keys are not cached");
+
+    /* The cache survives reinitializing the plugin. */
+    sync_close(ctx, config);
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds again");
+    ok(sync_cache_get(config, SYNC_CACHE_DN, UPN, value, sizeof(value),
+                      &negative), "Stored entry is still found");
+    is_string(DN, value, "...with the right value");
+
+    /* Entries can be removed. */
+    sync_cache_remove(config, SYNC_CACHE_DN, UPN);
+    ok(!sync_cache_get(config, SYNC_CACHE_DN, UPN, value, sizeof(value),
+                       &negative), "Removed entry is not found");
+
+    /* Entries expire after the TTL, and negative entries sooner. */
+    sync_cache_put(config, SYNC_CACHE_DN, UPN, DN);
+    age_cache("queue/.cache", TTL - 2);
+    ok(sync_cache_get(config, SYNC_CACHE_DN, UPN, value, sizeof(value),
+                      &negative), "Entry is found just before it expires");
+    ok(!sync_cache_get(config, SYNC_CACHE_DN, "other@AD.EXAMPLE.COM", value,
+                       sizeof(value), &negative),
+       "...but the older negative entry is not");
+    age_cache("queue/.cache", 2);
+    ok(!sync_cache_get(config, SYNC_CACHE_DN, UPN, value, sizeof(value),
+                       &negative), "Entry is not found after it expires");
+
+    /* Entries stored in the future, after the clock went back, expire. */
+    sync_cache_put(config, SYNC_CACHE_DN, UPN, DN);
+    ok(sync_cache_get(config, SYNC_CACHE_DN, UPN, value, sizeof(value),
+                      &negative), "Stored entry is found");
+    age_cache("queue/.cache", -60);
+    ok(!sync_cache_get(config, SYNC_CACHE_DN, UPN, value, sizeof(value),
+                       &negative), "...but not if stored in the future");
+    sync_close(ctx, config);
+
+    /* Be sure the cache file was created and nothing else. */
+    ok(unlink("queue/.cache") == 0, "Cache file exists");
+    ok(rmdir("queue") == 0, "No other files in queue directory");
+
+    /* Clean up. */
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Tests for capturing changes for replay.
+ *
+ * Sets capture_file and forces queuing, makes some changes, and checks the
+ * records written to the capture file, including that the principals and
+ * passwords aren't in it and that the same user keeps the same pseudonym
+ * after the plugin is restarted.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* The number of records the test writes. */
+#define RECORDS 5
+
+
+/*
+ * Make a change for the given principal, parsing it first.  If password is
+ * NULL, the change is a status change.
+ */
+static krb5_error_code
+change(kadm5_hook_modinfo *config, krb5_context ctx, const char *name,
+       const char *password, bool enabled)
+{
+    krb5_principal princ;
+    krb5_error_code code;
+
+    code = krb5_parse_name(ctx, name, &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal %s", name);
+    if (password != NULL)
+        code = sync_chpass(config, ctx, princ, password);
+    else
+        code = sync_status(config, ctx, princ, enabled);
+    krb5_free_principal(ctx, princ);
+    return code;
+}
+
+
+/*
+ * Returns true if the string occurs in the buffer.
+ */
+static bool
+contains(const char *buffer, size_t length, const char *string)
+{
+    size_t i, size;
+
+    size = strlen(string);
+    for (i = 0; i + size <= length; i++)
+        if (memcmp(buffer + i, string, size) == 0)
+            return true;
+    return false;
+}
+
+
+int
+main(void)
+{
+    char *tmpdir, *krb5_config;
+    const char *const settings[] = {
+        "ad_queue_only", "true",
+        "capture_file", "capture",
+        NULL
+    };
+    const char *message;
+    krb5_context ctx;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct sync_capture_header header;
+    struct sync_capture_record records[RECORDS];
+    char buffer[sizeof(header) + sizeof(records)];
+    struct stat st;
+    FILE *file;
+
+    /* Define the plan. */
+    plan(60);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with ad_queue_only and capture_file set. */
+    sync_make_config(tmpdir, settings);
+
+    /* Point KRB5_CONFIG at the newly-generated krb5.conf file. */
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+
+    /* Make some changes, which are all queued. */
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    is_int(0, stat("capture", &st), "...and creates the capture file");
+    is_int(0600, st.st_mode & 0777, "...with the right mode");
+    code = change(config, ctx, "test@EXAMPLE.COM", "foobar", true);
+    is_int(0, code, "Password change succeeds");
+    sync_queue_check_password("queue", "test", "foobar");
+    code = change(config, ctx, "test@EXAMPLE.COM", NULL, false);
+    is_int(0, code, "Disable succeeds");
+    sync_queue_check_enable("queue", "test", false);
+    code = change(config, ctx, "test/admin@EXAMPLE.COM", "foobar", true);
+    is_int(0, code, "Password change for an instance succeeds");
+    code = change(config, ctx, "other@EXAMPLE.COM", "foobar", true);
+    is_int(0, code, "Password change for another user succeeds");
+    sync_queue_check_password("queue", "other", "foobar");
+
+    /* Restart the plugin, which should append to the same file. */
+    sync_close(ctx, config);
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds again");
+    code = change(config, ctx, "test@EXAMPLE.COM", NULL, true);
+    is_int(0, code, "Enable succeeds");
+    sync_queue_check_enable("queue", "test", true);
+    sync_close(ctx, config);
+
+    /* Read the capture file. */
+    file = fopen("capture", "r");
+    if (file == NULL)
+        sysbail("cannot open capture");
+    memset(buffer, 0, sizeof(buffer));
+    is_int(sizeof(buffer), fread(buffer, 1, sizeof(buffer), file),
+           "Capture file has a header and five records");
+    ok(fgetc(file) == EOF, "...and nothing else");
+    fclose(file);
+    memcpy(&header, buffer, sizeof(header));
+    memcpy(records, buffer + sizeof(header), sizeof(records));
+    is_int(SYNC_CAPTURE_MAGIC, header.magic, "...with the right magic");
+    is_int(SYNC_CAPTURE_VERSION, header.version, "...and version");
+    ok(!contains(buffer, sizeof(buffer), "foobar"), "...and no passwords");
+    ok(!contains(buffer, sizeof(buffer), "other"), "...or user names");
+
+    /* Check the records. */
+    is_int(SYNC_STATS_PASSWORD, records[0].type, "First is a password change");
+    is_int(SYNC_CAPTURE_QUEUED, records[0].outcome, "...that was queued");
+    is_int(1, records[0].queued, "...for one target");
+    is_int(SYNC_CAPTURE_BASE, records[0].shape, "...with no instance");
+    is_int(4, records[0].length, "...and the right length");
+    ok(records[0].time > 0 && records[0].time <= records[1].time,
+       "...and a time before the next change");
+    is_int(SYNC_STATS_STATUS, records[1].type, "Second is a status change");
+    is_int(0, records[1].enabled, "...disabling the account");
+    ok(records[1].user == records[0].user, "...for the same user");
+    is_int(SYNC_CAPTURE_SKIPPED, records[2].outcome, "Third was skipped");
+    is_int(SYNC_CAPTURE_OTHER, records[2].shape, "...with another instance");
+    is_int(2, records[2].components, "...and two components");
+    ok(records[2].user == records[0].user, "...for the same user");
+    ok(records[3].user != records[0].user, "Fourth is for another user");
+    is_int(5, records[3].length, "...with the right length");
+    is_int(1, records[4].enabled, "Fifth enables the account");
+    ok(records[4].user == records[0].user, "...for the same user");
+
+    /* A file that isn't a capture file is rejected. */
+    file = fopen("capture", "w");
+    if (file == NULL)
+        sysbail("cannot create capture");
+    fprintf(file, "not a capture file\n");
+    fclose(file);
+    code = sync_init(ctx, &config);
+    ok(code != 0, "sync_init fails with a bad capture file");
+    message = krb5_get_error_message(ctx, code);
+    ok(strstr(message, "not a capture file") != NULL,
+       "...with the right error");
+    krb5_free_error_message(ctx, message);
+
+    /* Clean up. */
+    unlink("capture");
+    unlink("queue/.lock");
+    rmdir("queue");
+    unlink("krb5.conf");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
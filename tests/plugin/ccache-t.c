@@ -0,0 +1,145 @@
+/*
+ * Tests for the shared credential cache in the krb5-sync plugin.
+ *
+ * We have no Active Directory KDC to talk to, so store a fake ticket-granting
+ * ticket in the shared cache and check that it is used while it's fresh,
+ * that a refresh from the keytab is attempted once it's near expiration, and
+ * that a shared cache in a directory that isn't writable only causes a
+ * warning rather than failing the refresh.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* The principal for which we store tickets, from data/krb5.conf. */
+#define PRINCIPAL "service/krb5-sync@EXAMPLE.COM"
+
+
+int
+main(void)
+{
+    char *tmpdir, *krb5_config, *path;
+    const char *const settings[] = {
+        "ad_ccache", "FILE:ad-ccache",
+        "ad_targets", "ad forest2 readonly",
+        "readonly.ad_ccache", "FILE:readonly/ad-ccache",
+        "log_file", "log.json",
+        NULL
+    };
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code, refresh;
+    krb5_creds creds;
+    kadm5_hook_modinfo *config;
+    struct sync_target *ad, *forest2, *readonly;
+    time_t now;
+
+    /* Define the plan. */
+    plan(12);
+
+    /* Set up a temporary directory. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+
+    /* Point KRB5_CONFIG at the generated krb5.conf file. */
+    sync_make_config(tmpdir, settings);
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+
+    /* Test init and that the shared cache isn't inherited. */
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    ad = sync_target_find(config, "ad");
+    forest2 = sync_target_find(config, "forest2");
+    if (ad == NULL || forest2 == NULL)
+        bail("cannot find targets");
+    is_string("FILE:ad-ccache", ad->ad_ccache, "...and ad_ccache is set");
+    ok(forest2->ad_ccache == NULL, "...and isn't inherited by forest2");
+
+    /* Fresh tickets in the shared cache are used without the keytab. */
+    code = krb5_parse_name(ctx, PRINCIPAL, &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal %s", PRINCIPAL);
+    sync_ccache_store(ctx, "FILE:ad-ccache", princ, 60 * 60);
+    now = time(NULL);
+    is_int(0, sync_ccache_creds(config, ad, ctx, princ, &creds),
+           "Credentials from the shared cache");
+    ok(creds.times.endtime >= now + 60 * 60 - 1, "...with the right lifetime");
+    ok(creds.ticket.length == strlen("ticket")
+           && memcmp(creds.ticket.data, "ticket", creds.ticket.length) == 0,
+       "...and the right ticket");
+    krb5_free_cred_contents(ctx, &creds);
+
+    /* Tickets near expiration are refreshed, which fails without a keytab. */
+    sync_ccache_store(ctx, "FILE:ad-ccache", princ, 60);
+    refresh = sync_ccache_creds(config, ad, ctx, princ, &creds);
+    ok(refresh != 0, "Refresh of expiring credentials fails without a keytab");
+    ok(access("ad-ccache.lock", F_OK) == 0, "...after taking the lock");
+    ok(access("ad-ccache", F_OK) == 0, "...and the cache wasn't destroyed");
+
+    /*
+     * If the shared cache is in a directory that isn't writable, the lock
+     * can't be taken, but the refresh from the keytab is still made and only
+     * fails for the same reason.  root can write to any directory.
+     */
+    readonly = sync_target_find(config, "readonly");
+    if (readonly == NULL)
+        bail("cannot find readonly target");
+    if (mkdir("readonly", 0755) < 0)
+        sysbail("cannot mkdir readonly");
+    sync_ccache_store(ctx, "FILE:readonly/ad-ccache", princ, 60);
+    if (chmod("readonly", 0555) < 0)
+        sysbail("cannot chmod readonly");
+    if (access("readonly", W_OK) == 0)
+        skip_block(3, "readonly directory is writable");
+    else {
+        code = sync_ccache_creds(config, readonly, ctx, princ, &creds);
+        is_int(refresh, code,
+               "Refresh in a read-only directory fails only without a keytab");
+        ok(sync_log_count("log.json", "cannot refresh tickets in"
+                          " FILE:readonly/ad-ccache") > 0,
+           "...with a warning about the shared cache");
+        ok(access("readonly/ad-ccache.lock", F_OK) != 0,
+           "...and without a lock file");
+    }
+    if (chmod("readonly", 0755) < 0)
+        sysbail("cannot chmod readonly");
+
+    /* Clean up. */
+    krb5_free_principal(ctx, princ);
+    sync_close(ctx, config);
+    krb5_free_context(ctx);
+    unlink("ad-ccache");
+    unlink("ad-ccache.lock");
+    unlink("readonly/ad-ccache");
+    rmdir("readonly");
+    unlink("log.json");
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
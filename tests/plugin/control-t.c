@@ -0,0 +1,186 @@
+/*
+ * Tests for the rate and concurrency controller in the krb5-sync plugin.
+ *
+ * Configure a rate limit and drain concurrency and then exercise the token
+ * bucket and AIMD window directly, since we have no Active Directory to talk
+ * to.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+
+/*
+ * Return the current time in seconds as a double.
+ */
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+}
+
+
+int
+main(void)
+{
+    char *tmpdir, *krb5_config, *path;
+    const char *const settings[] = {
+        "ad_rate_limit", "10",
+        "ad_rate_burst", "4",
+        "ad_live_reserve", "50",
+        "ad_drain_concurrency", "4",
+        NULL
+    };
+    const char *const invalid[] = { "ad_rate_burst", "many", NULL };
+    const char *dc;
+    double start;
+    size_t count;
+    int i;
+    krb5_context ctx;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct sync_control_info *info;
+
+    /* Define the plan. */
+    plan(35);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Point KRB5_CONFIG at the generated krb5.conf file. */
+    sync_make_config(tmpdir, settings);
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+
+    /* Test init and the parsing of the settings. */
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    ok(config != NULL, "...and config is non-NULL");
+    is_int(10, config->ad_rate_limit, "...and ad_rate_limit is correct");
+    is_int(4, config->ad_rate_burst, "...and ad_rate_burst is correct");
+    is_int(50, config->ad_live_reserve, "...and ad_live_reserve is correct");
+    is_int(4, config->ad_drain_concurrency,
+           "...and ad_drain_concurrency is correct");
+    dc = sync_control_dc(&config->ad_targets[0]);
+    is_string("ad.example.com", dc, "Controller uses ad_admin_server");
+
+    /* There is no state until the first operation. */
+    code = sync_control_list(config, ctx, &info, &count);
+    is_int(0, code, "sync_control_list succeeds");
+    is_int(0, count, "...and there is no state yet");
+
+    /* Live changes never wait, even when the bucket is empty. */
+    start = now();
+    for (i = 0; i < 5; i++)
+        if (sync_control_acquire(config, ctx, dc) != 0)
+            break;
+    is_int(5, i, "Five live changes acquire tokens");
+    ok(now() - start < 0.2, "...without waiting");
+
+    /* The queue drain must wait for the bucket to refill past the reserve. */
+    config->drain = true;
+    start = now();
+    is_int(0, sync_control_acquire(config, ctx, dc), "Drain acquires token");
+    ok(now() - start >= 0.2, "...after waiting for the live reserve");
+    config->drain = false;
+    code = sync_control_list(config, ctx, &info, &count);
+    is_int(0, code, "sync_control_list succeeds");
+    is_int(1, count, "...and there is one domain controller");
+    is_string("ad.example.com", info[0].name, "...with the right name");
+    is_int(5, info[0].live, "...and the right live count");
+    is_int(1, info[0].drain, "...and the right drain count");
+    ok(info[0].waits > 0, "...and the drain waited");
+    free(info);
+
+    /* Additive increase of the window, capped at ad_drain_concurrency. */
+    is_int(1, sync_control_window(config, dc), "Window starts at one");
+    sync_control_result(config, dc, SYNC_OUTCOME_SUCCESS);
+    is_int(2, sync_control_window(config, dc), "...and grows with success");
+    for (i = 0; i < 20; i++)
+        sync_control_result(config, dc, SYNC_OUTCOME_SUCCESS);
+    is_int(4, sync_control_window(config, dc), "...up to the maximum");
+
+    /* Multiplicative decrease, but only once per holdoff period. */
+    sync_control_result(config, dc, SYNC_OUTCOME_HARD);
+    is_int(4, sync_control_window(config, dc), "Hard failures don't back off");
+    sync_control_result(config, dc, SYNC_OUTCOME_SOFT);
+    is_int(2, sync_control_window(config, dc), "Soft failures halve window");
+    sync_control_result(config, dc, SYNC_OUTCOME_SOFT);
+    is_int(2, sync_control_window(config, dc), "...once per holdoff");
+    code = sync_control_list(config, ctx, &info, &count);
+    if (code != 0 || count != 1)
+        bail("cannot list controller state");
+    is_int(3, info[0].failures, "Failures are counted");
+    is_int(1, info[0].backoffs, "...as are backoffs");
+    free(info);
+
+    /* Latency percentiles used for hedged requests. */
+    is_int(0, sync_control_percentile(config, dc, 95),
+           "No percentile without enough samples");
+    for (i = 20; i > 0; i--)
+        sync_control_latency(config, dc, (unsigned long) i * 1000);
+    is_int(19000, sync_control_percentile(config, dc, 95), "95th percentile");
+    is_int(10000, sync_control_percentile(config, dc, 50), "50th percentile");
+    is_int(0, sync_hedge_delay(config, &config->ad_targets[0], dc,
+                               SYNC_HEDGE_CHPASS),
+           "No hedging without ad_hedge_server");
+    sync_control_hedge(config, dc, true);
+    sync_control_hedge(config, dc, false);
+    code = sync_control_list(config, ctx, &info, &count);
+    if (code != 0 || count != 1)
+        bail("cannot list controller state");
+    is_int(2, info[0].hedges, "Hedges are counted");
+    is_int(1, info[0].hedge_wins, "...as are hedge wins");
+    free(info);
+    sync_close(ctx, config);
+    krb5_free_context(ctx);
+
+    /* Invalid settings are rejected. */
+    sync_make_config(tmpdir, invalid);
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    code = sync_init(ctx, &config);
+    ok(code != 0, "sync_init fails with an invalid number");
+    krb5_free_context(ctx);
+
+    /* Clean up. */
+    ok(unlink("queue/.control") == 0, "Control file exists");
+    if (rmdir("queue") < 0)
+        sysdiag("cannot remove queue directory");
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Tests for the structured log events of the krb5-sync plugin.
+ *
+ * Log to a file through the asynchronous ring and check that a queued change
+ * is logged with its fields, that messages are escaped, and that every
+ * message is either written or counted as dropped when the ring overflows.
+ * Also check that a forked child writes only its own messages.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* Number of messages logged to overflow the ring. */
+#define FLOOD 2000
+
+
+/*
+ * Return the total number of messages reported as dropped in the log file.
+ */
+static unsigned long
+count_dropped(void)
+{
+    FILE *file;
+    char line[BUFSIZ];
+    const char *p;
+    unsigned long count = 0;
+
+    file = fopen("log.json", "r");
+    if (file == NULL)
+        sysbail("cannot open log.json");
+    while (fgets(line, sizeof(line), file) != NULL) {
+        p = strstr(line, "krb5-sync: dropped ");
+        if (p != NULL)
+            count += strtoul(p + strlen("krb5-sync: dropped "), NULL, 10);
+    }
+    fclose(file);
+    return count;
+}
+
+
+int
+main(void)
+{
+    char *path, *tmpdir, *krb5_config;
+    const char *const settings[] = {
+        "ad_queue_only", "true",
+        "stats", "true",
+        "log_file", "log.json",
+        "log_async", "true",
+        "log_level", "info",
+        NULL
+    };
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct sync_stats stats;
+    unsigned long dropped;
+    pid_t child;
+    int i, status;
+
+    /* Define the plan. */
+    plan(24);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with queuing, statistics, and a log file. */
+    sync_make_config(tmpdir, settings);
+
+    /* Point KRB5_CONFIG at the newly-generated krb5.conf file. */
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    ok(config->events != NULL, "...and events are set up");
+    ok(SYNC_LOG_ENABLED(config, SYNC_LOG_INFO), "...with info messages");
+    ok(!SYNC_LOG_ENABLED(config, SYNC_LOG_DEBUG), "...but not debug");
+
+    /* Log a structured event and messages that need escaping. */
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+    is_int(0, sync_chpass(config, ctx, princ, "foobar"),
+           "sync_chpass succeeds");
+    sync_queue_check_password("queue", "test", "foobar");
+    krb5_free_principal(ctx, princ);
+    sync_syslog_notice(config, "krb5-sync: \"quoted\"\n");
+    sync_syslog_debug(config, "krb5-sync: not logged");
+
+    /* A forked child writes only its own messages. */
+    sync_syslog_notice(config, "krb5-sync: before fork");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        sync_syslog_notice(config, "krb5-sync: in child");
+        sync_close(ctx, config);
+        _exit(0);
+    }
+    if (waitpid(child, &status, 0) != child)
+        sysbail("cannot wait for child");
+
+    /* Overflow the ring. */
+    for (i = 0; i < FLOOD; i++)
+        sync_syslog_notice(config, "krb5-sync: flood %d", i);
+    sync_stats_read(config, ctx, &stats);
+    dropped = (unsigned long) stats.log_dropped;
+    sync_close(ctx, config);
+
+    /* Check the log file. */
+    is_int(0, sync_log_count("log.json", "\"level\":\"debug\""),
+           "No debug messages logged");
+    is_int(1, sync_log_count("log.json", "\"principal\":\"test@EXAMPLE.COM\","
+                             "\"operation\":\"password\",\"target\":\"ad\","
+                             "\"outcome\":\"queued\""),
+           "Queued change logged with its fields");
+    is_int(1, sync_log_count("log.json", "\"trace\":\""),
+           "...and its trace ID");
+    is_int(1, sync_log_count("log.json", "\"message\":\"krb5-sync: "
+                             "\\\"quoted\\\"\\u000a\""),
+           "Message is escaped");
+    is_int(FLOOD - dropped, sync_log_count("log.json", "krb5-sync: flood "),
+           "Messages not dropped are logged");
+    is_int(dropped, count_dropped(), "...and dropped messages are reported");
+    is_int(1, sync_log_count("log.json", "krb5-sync: before fork"),
+           "Message before fork logged once");
+    is_int(1, sync_log_count("log.json", "krb5-sync: in child"),
+           "Child message logged");
+
+    /* Unwind the queue and be sure all the right files exist. */
+    ok(unlink("log.json") == 0, "Log file exists");
+    ok(unlink("queue/.stats") == 0, "Stats file exists");
+    ok(unlink("queue/.lock") == 0, "Lock file still exists");
+    ok(rmdir("queue") == 0, "No other files in queue directory");
+
+    /* Clean up. */
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
@@ -0,0 +1,350 @@
+/*
+ * Tests for fault injection in the krb5-sync plugin.
+ *
+ * Links in the LDAP stand-in from the test library and checks that the
+ * fault_* settings are parsed, that faults follow their schedules and can be
+ * repeated from a seed, and that injected failures in Active Directory and
+ * the queue are handled the way real ones would be.  Skipped unless the
+ * plugin was built with --enable-fault-injection.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/directory.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+#ifdef HAVE_FAULT_INJECTION
+
+/* The principal for which we store tickets, from data/krb5.conf. */
+# define PRINCIPAL "service/krb5-sync@EXAMPLE.COM"
+
+/* The test account in Active Directory. */
+# define UPN "test@AD.EXAMPLE.COM"
+# define DN  "CN=test,OU=Accounts,DC=ad,DC=example,DC=com"
+
+/* userAccountControl for a normal account, and with the disabled flag. */
+# define NORMAL   0x200
+# define DISABLED 0x202
+
+/* The most settings and values passed to setup, plus the terminating NULL. */
+# define MAX_SETTINGS 7
+
+
+/*
+ * Write a krb5.conf file using the shared credential cache and with the
+ * given NULL-terminated list of settings and values, and initialize a new
+ * Kerberos context and the plugin with it.  Returns the status of sync_init,
+ * storing its error message in message if it failed.
+ */
+static krb5_error_code
+setup(const char *tmpdir, const char *const settings[], krb5_context *ctx,
+      kadm5_hook_modinfo **config, char **message)
+{
+    const char *options[MAX_SETTINGS + 3];
+    const char *error;
+    krb5_principal princ;
+    krb5_error_code code;
+    size_t i;
+
+    options[0] = "ad_ccache";
+    options[1] = "FILE:ad-ccache";
+    for (i = 0; settings[i] != NULL && i < MAX_SETTINGS; i++)
+        options[i + 2] = settings[i];
+    options[i + 2] = NULL;
+    sync_make_config(tmpdir, options);
+
+    /* Get a new context so that the new krb5.conf file is read. */
+    code = krb5_init_context(ctx);
+    if (code != 0)
+        bail_krb5(*ctx, code, "cannot initialize Kerberos context");
+    code = krb5_parse_name(*ctx, PRINCIPAL, &princ);
+    if (code != 0)
+        bail_krb5(*ctx, code, "cannot parse principal %s", PRINCIPAL);
+    sync_ccache_store(*ctx, "FILE:ad-ccache", princ, 60 * 60);
+    krb5_free_principal(*ctx, princ);
+    *config = NULL;
+    *message = NULL;
+    code = sync_init(*ctx, config);
+    if (code != 0) {
+        error = krb5_get_error_message(*ctx, code);
+        *message = bstrdup(error);
+        krb5_free_error_message(*ctx, error);
+    }
+    return code;
+}
+
+
+/*
+ * Shut down the plugin and free the context created by setup.
+ */
+static void
+teardown(krb5_context ctx, kadm5_hook_modinfo *config)
+{
+    if (config != NULL)
+        sync_close(ctx, config);
+    krb5_free_context(ctx);
+}
+
+
+/*
+ * Call sync_fault for the given point count times and return a string of 0
+ * and 1 characters recording which calls failed.  The caller must free it.
+ */
+static char *
+schedule(enum sync_fault_point point, size_t count)
+{
+    char *result;
+    size_t i;
+
+    result = bcalloc(count + 1, 1);
+    for (i = 0; i < count; i++)
+        result[i] = sync_fault(point) ? '1' : '0';
+    return result;
+}
+
+
+/*
+ * Change the account status with sync_status and return its result, storing
+ * the error message, if it failed, in message.
+ */
+static krb5_error_code
+status(kadm5_hook_modinfo *config, krb5_context ctx, bool enabled,
+       char **message)
+{
+    krb5_principal princ;
+    krb5_error_code code;
+    const char *error;
+
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+    code = sync_status(config, ctx, princ, enabled);
+    *message = NULL;
+    if (code != 0) {
+        error = krb5_get_error_message(ctx, code);
+        *message = bstrdup(error);
+        krb5_free_error_message(ctx, error);
+    }
+    krb5_free_principal(ctx, princ);
+    return code;
+}
+
+
+/*
+ * Check that the queue is empty apart from its lock file, leaving it empty.
+ */
+static void
+check_queue_empty(const char *description)
+{
+    unlink("queue/.lock");
+    ok(rmdir("queue") == 0, "%s", description);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+}
+
+
+int
+main(void)
+{
+    char *tmpdir, *krb5_config, *message, *first, *second;
+    krb5_context ctx;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct directory_options options;
+    struct directory_counts counts;
+    struct timeval before, after;
+    long elapsed;
+    size_t i, failed;
+    char *wanted;
+    const char *settings[MAX_SETTINGS];
+    const char *const invalid[] = {
+        "probability=2", "probability=nan", "nth=-1", "nth=x", "latency=",
+        "bogus=1", NULL
+    };
+
+    /* Define the plan. */
+    plan(40);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+
+    /* Invalid settings are rejected. */
+    for (i = 0; invalid[i] != NULL; i++) {
+        settings[0] = "fault_ldap_bind";
+        settings[1] = invalid[i];
+        settings[2] = NULL;
+        code = setup(tmpdir, settings, &ctx, &config, &message);
+        basprintf(&wanted, "invalid setting %s in fault_ldap_bind",
+                  invalid[i]);
+        is_string(wanted, message, "Rejected fault setting %s", invalid[i]);
+        free(wanted);
+        free(message);
+        teardown(ctx, code == 0 ? config : NULL);
+    }
+
+    /* Faults follow their schedules and repeat with the same seed. */
+    settings[0] = "fault_creds";
+    settings[1] = "nth=3";
+    settings[2] = "fault_kpasswd";
+    settings[3] = "probability=0.5";
+    settings[4] = "fault_seed";
+    settings[5] = "42";
+    settings[6] = NULL;
+    if (setup(tmpdir, settings, &ctx, &config, &message) != 0)
+        bail("cannot initialize plugin: %s", message);
+    first = schedule(SYNC_FAULT_CREDS, 6);
+    is_string("001001", first, "nth=3 fails every third call");
+    free(first);
+    first = schedule(SYNC_FAULT_KPASSWD, 64);
+    for (failed = 0, i = 0; i < 64; i++)
+        if (first[i] == '1')
+            failed++;
+    ok(failed >= 16 && failed <= 48, "probability=0.5 fails about half");
+    second = schedule(SYNC_FAULT_LDAP_SEARCH, 16);
+    is_string("0000000000000000", second, "...and unset points never fail");
+    free(second);
+    teardown(ctx, config);
+    if (setup(tmpdir, settings, &ctx, &config, &message) != 0)
+        bail("cannot initialize plugin: %s", message);
+    second = schedule(SYNC_FAULT_KPASSWD, 64);
+    is_string(first, second, "...the same ones with the same seed");
+    free(second);
+    teardown(ctx, config);
+    settings[5] = "43";
+    if (setup(tmpdir, settings, &ctx, &config, &message) != 0)
+        bail("cannot initialize plugin: %s", message);
+    second = schedule(SYNC_FAULT_KPASSWD, 64);
+    ok(strcmp(first, second) != 0, "...and different ones with another");
+    free(first);
+    free(second);
+    teardown(ctx, config);
+
+    /* A fault in the LDAP modify happens before the modify is sent. */
+    memset(&options, 0, sizeof(options));
+    directory_start(&options);
+    directory_add(UPN, DN, NORMAL);
+    settings[0] = "fault_ldap_modify";
+    settings[1] = "nth=2";
+    settings[2] = NULL;
+    if (setup(tmpdir, settings, &ctx, &config, &message) != 0)
+        bail("cannot initialize plugin: %s", message);
+    is_int(0, status(config, ctx, false, &message), "First disable succeeds");
+    is_int(DISABLED, directory_control(UPN), "...and the account is disabled");
+    is_int(0, status(config, ctx, true, &message), "Second change is queued");
+    is_int(DISABLED, directory_control(UPN), "...and not made");
+    directory_counts(&counts);
+    is_int(1, counts.modifies, "...and the fault stopped the modify");
+    sync_queue_check_enable("queue", "test", true);
+    teardown(ctx, config);
+
+    /* An unreachable server causes the change to be queued. */
+    directory_stop();
+    directory_start(&options);
+    directory_add(UPN, DN, NORMAL);
+    settings[0] = "fault_ldap_bind";
+    settings[1] = "probability=1";
+    if (setup(tmpdir, settings, &ctx, &config, &message) != 0)
+        bail("cannot initialize plugin: %s", message);
+    is_int(0, status(config, ctx, false, &message),
+           "sync_status succeeds with a bind fault");
+    sync_queue_check_enable("queue", "test", false);
+    directory_counts(&counts);
+    is_int(0, counts.binds, "...without binding");
+    teardown(ctx, config);
+
+    /* A failure to write the queue file doesn't leave part of one. */
+    settings[2] = "fault_queue_write";
+    settings[3] = "nth=2";
+    settings[4] = NULL;
+    if (setup(tmpdir, settings, &ctx, &config, &message) != 0)
+        bail("cannot initialize plugin: %s", message);
+    code = status(config, ctx, false, &message);
+    ok(code != 0, "Queuing fails with a write fault");
+    ok(message != NULL && strstr(message, "cannot write queue file") != NULL,
+       "...with the right error");
+    free(message);
+    check_queue_empty("...and no queue file is left behind");
+    teardown(ctx, config);
+
+    /* Failures to create the queue file and to lock the queue. */
+    settings[2] = "fault_queue_open";
+    settings[3] = "nth=1";
+    if (setup(tmpdir, settings, &ctx, &config, &message) != 0)
+        bail("cannot initialize plugin: %s", message);
+    code = status(config, ctx, false, &message);
+    ok(code != 0, "Queuing fails with an open fault");
+    ok(message != NULL && strstr(message, "cannot create queue file") != NULL,
+       "...with the right error");
+    free(message);
+    teardown(ctx, config);
+    settings[2] = "fault_queue_lock";
+    if (setup(tmpdir, settings, &ctx, &config, &message) != 0)
+        bail("cannot initialize plugin: %s", message);
+    code = status(config, ctx, false, &message);
+    ok(code != 0, "Queuing fails with a lock fault");
+    ok(message != NULL && strstr(message, "cannot flock lock file") != NULL,
+       "...with the right error");
+    free(message);
+    teardown(ctx, config);
+
+    /* Latency is added before the call. */
+    settings[0] = "fault_ldap_search";
+    settings[1] = "latency=200";
+    settings[2] = NULL;
+    if (setup(tmpdir, settings, &ctx, &config, &message) != 0)
+        bail("cannot initialize plugin: %s", message);
+    gettimeofday(&before, NULL);
+    code = status(config, ctx, false, &message);
+    gettimeofday(&after, NULL);
+    elapsed = (after.tv_sec - before.tv_sec) * 1000
+        + (after.tv_usec - before.tv_usec) / 1000;
+    is_int(0, code, "Disabling with search latency succeeds");
+    ok(elapsed >= 200, "...and waits for the latency");
+    is_int(DISABLED, directory_control(UPN), "...and the account is disabled");
+    teardown(ctx, config);
+    directory_stop();
+
+    /* Clean up. */
+    unlink("queue/.lock");
+    rmdir("queue");
+    unlink("ad-ccache");
+    unlink("krb5.conf");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
+
+#else /* !HAVE_FAULT_INJECTION */
+
+int
+main(void)
+{
+    skip_all("built without fault injection");
+    return 0;
+}
+
+#endif /* !HAVE_FAULT_INJECTION */
@@ -0,0 +1,188 @@
+/*
+ * Tests for hedging account status changes to a second domain controller.
+ *
+ * Links in the LDAP stand-in from the test library in place of the real LDAP
+ * library, makes the usual domain controller stall, and checks that a status
+ * change is hedged to ad_hedge_server, that an opposite change made while
+ * the stalled attempt is still running is queued rather than made, that the
+ * stalled attempt gives up instead of making its change after the hedge
+ * server won, and that only the stalled attempt's own latency is sampled for
+ * the usual domain controller.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/directory.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* The principal for which we store tickets, from data/krb5.conf. */
+#define PRINCIPAL "service/krb5-sync@EXAMPLE.COM"
+
+/* The usual domain controller, from data/krb5.conf, and the hedge server. */
+#define DC    "ad.example.com"
+#define HEDGE "hedge.example.com"
+
+/* How long each round trip to the usual domain controller takes, in ms. */
+#define STALL 300
+
+/* The test account in Active Directory. */
+#define UPN "test@AD.EXAMPLE.COM"
+#define DN  "CN=test,OU=Accounts,DC=ad,DC=example,DC=com"
+
+/* userAccountControl for a normal account, and with the disabled flag. */
+#define NORMAL   0x200
+#define DISABLED 0x202
+
+
+int
+main(void)
+{
+    char *tmpdir, *krb5_config;
+    const char *const settings[] = {
+        "ad_ccache", "FILE:ad-ccache",
+        "ad_hedge_server", HEDGE,
+        "ad_hedge_percentile", "50",
+        NULL
+    };
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct sync_target *ad;
+    struct sync_op op;
+    struct sync_control_info *info;
+    struct directory_options options;
+    struct directory_counts counts;
+    struct timeval before, after;
+    size_t count, i;
+    long elapsed;
+
+#if !defined(HAVE_PTHREAD) || !defined(HAVE_GSS_KRB5_CCACHE_NAME)
+    skip_all("status changes cannot be hedged on this platform");
+#endif
+
+    /* Define the plan. */
+    plan(21);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with a shared credential cache and hedging. */
+    sync_make_config(tmpdir, settings);
+
+    /* Point KRB5_CONFIG at the newly-generated krb5.conf file. */
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    code = krb5_parse_name(ctx, PRINCIPAL, &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal %s", PRINCIPAL);
+    sync_ccache_store(ctx, "FILE:ad-ccache", princ, 60 * 60);
+    krb5_free_principal(ctx, princ);
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    ad = sync_target_find(config, "ad");
+    if (ad == NULL)
+        bail("cannot find ad target");
+
+    /*
+     * Give the usual domain controller a history of fast changes so that
+     * changes are hedged after a millisecond, and then make it stall.
+     */
+    for (i = 0; i < 20; i++)
+        sync_control_latency(config, DC, 1000);
+    is_int(1000, sync_hedge_delay(config, ad, DC, SYNC_HEDGE_STATUS),
+           "Status changes are hedged after the median latency");
+    memset(&options, 0, sizeof(options));
+    strcpy(options.slow_server, DC);
+    options.slow_latency = STALL;
+    directory_start(&options);
+    directory_add(UPN, DN, NORMAL);
+
+    /* Disable the account, which the hedge server does. */
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+    gettimeofday(&before, NULL);
+    is_int(0, sync_status(config, ctx, princ, false),
+           "Disabling with a stalled domain controller succeeds");
+    gettimeofday(&after, NULL);
+    elapsed = (after.tv_sec - before.tv_sec) * 1000
+        + (after.tv_usec - before.tv_usec) / 1000;
+    ok(elapsed < STALL, "...without waiting for it");
+    is_int(DISABLED, directory_control(UPN), "...and the account is disabled");
+
+    /* The stalled attempt is still running, so enabling is queued. */
+    code = sync_op_init(&op, ctx, princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize operation");
+    ok(sync_hedge_pending(config, ad, &op, SYNC_HEDGE_STATUS),
+       "The stalled attempt is pending");
+    ok(!sync_hedge_pending(config, ad, &op, SYNC_HEDGE_CHPASS),
+       "...but doesn't conflict with password changes");
+    is_int(0, sync_status(config, ctx, princ, true),
+           "Enabling while it's pending succeeds");
+    is_int(DISABLED, directory_control(UPN), "...but isn't made yet");
+    sync_queue_check_enable("queue", "test", true);
+
+    /* Once the stalled attempt finishes, it hasn't undone anything. */
+    sync_hedge_close(config);
+    ok(!sync_hedge_pending(config, ad, &op, SYNC_HEDGE_STATUS),
+       "The stalled attempt is no longer pending once it finishes");
+    directory_counts(&counts);
+    is_int(1, counts.modifies, "...and it gave up before changing AD");
+    is_int(DISABLED, directory_control(UPN), "...so the account is as it was");
+    is_int(0, counts.handles, "...and no LDAP handles are left open");
+    sync_op_free(&op);
+    krb5_free_principal(ctx, princ);
+
+    /* The hedge is counted and its latency isn't taken for the DC's. */
+    code = sync_control_list(config, ctx, &info, &count);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot list controller state");
+    for (i = 0; i < count; i++)
+        if (strcmp(info[i].name, DC) == 0)
+            break;
+    if (i == count)
+        bail("no controller state for %s", DC);
+    is_int(1, info[i].hedge_wins, "The hedge server win is counted");
+    free(info);
+    ok(sync_control_percentile(config, DC, 100) >= 2 * STALL * 1000UL,
+       "The stalled attempt sampled its own latency");
+    directory_stop();
+
+    /* Clean up. */
+    sync_close(ctx, config);
+    krb5_free_context(ctx);
+    unlink("queue/.control");
+    unlink("queue/.lock");
+    rmdir("queue");
+    unlink("ad-ccache");
+    unlink("krb5.conf");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
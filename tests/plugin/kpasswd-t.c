@@ -0,0 +1,184 @@
+/*
+ * Tests for pushing password changes to Active Directory.
+ *
+ * Runs a kpasswd stand-in on localhost and points the Active Directory
+ * target at it, so that sync_ad_chpass makes real password changes.  This
+ * needs a test realm: config/keytab and config/principal for the principal
+ * that pushes changes, and config/kpasswd-keytab with the keys for
+ * kadmin/changepw in the same realm, so that the stand-in can decrypt the
+ * requests.  See config/README for more information.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/time.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/kpasswd.h>
+#include <tests/tap/string.h>
+
+/* The account whose password we change and its new password. */
+#define USER     "kpasswd-test"
+#define PASSWORD "kpasswd-test-password"
+
+
+/*
+ * Start a stand-in with the given options and push a password change to it
+ * with sync_ad_chpass.  Stores the counts from the stand-in in counts and the
+ * error message, if the change failed, in message.  Returns the status of
+ * the change.
+ */
+static krb5_error_code
+push(const char *tmpdir, struct kerberos_config *krbconf, const char *keytab,
+     const char *base, const struct kpasswd_options *options,
+     struct kpasswd_counts *counts, char **message)
+{
+    struct kpasswd_server *server;
+    char *krb5_config, *name;
+    const char *realm, *error;
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct sync_target *ad;
+    struct sync_op op;
+
+    /* Start the stand-in and point the configuration at it. */
+    realm = strchr(krbconf->principal, '@');
+    if (realm == NULL)
+        bail("test principal %s has no realm", krbconf->principal);
+    realm++;
+    server = kpasswd_start(keytab, realm, options);
+    krb5_config = kpasswd_config(server, tmpdir, krbconf->keytab,
+                                 krbconf->principal, base);
+
+    /* Set up the plugin. */
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    code = sync_init(ctx, &config);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize plugin");
+    ad = sync_target_find(config, "ad");
+    if (ad == NULL)
+        bail("cannot find ad target");
+
+    /* Push the change. */
+    basprintf(&name, "%s@%s", USER, realm);
+    code = krb5_parse_name(ctx, name, &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal %s", name);
+    free(name);
+    code = sync_op_init(&op, ctx, princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize operation");
+    code = sync_ad_chpass(config, ad, &op, PASSWORD);
+    *message = NULL;
+    if (code != 0) {
+        error = krb5_get_error_message(ctx, code);
+        *message = bstrdup(error);
+        krb5_free_error_message(ctx, error);
+    }
+    sync_op_free(&op);
+    krb5_free_principal(ctx, princ);
+    kpasswd_counts(server, counts);
+
+    /* Clean up. */
+    sync_close(ctx, config);
+    krb5_free_context(ctx);
+    kpasswd_stop(server);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return code;
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *krbconf;
+    struct kpasswd_options options;
+    struct kpasswd_counts counts;
+    struct timeval start, end;
+    char *tmpdir, *keytab, *base, *path, *message;
+    const char *env;
+    long elapsed;
+    krb5_error_code code;
+
+    /* Skip the tests unless a test realm is configured. */
+    krbconf = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    keytab = test_file_path("config/kpasswd-keytab");
+    if (keytab == NULL)
+        skip_all("kpasswd tests not configured");
+    plan(12);
+    tmpdir = test_tmpdir();
+
+    /* The krb5.conf file that knows about the test realm. */
+    path = test_file_path("config/krb5.conf");
+    env = getenv("KRB5_CONFIG");
+    if (path != NULL)
+        base = bstrdup(path);
+    else if (env != NULL && env[0] != '\0')
+        base = bstrdup(env);
+    else
+        base = bstrdup("/etc/krb5.conf");
+    test_file_path_free(path);
+
+    /* A successful password change. */
+    memset(&options, 0, sizeof(options));
+    code = push(tmpdir, krbconf, keytab, base, &options, &counts, &message);
+    is_int(0, code, "Password change succeeds");
+    is_int(1, counts.requests, "...with one request");
+    is_int(0, counts.rejected, "...and none rejected");
+    is_string(PASSWORD, counts.password, "...and the right password");
+    free(message);
+
+    /* An error from the server is reported. */
+    options.error_every = 1;
+    options.error_code = KRB5_KPASSWD_SOFTERROR;
+    code = push(tmpdir, krbconf, keytab, base, &options, &counts, &message);
+    ok(code != 0, "Password change fails with an error");
+    is_int(1, counts.errors, "...after one error");
+    ok(message != NULL && strstr(message, "Injected error") != NULL,
+       "...with the error message from the server");
+    free(message);
+
+    /* A password change over UDP. */
+    memset(&options, 0, sizeof(options));
+    options.udp_only = true;
+    code = push(tmpdir, krbconf, keytab, base, &options, &counts, &message);
+    is_int(0, code, "Password change over UDP succeeds");
+    is_int(1, counts.udp, "...with a UDP request");
+    is_int(0, counts.tcp, "...and no TCP requests");
+    free(message);
+
+    /* The server waits before replying if asked. */
+    memset(&options, 0, sizeof(options));
+    options.latency = 200;
+    gettimeofday(&start, NULL);
+    code = push(tmpdir, krbconf, keytab, base, &options, &counts, &message);
+    gettimeofday(&end, NULL);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000
+        + (end.tv_usec - start.tv_usec) / 1000;
+    is_int(0, code, "Password change with latency succeeds");
+    ok(elapsed >= 200, "...and waits for the reply");
+    free(message);
+
+    /* Clean up. */
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(keytab);
+    free(base);
+    return 0;
+}
@@ -0,0 +1,328 @@
+/*
+ * Tests for pushing account status changes to Active Directory.
+ *
+ * Links in the LDAP stand-in from the test library in place of the real LDAP
+ * library and checks that sync_ad_status finds the account and changes its
+ * userAccountControl, that errors from the directory are reported and cause
+ * the change to be queued, how many round trips a change takes, and that a
+ * cached DN is only used while the account has the same userPrincipalName.
+ * Then checks that sync_ad_changes reports an account whose
+ * userPrincipalName changed with its status, even though DirSync only
+ * returns the changed attribute.  There is no KDC, so a fake
+ * ticket-granting ticket in the shared credential cache stands in for the
+ * one the plugin would get from the keytab.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <ldap.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/directory.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* The principal for which we store tickets, from data/krb5.conf. */
+#define PRINCIPAL "service/krb5-sync@EXAMPLE.COM"
+
+/* The test account in Active Directory. */
+#define UPN "test@AD.EXAMPLE.COM"
+#define DN  "CN=test,OU=Accounts,DC=ad,DC=example,DC=com"
+
+/* userAccountControl for a normal account, and with the disabled flag. */
+#define NORMAL   0x200
+#define DISABLED 0x202
+
+/* The accounts reported by sync_ad_changes. */
+struct changes {
+    size_t count;
+    char upn[BUFSIZ];
+    bool disabled;
+};
+
+
+/*
+ * (Re)start the directory with the given options and the test account.
+ */
+static void
+start(const struct directory_options *options)
+{
+    directory_stop();
+    directory_start(options);
+    directory_add(UPN, DN, NORMAL);
+}
+
+
+/*
+ * Change the status of a user with sync_ad_status.  Stores the error message,
+ * if the change failed, in message.  Returns the status of the change.
+ */
+static krb5_error_code
+status(kadm5_hook_modinfo *config, krb5_context ctx, const char *user,
+       bool enabled, char **message)
+{
+    struct sync_target *ad;
+    struct sync_op op;
+    krb5_principal princ;
+    krb5_error_code code;
+    const char *error;
+
+    ad = sync_target_find(config, "ad");
+    if (ad == NULL)
+        bail("cannot find ad target");
+    code = krb5_parse_name(ctx, user, &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal %s", user);
+    code = sync_op_init(&op, ctx, princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize operation");
+    code = sync_ad_status(config, ad, &op, enabled);
+    *message = NULL;
+    if (code != 0) {
+        error = krb5_get_error_message(ctx, code);
+        *message = bstrdup(error);
+        krb5_free_error_message(ctx, error);
+    }
+    sync_op_free(&op);
+    krb5_free_principal(ctx, princ);
+    return code;
+}
+
+
+/*
+ * Record an account reported by sync_ad_changes, keeping only the last one.
+ */
+static void
+record(void *data, const char *upn, bool disabled)
+{
+    struct changes *changes = data;
+
+    changes->count++;
+    if (strlen(upn) >= sizeof(changes->upn))
+        bail("userPrincipalName %s too long", upn);
+    strcpy(changes->upn, upn);
+    changes->disabled = disabled;
+}
+
+
+/*
+ * Search for the changes since the given cookie with sync_ad_changes and
+ * return what was reported, replacing the cookie with the new one.
+ */
+static struct changes
+changes(kadm5_hook_modinfo *config, krb5_context ctx, void **cookie,
+        size_t *length)
+{
+    struct sync_target *ad;
+    struct changes changes;
+    krb5_error_code code;
+    bool invalid;
+
+    ad = sync_target_find(config, "ad");
+    if (ad == NULL)
+        bail("cannot find ad target");
+    memset(&changes, 0, sizeof(changes));
+    code = sync_ad_changes(config, ad, ctx, cookie, length, &invalid, record,
+                           &changes);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot search for changes");
+    if (invalid)
+        bail("DirSync cookie rejected");
+    return changes;
+}
+
+
+int
+main(void)
+{
+    char *tmpdir, *krb5_config, *message;
+    void *cookie = NULL;
+    size_t length = 0;
+    struct changes found;
+    const char *const settings[] = {
+        "ad_ccache", "FILE:ad-ccache",
+        "ad_cache_ttl", "3600",
+        NULL
+    };
+    char value[BUFSIZ] = "";
+    bool negative;
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct directory_options options;
+    struct directory_counts counts;
+    struct timeval before, after;
+    long elapsed;
+
+    /* Define the plan. */
+    plan(47);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with a shared credential cache and DN cache. */
+    sync_make_config(tmpdir, settings);
+
+    /* Point KRB5_CONFIG at the newly-generated krb5.conf file. */
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    code = krb5_parse_name(ctx, PRINCIPAL, &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal %s", PRINCIPAL);
+    sync_ccache_store(ctx, "FILE:ad-ccache", princ, 60 * 60);
+    krb5_free_principal(ctx, princ);
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+
+    /* Disable and then enable the account. */
+    memset(&options, 0, sizeof(options));
+    start(&options);
+    code = status(config, ctx, "test@EXAMPLE.COM", false, &message);
+    is_int(0, code, "Disabling the account succeeds");
+    is_int(DISABLED, directory_control(UPN), "...and the account is disabled");
+    directory_counts(&counts);
+    is_int(1, counts.binds, "...with one bind");
+    is_int(1, counts.searches, "...and one search");
+    is_int(1, counts.modifies, "...and one modify");
+    free(message);
+    code = status(config, ctx, "test@EXAMPLE.COM", true, &message);
+    is_int(0, code, "Enabling the account succeeds");
+    is_int(NORMAL, directory_control(UPN), "...and the account is enabled");
+    directory_counts(&counts);
+    is_int(2, counts.searches, "...with one more search");
+    is_int(0, counts.handles, "...and no LDAP handles left open");
+    is_int(0, counts.messages, "...and no search results left");
+    is_int(0, counts.dns, "...and no DNs left");
+    is_int(0, counts.values, "...and no values left");
+    free(message);
+
+    /* An account that doesn't exist. */
+    code = status(config, ctx, "missing@EXAMPLE.COM", false, &message);
+    ok(code != 0, "Disabling a missing account fails");
+    ok(message != NULL && strstr(message, "not found via LDAP") != NULL,
+       "...with the right error");
+    free(message);
+
+    /* An error from the modify. */
+    options.error_every = 1;
+    options.error_ops = DIRECTORY_MODIFY;
+    options.error_code = LDAP_BUSY;
+    start(&options);
+    code = status(config, ctx, "test@EXAMPLE.COM", false, &message);
+    ok(code != 0, "Disabling fails with a busy server");
+    ok(message != NULL && strstr(message, "LDAP modification") != NULL,
+       "...with the right error");
+    is_int(NORMAL, directory_control(UPN), "...and the account is unchanged");
+    directory_counts(&counts);
+    is_int(1, counts.errors, "...after one error");
+    free(message);
+
+    /* A server that is down causes the change to be queued. */
+    options.error_ops = DIRECTORY_BIND;
+    options.error_code = LDAP_SERVER_DOWN;
+    start(&options);
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+    is_int(0, sync_status(config, ctx, princ, false),
+           "sync_status succeeds with the server down");
+    sync_queue_check_enable("queue", "test", false);
+    directory_counts(&counts);
+    is_int(0, counts.searches, "...without searching");
+    krb5_free_principal(ctx, princ);
+
+    /* Each round trip waits for the latency. */
+    memset(&options, 0, sizeof(options));
+    options.latency = 100;
+    start(&options);
+    gettimeofday(&before, NULL);
+    code = status(config, ctx, "test@EXAMPLE.COM", false, &message);
+    gettimeofday(&after, NULL);
+    elapsed = (after.tv_sec - before.tv_sec) * 1000
+        + (after.tv_usec - before.tv_usec) / 1000;
+    is_int(0, code, "Disabling with latency succeeds");
+    ok(elapsed >= 300, "...and waits for three round trips");
+    free(message);
+
+    /* The cached DN isn't used once the account has been renamed. */
+    ok(sync_cache_get(config, SYNC_CACHE_DN, "ad " UPN, value, sizeof(value),
+                      &negative),
+       "The DN of the account is cached for the target");
+    is_string(DN, value, "...with the right value");
+    memset(&options, 0, sizeof(options));
+    start(&options);
+    directory_add("renamed@AD.EXAMPLE.COM", DN, NORMAL);
+    code = status(config, ctx, "test@EXAMPLE.COM", false, &message);
+    ok(code != 0, "Disabling an account that was renamed fails");
+    ok(message != NULL && strstr(message, "not found via LDAP") != NULL,
+       "...with the right error");
+    is_int(NORMAL, directory_control("renamed@AD.EXAMPLE.COM"),
+           "...and the renamed account is unchanged");
+    free(message);
+
+    /* The first DirSync search returns every account. */
+    memset(&options, 0, sizeof(options));
+    start(&options);
+    found = changes(config, ctx, &cookie, &length);
+    is_int(1, found.count, "DirSync without a cookie finds the account");
+    is_string(UPN, found.upn, "...with the right userPrincipalName");
+    ok(!found.disabled, "...and status");
+    found = changes(config, ctx, &cookie, &length);
+    is_int(0, found.count, "...and then no changes are found");
+
+    /*
+     * DirSync only returns the attributes that changed, but the account is
+     * still reported with its userPrincipalName and status.
+     */
+    directory_add(UPN, DN, DISABLED);
+    found = changes(config, ctx, &cookie, &length);
+    is_int(1, found.count, "Disabling the account is found");
+    is_string(UPN, found.upn, "...with the right userPrincipalName");
+    ok(found.disabled, "...and status");
+    directory_add("renamed@AD.EXAMPLE.COM", DN, DISABLED);
+    found = changes(config, ctx, &cookie, &length);
+    is_int(1, found.count, "Renaming the account is found");
+    is_string("renamed@AD.EXAMPLE.COM", found.upn,
+              "...with the right userPrincipalName");
+    ok(found.disabled, "...and status");
+    directory_counts(&counts);
+    is_int(0, counts.handles, "...and no LDAP handles left open");
+    is_int(0, counts.messages, "...and no search results left");
+    is_int(0, counts.values, "...and no values left");
+    free(cookie);
+    directory_stop();
+
+    /* Clean up. */
+    sync_close(ctx, config);
+    krb5_free_context(ctx);
+    unlink("queue/.cache");
+    unlink("queue/.lock");
+    rmdir("queue");
+    unlink("ad-ccache");
+    unlink("krb5.conf");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Tests for the log levels of the krb5-sync plugin.
+ *
+ * Check that nothing is logged if syslog is false and there is no log file,
+ * and that messages below log_level are neither formatted nor written.  The
+ * messages that are logged go to a log file in the temporary directory, so
+ * nothing is sent to syslog.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+
+int
+main(void)
+{
+    char *path, *tmpdir, *krb5_config;
+    const char *const settings[] = {
+        "log_file", "log.json",
+        "log_level", "info",
+        NULL
+    };
+    krb5_context ctx;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+
+    /* Define the plan. */
+    plan(16);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with no log settings. */
+    sync_make_config(tmpdir, NULL);
+
+    /* Point KRB5_CONFIG at the newly-generated krb5.conf file. */
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+
+    /* Our krb5.conf sets syslog to false, so nothing is logged. */
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    ok(!SYNC_LOG_ENABLED(config, SYNC_LOG_WARNING),
+       "Nothing is logged if syslog is false");
+    ok(config->events == NULL, "...and there is no log file");
+    sync_syslog_warning(config, "krb5-sync: test %d", 1);
+    ok(config->log_buffer == NULL, "...and messages are not formatted");
+    sync_close(ctx, config);
+    krb5_free_context(ctx);
+
+    /* Log to a file at the info level. */
+    sync_make_config(tmpdir, settings);
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    is_int(0, sync_init(ctx, &config), "sync_init with a log file succeeds");
+    ok(SYNC_LOG_ENABLED(config, SYNC_LOG_INFO), "...with info messages");
+    ok(!SYNC_LOG_ENABLED(config, SYNC_LOG_DEBUG), "...but not debug");
+
+    /* Debug messages are neither formatted nor written at info. */
+    sync_syslog_debug(config, "krb5-sync: test %d", 2);
+    sync_log_event(config, SYNC_LOG_DEBUG, NULL, NULL, "krb5-sync: test %d",
+                   3);
+    sync_syslog_info(config, "krb5-sync: test %d", 4);
+    is_int(0, sync_log_count("log.json", "krb5-sync: test 2"),
+           "Debug messages are not written at info");
+    is_int(0, sync_log_count("log.json", "krb5-sync: test 3"),
+           "...nor debug events");
+    is_int(1, sync_log_count("log.json", "krb5-sync: test 4"),
+           "...but info messages are");
+    ok(config->log_buffer == NULL, "...without using the syslog buffer");
+
+    /* They are at debug. */
+    config->log_level = SYNC_LOG_DEBUG;
+    sync_syslog_debug(config, "krb5-sync: test %d", 5);
+    sync_log_event(config, SYNC_LOG_DEBUG, NULL, NULL, "krb5-sync: test %d",
+                   6);
+    is_int(1, sync_log_count("log.json", "krb5-sync: test 5"),
+           "Debug messages are written at debug");
+    is_int(1, sync_log_count("log.json", "\"level\":\"debug\","
+                             "\"message\":\"krb5-sync: test 5\""),
+           "...with the right level");
+    is_int(1, sync_log_count("log.json", "krb5-sync: test 6"),
+           "...and so are debug events");
+    sync_close(ctx, config);
+
+    /* Be sure the log file was created and nothing else. */
+    ok(unlink("log.json") == 0, "Log file exists");
+    ok(rmdir("queue") == 0, "No files in queue directory");
+
+    /* Clean up. */
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
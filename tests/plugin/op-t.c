@@ -0,0 +1,262 @@
+/*
+ * Tests for the per-operation state of the krb5-sync plugin.
+ *
+ * Check the names derived from the principal and that a queued change makes
+ * only the heap allocations we expect, which are the single unparse of the
+ * principal and the scan of the queue directory for conflicts, with
+ * everything else coming from the storage embedded in the operation.  The
+ * allocations are counted by replacing malloc and friends, so they're only
+ * checked where that works.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/leak.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+
+/*
+ * Check the number of allocations made since start, or skip the check if
+ * allocations can't be counted.
+ */
+static void
+is_allocs(unsigned long expected, const struct leak_counts *start,
+          const char *message)
+{
+    struct leak_counts now;
+
+    if (!leak_counts(&now))
+        skip("allocations can't be counted");
+    else
+        is_int(expected, now.allocs - start->allocs, "%s", message);
+}
+
+
+/*
+ * Check that everything allocated since start has been freed, or skip the
+ * check if allocations can't be counted.
+ */
+static void
+is_freed(const struct leak_counts *start, const char *message)
+{
+    struct leak_counts now;
+
+    if (!leak_counts(&now))
+        skip("allocations can't be counted");
+    else
+        is_int(start->blocks, now.blocks, "%s", message);
+}
+
+
+/*
+ * Return the number of allocations made by unparsing a principal and
+ * scanning the queue directory, which are all that a queued change should
+ * allocate.
+ */
+static unsigned long
+queue_allocs(krb5_context ctx, krb5_const_principal princ)
+{
+    struct leak_counts start, end;
+    krb5_error_code code;
+    char *name;
+    DIR *queue;
+
+    leak_counts(&start);
+    code = krb5_unparse_name(ctx, princ, &name);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot unparse principal");
+    krb5_free_unparsed_name(ctx, name);
+    queue = opendir("queue");
+    if (queue == NULL)
+        sysbail("cannot open queue");
+    while (readdir(queue) != NULL)
+        ;
+    closedir(queue);
+    leak_counts(&end);
+    return end.allocs - start.allocs;
+}
+
+
+/*
+ * Return the number of allocations made by converting a principal to its
+ * Active Directory principal and unparsing that.
+ */
+static unsigned long
+ad_name_allocs(kadm5_hook_modinfo *config, struct sync_target *target,
+               krb5_context ctx, krb5_const_principal princ)
+{
+    struct leak_counts start, end;
+    krb5_principal ad_principal;
+    krb5_error_code code;
+    char *name;
+
+    leak_counts(&start);
+    code = sync_ad_principal(config, target, ctx, princ, &ad_principal);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot convert principal");
+    code = krb5_unparse_name(ctx, ad_principal, &name);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot unparse principal");
+    krb5_free_unparsed_name(ctx, name);
+    krb5_free_principal(ctx, ad_principal);
+    leak_counts(&end);
+    return end.allocs - start.allocs;
+}
+
+
+int
+main(void)
+{
+    char *path, *tmpdir, *krb5_config;
+    const char *const settings[] = { "ad_queue_only", "true", NULL };
+    const char *name, *again;
+    char trace[SYNC_TRACE_SIZE];
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct sync_target *ad;
+    struct sync_op op;
+    struct leak_counts start, change;
+    unsigned long expected;
+    bool allowed;
+    void *block;
+
+    /* Define the plan. */
+    plan(49);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with ad_queue_only set. */
+    sync_make_config(tmpdir, settings);
+
+    /* Point KRB5_CONFIG at the newly-generated krb5.conf file. */
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    code = sync_init(ctx, &config);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize plugin");
+    ad = sync_target_find(config, "ad");
+    if (ad == NULL)
+        bail("cannot find ad target");
+
+    /* The names of a principal with a slash and an escaped @. */
+    code = krb5_parse_name(ctx, "a\\@b/c@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal a\\@b/c@EXAMPLE.COM");
+    is_int(0, sync_op_init(&op, ctx, princ), "sync_op_init succeeds");
+    is_string("a\\@b/c@EXAMPLE.COM", op.name, "...with the right name");
+    is_string("a\\@b/c", op.user, "...and user");
+    is_string("a\\@b.c", op.key, "...and queue key");
+    ok(strlen(op.trace) == 16 && strspn(op.trace, "0123456789abcdef") == 16,
+       "...and a trace ID of 16 hex digits");
+    memcpy(trace, op.trace, sizeof(trace));
+    sync_op_free(&op);
+
+    /* Each change gets its own trace ID, which can be replaced. */
+    sync_op_init(&op, ctx, princ);
+    ok(strcmp(trace, op.trace) != 0, "A second change has a new trace ID");
+    ok(op.origin > 0, "...and an origin");
+    sync_op_trace(&op, "0123456789abcdef", 1000000);
+    is_string("0123456789abcdef", op.trace, "sync_op_trace sets the trace ID");
+    ok(op.origin == 1000000, "...and the origin");
+    sync_op_free(&op);
+    krb5_free_principal(ctx, princ);
+
+    /*
+     * Queue one change first, so that the state the plugin sets up the first
+     * time it queues a change isn't counted below.
+     */
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+    sync_op_init(&op, ctx, princ);
+    is_int(0, sync_push(config, &op, "foobar", true), "sync_push succeeds");
+    sync_op_free(&op);
+    sync_queue_check_password("queue", "test", "foobar");
+
+    /*
+     * A queued password change only unparses the principal and scans the
+     * queue, and sync_op_free frees everything.
+     */
+    expected = queue_allocs(ctx, princ);
+    leak_counts(&change);
+    is_int(0, sync_op_init(&op, ctx, princ), "sync_op_init succeeds");
+    is_int(0, sync_principal_allowed(config, &op, true, &allowed),
+           "sync_principal_allowed succeeds");
+    ok(allowed, "...and test is allowed");
+    is_int(0, sync_push(config, &op, "foobar", true), "sync_push succeeds");
+    is_allocs(expected, &change, "...with only the expected allocations");
+    sync_op_free(&op);
+    is_freed(&change, "...which sync_op_free frees");
+    sync_queue_check_password("queue", "test", "foobar");
+
+    /* So does a queued status change. */
+    leak_counts(&change);
+    is_int(0, sync_op_init(&op, ctx, princ), "sync_op_init succeeds");
+    is_int(0, sync_push(config, &op, NULL, false), "sync_push succeeds");
+    is_allocs(expected, &change, "...with only the expected allocations");
+
+    /* The Active Directory name is computed once. */
+    expected = ad_name_allocs(config, ad, ctx, princ);
+    leak_counts(&start);
+    is_int(0, sync_op_ad_name(config, &op, ad, &name),
+           "sync_op_ad_name succeeds");
+    is_string("test@AD.EXAMPLE.COM", name, "...with the right name");
+    is_allocs(expected, &start, "...converting and unparsing the principal");
+    leak_counts(&start);
+    sync_op_ad_name(config, &op, ad, &again);
+    ok(name == again, "...and the name is reused");
+    is_allocs(0, &start, "...without more allocations");
+
+    /* Allocations that don't fit in the storage get a block of their own. */
+    leak_counts(&start);
+    block = sync_op_alloc(&op, sizeof(op.storage) * 2);
+    ok(block != NULL, "Large allocation succeeds");
+    is_allocs(1, &start, "...with an allocation");
+    sync_op_free(&op);
+    is_freed(&change, "sync_op_free frees everything");
+    sync_queue_check_enable("queue", "test", false);
+    krb5_free_principal(ctx, princ);
+
+    /* Unwind the queue and be sure all the right files exist. */
+    ok(unlink("queue/.lock") == 0, "Lock file still exists");
+    ok(rmdir("queue") == 0, "No other files in queue directory");
+
+    /* Shut down the plugin and clean up. */
+    sync_close(ctx, config);
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
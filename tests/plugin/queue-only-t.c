@@ -37,7 +37,7 @@ main(void)
     kadm5_hook_modinfo *config;
 
     /* Define the plan. */
-    plan(23);
+    plan(26);
 
     /* Set up a temporary directory and queue relative to it. */
     path = test_file_path("data/krb5.conf");
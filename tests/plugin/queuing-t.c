@@ -40,7 +40,7 @@ main(void)
     char *wanted;
 
     /* Define the plan. */
-    plan(47);
+    plan(52);
 
     /* Set up a temporary directory and queue relative to it. */
     tmpdir = test_tmpdir();
@@ -0,0 +1,175 @@
+/*
+ * Tests for the shared statistics of the krb5-sync plugin.
+ *
+ * Force queuing, since we have no Active Directory to talk to, and check that
+ * the queued changes, queue writes, and lock waits are counted.  Domain
+ * controller and cache statistics are recorded directly.  Then check that a
+ * forked child updates the same statistics and that they survive
+ * reinitializing the plugin.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+
+int
+main(void)
+{
+    char *path, *tmpdir, *krb5_config;
+    const char *const settings[] = {
+        "ad_queue_only", "true",
+        "stats", "true",
+        "ad_cache_ttl", "60",
+        NULL
+    };
+    char value[BUFSIZ];
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct sync_stats stats;
+    bool negative;
+    pid_t child;
+    int status;
+
+    /* Define the plan. */
+    plan(47);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with queuing, statistics, and the cache. */
+    sync_make_config(tmpdir, settings);
+
+    /* Point KRB5_CONFIG at the newly-generated krb5.conf file. */
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    ok(config->stats, "...and stats is set");
+
+    /* Queue a password change and a status change. */
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+    is_int(0, sync_chpass(config, ctx, princ, "foobar"),
+           "sync_chpass succeeds");
+    sync_queue_check_password("queue", "test", "foobar");
+    is_int(0, sync_status(config, ctx, princ, false), "sync_status succeeds");
+    sync_queue_check_enable("queue", "test", false);
+    krb5_free_principal(ctx, princ);
+
+    /* Record some cache lookups and domain controller operations. */
+    sync_cache_get(config, SYNC_CACHE_DN, "test@AD.EXAMPLE.COM", value,
+                   sizeof(value), &negative);
+    sync_cache_put(config, SYNC_CACHE_DN, "test@AD.EXAMPLE.COM", "CN=test");
+    sync_cache_get(config, SYNC_CACHE_DN, "test@AD.EXAMPLE.COM", value,
+                   sizeof(value), &negative);
+    sync_stats_dc(config, "dc1", SYNC_OUTCOME_SUCCESS,
+                  sync_stats_now() - 1500);
+    sync_stats_dc(config, "dc1", SYNC_OUTCOME_SOFT, sync_stats_now());
+    sync_stats_dc(config, "dc2", SYNC_OUTCOME_HARD, sync_stats_now());
+
+    /* Record a password change applied three seconds after it was seen. */
+    sync_stats_lag(config, SYNC_STATS_PASSWORD, sync_stats_now() - 3000000);
+
+    /* Check the statistics. */
+    is_int(0, sync_stats_read(config, ctx, &stats), "sync_stats_read works");
+    is_int(1, stats.changes[SYNC_STATS_LIVE][SYNC_STATS_PASSWORD]
+                           [SYNC_STATS_QUEUED],
+           "...one queued password change");
+    is_int(0, stats.changes[SYNC_STATS_LIVE][SYNC_STATS_PASSWORD]
+                           [SYNC_STATS_SUCCESS],
+           "...and no successful ones");
+    is_int(1, stats.changes[SYNC_STATS_LIVE][SYNC_STATS_STATUS]
+                           [SYNC_STATS_QUEUED],
+           "...one queued status change");
+    is_int(0, stats.changes[SYNC_STATS_DRAIN][SYNC_STATS_STATUS]
+                           [SYNC_STATS_SUCCESS],
+           "...and no changes from the queue");
+    is_int(1, stats.latency[SYNC_STATS_LIVE][SYNC_STATS_PASSWORD].count,
+           "...one password change latency");
+    is_int(1, stats.lag[SYNC_STATS_PASSWORD].bucket[12],
+           "...one password change applied within 4s");
+    is_int(0, stats.lag[SYNC_STATS_STATUS].count,
+           "...and no status changes applied");
+    is_int(2, stats.queue_writes, "...two queue writes");
+    ok(stats.lock_wait.count >= 2, "...at least two lock waits");
+    is_int(1, stats.cache_misses[SYNC_CACHE_DN], "...one cache miss");
+    is_int(1, stats.cache_hits[SYNC_CACHE_DN], "...one cache hit");
+    is_int(0, stats.cache_hits[SYNC_CACHE_INSTANCE],
+           "...and no instance cache hits");
+    is_int(2, stats.dc_count, "...two domain controllers");
+    is_string("dc1", stats.dc[0].name, "...the first is dc1");
+    is_int(1, stats.dc[0].outcomes[SYNC_OUTCOME_SUCCESS], "...one success");
+    is_int(1, stats.dc[0].outcomes[SYNC_OUTCOME_SOFT], "...one soft failure");
+    is_int(2, stats.dc[0].latency.count, "...two latencies");
+    is_int(1, stats.dc[0].latency.bucket[11], "...one in the 2ms bucket");
+    is_string("dc2", stats.dc[1].name, "...the second is dc2");
+    is_int(1, stats.dc[1].outcomes[SYNC_OUTCOME_HARD], "...one hard failure");
+
+    /* A forked child updates the same statistics. */
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        sync_stats_queued(config);
+        sync_stats_dc(config, "dc2", SYNC_OUTCOME_HARD, sync_stats_now());
+        _exit(0);
+    }
+    if (waitpid(child, &status, 0) != child)
+        sysbail("cannot wait for child");
+    sync_stats_read(config, ctx, &stats);
+    is_int(3, stats.queue_writes, "Child queue write is counted");
+    is_int(2, stats.dc_count, "...without adding a domain controller");
+    is_int(2, stats.dc[1].outcomes[SYNC_OUTCOME_HARD],
+           "...and its failure is counted");
+
+    /* The statistics survive reinitializing the plugin. */
+    sync_close(ctx, config);
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds again");
+    sync_stats_read(config, ctx, &stats);
+    is_int(3, stats.queue_writes, "...and the statistics are kept");
+    sync_close(ctx, config);
+
+    /* Unwind the queue and be sure all the right files exist. */
+    ok(unlink("queue/.stats") == 0, "Stats file exists");
+    ok(unlink("queue/.cache") == 0, "Cache file exists");
+    ok(unlink("queue/.lock") == 0, "Lock file still exists");
+    ok(rmdir("queue") == 0, "No other files in queue directory");
+
+    /* Clean up. */
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * Tests for multiple Active Directory targets in the krb5-sync plugin.
+ *
+ * Configure a second target with its own realm and routing rules and force
+ * queuing, since we have no Active Directory to talk to, and then check that
+ * changes are queued for the right targets.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+
+int
+main(void)
+{
+    char *tmpdir, *krb5_config, *path;
+    const char *const settings[] = {
+        "ad_targets", "ad forest2",
+        "ad_queue_only", "true",
+        "forest2.ad_realm", "FOREST2.EXAMPLE.COM",
+        "forest2.ad_admin_server", "dc.forest2.example.com",
+        "forest2.ad_match", "test admin*",
+        NULL
+    };
+    const char *const bad_name[] = { "ad_targets", "ad bad-name", NULL };
+    const char *const duplicate[] = { "ad_targets", "ad ad", NULL };
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct sync_target *ad, *forest2;
+    struct sync_op op;
+
+    /* Define the plan. */
+    plan(51);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Point KRB5_CONFIG at the generated krb5.conf file. */
+    sync_make_config(tmpdir, settings);
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+
+    /* Test init and the parsing of the targets. */
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    ok(config != NULL, "...and config is non-NULL");
+    is_int(2, config->ad_targets_count, "...and there are two targets");
+    ad = sync_target_find(config, "ad");
+    forest2 = sync_target_find(config, "forest2");
+    if (ad == NULL || forest2 == NULL)
+        bail("cannot find targets");
+    is_string("AD.EXAMPLE.COM", ad->ad_realm, "...and ad has the right realm");
+    is_string("FOREST2.EXAMPLE.COM", forest2->ad_realm,
+              "...and forest2 has its own realm");
+    is_string("ad-keytab", forest2->ad_keytab,
+              "...and inherits the top-level keytab");
+    is_string("dc.forest2.example.com", sync_control_dc(forest2),
+              "...and has its own domain controller");
+    ok(sync_target_find(config, "forest3") == NULL, "Unknown target");
+
+    /* Check the routing rules. */
+    code = krb5_parse_name(ctx, "other@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal other@EXAMPLE.COM");
+    is_int(0, sync_op_init(&op, ctx, princ), "sync_op_init succeeds");
+    ok(sync_target_match(ad, &op),
+       "...and targets without rules match everything");
+    ok(!sync_target_match(forest2, &op), "...and other doesn't go to forest2");
+    sync_op_free(&op);
+
+    /* A change for other is only queued for the ad target. */
+    is_int(0, sync_chpass(config, ctx, princ, "foobar"),
+           "sync_chpass for other succeeds");
+    sync_queue_check_target("queue", "ad", "other", "password", "foobar");
+    krb5_free_principal(ctx, princ);
+
+    /* A change for test is queued for both targets. */
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+    is_int(0, sync_chpass(config, ctx, princ, "foobar"),
+           "sync_chpass for test succeeds");
+    sync_queue_check_target("queue", "ad", "test", "password", "foobar");
+    sync_queue_check_target("queue", "forest2", "test", "password", "foobar");
+    is_int(0, sync_status(config, ctx, princ, false),
+           "sync_status for test succeeds");
+    sync_queue_check_target("queue", "ad", "test", "disable", NULL);
+    sync_queue_check_target("queue", "forest2", "test", "disable", NULL);
+    krb5_free_principal(ctx, princ);
+    sync_close(ctx, config);
+    krb5_free_context(ctx);
+
+    /* Invalid and duplicate target names are rejected. */
+    sync_make_config(tmpdir, bad_name);
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    ok(sync_init(ctx, &config) != 0, "sync_init fails with invalid target");
+    krb5_free_context(ctx);
+    sync_make_config(tmpdir, duplicate);
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    ok(sync_init(ctx, &config) != 0, "sync_init fails with duplicate target");
+    krb5_free_context(ctx);
+
+    /* Unwind the queue and be sure all the right files exist. */
+    ok(unlink("queue/.lock") == 0, "Lock file still exists");
+    ok(rmdir("queue") == 0, "No other files in queue directory");
+
+    /* Clean up. */
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
@@ -0,0 +1,900 @@
+/*
+ * An Active Directory LDAP stand-in for testing and benchmarking status
+ * changes.
+ *
+ * Rather than running a directory server, which would need a KDC for the
+ * GSSAPI bind, this file defines the LDAP library functions that the plugin
+ * uses and answers them from a small table of accounts.  Since a program's
+ * own definitions take precedence over those in shared libraries, linking
+ * this file into a program replaces the real LDAP library for all of its
+ * code, which is why it isn't part of libtap.a.  The BER functions and
+ * ldap_err2string still come from the real libraries.
+ *
+ * Only what the plugin needs is supported: searches for accounts by
+ * userPrincipalName or for all accounts, reads of an account by DN, and
+ * replacing userAccountControl.  Searches return every result in one page.
+ * Searches with the DirSync control return only the accounts and attributes
+ * changed since the search that returned the cookie, where a cookie is the
+ * update sequence number of the last change it covers.  Cookies can be
+ * expired, after which Active Directory would reject them, so that callers
+ * fall back on searching for every account.  The bind accepts any
+ * credentials.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <lber.h>
+#include <ldap.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/directory.h>
+#include <tests/tap/string.h>
+
+/* The OID of the DirSync control. */
+#define DIRSYNC_OID "1.2.840.113556.1.4.841"
+
+/* The largest number of accounts and the longest UPN or DN. */
+#define ACCOUNTS_MAX 4096
+#define NAME_MAX_LEN 256
+
+/*
+ * Counters and values shared between threads and forked children.  Without
+ * atomic builtins, plain updates are enough for the tests, which don't run
+ * changes in parallel.
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+# define COUNT_ADD(p, n) __atomic_add_fetch((p), (n), __ATOMIC_RELAXED)
+# define COUNT_GET(p)    __atomic_load_n((p), __ATOMIC_RELAXED)
+# define COUNT_SET(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#else
+# define COUNT_ADD(p, n) (*(p) += (n))
+# define COUNT_GET(p)    (*(p))
+# define COUNT_SET(p, v) (*(p) = (v))
+#endif
+
+/*
+ * An account in the directory, with the update sequence numbers of the last
+ * changes to its userPrincipalName and userAccountControl.
+ */
+struct account {
+    char upn[NAME_MAX_LEN];
+    char dn[NAME_MAX_LEN];
+    unsigned long control;
+    unsigned long upn_usn;
+    unsigned long control_usn;
+};
+
+/* The directory, kept in shared memory. */
+struct directory {
+    struct directory_options options;
+    struct directory_counts counts;
+    unsigned long calls;
+    unsigned long usn;
+    unsigned long expired;
+    size_t count;
+    struct account accounts[ACCOUNTS_MAX];
+};
+
+/* An LDAP handle and the server it was opened to. */
+struct ldap {
+    bool bound;
+    char server[NAME_MAX_LEN];
+};
+
+/*
+ * A search result, which is a chain of entries followed by the final result.
+ * Entries hold a copy of the account as it was when it was found, with only
+ * the attributes that were asked for.  The final result of a DirSync search
+ * holds the new cookie.
+ */
+struct ldapmsg {
+    int type;
+    int code;
+    char *dn;
+    char *upn;
+    char *control;
+    char *cookie;
+    struct ldapmsg *next;
+};
+
+/* The directory, if one has been started. */
+static struct directory *directory = NULL;
+
+
+/*
+ * Wait for the configured latency of the server to which the handle was
+ * opened and decide whether to inject an error into an operation.  Returns
+ * the LDAP result code the operation should return.
+ */
+static int
+inject(LDAP *ld, unsigned int op)
+{
+    const struct directory_options *options = &directory->options;
+    struct timespec delay;
+    unsigned long latency = options->latency;
+
+    if (options->slow_server[0] != '\0'
+        && strcasecmp(ld->server, options->slow_server) == 0)
+        latency = options->slow_latency;
+    if (latency > 0) {
+        delay.tv_sec = (time_t) (latency / 1000);
+        delay.tv_nsec = (long) (latency % 1000) * 1000000;
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+            ;
+    }
+    if (options->error_every == 0 || (options->error_ops & op) == 0)
+        return LDAP_SUCCESS;
+    if (COUNT_ADD(&directory->calls, 1) % options->error_every != 0)
+        return LDAP_SUCCESS;
+    COUNT_ADD(&directory->counts.errors, 1);
+    return options->error_code;
+}
+
+
+/*
+ * Find an account by DN.  Returns NULL if there is no such account.
+ */
+static struct account *
+find_dn(const char *dn)
+{
+    size_t i;
+
+    for (i = 0; i < directory->count; i++)
+        if (strcasecmp(directory->accounts[i].dn, dn) == 0)
+            return &directory->accounts[i];
+    return NULL;
+}
+
+
+/*
+ * Check whether an account is under the base of a subtree search.
+ */
+static bool
+under_base(const struct account *account, const char *base)
+{
+    size_t length, base_length;
+
+    length = strlen(account->dn);
+    base_length = strlen(base);
+    if (base_length == 0)
+        return true;
+    if (length < base_length)
+        return false;
+    return strcasecmp(account->dn + length - base_length, base) == 0;
+}
+
+
+/*
+ * Check whether an account matches a search filter.  Only the filters used by
+ * the plugin are supported.  Returns 1 if it matches, 0 if it doesn't or if
+ * account is NULL, and -1 if the filter isn't supported.
+ */
+static int
+filter_match(const struct account *account, const char *filter)
+{
+    static const char prefix[] = "(userPrincipalName=";
+    size_t length;
+
+    if (strcmp(filter, "(objectClass=*)") == 0
+        || strcmp(filter, "(objectClass=user)") == 0
+        || strcmp(filter, "(&(objectClass=user)(userPrincipalName=*))") == 0)
+        return (account == NULL) ? 0 : 1;
+    length = strlen(filter);
+    if (strncmp(filter, prefix, strlen(prefix)) != 0
+        || filter[length - 1] != ')')
+        return -1;
+    filter += strlen(prefix);
+    length -= strlen(prefix) + 1;
+    if (account == NULL || strlen(account->upn) != length)
+        return 0;
+    return strncasecmp(account->upn, filter, length) == 0;
+}
+
+
+/*
+ * Check whether an attribute was asked for by a search.
+ */
+static bool
+wanted(char **attrs, const char *attr)
+{
+    size_t i;
+
+    if (attrs == NULL)
+        return true;
+    for (i = 0; attrs[i] != NULL; i++)
+        if (strcasecmp(attrs[i], attr) == 0)
+            return true;
+    return false;
+}
+
+
+/*
+ * Find the DirSync control among the server controls of a search and store
+ * the update sequence number from its cookie in since, or 0 for an empty
+ * cookie.  Returns false if there is no DirSync control.
+ */
+static bool
+dirsync_since(LDAPControl **controls, unsigned long *since)
+{
+    LDAPControl *control;
+    BerElement *ber;
+    struct berval cookie;
+    ber_int_t flags, size;
+    char buffer[32];
+
+    *since = 0;
+    control = ldap_control_find(DIRSYNC_OID, controls, NULL);
+    if (control == NULL)
+        return false;
+    ber = ber_init(&control->ldctl_value);
+    if (ber == NULL)
+        bail("cannot allocate memory");
+    if (ber_scanf(ber, "{iim}", &flags, &size, &cookie) == LBER_ERROR)
+        bail("cannot parse DirSync control");
+    if (cookie.bv_len >= sizeof(buffer))
+        bail("DirSync cookie too long");
+    memcpy(buffer, cookie.bv_val, cookie.bv_len);
+    buffer[cookie.bv_len] = '\0';
+    ber_free(ber, 1);
+    *since = strtoul(buffer, NULL, 10);
+    return true;
+}
+
+
+/*
+ * Build the controls returned with the result of a DirSync search, holding
+ * the new cookie.  There are never more changes to return.
+ */
+static LDAPControl **
+dirsync_response(const char *cookie)
+{
+    LDAPControl **controls;
+    BerElement *ber;
+    struct berval value, *encoded = NULL;
+
+    value.bv_val = (char *) cookie;
+    value.bv_len = strlen(cookie);
+    ber = ber_alloc_t(LBER_USE_DER);
+    if (ber == NULL)
+        bail("cannot allocate memory");
+    if (ber_printf(ber, "{iiO}", (ber_int_t) 0, (ber_int_t) 0, &value) < 0
+        || ber_flatten(ber, &encoded) < 0)
+        bail("cannot encode DirSync control");
+    ber_free(ber, 1);
+    controls = bcalloc(2, sizeof(LDAPControl *));
+    ldap_control_create(DIRSYNC_OID, 0, encoded, 1, &controls[0]);
+    ber_bvfree(encoded);
+    return controls;
+}
+
+
+/*
+ * Allocate a message of the given type and append it to a chain, given a
+ * pointer to the next pointer of the last message.  Returns the new message.
+ */
+static struct ldapmsg *
+message_add(struct ldapmsg ***tail, int type)
+{
+    struct ldapmsg *message;
+
+    message = bcalloc(1, sizeof(struct ldapmsg));
+    message->type = type;
+    **tail = message;
+    *tail = &message->next;
+    return message;
+}
+
+
+/*
+ * Start the directory.
+ */
+void
+directory_start(const struct directory_options *options)
+{
+    if (directory != NULL)
+        bail("directory already started");
+    directory = mmap(NULL, sizeof(struct directory), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (directory == MAP_FAILED) {
+        directory = NULL;
+        sysbail("cannot map shared memory for directory");
+    }
+    memset(directory, 0, sizeof(struct directory));
+    directory->options = *options;
+}
+
+
+/*
+ * Move the directory into a file.  The file is written and then mapped in
+ * place of the anonymous memory, so nothing else may be using the directory
+ * at the time.
+ */
+void
+directory_share(const char *path)
+{
+    struct directory *shared;
+    int fd;
+
+    if (directory == NULL)
+        bail("directory not started");
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        sysbail("cannot create %s", path);
+    if (write(fd, directory, sizeof(struct directory))
+        < (ssize_t) sizeof(struct directory))
+        sysbail("cannot write to %s", path);
+    shared = mmap(NULL, sizeof(struct directory), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED)
+        sysbail("cannot map %s", path);
+    close(fd);
+    munmap(directory, sizeof(struct directory));
+    directory = shared;
+}
+
+
+/*
+ * Use a directory shared in a file by another program.
+ */
+void
+directory_attach(const char *path)
+{
+    struct stat st;
+    int fd;
+
+    if (directory != NULL)
+        bail("directory already started");
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+        sysbail("cannot open %s", path);
+    if (fstat(fd, &st) < 0)
+        sysbail("cannot stat %s", path);
+    if (st.st_size != (off_t) sizeof(struct directory))
+        bail("%s is not a shared directory", path);
+    directory = mmap(NULL, sizeof(struct directory), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (directory == MAP_FAILED) {
+        directory = NULL;
+        sysbail("cannot map %s", path);
+    }
+    close(fd);
+}
+
+
+/*
+ * Add an account to the directory, or change the account with that DN.
+ */
+void
+directory_add(const char *upn, const char *dn, unsigned long control)
+{
+    struct account *account;
+    unsigned long usn;
+    bool added = false;
+
+    if (directory == NULL)
+        bail("directory not started");
+    if (strlen(upn) >= NAME_MAX_LEN || strlen(dn) >= NAME_MAX_LEN)
+        bail("account name %s too long", upn);
+    account = find_dn(dn);
+    if (account == NULL) {
+        if (directory->count >= ACCOUNTS_MAX)
+            bail("too many accounts in directory");
+        account = &directory->accounts[directory->count];
+        memcpy(account->dn, dn, strlen(dn) + 1);
+        directory->count++;
+        added = true;
+    }
+    usn = COUNT_ADD(&directory->usn, 1);
+    if (added || strcmp(account->upn, upn) != 0) {
+        memcpy(account->upn, upn, strlen(upn) + 1);
+        account->upn_usn = usn;
+    }
+    if (added || COUNT_GET(&account->control) != control) {
+        COUNT_SET(&account->control, control);
+        account->control_usn = usn;
+    }
+}
+
+
+/*
+ * Expire every DirSync cookie returned so far.  The update sequence number
+ * is advanced so that cookies returned from now on are newer.
+ */
+void
+directory_expire_cookies(void)
+{
+    if (directory == NULL)
+        bail("directory not started");
+    COUNT_SET(&directory->expired, COUNT_ADD(&directory->usn, 1));
+}
+
+
+/*
+ * Return the userAccountControl value of an account.
+ */
+unsigned long
+directory_control(const char *upn)
+{
+    size_t i;
+
+    if (directory == NULL)
+        bail("directory not started");
+    for (i = 0; i < directory->count; i++)
+        if (strcasecmp(directory->accounts[i].upn, upn) == 0)
+            return COUNT_GET(&directory->accounts[i].control);
+    bail("no account %s in directory", upn);
+}
+
+
+/*
+ * Copy the current counts.
+ */
+void
+directory_counts(struct directory_counts *counts)
+{
+    const struct directory_counts *shared;
+
+    if (directory == NULL)
+        bail("directory not started");
+    shared = &directory->counts;
+    counts->binds = COUNT_GET(&shared->binds);
+    counts->searches = COUNT_GET(&shared->searches);
+    counts->modifies = COUNT_GET(&shared->modifies);
+    counts->errors = COUNT_GET(&shared->errors);
+    counts->handles = COUNT_GET(&shared->handles);
+    counts->messages = COUNT_GET(&shared->messages);
+    counts->dns = COUNT_GET(&shared->dns);
+    counts->values = COUNT_GET(&shared->values);
+}
+
+
+/*
+ * Stop the directory.
+ */
+void
+directory_stop(void)
+{
+    if (directory == NULL)
+        return;
+    munmap(directory, sizeof(struct directory));
+    directory = NULL;
+}
+
+
+/*
+ * The rest of this file replaces the LDAP library functions.  Connections
+ * and binds succeed without talking to anything as long as the directory has
+ * been started.
+ */
+int
+ldap_initialize(LDAP **ldp, const char *uri)
+{
+    *ldp = NULL;
+    if (uri == NULL || strncmp(uri, "ldap://", strlen("ldap://")) != 0)
+        return LDAP_PARAM_ERROR;
+    *ldp = bcalloc(1, sizeof(LDAP));
+    snprintf((*ldp)->server, sizeof((*ldp)->server), "%s",
+             uri + strlen("ldap://"));
+    if (directory != NULL)
+        COUNT_ADD(&directory->counts.handles, 1);
+    return LDAP_SUCCESS;
+}
+
+
+int
+ldap_set_option(LDAP *ld UNUSED, int option UNUSED,
+                const void *value UNUSED)
+{
+    return LDAP_OPT_SUCCESS;
+}
+
+
+int
+ldap_sasl_interactive_bind_s(LDAP *ld, const char *dn UNUSED,
+                             const char *mechanism,
+                             LDAPControl **server UNUSED,
+                             LDAPControl **client UNUSED,
+                             unsigned int flags UNUSED,
+                             LDAP_SASL_INTERACT_PROC *interact UNUSED,
+                             void *defaults UNUSED)
+{
+    int code;
+
+    if (directory == NULL)
+        return LDAP_SERVER_DOWN;
+    COUNT_ADD(&directory->counts.binds, 1);
+    code = inject(ld, DIRECTORY_BIND);
+    if (code != LDAP_SUCCESS)
+        return code;
+    if (mechanism == NULL || strcmp(mechanism, "GSSAPI") != 0)
+        return LDAP_AUTH_METHOD_NOT_SUPPORTED;
+    ld->bound = true;
+    return LDAP_SUCCESS;
+}
+
+
+int
+ldap_unbind_ext_s(LDAP *ld, LDAPControl **server UNUSED,
+                  LDAPControl **client UNUSED)
+{
+    if (ld == NULL)
+        return LDAP_PARAM_ERROR;
+    if (directory != NULL)
+        COUNT_ADD(&directory->counts.handles, -1);
+    free(ld);
+    return LDAP_SUCCESS;
+}
+
+
+/*
+ * Searches return a chain of entries followed by the result.  Server errors
+ * return just the result, and errors that a real library would detect
+ * without a server return no messages.
+ */
+int
+ldap_search_ext_s(LDAP *ld, const char *base, int scope, const char *filter,
+                  char **attrs, int attrsonly UNUSED, LDAPControl **server,
+                  LDAPControl **client UNUSED, struct timeval *timeout UNUSED,
+                  int limit UNUSED, LDAPMessage **res)
+{
+    struct ldapmsg *chain = NULL, **tail = &chain, *message;
+    struct account *account;
+    unsigned long since;
+    bool dirsync, exists = false;
+    size_t i;
+    int code;
+
+    *res = NULL;
+    if (directory == NULL)
+        return LDAP_SERVER_DOWN;
+    if (base == NULL || filter == NULL)
+        return LDAP_PARAM_ERROR;
+    if (filter_match(NULL, filter) < 0)
+        return LDAP_FILTER_ERROR;
+    COUNT_ADD(&directory->counts.searches, 1);
+    code = inject(ld, DIRECTORY_SEARCH);
+    if (code < 0)
+        return code;
+    if (code == LDAP_SUCCESS && !ld->bound)
+        code = LDAP_OPERATIONS_ERROR;
+    dirsync = dirsync_since(server, &since);
+    if (code == LDAP_SUCCESS && dirsync && since != 0
+        && since < COUNT_GET(&directory->expired))
+        code = LDAP_UNWILLING_TO_PERFORM;
+    for (i = 0; code == LDAP_SUCCESS && i < directory->count; i++) {
+        account = &directory->accounts[i];
+        if (scope == LDAP_SCOPE_BASE) {
+            if (strcasecmp(account->dn, base) != 0)
+                continue;
+            exists = true;
+        } else if (!under_base(account, base)) {
+            continue;
+        }
+        if (filter_match(account, filter) == 0)
+            continue;
+        if (dirsync && account->upn_usn <= since
+            && account->control_usn <= since)
+            continue;
+        message = message_add(&tail, LDAP_RES_SEARCH_ENTRY);
+        message->dn = bstrdup(account->dn);
+        if (wanted(attrs, "userPrincipalName")
+            && (!dirsync || account->upn_usn > since))
+            message->upn = bstrdup(account->upn);
+        if (wanted(attrs, "userAccountControl")
+            && (!dirsync || account->control_usn > since))
+            basprintf(&message->control, "%lu",
+                      COUNT_GET(&account->control));
+    }
+    if (code == LDAP_SUCCESS && scope == LDAP_SCOPE_BASE && !exists)
+        code = LDAP_NO_SUCH_OBJECT;
+    message = message_add(&tail, LDAP_RES_SEARCH_RESULT);
+    message->code = code;
+    if (dirsync && code == LDAP_SUCCESS)
+        basprintf(&message->cookie, "%lu", COUNT_GET(&directory->usn));
+    COUNT_ADD(&directory->counts.messages, 1);
+    *res = chain;
+    return code;
+}
+
+
+int
+ldap_modify_ext_s(LDAP *ld, const char *dn, LDAPMod **mods,
+                  LDAPControl **server UNUSED, LDAPControl **client UNUSED)
+{
+    struct account *account;
+    unsigned long control = 0;
+    bool found = false;
+    size_t i;
+    int code;
+
+    if (directory == NULL)
+        return LDAP_SERVER_DOWN;
+    if (dn == NULL || mods == NULL)
+        return LDAP_PARAM_ERROR;
+    COUNT_ADD(&directory->counts.modifies, 1);
+    code = inject(ld, DIRECTORY_MODIFY);
+    if (code != LDAP_SUCCESS)
+        return code;
+    if (!ld->bound)
+        return LDAP_OPERATIONS_ERROR;
+    account = find_dn(dn);
+    if (account == NULL)
+        return LDAP_NO_SUCH_OBJECT;
+    for (i = 0; mods[i] != NULL; i++) {
+        if (mods[i]->mod_op != LDAP_MOD_REPLACE
+            || strcasecmp(mods[i]->mod_type, "userAccountControl") != 0
+            || mods[i]->mod_values == NULL || mods[i]->mod_values[0] == NULL)
+            return LDAP_UNWILLING_TO_PERFORM;
+        control = strtoul(mods[i]->mod_values[0], NULL, 10);
+        found = true;
+    }
+    if (found) {
+        COUNT_SET(&account->control, control);
+        account->control_usn = COUNT_ADD(&directory->usn, 1);
+    }
+    return LDAP_SUCCESS;
+}
+
+
+int
+ldap_msgfree(LDAPMessage *chain)
+{
+    struct ldapmsg *next;
+    int type;
+
+    if (chain == NULL)
+        return -1;
+    type = chain->type;
+    if (directory != NULL)
+        COUNT_ADD(&directory->counts.messages, -1);
+    for (; chain != NULL; chain = next) {
+        next = chain->next;
+        free(chain->dn);
+        free(chain->upn);
+        free(chain->control);
+        free(chain->cookie);
+        free(chain);
+    }
+    return type;
+}
+
+
+int
+ldap_msgtype(LDAPMessage *message)
+{
+    return (message == NULL) ? -1 : message->type;
+}
+
+
+int
+ldap_count_entries(LDAP *ld UNUSED, LDAPMessage *chain)
+{
+    int count = 0;
+
+    for (; chain != NULL; chain = chain->next)
+        if (chain->type == LDAP_RES_SEARCH_ENTRY)
+            count++;
+    return count;
+}
+
+
+LDAPMessage *
+ldap_first_entry(LDAP *ld UNUSED, LDAPMessage *chain)
+{
+    for (; chain != NULL; chain = chain->next)
+        if (chain->type == LDAP_RES_SEARCH_ENTRY)
+            return chain;
+    return NULL;
+}
+
+
+LDAPMessage *
+ldap_next_entry(LDAP *ld, LDAPMessage *entry)
+{
+    if (entry == NULL)
+        return NULL;
+    return ldap_first_entry(ld, entry->next);
+}
+
+
+char *
+ldap_get_dn(LDAP *ld UNUSED, LDAPMessage *entry)
+{
+    if (entry == NULL || entry->dn == NULL)
+        return NULL;
+    if (directory != NULL)
+        COUNT_ADD(&directory->counts.dns, 1);
+    return bstrdup(entry->dn);
+}
+
+
+void
+ldap_memfree(void *p)
+{
+    if (p == NULL)
+        return;
+    if (directory != NULL)
+        COUNT_ADD(&directory->counts.dns, -1);
+    free(p);
+}
+
+
+struct berval **
+ldap_get_values_len(LDAP *ld UNUSED, LDAPMessage *entry, const char *attr)
+{
+    struct berval **values;
+    const char *value = NULL;
+
+    if (entry == NULL || attr == NULL)
+        return NULL;
+    if (strcasecmp(attr, "userPrincipalName") == 0)
+        value = entry->upn;
+    else if (strcasecmp(attr, "userAccountControl") == 0)
+        value = entry->control;
+    if (value == NULL)
+        return NULL;
+    values = bcalloc(2, sizeof(struct berval *));
+    values[0] = bcalloc(1, sizeof(struct berval));
+    values[0]->bv_val = bstrdup(value);
+    values[0]->bv_len = strlen(value);
+    if (directory != NULL)
+        COUNT_ADD(&directory->counts.values, 1);
+    return values;
+}
+
+
+int
+ldap_count_values_len(struct berval **values)
+{
+    int count = 0;
+
+    if (values == NULL)
+        return 0;
+    while (values[count] != NULL)
+        count++;
+    return count;
+}
+
+
+void
+ldap_value_free_len(struct berval **values)
+{
+    size_t i;
+
+    if (values == NULL)
+        return;
+    if (directory != NULL)
+        COUNT_ADD(&directory->counts.values, -1);
+    for (i = 0; values[i] != NULL; i++) {
+        free(values[i]->bv_val);
+        free(values[i]);
+    }
+    free(values);
+}
+
+
+/*
+ * The only returned control is the DirSync response with the new cookie.
+ * There is never a cookie for another page of results.
+ */
+int
+ldap_parse_result(LDAP *ld UNUSED, LDAPMessage *res, int *code,
+                  char **matched, char **message, char ***referrals,
+                  LDAPControl ***controls, int freeit)
+{
+    struct ldapmsg *last;
+
+    if (res == NULL)
+        return LDAP_PARAM_ERROR;
+    for (last = res; last->next != NULL; last = last->next)
+        ;
+    if (code != NULL)
+        *code = last->code;
+    if (matched != NULL)
+        *matched = NULL;
+    if (message != NULL)
+        *message = NULL;
+    if (referrals != NULL)
+        *referrals = NULL;
+    if (controls != NULL)
+        *controls = (last->cookie == NULL) ? NULL
+                                           : dirsync_response(last->cookie);
+    if (freeit)
+        ldap_msgfree(res);
+    return LDAP_SUCCESS;
+}
+
+
+int
+ldap_control_create(const char *oid, int critical, struct berval *value,
+                    int dupval, LDAPControl **control)
+{
+    LDAPControl *result;
+
+    result = bcalloc(1, sizeof(LDAPControl));
+    result->ldctl_oid = bstrdup(oid);
+    result->ldctl_iscritical = (char) critical;
+    if (value != NULL && dupval) {
+        result->ldctl_value.bv_val = bmalloc(value->bv_len + 1);
+        memcpy(result->ldctl_value.bv_val, value->bv_val, value->bv_len);
+        result->ldctl_value.bv_len = value->bv_len;
+    } else if (value != NULL) {
+        result->ldctl_value = *value;
+    }
+    *control = result;
+    return LDAP_SUCCESS;
+}
+
+
+int
+ldap_create_page_control(LDAP *ld UNUSED, ber_int_t size UNUSED,
+                         struct berval *cookie UNUSED, int critical,
+                         LDAPControl **control)
+{
+    return ldap_control_create(LDAP_CONTROL_PAGEDRESULTS, critical, NULL, 0,
+                               control);
+}
+
+
+int
+ldap_parse_pageresponse_control(LDAP *ld UNUSED, LDAPControl *control UNUSED,
+                                ber_int_t *count, struct berval *cookie)
+{
+    *count = 0;
+    cookie->bv_val = NULL;
+    cookie->bv_len = 0;
+    return LDAP_CONTROL_NOT_FOUND;
+}
+
+
+LDAPControl *
+ldap_control_find(const char *oid, LDAPControl **controls,
+                  LDAPControl ***next)
+{
+    size_t i;
+
+    if (controls == NULL)
+        return NULL;
+    for (i = 0; controls[i] != NULL; i++)
+        if (strcmp(controls[i]->ldctl_oid, oid) == 0) {
+            if (next != NULL)
+                *next = &controls[i + 1];
+            return controls[i];
+        }
+    return NULL;
+}
+
+
+void
+ldap_control_free(LDAPControl *control)
+{
+    if (control == NULL)
+        return;
+    free(control->ldctl_oid);
+    free(control->ldctl_value.bv_val);
+    free(control);
+}
+
+
+void
+ldap_controls_free(LDAPControl **controls)
+{
+    size_t i;
+
+    if (controls == NULL)
+        return;
+    for (i = 0; controls[i] != NULL; i++)
+        ldap_control_free(controls[i]);
+    free(controls);
+}
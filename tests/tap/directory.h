@@ -0,0 +1,123 @@
+/*
+ * An Active Directory LDAP stand-in for testing and benchmarking status
+ * changes.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef TAP_DIRECTORY_H
+#define TAP_DIRECTORY_H 1
+
+#include <config.h>
+#include <tests/tap/macros.h>
+
+/* The operations in which directory_options can inject errors. */
+#define DIRECTORY_BIND   0x01
+#define DIRECTORY_SEARCH 0x02
+#define DIRECTORY_MODIFY 0x04
+
+/*
+ * How the directory should behave.  latency is how long to wait in each bind,
+ * search, and modify, in milliseconds.  If slow_server is not empty, those
+ * made through connections to that server wait slow_latency instead, which
+ * simulates one domain controller stalling.  If error_every is not zero,
+ * every error_every'th one of the operations in error_ops fails with the
+ * LDAP result code error_code.
+ */
+struct directory_options {
+    unsigned long latency;
+    char slow_server[256];
+    unsigned long slow_latency;
+    unsigned long error_every;
+    unsigned int error_ops;
+    int error_code;
+};
+
+/*
+ * Counts of the operations the directory has seen.  binds, searches, and
+ * modifies count those requests, each of which is one round trip to a real
+ * server, and errors the ones that got an injected error.  The rest count
+ * what the caller has allocated and not yet freed: LDAP handles that haven't
+ * been unbound, search results, DNs from ldap_get_dn, and values from
+ * ldap_get_values_len.
+ */
+struct directory_counts {
+    unsigned long binds;
+    unsigned long searches;
+    unsigned long modifies;
+    unsigned long errors;
+    long handles;
+    long messages;
+    long dns;
+    long values;
+};
+
+BEGIN_DECLS
+
+/*
+ * Start the directory with the given options.  There is only one directory,
+ * which replaces the LDAP library for the whole program, so this must be
+ * called before any LDAP connection is made and the directory must be
+ * stopped before it is started again.  The directory is kept in shared
+ * memory, so forked children use the same accounts and counts.  Calls bail
+ * on failure.
+ */
+void directory_start(const struct directory_options *)
+    __attribute__((__nonnull__));
+
+/*
+ * Move the directory into a new file at path, so that programs run by the
+ * caller or its children can use it by calling directory_attach with the
+ * same path.  Must be called before forking any children that use the
+ * directory.  The caller should remove the file after stopping the
+ * directory.  Calls bail on failure.
+ */
+void directory_share(const char *path)
+    __attribute__((__nonnull__));
+
+/*
+ * Use the directory shared in the file at path by another program, with its
+ * options, accounts, and counts, in place of starting one.  Calls bail on
+ * failure.
+ */
+void directory_attach(const char *path)
+    __attribute__((__nonnull__));
+
+/*
+ * Add an account to the directory with the given userPrincipalName, DN, and
+ * userAccountControl value.  If there is already an account with that DN,
+ * change its userPrincipalName and userAccountControl instead, and only the
+ * ones that changed are returned by the next DirSync search.  Calls bail on
+ * failure.
+ */
+void directory_add(const char *upn, const char *dn, unsigned long control)
+    __attribute__((__nonnull__));
+
+/*
+ * Expire every DirSync cookie the directory has returned, so that searches
+ * using one of them fail with LDAP_UNWILLING_TO_PERFORM, as Active Directory
+ * does for a cookie it no longer accepts.  Cookies returned afterwards are
+ * accepted.  Calls bail if the directory isn't started.
+ */
+void directory_expire_cookies(void);
+
+/*
+ * Return the userAccountControl value of the account with the given
+ * userPrincipalName, calling bail if there is no such account.
+ */
+unsigned long directory_control(const char *upn)
+    __attribute__((__nonnull__));
+
+/* Copy the current counts into the provided struct. */
+void directory_counts(struct directory_counts *)
+    __attribute__((__nonnull__));
+
+/* Stop the directory and free its resources. */
+void directory_stop(void);
+
+END_DECLS
+
+#endif /* TAP_DIRECTORY_H */
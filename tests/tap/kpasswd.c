@@ -0,0 +1,628 @@
+/*
+ * A kpasswd server stand-in for testing and benchmarking password changes.
+ *
+ * Implements enough of the Kerberos change and set password protocol (RFC
+ * 3244) to accept password changes from krb5_set_password over UDP and TCP
+ * on localhost, without changing anything.  Requests are answered by forked
+ * worker processes that share the listening sockets and keep their counts in
+ * shared memory, so the server can answer several clients at once even if
+ * it's told to wait before each reply.
+ *
+ * The server authenticates requests with the keys for kadmin/changepw in a
+ * keytab, so it needs a test realm whose KDC will issue tickets for that
+ * principal.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/kpasswd.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* The protocol versions for change password and set password requests. */
+#define VERSION_CHANGE 0x0001
+#define VERSION_SET    0xff80
+
+/* The largest request we accept and the largest number of workers. */
+#define REQUEST_MAX 8192
+#define WORKERS_MAX 64
+
+/* The maximum number of times to look for a port free for UDP and TCP. */
+#define PORT_TRIES 10
+
+/*
+ * Counters shared between the workers and the parent.  Without atomic
+ * builtins, there is only ever one worker, so plain updates are enough.
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+# define COUNT_ADD(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+# define COUNT_GET(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#else
+# define COUNT_ADD(p) (++*(p))
+# define COUNT_GET(p) (*(p))
+#endif
+
+/* The opaque data type for the server. */
+struct kpasswd_server {
+    unsigned short port;
+    unsigned int workers;
+    pid_t pids[WORKERS_MAX];
+    struct kpasswd_counts *counts;
+};
+
+/* The state of one worker process. */
+struct worker {
+    krb5_context ctx;
+    krb5_keytab keytab;
+    krb5_principal changepw;
+    const struct kpasswd_options *options;
+    struct kpasswd_counts *counts;
+    struct in_addr local;
+};
+
+
+/*
+ * Parse a DER tag and length at *p, which must be before end, and check that
+ * the tag is the one expected and the contents fit.  Advances *p to the
+ * contents and stores their length in length.  Returns true on success and
+ * false if the encoding is wrong.
+ */
+static bool
+der_read(const unsigned char **p, const unsigned char *end, unsigned char tag,
+         size_t *length)
+{
+    size_t bytes, i;
+
+    if (end - *p < 2 || **p != tag)
+        return false;
+    (*p)++;
+    if (**p < 0x80) {
+        *length = *(*p)++;
+    } else {
+        bytes = *(*p)++ & 0x7f;
+        if (bytes == 0 || bytes > 4 || (size_t) (end - *p) < bytes)
+            return false;
+        *length = 0;
+        for (i = 0; i < bytes; i++)
+            *length = (*length << 8) | *(*p)++;
+    }
+    return *length <= (size_t) (end - *p);
+}
+
+
+/*
+ * Extract the new password from the decrypted request, which is the bare
+ * password for a change password request and a ChangePasswdData sequence for
+ * a set password request.  We only need the password, so the target name
+ * that may follow it is ignored.  Returns false if the request is malformed.
+ */
+static bool
+request_password(unsigned int version, const krb5_data *clear, char *buffer,
+                 size_t size)
+{
+    const unsigned char *p, *end;
+    size_t length;
+
+    p = (const unsigned char *) clear->data;
+    end = p + clear->length;
+    if (version == VERSION_SET) {
+        if (!der_read(&p, end, 0x30, &length))
+            return false;
+        if (!der_read(&p, end, 0xa0, &length))
+            return false;
+        if (!der_read(&p, end, 0x04, &length))
+            return false;
+    } else {
+        length = clear->length;
+    }
+    if (length >= size)
+        return false;
+    memcpy(buffer, p, length);
+    buffer[length] = '\0';
+    return true;
+}
+
+
+/*
+ * Wait for the configured latency before replying.
+ */
+static void
+request_wait(const struct kpasswd_options *options)
+{
+    struct timespec delay;
+
+    if (options->latency == 0)
+        return;
+    delay.tv_sec = (time_t) (options->latency / 1000);
+    delay.tv_nsec = (long) (options->latency % 1000) * 1000000;
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+        ;
+}
+
+
+/*
+ * Handle a request, storing the reply in reply, which the caller must free.
+ * Decides whether to inject an error based on the request count.  Returns
+ * false if the request couldn't be parsed or authenticated and should be
+ * dropped without a reply.
+ */
+static bool
+request_handle(struct worker *worker, const unsigned char *request,
+               size_t length, krb5_data *reply)
+{
+    krb5_context ctx = worker->ctx;
+    krb5_auth_context auth = NULL;
+    krb5_ticket *ticket = NULL;
+    krb5_data ap_req, cipher, clear, result, ap_rep, priv;
+    krb5_address local;
+    unsigned char *p;
+    unsigned long count;
+    unsigned int version;
+    size_t aplen;
+    int code;
+    const char *message;
+    char password[sizeof(worker->counts->password)];
+    bool success = false;
+
+    /* Parse the framing. */
+    if (length < 6 || (size_t) ((request[0] << 8) | request[1]) != length)
+        return false;
+    version = (unsigned int) ((request[2] << 8) | request[3]);
+    if (version != VERSION_CHANGE && version != VERSION_SET)
+        return false;
+    aplen = (size_t) ((request[4] << 8) | request[5]);
+    if (aplen == 0 || 6 + aplen >= length)
+        return false;
+    ap_req.data = (char *) request + 6;
+    ap_req.length = (unsigned int) aplen;
+    cipher.data = (char *) request + 6 + aplen;
+    cipher.length = (unsigned int) (length - 6 - aplen);
+    memset(&clear, 0, sizeof(clear));
+    memset(&ap_rep, 0, sizeof(ap_rep));
+    memset(&priv, 0, sizeof(priv));
+
+    /* Authenticate the request and decrypt the new password. */
+    if (krb5_auth_con_init(ctx, &auth) != 0)
+        return false;
+    if (krb5_auth_con_setflags(ctx, auth, KRB5_AUTH_CONTEXT_DO_SEQUENCE) != 0)
+        goto done;
+    if (krb5_rd_req(ctx, &auth, &ap_req, worker->changepw, worker->keytab,
+                    NULL, &ticket) != 0)
+        goto done;
+    if (krb5_mk_rep(ctx, auth, &ap_rep) != 0)
+        goto done;
+    if (krb5_rd_priv(ctx, auth, &cipher, &clear, NULL) != 0)
+        goto done;
+    if (!request_password(version, &clear, password, sizeof(password)))
+        goto done;
+
+    /* Decide on the result and wait before replying. */
+    count = COUNT_ADD(&worker->counts->requests);
+    if (worker->options->error_every > 0
+        && count % worker->options->error_every == 0) {
+        code = worker->options->error_code;
+        message = "Injected error";
+        COUNT_ADD(&worker->counts->errors);
+    } else {
+        code = 0;
+        message = "Password changed";
+        memcpy(worker->counts->password, password, sizeof(password));
+    }
+    request_wait(worker->options);
+
+    /* Build the encrypted result, which needs our address. */
+    memset(&result, 0, sizeof(result));
+    result.length = (unsigned int) (2 + strlen(message));
+    result.data = bmalloc(result.length);
+    result.data[0] = (char) ((code >> 8) & 0xff);
+    result.data[1] = (char) (code & 0xff);
+    memcpy(result.data + 2, message, result.length - 2);
+    memset(&local, 0, sizeof(local));
+    local.addrtype = ADDRTYPE_INET;
+    local.length = sizeof(worker->local);
+    local.contents = (krb5_octet *) &worker->local;
+    code = krb5_auth_con_setaddrs(ctx, auth, &local, NULL);
+    if (code == 0)
+        code = krb5_mk_priv(ctx, auth, &result, &priv, NULL);
+    free(result.data);
+    if (code != 0)
+        goto done;
+
+    /* Put the reply together. */
+    reply->length = 6 + ap_rep.length + priv.length;
+    reply->data = bmalloc(reply->length);
+    p = (unsigned char *) reply->data;
+    p[0] = (unsigned char) ((reply->length >> 8) & 0xff);
+    p[1] = (unsigned char) (reply->length & 0xff);
+    p[2] = 0;
+    p[3] = 1;
+    p[4] = (unsigned char) ((ap_rep.length >> 8) & 0xff);
+    p[5] = (unsigned char) (ap_rep.length & 0xff);
+    memcpy(p + 6, ap_rep.data, ap_rep.length);
+    memcpy(p + 6 + ap_rep.length, priv.data, priv.length);
+    success = true;
+
+done:
+    if (ticket != NULL)
+        krb5_free_ticket(ctx, ticket);
+    krb5_free_data_contents(ctx, &clear);
+    krb5_free_data_contents(ctx, &ap_rep);
+    krb5_free_data_contents(ctx, &priv);
+    krb5_auth_con_free(ctx, auth);
+    if (!success)
+        COUNT_ADD(&worker->counts->rejected);
+    return success;
+}
+
+
+/*
+ * Read exactly length bytes from a stream socket.  Returns false on error or
+ * end of file.
+ */
+static bool
+read_all(int fd, void *buffer, size_t length)
+{
+    char *p = buffer;
+    ssize_t status;
+
+    while (length > 0) {
+        status = read(fd, p, length);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            return false;
+        p += status;
+        length -= (size_t) status;
+    }
+    return true;
+}
+
+
+/*
+ * Write exactly length bytes to a stream socket.  Returns false on error.
+ */
+static bool
+write_all(int fd, const void *buffer, size_t length)
+{
+    const char *p = buffer;
+    ssize_t status;
+
+    while (length > 0) {
+        status = write(fd, p, length);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status < 0)
+            return false;
+        p += status;
+        length -= (size_t) status;
+    }
+    return true;
+}
+
+
+/*
+ * Answer a request on the UDP socket, if there is one waiting.  Another
+ * worker may have taken it first.
+ */
+static void
+worker_udp(struct worker *worker, int fd)
+{
+    unsigned char request[REQUEST_MAX];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    krb5_data reply;
+    ssize_t length;
+
+    length = recvfrom(fd, request, sizeof(request), MSG_DONTWAIT,
+                      (struct sockaddr *) &from, &fromlen);
+    if (length <= 0)
+        return;
+    COUNT_ADD(&worker->counts->udp);
+    if (!request_handle(worker, request, (size_t) length, &reply))
+        return;
+    sendto(fd, reply.data, reply.length, 0, (struct sockaddr *) &from,
+           fromlen);
+    free(reply.data);
+}
+
+
+/*
+ * Answer a request on a new TCP connection, if there is one waiting.  TCP
+ * messages are preceded by a four-byte length, and each connection carries
+ * one request.
+ */
+static void
+worker_tcp(struct worker *worker, int fd)
+{
+    unsigned char request[REQUEST_MAX];
+    unsigned char prefix[4];
+    krb5_data reply;
+    size_t length;
+    int conn;
+
+    conn = accept(fd, NULL, NULL);
+    if (conn < 0)
+        return;
+    COUNT_ADD(&worker->counts->tcp);
+    if (!read_all(conn, prefix, sizeof(prefix)))
+        goto done;
+    length = ((size_t) prefix[0] << 24) | ((size_t) prefix[1] << 16)
+        | ((size_t) prefix[2] << 8) | prefix[3];
+    if (length > sizeof(request) || !read_all(conn, request, length)) {
+        COUNT_ADD(&worker->counts->rejected);
+        goto done;
+    }
+    if (!request_handle(worker, request, length, &reply))
+        goto done;
+    prefix[0] = (unsigned char) ((reply.length >> 24) & 0xff);
+    prefix[1] = (unsigned char) ((reply.length >> 16) & 0xff);
+    prefix[2] = (unsigned char) ((reply.length >> 8) & 0xff);
+    prefix[3] = (unsigned char) (reply.length & 0xff);
+    if (write_all(conn, prefix, sizeof(prefix)))
+        write_all(conn, reply.data, reply.length);
+    free(reply.data);
+
+done:
+    close(conn);
+}
+
+
+/*
+ * The main loop of a worker, which runs until the worker is killed.  tcp is
+ * -1 if we're not listening for TCP, which poll ignores.  Runs in a forked
+ * child, so exits rather than calling bail on errors to avoid confusing the
+ * TAP output.
+ */
+static void __attribute__((__noreturn__))
+worker_run(struct kpasswd_server *server, const char *keytab,
+           const char *realm, const struct kpasswd_options *options, int udp,
+           int tcp)
+{
+    struct worker worker;
+    struct pollfd fds[2];
+
+    /* The replay cache only gets in the way of a stand-in. */
+    setenv("KRB5RCACHETYPE", "none", 1);
+    memset(&worker, 0, sizeof(worker));
+    worker.options = options;
+    worker.counts = server->counts;
+    worker.local.s_addr = htonl(INADDR_LOOPBACK);
+    if (krb5_init_context(&worker.ctx) != 0)
+        _exit(1);
+    if (krb5_kt_resolve(worker.ctx, keytab, &worker.keytab) != 0)
+        _exit(1);
+    if (krb5_build_principal(worker.ctx, &worker.changepw, strlen(realm),
+                             realm, "kadmin", "changepw", (char *) 0) != 0)
+        _exit(1);
+
+    /* Answer requests. */
+    fds[0].fd = udp;
+    fds[0].events = POLLIN;
+    fds[1].fd = tcp;
+    fds[1].events = POLLIN;
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            _exit(1);
+        }
+        if (fds[0].revents & POLLIN)
+            worker_udp(&worker, udp);
+        if (fds[1].revents & POLLIN)
+            worker_tcp(&worker, tcp);
+    }
+}
+
+
+/*
+ * Create the UDP and TCP sockets on the same ephemeral port of localhost.
+ * The kernel picks the UDP port, which may already be in use for TCP, so try
+ * a few times.  The TCP socket is still bound if udp_only is set, so that
+ * nothing else can listen on the port, but we don't listen on it.  Stores
+ * the sockets and returns the port.
+ */
+static unsigned short
+server_sockets(int *udp, int *tcp, bool udp_only)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    int i, flags;
+
+    for (i = 0; i < PORT_TRIES; i++) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        *udp = socket(AF_INET, SOCK_DGRAM, 0);
+        if (*udp < 0)
+            sysbail("cannot create UDP socket");
+        if (bind(*udp, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            sysbail("cannot bind UDP socket");
+        addrlen = sizeof(addr);
+        if (getsockname(*udp, (struct sockaddr *) &addr, &addrlen) < 0)
+            sysbail("cannot get UDP socket address");
+        *tcp = socket(AF_INET, SOCK_STREAM, 0);
+        if (*tcp < 0)
+            sysbail("cannot create TCP socket");
+        if (bind(*tcp, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+            break;
+        if (errno != EADDRINUSE)
+            sysbail("cannot bind TCP socket");
+        close(*udp);
+        close(*tcp);
+    }
+    if (i == PORT_TRIES)
+        bail("cannot find a port free for both UDP and TCP");
+    if (udp_only)
+        return ntohs(addr.sin_port);
+    if (listen(*tcp, 64) < 0)
+        sysbail("cannot listen on TCP socket");
+
+    /* Workers compete for connections, so accept must not block. */
+    flags = fcntl(*tcp, F_GETFL);
+    if (flags < 0 || fcntl(*tcp, F_SETFL, flags | O_NONBLOCK) < 0)
+        sysbail("cannot make TCP socket nonblocking");
+    return ntohs(addr.sin_port);
+}
+
+
+/*
+ * Start the server, forking the workers.
+ */
+struct kpasswd_server *
+kpasswd_start(const char *keytab, const char *realm,
+              const struct kpasswd_options *options)
+{
+    struct kpasswd_server *server;
+    unsigned int i;
+    int udp, tcp;
+    pid_t child;
+
+    server = bcalloc(1, sizeof(struct kpasswd_server));
+    server->workers = options->workers;
+    if (server->workers == 0)
+        server->workers = 1;
+    if (server->workers > WORKERS_MAX)
+        server->workers = WORKERS_MAX;
+#ifndef HAVE_ATOMIC_BUILTINS
+    server->workers = 1;
+#endif
+    server->counts = mmap(NULL, sizeof(struct kpasswd_counts),
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                          -1, 0);
+    if (server->counts == MAP_FAILED)
+        sysbail("cannot map shared memory for kpasswd counts");
+    memset(server->counts, 0, sizeof(struct kpasswd_counts));
+    server->port = server_sockets(&udp, &tcp, options->udp_only);
+
+    /* Fork the workers, which inherit the sockets. */
+    fflush(stdout);
+    for (i = 0; i < server->workers; i++) {
+        child = fork();
+        if (child < 0)
+            sysbail("cannot fork kpasswd worker");
+        else if (child == 0)
+            worker_run(server, keytab, realm, options, udp,
+                       options->udp_only ? -1 : tcp);
+        server->pids[i] = child;
+    }
+    close(udp);
+    close(tcp);
+    return server;
+}
+
+
+/*
+ * Return the port of the server.
+ */
+unsigned short
+kpasswd_port(struct kpasswd_server *server)
+{
+    return server->port;
+}
+
+
+/*
+ * Copy the counts out of shared memory.  The password may be torn if
+ * several workers are changing it, but it's only checked when the requests
+ * are made one at a time.
+ */
+void
+kpasswd_counts(struct kpasswd_server *server, struct kpasswd_counts *counts)
+{
+    counts->requests = COUNT_GET(&server->counts->requests);
+    counts->udp = COUNT_GET(&server->counts->udp);
+    counts->tcp = COUNT_GET(&server->counts->tcp);
+    counts->errors = COUNT_GET(&server->counts->errors);
+    counts->rejected = COUNT_GET(&server->counts->rejected);
+    memcpy(counts->password, server->counts->password,
+           sizeof(counts->password));
+    counts->password[sizeof(counts->password) - 1] = '\0';
+}
+
+
+/*
+ * Stop the workers and free the server.
+ */
+void
+kpasswd_stop(struct kpasswd_server *server)
+{
+    unsigned int i;
+
+    if (server == NULL)
+        return;
+    for (i = 0; i < server->workers; i++)
+        kill(server->pids[i], SIGTERM);
+    for (i = 0; i < server->workers; i++)
+        waitpid(server->pids[i], NULL, 0);
+    munmap(server->counts, sizeof(struct kpasswd_counts));
+    free(server);
+}
+
+
+/*
+ * Generate a krb5.conf file for the plugin that uses the server.
+ */
+char *
+kpasswd_config(struct kpasswd_server *server, const char *tmpdir,
+               const char *keytab, const char *principal, const char *base)
+{
+    char *path, *krb5_config;
+    const char *realm;
+    const char *settings[9];
+    FILE *file;
+
+    /* Add our settings to the test configuration. */
+    realm = strchr(principal, '@');
+    if (realm == NULL)
+        bail("principal %s has no realm", principal);
+    realm++;
+    settings[0] = "ad_keytab";
+    settings[1] = keytab;
+    settings[2] = "ad_principal";
+    settings[3] = principal;
+    settings[4] = "ad_realm";
+    settings[5] = realm;
+    settings[6] = "ad_admin_server";
+    settings[7] = "127.0.0.1";
+    settings[8] = NULL;
+    sync_make_config(tmpdir, settings);
+
+    /* Send password changes to the server. */
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    file = fopen(path, "a");
+    if (file == NULL)
+        sysbail("cannot open %s", path);
+    fprintf(file, "\n[realms]\n    %s = {\n", realm);
+    fprintf(file, "        kpasswd_server = 127.0.0.1:%hu\n    }\n",
+            server->port);
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+
+    /* Fall back on the original configuration for everything else. */
+    basprintf(&krb5_config, "KRB5_CONFIG=%s:%s", path, base);
+    free(path);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    return krb5_config;
+}
@@ -0,0 +1,90 @@
+/*
+ * A kpasswd server stand-in for testing and benchmarking password changes.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef TAP_KPASSWD_H
+#define TAP_KPASSWD_H 1
+
+#include <config.h>
+#include <tests/tap/macros.h>
+
+/* Opaque data type for kpasswd_start and friends. */
+struct kpasswd_server;
+
+/*
+ * How the server should behave.  latency is how long to wait before replying
+ * to each request, in milliseconds.  If error_every is not zero, every
+ * error_every'th request gets the kpasswd result code error_code instead of
+ * success.  workers is the number of processes answering requests, which
+ * should be at least the number of concurrent clients if latency is set.  If
+ * udp_only is set, the server doesn't listen for TCP, so clients that prefer
+ * TCP have to fall back on UDP.
+ */
+struct kpasswd_options {
+    unsigned long latency;
+    unsigned long error_every;
+    int error_code;
+    unsigned int workers;
+    bool udp_only;
+};
+
+/*
+ * Counts of requests the server has seen.  udp and tcp count the requests
+ * received over each transport, and requests counts those that were
+ * answered.  errors counts the answers that were an injected error, and
+ * rejected the requests that couldn't be parsed or authenticated and were
+ * dropped.  password is the new password from the most recent successful
+ * request.
+ */
+struct kpasswd_counts {
+    unsigned long requests;
+    unsigned long udp;
+    unsigned long tcp;
+    unsigned long errors;
+    unsigned long rejected;
+    char password[256];
+};
+
+BEGIN_DECLS
+
+/*
+ * Start a server listening on UDP and TCP on an ephemeral port of localhost,
+ * accepting requests for kadmin/changepw in realm using the keys in keytab.
+ * The server runs in forked children.  Calls bail on failure.
+ */
+struct kpasswd_server *kpasswd_start(const char *keytab, const char *realm,
+                                     const struct kpasswd_options *)
+    __attribute__((__malloc__, __nonnull__));
+
+/* Return the port on which the server is listening. */
+unsigned short kpasswd_port(struct kpasswd_server *)
+    __attribute__((__nonnull__));
+
+/* Copy the current counts into the provided struct. */
+void kpasswd_counts(struct kpasswd_server *, struct kpasswd_counts *)
+    __attribute__((__nonnull__));
+
+/* Stop the server and free its resources. */
+void kpasswd_stop(struct kpasswd_server *);
+
+/*
+ * Generate a krb5.conf file in tmpdir for the plugin that pushes changes to
+ * the realm of principal, authenticating with the keys in keytab, and sends
+ * password changes for that realm to the server.  base is the krb5.conf file
+ * that knows about the realm, which is used for everything else.  Sets
+ * KRB5_CONFIG and returns the new environment string, which the caller
+ * should free after resetting KRB5_CONFIG.  Calls bail on failure.
+ */
+char *kpasswd_config(struct kpasswd_server *, const char *tmpdir,
+                     const char *keytab, const char *principal,
+                     const char *base)
+    __attribute__((__malloc__, __nonnull__));
+
+END_DECLS
+
+#endif /* TAP_KPASSWD_H */
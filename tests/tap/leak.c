@@ -0,0 +1,221 @@
+/*
+ * Allocation and descriptor accounting for finding leaks.
+ *
+ * With the GNU C library, this file replaces malloc, free, and the rest of
+ * the allocation functions with ones that count each call and then pass it
+ * on to the C library's own allocator, which it exports as __libc_malloc and
+ * so forth.  The C library and every shared library call the program's
+ * allocation functions in preference to their own, so this counts the
+ * allocations of the Kerberos and GSSAPI libraries as well as the program's.
+ * Like the LDAP stand-in, this means it can't be part of libtap.a.
+ * Elsewhere, only descriptors are counted.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __GLIBC__
+# include <malloc.h>
+#endif
+
+#include <tests/tap/leak.h>
+
+/* The most descriptors checked for being open. */
+#define LEAK_FDS_MAX 4096
+
+/*
+ * Counters shared between threads.  Without atomic builtins, plain updates
+ * are enough for programs that don't allocate in several threads at once.
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+# define COUNT_ADD(p, n) __atomic_add_fetch((p), (n), __ATOMIC_RELAXED)
+# define COUNT_GET(p)    __atomic_load_n((p), __ATOMIC_RELAXED)
+#else
+# define COUNT_ADD(p, n) (*(p) += (n))
+# define COUNT_GET(p)    (*(p))
+#endif
+
+#ifdef __GLIBC__
+
+/* The C library's allocator, which it exports under these names. */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+extern void __libc_free(void *);
+
+/* The counts, which are only changed by the functions below. */
+static unsigned long leak_allocs;
+static unsigned long leak_frees;
+static long leak_blocks;
+static long leak_bytes;
+
+
+/*
+ * Record that a block was allocated or will be freed.
+ */
+static void
+record_alloc(void *p)
+{
+    COUNT_ADD(&leak_allocs, 1);
+    COUNT_ADD(&leak_blocks, 1);
+    COUNT_ADD(&leak_bytes, (long) malloc_usable_size(p));
+}
+
+static void
+record_free(void *p)
+{
+    COUNT_ADD(&leak_frees, 1);
+    COUNT_ADD(&leak_blocks, -1);
+    COUNT_ADD(&leak_bytes, -(long) malloc_usable_size(p));
+}
+
+
+void *
+malloc(size_t size)
+{
+    void *p;
+
+    p = __libc_malloc(size);
+    if (p != NULL)
+        record_alloc(p);
+    return p;
+}
+
+
+void *
+calloc(size_t n, size_t size)
+{
+    void *p;
+
+    p = __libc_calloc(n, size);
+    if (p != NULL)
+        record_alloc(p);
+    return p;
+}
+
+
+/*
+ * A reallocation that moves or resizes a block is counted as freeing the old
+ * block and allocating a new one, which leaves the number of blocks the same
+ * but updates their size.
+ */
+void *
+realloc(void *old, size_t size)
+{
+    void *p;
+    long bytes = 0;
+
+    if (old != NULL)
+        bytes = (long) malloc_usable_size(old);
+    p = __libc_realloc(old, size);
+    if (old != NULL && (p != NULL || size == 0)) {
+        COUNT_ADD(&leak_frees, 1);
+        COUNT_ADD(&leak_blocks, -1);
+        COUNT_ADD(&leak_bytes, -bytes);
+    }
+    if (p != NULL)
+        record_alloc(p);
+    return p;
+}
+
+
+void
+free(void *p)
+{
+    if (p == NULL)
+        return;
+    record_free(p);
+    __libc_free(p);
+}
+
+
+void *
+memalign(size_t alignment, size_t size)
+{
+    void *p;
+
+    p = __libc_memalign(alignment, size);
+    if (p != NULL)
+        record_alloc(p);
+    return p;
+}
+
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+
+int
+posix_memalign(void **result, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment % sizeof(void *) != 0
+        || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    p = memalign(alignment, size);
+    if (p == NULL)
+        return ENOMEM;
+    *result = p;
+    return 0;
+}
+
+
+void *
+valloc(size_t size)
+{
+    return memalign((size_t) sysconf(_SC_PAGESIZE), size);
+}
+
+#endif /* __GLIBC__ */
+
+
+/*
+ * Count the open descriptors and the sockets among them.
+ */
+static void
+count_fds(struct leak_counts *counts)
+{
+    struct stat st;
+    long max, fd;
+
+    max = sysconf(_SC_OPEN_MAX);
+    if (max < 0 || max > LEAK_FDS_MAX)
+        max = LEAK_FDS_MAX;
+    for (fd = 0; fd < max; fd++) {
+        if (fstat((int) fd, &st) < 0)
+            continue;
+        counts->fds++;
+        if (S_ISSOCK(st.st_mode))
+            counts->sockets++;
+    }
+}
+
+
+bool
+leak_counts(struct leak_counts *counts)
+{
+    memset(counts, 0, sizeof(*counts));
+    count_fds(counts);
+#ifdef __GLIBC__
+    counts->allocs = COUNT_GET(&leak_allocs);
+    counts->frees = COUNT_GET(&leak_frees);
+    counts->blocks = COUNT_GET(&leak_blocks);
+    counts->bytes = COUNT_GET(&leak_bytes);
+    return true;
+#else
+    return false;
+#endif
+}
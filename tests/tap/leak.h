@@ -0,0 +1,45 @@
+/*
+ * Allocation and descriptor accounting for finding leaks.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef TAP_LEAK_H
+#define TAP_LEAK_H 1
+
+#include <config.h>
+#include <portable/stdbool.h>
+#include <tests/tap/macros.h>
+
+/*
+ * Counts of the program's allocations and open descriptors.  allocs and
+ * frees count the calls that allocated or freed a block since the program
+ * started, and blocks and bytes are the blocks allocated and not yet freed
+ * and their usable size.  fds is the number of open file descriptors, of
+ * which sockets are sockets.
+ */
+struct leak_counts {
+    unsigned long allocs;
+    unsigned long frees;
+    long blocks;
+    long bytes;
+    long fds;
+    long sockets;
+};
+
+BEGIN_DECLS
+
+/*
+ * Copy the current counts into the provided struct.  Returns false if
+ * allocations can't be counted on this platform, in which case only the
+ * descriptors are counted and the rest is zero.
+ */
+bool leak_counts(struct leak_counts *)
+    __attribute__((__nonnull__));
+
+END_DECLS
+
+#endif /* TAP_LEAK_H */
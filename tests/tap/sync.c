@@ -12,6 +12,7 @@
  */
 
 #include <config.h>
+#include <portable/krb5.h>
 #include <portable/system.h>
 
 #include <fcntl.h>
@@ -19,6 +20,8 @@
 #include <time.h>
 
 #include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
 #include <tests/tap/string.h>
 #include <tests/tap/sync.h>
 
@@ -81,13 +84,16 @@ sync_queue_unblock(const char *queue, const char *user, const char *op)
 
 
 /*
- * Internal helper function for queue checks.  Takes the queue path, the user,
- * the operation, and (optionally) the password.  Reports results with the
- * normal ok functions and calls bail on system failures.
+ * Look for a change queued in the past second for the given target and check
+ * that it matches the provided parameters.  Takes the queue path, the target,
+ * the user, the operation, and (optionally) the password, and check that
+ * the change is followed by its trace ID and origin.  Reports results with
+ * the normal ok functions and calls bail on system failures.
  */
-static void
-queue_check(const char *queue, const char *user, const char *op,
-            const char *password)
+void
+sync_queue_check_target(const char *queue, const char *target,
+                        const char *user, const char *op,
+                        const char *password)
 {
     char *path, *wanted, *munged_user;
     const char *path_op;
@@ -96,6 +102,7 @@ queue_check(const char *queue, const char *user, const char *op,
     struct stat st;
     FILE *file;
     char buffer[BUFSIZ];
+    unsigned long seconds, usec;
 
     /* Find the queue file.  It should have a nearby timestamp. */
     path = NULL;
@@ -104,9 +111,10 @@ queue_check(const char *queue, const char *user, const char *op,
     munged_user = munge_user(user);
     for (timestamp = now - 1; timestamp <= now; timestamp++) {
         date = gmtime(&timestamp);
-        basprintf(&path, "%s/%s-ad-%s-%04d%02d%02dT%02d%02d%02dZ-00", queue,
-                  munged_user, path_op, date->tm_year + 1900, date->tm_mon + 1,
-                  date->tm_mday, date->tm_hour, date->tm_min, date->tm_sec);
+        basprintf(&path, "%s/%s-%s-%s-%04d%02d%02dT%02d%02d%02dZ-00", queue,
+                  munged_user, target, path_op, date->tm_year + 1900,
+                  date->tm_mon + 1, date->tm_mday, date->tm_hour,
+                  date->tm_min, date->tm_sec);
         if (access(path, F_OK) == 0)
             break;
         free(path);
@@ -115,12 +123,12 @@ queue_check(const char *queue, const char *user, const char *op,
     free(munged_user);
 
     /* Check that we found a queued change. */
-    ok(path != NULL, "%s for %s was queued", op, user);
+    ok(path != NULL, "%s for %s in %s was queued", op, user, target);
     if (path == NULL) {
         if (password == NULL)
-            ok_block(4, false, "No queued change to check");
-        else
             ok_block(5, false, "No queued change to check");
+        else
+            ok_block(6, false, "No queued change to check");
         free(path);
         return;
     }
@@ -141,7 +149,9 @@ queue_check(const char *queue, const char *user, const char *op,
     free(wanted);
     if (fgets(buffer, sizeof(buffer), file) == NULL)
         buffer[0] = '\0';
-    is_string("ad\n", buffer, "...queued domain is correct");
+    basprintf(&wanted, "%s\n", target);
+    is_string(wanted, buffer, "...queued domain is correct");
+    free(wanted);
     if (fgets(buffer, sizeof(buffer), file) == NULL)
         buffer[0] = '\0';
     basprintf(&wanted, "%s\n", op);
@@ -154,6 +164,14 @@ queue_check(const char *queue, const char *user, const char *op,
         is_string(wanted, buffer, "...queued password is correct");
         free(wanted);
     }
+    ok(fgets(buffer, sizeof(buffer), file) != NULL
+           && strncmp(buffer, "trace ", 6) == 0
+           && strspn(buffer + 6, "0123456789abcdef") == 16
+           && strcmp(buffer + 6 + 16, "\n") == 0
+           && fgets(buffer, sizeof(buffer), file) != NULL
+           && sscanf(buffer, "origin %lu.%lu", &seconds, &usec) == 2
+           && seconds > 0 && usec < 1000000,
+       "...queued trace ID and origin are present");
     fclose(file);
 
     /* Remove the queue file. */
@@ -172,7 +190,8 @@ queue_check(const char *queue, const char *user, const char *op,
 void
 sync_queue_check_enable(const char *queue, const char *user, bool enable)
 {
-    queue_check(queue, user, enable ? "enable" : "disable", NULL);
+    sync_queue_check_target(queue, "ad", user, enable ? "enable" : "disable",
+                            NULL);
 }
 
 
@@ -185,5 +204,121 @@ void
 sync_queue_check_password(const char *queue, const char *user,
                           const char *password)
 {
-    queue_check(queue, user, "password", password);
+    sync_queue_check_target(queue, "ad", user, "password", password);
+}
+
+
+/*
+ * Compare two strings for qsort.
+ */
+static int
+compare_strings(const void *a, const void *b)
+{
+    const char *const *first = a;
+    const char *const *second = b;
+
+    return strcmp(*first, *second);
+}
+
+
+/*
+ * Sort an array of strings in place.
+ */
+void
+sync_sort_strings(char **strings, size_t count)
+{
+    qsort(strings, count, sizeof(char *), compare_strings);
+}
+
+
+/*
+ * Count the lines of a log file that contain a string.
+ */
+unsigned long
+sync_log_count(const char *path, const char *string)
+{
+    FILE *file;
+    char line[BUFSIZ];
+    unsigned long count = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        sysbail("cannot open %s", path);
+    while (fgets(line, sizeof(line), file) != NULL)
+        if (strstr(line, string) != NULL)
+            count++;
+    fclose(file);
+    return count;
+}
+
+
+/*
+ * Generate krb5.conf in tmpdir with the given krb5-sync settings by running
+ * data/make-krb5-conf on data/krb5.conf.
+ */
+void
+sync_make_config(const char *tmpdir, const char *const *settings)
+{
+    const char **argv;
+    char *source, *make_conf;
+    size_t count, i;
+
+    source = test_file_path("data/krb5.conf");
+    if (source == NULL)
+        bail("cannot find data/krb5.conf in the test suite");
+    make_conf = test_file_path("data/make-krb5-conf");
+    if (make_conf == NULL)
+        bail("cannot find data/make-krb5-conf in the test suite");
+    for (count = 0; settings != NULL && settings[count] != NULL; count++)
+        ;
+    argv = bcalloc(count + 4, sizeof(const char *));
+    argv[0] = make_conf;
+    argv[1] = source;
+    argv[2] = tmpdir;
+    for (i = 0; i < count; i++)
+        argv[i + 3] = settings[i];
+    argv[count + 3] = NULL;
+    run_setup(argv);
+    free(argv);
+    test_file_path_free(make_conf);
+    test_file_path_free(source);
+}
+
+
+/*
+ * Store a fake ticket-granting ticket for princ that expires lifetime seconds
+ * from now in the given credential cache, replacing its contents.  There's no
+ * KDC in the test suite, so this lets the plugin use a shared credential
+ * cache without getting tickets from the keytab.  Calls bail on failure.
+ */
+void
+sync_ccache_store(krb5_context ctx, const char *name,
+                  krb5_const_principal princ, long lifetime)
+{
+    krb5_ccache cache;
+    krb5_creds creds;
+    krb5_error_code code;
+    const char *realm;
+    char ticket[] = "ticket";
+
+    memset(&creds, 0, sizeof(creds));
+    creds.client = (krb5_principal) princ;
+    realm = krb5_principal_get_realm(ctx, princ);
+    code = krb5_build_principal(ctx, &creds.server, strlen(realm), realm,
+                                "krbtgt", realm, (const char *) NULL);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot build krbtgt principal");
+    creds.times.authtime = time(NULL);
+    creds.times.endtime = time(NULL) + lifetime;
+    creds.ticket.data = ticket;
+    creds.ticket.length = strlen(ticket);
+    code = krb5_cc_resolve(ctx, name, &cache);
+    if (code == 0)
+        code = krb5_cc_initialize(ctx, cache, creds.client);
+    if (code == 0)
+        code = krb5_cc_store_cred(ctx, cache, &creds);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot store fake ticket in %s", name);
+    krb5_cc_close(ctx, cache);
+    krb5_free_principal(ctx, creds.server);
 }
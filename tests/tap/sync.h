@@ -12,6 +12,7 @@
 #define TAP_SYNC_H 1
 
 #include <config.h>
+#include <portable/krb5.h>
 #include <tests/tap/macros.h>
 
 BEGIN_DECLS
@@ -32,6 +33,39 @@ void sync_queue_check_enable(const char *queue, const char *user, bool);
 void sync_queue_check_password(const char *queue, const char *user,
                                const char *password);
 
+/*
+ * The same for a change queued for a particular target.  password should be
+ * NULL except for password changes.
+ */
+void sync_queue_check_target(const char *queue, const char *target,
+                             const char *user, const char *op,
+                             const char *password);
+
+/* Sort an array of strings in place. */
+void sync_sort_strings(char **, size_t);
+
+/*
+ * Count the lines of a log file written with log_file that contain a string.
+ * Calls bail if the file can't be read.
+ */
+unsigned long sync_log_count(const char *path, const char *string);
+
+/*
+ * Generate krb5.conf in tmpdir from data/krb5.conf in the test suite, adding
+ * settings, a NULL-terminated list of alternating keys and values, to the
+ * krb5-sync section of [appdefaults].  settings may be NULL to add nothing.
+ * Calls bail on failure.
+ */
+void sync_make_config(const char *tmpdir, const char *const *settings);
+
+/*
+ * Store a fake ticket-granting ticket for a principal that expires lifetime
+ * seconds from now in a credential cache, for use with ad_ccache.  Calls bail
+ * on failure.
+ */
+void sync_ccache_store(krb5_context, const char *cache, krb5_const_principal,
+                       long lifetime);
+
 END_DECLS
 
 #endif /* TAP_SYNC_H */
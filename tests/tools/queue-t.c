@@ -0,0 +1,204 @@
+/*
+ * Tests for parsing queue files in krb5-sync.
+ *
+ * Checks what queue_file_parse makes of files in the current format, in the
+ * format written by older versions, and with lines added by later versions,
+ * that it rejects incomplete and corrupt files, and that queue_file_read
+ * reads files and refuses ones that are too large.  Then runs every file in
+ * the fuzzing corpus in tests/data/queue through the parser.  Files whose
+ * names start with ok- must parse and files whose names start with bad- must
+ * be rejected.  Anything else, such as an input saved from a fuzzer, only
+ * has to be parsed without crashing.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <errno.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+#include <tools/internal.h>
+
+
+/*
+ * Parse a queue file given as a string and return the result of
+ * queue_file_parse.  The change points into a static buffer that is
+ * overwritten by the next call.
+ */
+static const char *
+parse(const char *contents, size_t length, struct queue_change *change)
+{
+    static char buffer[BUFSIZ];
+
+    if (length >= sizeof(buffer))
+        bail("queue file too long for test");
+    memcpy(buffer, contents, length);
+    return queue_file_parse(buffer, length, change);
+}
+
+
+/*
+ * Return the sorted names of the files in the corpus directory, which the
+ * caller should free with sync_vector_free.
+ */
+static struct vector *
+corpus_files(const char *corpus)
+{
+    struct vector *files;
+    DIR *dir;
+    struct dirent *entry;
+
+    files = sync_vector_new();
+    if (files == NULL)
+        sysbail("cannot allocate vector");
+    dir = opendir(corpus);
+    if (dir == NULL)
+        sysbail("cannot open %s", corpus);
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (!sync_vector_add(files, entry->d_name))
+            sysbail("cannot allocate vector");
+    }
+    closedir(dir);
+    sync_sort_strings(files->strings, files->count);
+    return files;
+}
+
+
+int
+main(void)
+{
+    struct queue_change change;
+    struct vector *files;
+    char *corpus, *path, *data, *tmpdir;
+    const char *error;
+    size_t length, i;
+    uint64_t mtime;
+    FILE *file;
+
+    /* Read the names of the files in the corpus to set the plan. */
+    corpus = test_file_path("data/queue");
+    if (corpus == NULL)
+        bail("cannot find data/queue in the test suite");
+    files = corpus_files(corpus);
+    plan(28 + (unsigned long) files->count);
+
+    /* A password change in the current format. */
+#define FILE_PASSWORD                                          \
+    "test@EXAMPLE.COM\nad\npassword\nfoo bar\n"               \
+    "trace 0123456789abcdef\norigin 1760000000.123456\n"
+    error = parse(FILE_PASSWORD, strlen(FILE_PASSWORD), &change);
+    is_string(NULL, error, "Password change parses");
+    is_string("test@EXAMPLE.COM", change.user, "...with the right user");
+    is_string("ad", change.target, "...and target");
+    is_int(QUEUE_PASSWORD, change.type, "...and type");
+    is_string("foo bar", change.password, "...and password");
+    is_string("0123456789abcdef", change.trace, "...and trace ID");
+    ok(change.origin == UINT64_C(1760000000123456), "...and origin");
+
+    /* A status change as written by older versions. */
+    error = parse("test\nad\ndisable\n", 16, &change);
+    is_string(NULL, error, "Status change without metadata parses");
+    is_int(QUEUE_DISABLE, change.type, "...with the right type");
+    ok(change.password == NULL, "...and no password");
+    ok(change.trace == NULL, "...and no trace ID");
+    ok(change.origin == 0, "...and no origin");
+
+    /*
+     * Lines added by later versions.  Later metadata lines win, invalid ones
+     * are ignored, and the last line doesn't need a newline.
+     */
+#define FILE_FUTURE                                             \
+    "test\nforest2\nenable\nversion 2\ntrace 0123456789abcdef\n" \
+    "trace 0123456789abcdef0\norigin 5.000007\norigin 6.x\nflags"
+    error = parse(FILE_FUTURE, strlen(FILE_FUTURE), &change);
+    is_string(NULL, error, "Status change with unknown lines parses");
+    is_int(QUEUE_ENABLE, change.type, "...with the right type");
+    is_string("0123456789abcdef", change.trace, "...and trace ID");
+    ok(change.origin == UINT64_C(5000007), "...and origin");
+
+    /* Unknown actions are left to the caller. */
+    error = parse("test\nad\nrename\n", 15, &change);
+    is_string(NULL, error, "Unknown action parses");
+    is_int(QUEUE_UNKNOWN, change.type, "...with the unknown type");
+    is_string("rename", change.action, "...and the action");
+
+    /* Incomplete and corrupt files. */
+    is_string("missing principal", parse("", 0, &change),
+              "Empty file is rejected");
+    is_string("missing principal", parse("\nad\nenable\n", 11, &change),
+              "Empty principal is rejected");
+    is_string("missing target", parse("test\n", 5, &change),
+              "Missing target is rejected");
+    is_string("missing action", parse("test\nad\nena", 11, &change),
+              "Incomplete action is rejected");
+    is_string("missing password", parse("test\nad\npassword\nfoo", 20,
+                                        &change),
+              "Incomplete password is rejected");
+    is_string("nul byte", parse("\0test\nad\nenable\n", 16, &change),
+              "Nul byte is rejected");
+
+    /* Reading files, including ones that are too large. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/queue-file", tmpdir);
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    fputs(FILE_PASSWORD, file);
+    fclose(file);
+    data = queue_file_read(path, &length, &mtime);
+    ok(data != NULL && length == strlen(FILE_PASSWORD)
+           && memcmp(data, FILE_PASSWORD, length) == 0 && mtime > 0,
+       "Reading a queue file works");
+    free(data);
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    for (i = 0; i <= QUEUE_FILE_MAX / 8; i++)
+        fputs("padding\n", file);
+    fclose(file);
+    errno = 0;
+    data = queue_file_read(path, &length, &mtime);
+    ok(data == NULL && errno == EFBIG, "...and refuses a file too large");
+    free(data);
+    unlink(path);
+    errno = 0;
+    data = queue_file_read(path, &length, &mtime);
+    ok(data == NULL && errno == ENOENT, "...and reports a missing file");
+    free(path);
+    test_tmpdir_free(tmpdir);
+
+    /* Run the corpus through the parser. */
+    for (i = 0; i < files->count; i++) {
+        basprintf(&path, "%s/%s", corpus, files->strings[i]);
+        data = queue_file_read(path, &length, &mtime);
+        if (data == NULL)
+            sysbail("cannot read %s", path);
+        error = queue_file_parse(data, length, &change);
+        if (strncmp(files->strings[i], "ok-", 3) == 0)
+            is_string(NULL, error, "Corpus file %s parses",
+                      files->strings[i]);
+        else if (strncmp(files->strings[i], "bad-", 4) == 0)
+            ok(error != NULL, "Corpus file %s is rejected (%s)",
+               files->strings[i], error == NULL ? "accepted" : error);
+        else
+            ok(true, "Corpus file %s doesn't crash the parser",
+               files->strings[i]);
+        free(data);
+        free(path);
+    }
+
+    /* Clean up. */
+    sync_vector_free(files);
+    test_file_path_free(corpus);
+    return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ * Tests for reconciling account status in krb5-sync.
+ *
+ * Links in the LDAP stand-in from the test library in place of the real LDAP
+ * library, fills it with accounts, and checks reconcile against the
+ * principals in a small kdb5_util dump file.  Only the principals whose
+ * status differs from their account should be reported or queued, matching
+ * userPrincipalName case-insensitively, and principals without an account
+ * and accounts without a principal should be ignored.  Enough accounts are
+ * added to make the hash table of accounts grow.  Then checks that an
+ * incremental reconcile saves a DirSync cookie, only checks the accounts
+ * that changed since then, and falls back on a full sweep when the cookie is
+ * rejected.  There is no KDC, so a fake
+ * ticket-granting ticket in the shared credential cache stands in for the
+ * one that would be obtained from the keytab.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/directory.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/messages.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+#include <tools/internal.h>
+
+/* The principal for which we store tickets, from data/krb5.conf. */
+#define PRINCIPAL "service/krb5-sync@EXAMPLE.COM"
+
+/* The base of the DNs of the accounts in Active Directory. */
+#define BASE "OU=Accounts,DC=ad,DC=example,DC=com"
+
+/* userAccountControl for a normal account, and with the disabled flag. */
+#define NORMAL   0x200
+#define DISABLED 0x202
+
+/* The number of accounts without principals, enough to grow the table. */
+#define FILLER 1500
+
+/* The differences between data/reconcile.dump and the accounts. */
+#define REPORT "bob@EXAMPLE.COM ad disable\ncarol@EXAMPLE.COM ad enable\n"
+
+
+/*
+ * Add an account to the directory with a DN built from its name.
+ */
+static void
+add_account(const char *name, unsigned long control)
+{
+    char *upn, *dn;
+
+    basprintf(&upn, "%s@AD.EXAMPLE.COM", name);
+    basprintf(&dn, "CN=%s,%s", name, BASE);
+    directory_add(upn, dn, control);
+    free(upn);
+    free(dn);
+}
+
+
+/*
+ * Return the contents of a file, which the caller should free, or NULL if
+ * the file doesn't exist.
+ */
+static char *
+read_file(const char *path)
+{
+    char buffer[BUFSIZ];
+    size_t length;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return NULL;
+    length = fread(buffer, 1, sizeof(buffer) - 1, file);
+    if (ferror(file))
+        sysbail("cannot read %s", path);
+    fclose(file);
+    buffer[length] = '\0';
+    return bstrdup(buffer);
+}
+
+
+/*
+ * Run reconcile without queuing, capturing the differences it prints to
+ * standard output.  Stores the number of differences it returns in
+ * differences and returns the output, which the caller should free.
+ */
+static char *
+report(kadm5_hook_modinfo *config, krb5_context ctx, const char *dump,
+       bool incremental, unsigned long *differences)
+{
+    char *output;
+    int fd, saved;
+
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    fd = open("report", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (saved < 0 || fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+        sysbail("cannot redirect standard output");
+    close(fd);
+    *differences = reconcile(config, ctx, dump, false, incremental);
+    fflush(stdout);
+    if (dup2(saved, STDOUT_FILENO) < 0)
+        sysbail("cannot restore standard output");
+    close(saved);
+    output = read_file("report");
+    if (output == NULL)
+        sysbail("cannot open report");
+    unlink("report");
+    return output;
+}
+
+
+int
+main(void)
+{
+    char *tmpdir, *krb5_config, *path, *dump, *output, *cookie, *again;
+    const char *const settings[] = { "ad_ccache", "FILE:ad-ccache", NULL };
+    char name[32];
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct directory_options options;
+    unsigned long differences;
+    int i;
+
+    /* Define the plan. */
+    plan(33);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Point KRB5_CONFIG at the generated krb5.conf file. */
+    sync_make_config(tmpdir, settings);
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+
+    /* Store fresh tickets in the shared cache and initialize the plugin. */
+    code = krb5_parse_name(ctx, PRINCIPAL, &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal %s", PRINCIPAL);
+    sync_ccache_store(ctx, "FILE:ad-ccache", princ, 60 * 60);
+    code = sync_init(ctx, &config);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize plugin");
+
+    /*
+     * The accounts to compare with the dump file, in which bob is disabled,
+     * carol is enabled, dave is disabled, and alice and erin are enabled.
+     * erin has no account, and frank and the fillers have no principal.
+     */
+    memset(&options, 0, sizeof(options));
+    directory_start(&options);
+    add_account("alice", NORMAL);
+    add_account("bob", NORMAL);
+    directory_add("Carol@AD.EXAMPLE.COM", "CN=carol," BASE, DISABLED);
+    add_account("dave", DISABLED);
+    add_account("frank", DISABLED);
+    for (i = 0; i < FILLER; i++) {
+        sprintf(name, "user%d", i);
+        add_account(name, (i % 2 == 0) ? NORMAL : DISABLED);
+    }
+    dump = test_file_path("data/reconcile.dump");
+    if (dump == NULL)
+        bail("cannot find data/reconcile.dump");
+
+    /* Only the differences are reported. */
+    output = report(config, ctx, dump, false, &differences);
+    is_int(2, differences, "reconcile finds two differences");
+    is_string(REPORT, output, "...and reports them");
+    free(output);
+    is_int(NORMAL, directory_control("bob@AD.EXAMPLE.COM"),
+           "...without changing the accounts");
+    ok(access("queue/.dirsync-ad", F_OK) != 0, "...or saving a cookie");
+
+    /* Queuing the differences writes the right enable and disable. */
+    is_int(2, reconcile(config, ctx, dump, true, false),
+           "reconcile with queuing finds two differences");
+    sync_queue_check_target("queue", "ad", "bob", "disable", NULL);
+    sync_queue_check_target("queue", "ad", "carol", "enable", NULL);
+
+    /* The first incremental reconcile is a full sweep that saves a cookie. */
+    output = report(config, ctx, dump, true, &differences);
+    is_int(2, differences, "First incremental reconcile finds everything");
+    is_string(REPORT, output, "...and reports it");
+    free(output);
+    cookie = read_file("queue/.dirsync-ad");
+    ok(cookie != NULL && cookie[0] != '\0', "...and saves a cookie");
+
+    /* The next one only checks the accounts that changed. */
+    add_account("alice", DISABLED);
+    output = report(config, ctx, dump, true, &differences);
+    is_int(1, differences, "Incremental reconcile finds one difference");
+    is_string("alice@EXAMPLE.COM ad enable\n", output,
+              "...in the only changed account");
+    free(output);
+    again = read_file("queue/.dirsync-ad");
+    ok(again != NULL && strcmp(cookie, again) != 0,
+       "...and saves a new cookie");
+    free(cookie);
+    free(again);
+    output = report(config, ctx, dump, true, &differences);
+    is_int(0, differences, "Nothing is found without changes");
+    is_string("", output, "...and nothing is reported");
+    free(output);
+
+    /* A rejected cookie falls back on a full sweep. */
+    directory_expire_cookies();
+    errors_capture();
+    output = report(config, ctx, dump, true, &differences);
+    errors_uncapture();
+    is_int(3, differences,
+           "Reconcile with a rejected cookie finds everything");
+    is_string("alice@EXAMPLE.COM ad enable\n" REPORT, output,
+              "...and reports it");
+    free(output);
+    ok(errors != NULL
+           && strstr(errors, "DirSync cookie for ad rejected, doing a full"
+                     " sweep") != NULL,
+       "...after a warning");
+    free(errors);
+    errors = NULL;
+    errors_capture();
+    output = report(config, ctx, dump, true, &differences);
+    errors_uncapture();
+    is_int(0, differences, "The new cookie is used by the next reconcile");
+    ok(errors == NULL, "...without a warning");
+    free(output);
+    free(errors);
+    errors = NULL;
+
+    /* Unwind the queue and be sure all the right files exist. */
+    ok(unlink("queue/.dirsync-ad") == 0, "Cookie file exists");
+    ok(unlink("queue/.lock") == 0, "Lock file still exists");
+    ok(rmdir("queue") == 0, "No other files in queue directory");
+
+    /* Shut down the plugin and clean up. */
+    test_file_path_free(dump);
+    directory_stop();
+    krb5_free_principal(ctx, princ);
+    sync_close(ctx, config);
+    krb5_free_context(ctx);
+    unlink("ad-ccache");
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
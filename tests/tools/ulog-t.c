@@ -0,0 +1,307 @@
+/*
+ * Tests for reading the MIT Kerberos update log in krb5-sync.
+ *
+ * Builds small update logs in the temporary directory and checks the names
+ * that ulog_read returns for the changes after a serial number, including
+ * after the log has wrapped around, and that it returns NULL when the log no
+ * longer holds every change after that serial number, isn't stable, or has a
+ * damaged entry.  Also checks that the serial number saved in queue_dir is
+ * written and read back.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <tools/internal.h>
+
+/* Magic numbers and state of the log, which must match tools/ulog.c. */
+#define ULOG_HDR_MAGIC 0x6662323
+#define ULOG_MAGIC     0x6661212
+#define ULOG_STABLE    1
+#define ULOG_UNSTABLE  2
+
+/* The size of each block of the test logs and the number of blocks. */
+#define BLOCK 128
+#define SLOTS 4
+
+/* The layout of the log header and entry headers, as in tools/ulog.c. */
+struct ulog_time {
+    uint32_t seconds;
+    uint32_t useconds;
+};
+struct ulog_header {
+    uint32_t magic;
+    uint16_t db_version;
+    uint32_t num;
+    struct ulog_time first_time;
+    struct ulog_time last_time;
+    uint32_t first_sno;
+    uint32_t last_sno;
+    uint16_t state;
+    uint16_t block;
+};
+struct ulog_entry {
+    uint32_t magic;
+    uint32_t sno;
+    struct ulog_time time;
+    int32_t commit;
+    uint32_t size;
+};
+
+
+/*
+ * Write the entry for a serial number into the log at path.  The entry is
+ * given the magic number and size, and its data is a big-endian length
+ * followed by the name.
+ */
+static void
+write_entry(const char *path, uint32_t sno, uint32_t magic, uint32_t size,
+            uint32_t length, const char *name)
+{
+    struct ulog_entry entry;
+    unsigned char data[BLOCK];
+    off_t offset;
+    int fd;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.magic = magic;
+    entry.sno = sno;
+    entry.commit = 1;
+    entry.size = size;
+    memset(data, 0, sizeof(data));
+    data[0] = (unsigned char) (length >> 24);
+    data[1] = (unsigned char) (length >> 16);
+    data[2] = (unsigned char) (length >> 8);
+    data[3] = (unsigned char) length;
+    memcpy(data + 4, name, strlen(name));
+    fd = open(path, O_WRONLY);
+    if (fd < 0)
+        sysbail("cannot open %s", path);
+    offset = (off_t) sizeof(struct ulog_header) + ((sno - 1) % SLOTS) * BLOCK;
+    if (pwrite(fd, &entry, sizeof(entry), offset) != sizeof(entry))
+        sysbail("cannot write %s", path);
+    offset += sizeof(entry);
+    if (pwrite(fd, data, BLOCK - sizeof(entry), offset)
+        != BLOCK - sizeof(entry))
+        sysbail("cannot write %s", path);
+    close(fd);
+}
+
+
+/*
+ * Write the normal entry for a serial number, which changes the principal
+ * user<sno>@EXAMPLE.COM.
+ */
+static void
+write_change(const char *path, uint32_t sno)
+{
+    char *name;
+
+    basprintf(&name, "user%lu@EXAMPLE.COM", (unsigned long) sno);
+    write_entry(path, sno, ULOG_MAGIC, (uint32_t) strlen(name) + 4,
+                (uint32_t) strlen(name), name);
+    free(name);
+}
+
+
+/*
+ * Create a log at path holding the changes from first to last with the given
+ * state, with SLOTS blocks, so that the log has wrapped around if last is
+ * larger than SLOTS.  If last is 0, the log is empty.
+ */
+static void
+write_log(const char *path, uint32_t first, uint32_t last, uint16_t state)
+{
+    struct ulog_header header;
+    uint32_t sno;
+    int fd;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = ULOG_HDR_MAGIC;
+    header.db_version = 1;
+    header.num = (last == 0) ? 0 : last - first + 1;
+    header.first_sno = first;
+    header.last_sno = last;
+    header.state = state;
+    header.block = BLOCK;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        sysbail("cannot create %s", path);
+    if (write(fd, &header, sizeof(header)) != sizeof(header))
+        sysbail("cannot write %s", path);
+    if (ftruncate(fd, (off_t) sizeof(header) + SLOTS * BLOCK) < 0)
+        sysbail("cannot extend %s", path);
+    close(fd);
+    for (sno = first; last != 0 && sno <= last; sno++)
+        write_change(path, sno);
+}
+
+
+/*
+ * Read the log at path after a serial number and check that it returns the
+ * changes after that serial number, up to last, and sets the serial number
+ * to last.
+ */
+static void
+check_changes(const char *path, unsigned long serial, unsigned long last,
+              const char *message)
+{
+    struct vector *names;
+    unsigned long sno;
+    char *wanted;
+    size_t i;
+
+    sno = serial + 1;
+    names = ulog_read(path, &serial);
+    ok(names != NULL, "%s", message);
+    if (names == NULL) {
+        ok_block(2, false, "no changes to check");
+        return;
+    }
+    is_int(last, serial, "...and the serial number is set to the last change");
+    for (i = 0; i < names->count; i++, sno++) {
+        basprintf(&wanted, "user%lu@EXAMPLE.COM", sno);
+        if (strcmp(wanted, names->strings[i]) != 0) {
+            free(wanted);
+            break;
+        }
+        free(wanted);
+    }
+    ok(i == names->count && sno == last + 1, "...with the changed names");
+    sync_vector_free(names);
+}
+
+
+/*
+ * Read the log at path after a serial number and check that it returns NULL,
+ * still setting the serial number to the last change in the log.
+ */
+static void
+check_missing(const char *path, unsigned long serial, unsigned long last,
+              const char *message)
+{
+    struct vector *names;
+
+    names = ulog_read(path, &serial);
+    ok(names == NULL, "%s", message);
+    is_int(last, serial, "...and the serial number is set to the last change");
+    if (names != NULL)
+        sync_vector_free(names);
+}
+
+
+int
+main(void)
+{
+    char *tmpdir;
+    kadm5_hook_modinfo config;
+    unsigned long serial;
+    pid_t child;
+    int status;
+    FILE *file;
+    char buffer[BUFSIZ];
+
+    /* Define the plan. */
+    plan(45);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* A log that hasn't wrapped around. */
+    write_log("ulog", 1, 3, ULOG_STABLE);
+    check_changes("ulog", 0, 3, "All changes are read");
+    check_changes("ulog", 2, 3, "The last change is read");
+    check_changes("ulog", 3, 3, "Nothing is read with no new changes");
+
+    /* A log that has wrapped around, with 7 through 10 in slots 2, 3, 0, 1. */
+    write_log("ulog", 7, 10, ULOG_STABLE);
+    check_changes("ulog", 6, 10, "Changes are read after wrapping around");
+    check_changes("ulog", 8, 10, "...from the middle of the log");
+    check_missing("ulog", 5, 10, "Changes that were overwritten are missing");
+    check_missing("ulog", 11, 10, "A log that was reset is missing changes");
+
+    /* An empty log after a reset, or one that isn't stable. */
+    write_log("ulog", 0, 0, ULOG_STABLE);
+    check_missing("ulog", 3, 0, "An empty log after a reset is missing them");
+    write_log("ulog", 1, 3, ULOG_UNSTABLE);
+    check_missing("ulog", 3, 3, "A log that isn't stable is never used");
+
+    /* Damaged entries. */
+    write_log("ulog", 1, 3, ULOG_STABLE);
+    write_entry("ulog", 2, ULOG_MAGIC + 1, 21, 17, "user2@EXAMPLE.COM");
+    check_missing("ulog", 0, 3, "An entry with the wrong magic is damaged");
+    write_entry("ulog", 2, ULOG_MAGIC, 3, 17, "user2@EXAMPLE.COM");
+    check_missing("ulog", 0, 3, "...as is an entry smaller than a length");
+    write_entry("ulog", 2, ULOG_MAGIC, BLOCK, 17, "user2@EXAMPLE.COM");
+    check_missing("ulog", 0, 3, "...or one larger than a block");
+    write_entry("ulog", 2, ULOG_MAGIC, 21, 18, "user2@EXAMPLE.COM");
+    check_missing("ulog", 0, 3, "...or one with a truncated name");
+    write_entry("ulog", 2, ULOG_MAGIC, 21, 0, "");
+    check_missing("ulog", 0, 3, "...or one with an empty name");
+    write_entry("ulog", 2, ULOG_MAGIC, 21, 17, "user2@EXAMPLE.COM");
+    check_changes("ulog", 0, 3, "Changes are read once the entry is fixed");
+
+    /* A file that isn't an update log is an error. */
+    if (truncate("ulog", 0) < 0 || truncate("ulog", BLOCK * SLOTS) < 0)
+        sysbail("cannot truncate ulog");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        if (freopen("/dev/null", "w", stderr) == NULL)
+            _exit(2);
+        serial = 0;
+        ulog_read("ulog", &serial);
+        _exit(0);
+    }
+    if (waitpid(child, &status, 0) != child)
+        sysbail("cannot wait for child");
+    ok(WIFEXITED(status) && WEXITSTATUS(status) == 1,
+       "A file with the wrong magic number is rejected");
+    unlink("ulog");
+
+    /* The saved serial number is written and read back. */
+    memset(&config, 0, sizeof(config));
+    config.queue_dir = (char *) "queue";
+    ok(!ulog_serial_read(&config, &serial), "No serial number is saved");
+    ulog_serial_write(&config, 4294967295UL);
+    serial = 0;
+    ok(ulog_serial_read(&config, &serial), "A saved serial number is read");
+    ok(serial == 4294967295UL, "...with the right value");
+    file = fopen("queue/.ulog-serial", "r");
+    if (file == NULL)
+        sysbail("cannot open queue/.ulog-serial");
+    if (fgets(buffer, sizeof(buffer), file) == NULL)
+        buffer[0] = '\0';
+    fclose(file);
+    is_string("4294967295\n", buffer, "...and written as text");
+    ulog_serial_write(&config, 5);
+    ok(ulog_serial_read(&config, &serial), "A replaced serial number is read");
+    is_int(5, serial, "...with the new value");
+
+    /* Be sure the serial number file was created and nothing else. */
+    ok(unlink("queue/.ulog-serial") == 0, "Serial number file exists");
+    ok(rmdir("queue") == 0, "No other files in queue directory");
+
+    /* Clean up. */
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * Process the queue of changes that failed in the plugin.
+ *
+ * This is a native replacement for krb5-sync-backend process that can apply
+ * changes in parallel.  The queue is processed in name order.  Changes for
+ * the same user, target, and operation must be applied in the order in which
+ * they were queued, so at most one of them is in flight at a time and, once
+ * one of them fails, the rest are left in the queue.  Changes for different
+ * users are handed to child processes, as many at a time for each target as
+ * the concurrency window of the rate and concurrency controller permits.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+
+#include <tools/internal.h>
+#include <util/messages-krb5.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/*
+ * A group of queued changes for the same user, target, and operation, which
+ * must be applied in order.  The queued changes are files[start] through
+ * files[end - 1] and next is the index of the next one to apply.
+ */
+struct group {
+    size_t start;
+    size_t next;
+    size_t end;
+    size_t target;              /* Index of the target in the config. */
+    pid_t pid;                  /* Child applying files[next], or 0. */
+    bool failed;
+};
+
+
+/*
+ * Parse a queue file name of the form <user>-<target>-<operation>-<time>-<n>.
+ * Store the length of the user-target-operation prefix, which identifies the
+ * changes that have to be applied in order, and the offset and length of the
+ * target.  User names may contain hyphens but nothing after them may, so
+ * parse from the end.  Returns false if the file name isn't a valid queue
+ * file name.
+ */
+static bool
+queue_parse(const char *name, size_t *idlen, size_t *target,
+            size_t *targetlen)
+{
+    size_t dash[4];
+    size_t i, n = 0;
+
+    for (i = strlen(name); i > 0 && n < 4; i--)
+        if (name[i - 1] == '-')
+            dash[n++] = i - 1;
+    if (n < 4 || dash[3] == 0)
+        return false;
+    *idlen = dash[1] + 1;
+    *target = dash[3] + 1;
+    *targetlen = dash[2] - dash[3] - 1;
+    return true;
+}
+
+
+/*
+ * Read the names of all queue files, sorted, into a newly allocated array,
+ * and store the number of files in count.  The queue is locked while reading
+ * it so that we don't see partially created files.
+ */
+static char **
+read_queue(kadm5_hook_modinfo *config, krb5_context ctx, size_t *count)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char **files = NULL;
+    size_t n = 0, size = 0;
+    int lock;
+    krb5_error_code code;
+
+    code = sync_queue_lock(config, ctx, &lock);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot lock queue");
+    dir = opendir(config->queue_dir);
+    if (dir == NULL)
+        sysdie("cannot open %s", config->queue_dir);
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (n == size) {
+            size = (size == 0) ? 64 : size * 2;
+            files = xreallocarray(files, size, sizeof(char *));
+        }
+        files[n++] = xstrdup(entry->d_name);
+    }
+    closedir(dir);
+    sync_queue_unlock(lock);
+    if (n > 0)
+        sort_strings(files, n);
+    *count = n;
+    return files;
+}
+
+
+/*
+ * Apply one queued change in a child process.  The file may have been
+ * processed by someone else since we read the queue, so check that it still
+ * exists under the queue lock first.  Returns the PID of the child.
+ */
+static pid_t
+start_change(kadm5_hook_modinfo *config, krb5_context ctx, const char *name)
+{
+    char *path;
+    int lock;
+    pid_t pid;
+    krb5_error_code code;
+
+    xasprintf(&path, "%s/%s", config->queue_dir, name);
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0)
+        sysdie("cannot fork");
+    else if (pid > 0) {
+        free(path);
+        return pid;
+    }
+    code = sync_queue_lock(config, ctx, &lock);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot lock queue");
+    if (access(path, F_OK) != 0) {
+        sync_queue_unlock(lock);
+        exit(0);
+    }
+    sync_queue_unlock(lock);
+    process_queue_file(config, ctx, path);
+    exit(0);
+}
+
+
+/*
+ * Process every queued change.  We hold a lock on .drain in the queue
+ * directory for the duration so that only one drain runs at a time, since
+ * two drains would race each other applying the same changes.  Returns the
+ * number of queued changes that failed.
+ */
+unsigned long
+drain_queue(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    char **files;
+    char *path, *name;
+    struct group *groups;
+    struct sync_target *target;
+    size_t count, ngroups, i, t, idlen, offset, length;
+    unsigned long total = 0, failed = 0;
+    unsigned long *running, *windows;
+    int fd, status;
+    pid_t pid;
+
+    if (config->queue_dir == NULL)
+        die("queue_dir not set in configuration");
+    xasprintf(&path, "%s/.drain", config->queue_dir);
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        sysdie("cannot open %s", path);
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK)
+            die("queue is already being processed");
+        sysdie("cannot lock %s", path);
+    }
+    free(path);
+
+    /* Read the queue and divide it into groups that must run in order. */
+    files = read_queue(config, ctx, &count);
+    groups = xcalloc(count > 0 ? count : 1, sizeof(struct group));
+    ngroups = 0;
+    for (i = 0; i < count; i++) {
+        if (!queue_parse(files[i], &idlen, &offset, &length)) {
+            warn("invalid queue file name %s", files[i]);
+            failed++;
+            continue;
+        }
+        if (ngroups > 0) {
+            const char *last = files[groups[ngroups - 1].start];
+            size_t lastlen, lastoff, lastn;
+
+            queue_parse(last, &lastlen, &lastoff, &lastn);
+            if (lastlen == idlen && strncmp(last, files[i], idlen) == 0) {
+                groups[ngroups - 1].end = i + 1;
+                continue;
+            }
+        }
+        name = xstrndup(files[i] + offset, length);
+        target = sync_target_find(config, name);
+        free(name);
+        if (target == NULL) {
+            warn("unknown target in queue file name %s", files[i]);
+            failed++;
+            continue;
+        }
+        groups[ngroups].start = i;
+        groups[ngroups].next = i;
+        groups[ngroups].end = i + 1;
+        groups[ngroups].target = (size_t) (target - config->ad_targets);
+        ngroups++;
+    }
+
+    /*
+     * Start changes while the window of their target permits and there's
+     * something to start, and otherwise wait for a child to finish.  The
+     * windows are checked again each time, since they change as the children
+     * report their results.
+     */
+    running = xcalloc(config->ad_targets_count, sizeof(unsigned long));
+    windows = xcalloc(config->ad_targets_count, sizeof(unsigned long));
+    while (true) {
+        for (t = 0; t < config->ad_targets_count; t++) {
+            target = &config->ad_targets[t];
+            windows[t] = sync_control_window(config, sync_control_dc(target));
+        }
+        for (i = 0; i < ngroups; i++) {
+            struct group *group = &groups[i];
+
+            if (group->pid != 0 || group->failed)
+                continue;
+            if (group->next >= group->end)
+                continue;
+            if (running[group->target] >= windows[group->target])
+                continue;
+            group->pid = start_change(config, ctx, files[group->next]);
+            running[group->target]++;
+            total++;
+        }
+        if (total == 0)
+            break;
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            sysdie("cannot wait for child");
+        }
+        for (i = 0; i < ngroups; i++)
+            if (groups[i].pid == pid)
+                break;
+        if (i == ngroups)
+            continue;
+        groups[i].pid = 0;
+        running[groups[i].target]--;
+        total--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            groups[i].next++;
+        else {
+            groups[i].failed = true;
+            failed++;
+        }
+    }
+
+    /* Clean up.  Closing the file releases the lock. */
+    for (i = 0; i < count; i++)
+        free(files[i]);
+    free(files);
+    free(groups);
+    free(running);
+    free(windows);
+    close(fd);
+    return failed;
+}
+
+
+/*
+ * Print the state of the rate and concurrency controller for each domain
+ * controller, one per line.
+ */
+void
+report_control(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_control_info *info;
+    size_t count, i;
+    krb5_error_code code;
+
+    code = sync_control_list(config, ctx, &info, &count);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot read controller state");
+    for (i = 0; i < count; i++)
+        printf("%s: tokens %.1f, window %.2f, live %lu, drain %lu, waits %lu,"
+               " successes %lu, failures %lu, backoffs %lu, hedges %lu,"
+               " hedge wins %lu\n", info[i].name, info[i].tokens,
+               info[i].window, info[i].live, info[i].drain, info[i].waits,
+               info[i].successes, info[i].failures, info[i].backoffs,
+               info[i].hedges, info[i].hedge_wins);
+    free(info);
+}
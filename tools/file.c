@@ -0,0 +1,41 @@
+/*
+ * Replacing the state files in queue_dir for the krb5-sync utility.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <tools/internal.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+
+/*
+ * Replace the contents of a file atomically by writing a temporary file and
+ * renaming it into place.
+ */
+void
+replace_file(const char *path, const void *data, size_t length)
+{
+    char *tmp;
+    ssize_t status;
+    int fd;
+
+    xasprintf(&tmp, "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        sysdie("cannot create %s", tmp);
+    status = write(fd, data, length);
+    if (status < 0 || (size_t) status != length)
+        sysdie("cannot write %s", tmp);
+    if (close(fd) < 0)
+        sysdie("cannot write %s", tmp);
+    if (rename(tmp, path) < 0)
+        sysdie("cannot rename %s to %s", tmp, path);
+    free(tmp);
+}
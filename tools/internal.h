@@ -0,0 +1,157 @@
+/*
+ * Internal prototypes and structures for the krb5-sync utility.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef TOOLS_INTERNAL_H
+#define TOOLS_INTERNAL_H 1
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/macros.h>
+
+#include <plugin/internal.h>
+
+/* The largest queue file that krb5-sync will read. */
+#define QUEUE_FILE_MAX 65536
+
+/* The kinds of change in a queue file. */
+enum queue_type {
+    QUEUE_ENABLE,
+    QUEUE_DISABLE,
+    QUEUE_PASSWORD,
+    QUEUE_UNKNOWN
+};
+
+/*
+ * A change parsed from a queue file by queue_file_parse, pointing into the
+ * contents of the file.  password is NULL unless the type is QUEUE_PASSWORD,
+ * trace is NULL and origin is 0 if the file doesn't give them, and action is
+ * the action as written in the file.
+ */
+struct queue_change {
+    const char *user;
+    const char *target;
+    const char *action;
+    enum queue_type type;
+    const char *password;
+    const char *trace;
+    uint64_t origin;
+};
+
+BEGIN_DECLS
+
+/* Default to a hidden visibility for all internal functions. */
+#pragma GCC visibility push(hidden)
+
+/*
+ * Change a password or the account status in an Active Directory target for
+ * the given user, printing a message on success.  Don't return on failure.
+ */
+void ad_password(kadm5_hook_modinfo *, struct sync_target *, struct sync_op *,
+                 const char *password, const char *user)
+    __attribute__((__nonnull__));
+void ad_status(kadm5_hook_modinfo *, struct sync_target *, struct sync_op *,
+               bool enable, const char *user)
+    __attribute__((__nonnull__));
+
+/*
+ * Read a queue file and take the appropriate action based on its contents,
+ * deleting it on success.  Doesn't return on failure.
+ */
+void process_queue_file(kadm5_hook_modinfo *, krb5_context,
+                        const char *filename)
+    __attribute__((__nonnull__));
+
+/*
+ * Parse the length bytes of a queue file at data, which must have room for
+ * one more byte after them, into a change that points into it, replacing
+ * newlines with nul bytes.  Returns NULL on success or a description of the
+ * problem.  queue_file_read reads a queue file into newly allocated memory
+ * for queue_file_parse, storing its length and its modification time in
+ * microseconds, and returns NULL with errno set on failure.
+ */
+const char *queue_file_parse(char *data, size_t length,
+                             struct queue_change *)
+    __attribute__((__nonnull__));
+char *queue_file_read(const char *path, size_t *length, uint64_t *mtime)
+    __attribute__((__malloc__, __nonnull__));
+
+/*
+ * Process all queued changes, running as many in parallel as the rate and
+ * concurrency controller permits.  Returns the number of queued changes that
+ * failed.
+ */
+unsigned long drain_queue(kadm5_hook_modinfo *, krb5_context)
+    __attribute__((__nonnull__));
+
+/*
+ * Compare the account status of every local principal with Active Directory,
+ * reading the principals from the given kdb5_util dump file or, if it is
+ * NULL, from the local KDC database.  If incremental is true, only check the
+ * accounts that changed in Active Directory since the last incremental run.
+ * Prints the differences or, if queue is true, queues changes to fix them.
+ * Returns the number of differences.
+ */
+unsigned long reconcile(kadm5_hook_modinfo *, krb5_context, const char *dump,
+                        bool queue, bool incremental)
+    __attribute__((__nonnull__(1, 2)));
+
+/*
+ * The same, but only for the local principals changed since the last run
+ * according to the given MIT update log, falling back on checking every
+ * principal if the log doesn't go back that far.
+ */
+unsigned long reconcile_log(kadm5_hook_modinfo *, krb5_context,
+                            const char *ulog, bool queue)
+    __attribute__((__nonnull__));
+
+/*
+ * Return the names of the principals changed after serial in an MIT update
+ * log and set serial to the last change in the log, or return NULL if the log
+ * doesn't hold every change after serial.
+ */
+struct vector *ulog_read(const char *path, unsigned long *serial)
+    __attribute__((__nonnull__));
+
+/*
+ * Read the update log serial number saved in queue_dir by the last run,
+ * returning false if there isn't one, or save one for the next run.
+ */
+bool ulog_serial_read(kadm5_hook_modinfo *, unsigned long *serial)
+    __attribute__((__nonnull__));
+void ulog_serial_write(kadm5_hook_modinfo *, unsigned long serial)
+    __attribute__((__nonnull__));
+
+/*
+ * Replace the contents of a file atomically, dying on failure.  Used for the
+ * files in queue_dir that hold state between runs.
+ */
+void replace_file(const char *path, const void *data, size_t length)
+    __attribute__((__nonnull__));
+
+/* Sort an array of strings in place. */
+void sort_strings(char **, size_t)
+    __attribute__((__nonnull__));
+
+/* Print the state of the rate and concurrency controller. */
+void report_control(kadm5_hook_modinfo *, krb5_context)
+    __attribute__((__nonnull__));
+
+/*
+ * Print the statistics kept by the plugin and krb5-sync, in the Prometheus
+ * text format if prometheus is true.
+ */
+void report_stats(kadm5_hook_modinfo *, krb5_context, bool prometheus)
+    __attribute__((__nonnull__));
+
+/* Undo default visibility change. */
+#pragma GCC visibility pop
+
+END_DECLS
+
+#endif /* !TOOLS_INTERNAL_H */
@@ -23,145 +23,37 @@
 #include <errno.h>
 #include <syslog.h>
 
-#include <plugin/internal.h>
+#include <tools/internal.h>
 #include <util/messages-krb5.h>
 #include <util/messages.h>
 
 
-/*
- * Change a password in Active Directory.  Print a success message if we were
- * successful, and exit with an error message if we weren't.
- */
-static void
-ad_password(kadm5_hook_modinfo *config, krb5_context ctx,
-            krb5_principal principal, char *password, const char *user)
-{
-    krb5_error_code code;
-
-    code = sync_ad_chpass(config, ctx, principal, password);
-    if (code != 0)
-        die_krb5(ctx, code, "AD password change for %s failed", user);
-    notice("AD password change for %s succeeded", user);
-}
-
-
-/*
- * Change the account status in Active Directory.  Print a success message if
- * we were successful, and exit with an error message if we weren't.
- */
-static void
-ad_status(kadm5_hook_modinfo *config, krb5_context ctx,
-          krb5_principal principal, bool enable, const char *user)
-{
-    krb5_error_code code;
-
-    code = sync_ad_status(config, ctx, principal, enable);
-    if (code != 0)
-        die_krb5(ctx, code, "AD status change for %s failed", user);
-    notice("AD status change for %s succeeded", user);
-}
-
-
-/*
- * Read a line from a queue file, making sure we got a complete line and
- * cutting off the trailing newline.  Doesn't return on error.
- */
-static void
-read_line(FILE *file, const char *filename, char *buffer, size_t bufsiz)
-{
-    if (fgets(buffer, bufsiz, file) == NULL)
-        sysdie("cannot read from queue file %s", filename);
-    if (buffer[strlen(buffer) - 1] != '\n')
-        die("line too long in queue file %s", filename);
-    buffer[strlen(buffer) - 1] = '\0';
-}
-
-
-/*
- * Read a queue file and take appropriate action based on its contents.  The
- * format is:
- *
- *     <principal>
- *     ad
- *     enable | disable | password
- *     [<password>]
- *
- * The actions are the same as from the command-line switches, except that
- * passwords are changed separately in AFS and AD.  enable and disable are not
- * supported for AFS.
- */
-static void
-process_queue_file(kadm5_hook_modinfo *config, krb5_context ctx,
-                   const char *filename)
-{
-    FILE *queue;
-    char buffer[BUFSIZ];
-    char *user;
-    krb5_principal principal;
-    krb5_error_code ret;
-    bool ad = false;
-    bool enable = false;
-    bool disable = false;
-    bool password = false;
-
-    /* Open the queue file. */
-    queue = fopen(filename, "r");
-    if (queue == NULL)
-        sysdie("cannot open queue file %s", filename);
-
-    /* Get user and convert into a principal. */
-    read_line(queue, filename, buffer, sizeof(buffer));
-    user = strdup(buffer);
-    ret = krb5_parse_name(ctx, buffer, &principal);
-    if (ret != 0)
-        die_krb5(ctx, ret, "cannot parse user %s into principal", buffer);
-
-    /* Get function. */
-    read_line(queue, filename, buffer, sizeof(buffer));
-    if (strcmp(buffer, "ad") == 0)
-        ad = true;
-    else
-        die("unknown target system %s in queue file %s", buffer, filename);
-    read_line(queue, filename, buffer, sizeof(buffer));
-    if (strcmp(buffer, "enable") == 0)
-        enable = true;
-    else if (strcmp(buffer, "disable") == 0)
-        disable = true;
-    else if (strcmp(buffer, "password") == 0)
-        password = true;
-    else
-        die("unknown action %s in queue file %s", buffer, filename);
-
-    /* Perform the appropriate action. */
-    if (password) {
-        read_line(queue, filename, buffer, sizeof(buffer));
-        if (ad)
-            ad_password(config, ctx, principal, buffer, user);
-    } else if (enable || disable) {
-        ad_status(config, ctx, principal, enable, user);
-    }
-
-    /* If we got here, we were successful.  Close the file and delete it. */
-    fclose(queue);
-    if (unlink(filename) != 0)
-        sysdie("unable to unlink queue file %s", filename);
-    free(user);
-}
-
-
 int
 main(int argc, char *argv[])
 {
     int option;
     int enable = false;
     int disable = false;
+    int drain = false;
+    int list = false;
+    int stats = false;
+    int prometheus = false;
+    int report = false;
+    int requeue = false;
+    int incremental = false;
     char *password = NULL;
     char *filename = NULL;
+    char *dump = NULL;
+    char *ulog = NULL;
     char *user;
     kadm5_hook_modinfo *config;
     krb5_context ctx;
     krb5_error_code code;
     krb5_principal principal;
+    struct sync_op op;
+    struct sync_target *target;
+    size_t i;
+    bool found = false;
 
     /*
      * Actions should be logged to LOG_AUTH to go to the same place as the
@@ -171,12 +63,21 @@ main(int argc, char *argv[])
     message_program_name = "krb5-sync";
 
     /* Parse command-line options. */
-    while ((option = getopt(argc, argv, "def:p:")) != EOF) {
+    while ((option = getopt(argc, argv, "D:def:iLPp:qrRSU:")) != EOF) {
         switch (option) {
+        case 'D': dump = optarg;        break;
         case 'd': disable = true;       break;
         case 'e': enable = true;        break;
         case 'f': filename = optarg;    break;
+        case 'i': incremental = true;   break;
+        case 'L': list = true;          break;
+        case 'P': prometheus = true;    break;
         case 'p': password = optarg;    break;
+        case 'q': drain = true;         break;
+        case 'r': report = true;        break;
+        case 'R': requeue = true;       break;
+        case 'S': stats = true;         break;
+        case 'U': ulog = optarg;        break;
 
         default:
             fprintf(stderr, "Usage: krb5-sync [-d | -e] [-p <pass>] <user>\n");
@@ -185,7 +86,16 @@ main(int argc, char *argv[])
     }
     argc -= optind;
     argv += optind;
-    if (argc != 1 && filename == NULL) {
+    if (drain || list || report || requeue || stats || prometheus) {
+        if (argc != 0
+            || drain + list + report + requeue + (stats || prometheus) > 1) {
+            fprintf(stderr, "Usage: krb5-sync -q | -L | -S [-P] | -r | -R"
+                    " [-i] [-D <dump>] [-U <ulog>]\n");
+            exit(1);
+        }
+        if (enable || disable || password != NULL || filename != NULL)
+            die("cannot specify an action with -q, -L, -S, -r, or -R");
+    } else if (argc != 1 && filename == NULL) {
         fprintf(stderr, "Usage: krb5-sync [-d | -e] [-p <pass>] <user>\n");
         exit(1);
     }
@@ -196,8 +106,13 @@ main(int argc, char *argv[])
     user = argv[0];
     if (enable && disable)
         die("cannot specify both -d and -e");
-    if (!enable && !disable && password == NULL && filename == NULL)
+    if (!enable && !disable && password == NULL && filename == NULL
+        && !drain && !list && !report && !requeue && !stats && !prometheus)
         die("no action specified");
+    if ((dump != NULL || incremental || ulog != NULL) && !report && !requeue)
+        die("-D, -i, and -U may only be used with -r or -R");
+    if (ulog != NULL && (dump != NULL || incremental))
+        die("cannot specify -U with -D or -i");
     if (filename != NULL && (enable || disable || password != NULL))
         die("must specify queue file or action, not both");
 
@@ -211,17 +126,46 @@ main(int argc, char *argv[])
     if (code != 0)
         die_krb5(ctx, code, "plugin initialization failed");
 
+    /*
+     * Changes from the queue shouldn't use the share of the AD rate limit
+     * reserved for kadmind.
+     */
+    if (drain || filename != NULL)
+        config->drain = true;
+
     /* Now, do whatever we were supposed to do. */
-    if (filename != NULL)
+    if (list)
+        report_control(config, ctx);
+    else if (stats || prometheus)
+        report_stats(config, ctx, prometheus);
+    else if ((report || requeue) && ulog != NULL)
+        reconcile_log(config, ctx, ulog, requeue);
+    else if (report || requeue)
+        reconcile(config, ctx, dump, requeue, incremental);
+    else if (drain) {
+        if (drain_queue(config, ctx) > 0)
+            exit(1);
+    } else if (filename != NULL)
         process_queue_file(config, ctx, filename);
     else {
         code = krb5_parse_name(ctx, user, &principal);
         if (code != 0)
             die_krb5(ctx, code, "cannot parse user %s into principal", user);
-        if (password != NULL)
-            ad_password(config, ctx, principal, password, user);
-        if (enable || disable)
-            ad_status(config, ctx, principal, enable, user);
+        code = sync_op_init(&op, ctx, principal);
+        if (code != 0)
+            die_krb5(ctx, code, "cannot set up change for %s", user);
+        for (i = 0; i < config->ad_targets_count; i++) {
+            target = &config->ad_targets[i];
+            if (!sync_target_match(target, &op))
+                continue;
+            found = true;
+            if (password != NULL)
+                ad_password(config, target, &op, password, user);
+            if (enable || disable)
+                ad_status(config, target, &op, enable, user);
+        }
+        if (!found)
+            die("%s does not match any target", user);
     }
     exit(0);
 }
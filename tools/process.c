@@ -0,0 +1,162 @@
+/*
+ * Apply changes to Active Directory targets for the krb5-sync utility.
+ *
+ * These functions make a single change and report the result, either one
+ * given on the command line or one read from a queue file.  They're shared
+ * by the krb5-sync command-line handling and the queue drain, and are kept
+ * apart from main so that the queue drain can be benchmarked without it.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Based on code developed by Derrick Brashear and Ken Hornstein of Sine
+ *     Nomine Associates, on behalf of Stanford University
+ * Modified by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ * Copyright 2006, 2007, 2010, 2012, 2013
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <tools/internal.h>
+#include <util/messages-krb5.h>
+#include <util/messages.h>
+
+
+/*
+ * Record a change applied from the queue in the statistics, including the
+ * lag since the plugin first saw it if it succeeded.  Changes made directly
+ * from the command line aren't counted.
+ */
+static void
+record_change(kadm5_hook_modinfo *config, struct sync_op *op,
+              enum sync_stats_type type, krb5_error_code code, uint64_t start)
+{
+    enum sync_stats_result result;
+
+    if (!config->drain)
+        return;
+    result = (code == 0) ? SYNC_STATS_SUCCESS : SYNC_STATS_FAILED;
+    sync_stats_change(config, SYNC_STATS_DRAIN, type, result, start);
+    if (code == 0)
+        sync_stats_lag(config, type, op->origin);
+}
+
+
+/*
+ * Change a password in an Active Directory target.  Print a success message
+ * if we were successful, and exit with an error message if we weren't.
+ */
+void
+ad_password(kadm5_hook_modinfo *config, struct sync_target *target,
+            struct sync_op *op, const char *password, const char *user)
+{
+    krb5_error_code code;
+    uint64_t start;
+
+    start = sync_stats_now();
+    code = sync_ad_chpass(config, target, op, password);
+    record_change(config, op, SYNC_STATS_PASSWORD, code, start);
+    if (code != 0)
+        die_krb5(op->ctx, code, "AD password change for %s in %s failed"
+                 " (trace %s)", user, target->name, op->trace);
+    notice("AD password change for %s in %s succeeded (trace %s)", user,
+           target->name, op->trace);
+}
+
+
+/*
+ * Change the account status in an Active Directory target.  Print a success
+ * message if we were successful, and exit with an error message if we
+ * weren't.
+ */
+void
+ad_status(kadm5_hook_modinfo *config, struct sync_target *target,
+          struct sync_op *op, bool enable, const char *user)
+{
+    krb5_error_code code;
+    uint64_t start;
+
+    start = sync_stats_now();
+    code = sync_ad_status(config, target, op, enable);
+    record_change(config, op, SYNC_STATS_STATUS, code, start);
+    if (code != 0)
+        die_krb5(op->ctx, code, "AD status change for %s in %s failed"
+                 " (trace %s)", user, target->name, op->trace);
+    notice("AD status change for %s in %s succeeded (trace %s)", user,
+           target->name, op->trace);
+}
+
+
+/*
+ * Read a queue file and take the appropriate action based on its contents,
+ * as parsed by queue_file_parse.  The actions are the same as from the
+ * command-line switches, except that they're only applied to the given
+ * Active Directory target.  Queue files without a trace ID or origin, written
+ * by older versions of the plugin or by krb5-sync-backend, keep the new trace
+ * ID of the change and use the modification time of the file as its origin.
+ */
+void
+process_queue_file(kadm5_hook_modinfo *config, krb5_context ctx,
+                   const char *filename)
+{
+    char *data;
+    const char *error;
+    char trace[SYNC_TRACE_SIZE];
+    size_t length;
+    uint64_t mtime;
+    struct queue_change change;
+    krb5_principal principal;
+    struct sync_op op;
+    krb5_error_code ret;
+    struct sync_target *target;
+
+    /* Read and parse the queue file. */
+    data = queue_file_read(filename, &length, &mtime);
+    if (data == NULL)
+        sysdie("cannot read queue file %s", filename);
+    error = queue_file_parse(data, length, &change);
+    if (error != NULL)
+        die("%s in queue file %s", error, filename);
+
+    /* Convert the user into a principal and find the target. */
+    ret = krb5_parse_name(ctx, change.user, &principal);
+    if (ret != 0)
+        die_krb5(ctx, ret, "cannot parse user %s into principal",
+                 change.user);
+    ret = sync_op_init(&op, ctx, principal);
+    if (ret != 0)
+        die_krb5(ctx, ret, "cannot set up change for %s", change.user);
+    target = sync_target_find(config, change.target);
+    if (target == NULL)
+        die("unknown target system %s in queue file %s", change.target,
+            filename);
+    memcpy(trace, op.trace, sizeof(trace));
+    sync_op_trace(&op, change.trace != NULL ? change.trace : trace,
+                  change.origin != 0 ? change.origin : mtime);
+
+    /* Perform the appropriate action. */
+    switch (change.type) {
+    case QUEUE_PASSWORD:
+        ad_password(config, target, &op, change.password, change.user);
+        break;
+    case QUEUE_ENABLE:
+    case QUEUE_DISABLE:
+        ad_status(config, target, &op, change.type == QUEUE_ENABLE,
+                  change.user);
+        break;
+    case QUEUE_UNKNOWN:
+    default:
+        die("unknown action %s in queue file %s", change.action, filename);
+    }
+
+    /* If we got here, we were successful.  Delete the file. */
+    if (SYNC_FAULT(SYNC_FAULT_QUEUE_UNLINK) || unlink(filename) != 0)
+        sysdie("unable to unlink queue file %s", filename);
+    sync_op_free(&op);
+    krb5_free_principal(ctx, principal);
+    free(data);
+}
@@ -0,0 +1,202 @@
+/*
+ * Parsing queue files for the krb5-sync utility.
+ *
+ * Queue files are written by the plugin and krb5-sync-backend into a
+ * directory that other programs can also write to, so they're parsed as
+ * untrusted input.  The whole file is read into memory and split into lines
+ * in place, so parsing one doesn't allocate anything and its result points
+ * into the file contents.  The format is:
+ *
+ *     <principal>
+ *     <target>
+ *     <action>
+ *     [<password>]
+ *     [trace <id>]
+ *     [origin <seconds>.<microseconds>]
+ *
+ * where the password is only present if the action is password.  The first
+ * lines must be complete and aren't otherwise checked here, except that the
+ * principal, target, and action may not be empty.  Files written by older
+ * versions of the plugin or by krb5-sync-backend have no lines after the
+ * change, and any lines after it that aren't recognized are ignored so that
+ * later versions can add more.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <tools/internal.h>
+
+
+/*
+ * Split the next line off the data between *p and end, storing it in line
+ * with its newline replaced by a nul.  If complete is true, the line must
+ * end in a newline.  Returns false if there are no more lines or the line
+ * isn't complete.
+ */
+static bool
+next_line(char **p, char *end, bool complete, char **line)
+{
+    char *newline;
+
+    if (*p >= end)
+        return false;
+    newline = memchr(*p, '\n', (size_t) (end - *p));
+    if (newline == NULL) {
+        if (complete)
+            return false;
+        newline = end;
+    }
+    *newline = '\0';
+    *line = *p;
+    *p = newline + 1;
+    return true;
+}
+
+
+/*
+ * Parse an origin line after the "origin " prefix, which gives the time the
+ * plugin first saw the change in seconds and microseconds.  Returns false if
+ * the line isn't valid.
+ */
+static bool
+parse_origin(const char *value, uint64_t *origin)
+{
+    unsigned long long seconds;
+    unsigned long usec;
+    char *end;
+
+    if (!isdigit((unsigned char) value[0]))
+        return false;
+    errno = 0;
+    seconds = strtoull(value, &end, 10);
+    if (errno != 0 || *end != '.' || !isdigit((unsigned char) end[1]))
+        return false;
+    usec = strtoul(end + 1, &end, 10);
+    if (errno != 0 || usec >= 1000000)
+        return false;
+    *origin = (uint64_t) seconds * 1000000 + usec;
+    return true;
+}
+
+
+/*
+ * Parse the length bytes of a queue file at data, which must have room for
+ * one more byte after them, into change.  Returns NULL on success or a
+ * description of the problem.
+ */
+const char *
+queue_file_parse(char *data, size_t length, struct queue_change *change)
+{
+    char *p = data;
+    char *end = data + length;
+    char *line;
+
+    memset(change, 0, sizeof(*change));
+    *end = '\0';
+    if (memchr(data, '\0', length) != NULL)
+        return "nul byte";
+
+    /* The change itself. */
+    if (!next_line(&p, end, true, &line) || line[0] == '\0')
+        return "missing principal";
+    change->user = line;
+    if (!next_line(&p, end, true, &line) || line[0] == '\0')
+        return "missing target";
+    change->target = line;
+    if (!next_line(&p, end, true, &line) || line[0] == '\0')
+        return "missing action";
+    change->action = line;
+    if (strcmp(line, "enable") == 0)
+        change->type = QUEUE_ENABLE;
+    else if (strcmp(line, "disable") == 0)
+        change->type = QUEUE_DISABLE;
+    else if (strcmp(line, "password") == 0) {
+        change->type = QUEUE_PASSWORD;
+        if (!next_line(&p, end, true, &line))
+            return "missing password";
+        change->password = line;
+    } else
+        change->type = QUEUE_UNKNOWN;
+
+    /*
+     * The metadata, where the last line may be missing its newline.  Later
+     * lines override earlier ones, and a trace ID that's too long is ignored.
+     */
+    while (next_line(&p, end, false, &line)) {
+        if (strncmp(line, "trace ", 6) == 0) {
+            if (strlen(line + 6) < SYNC_TRACE_SIZE)
+                change->trace = line + 6;
+        } else if (strncmp(line, "origin ", 7) == 0)
+            parse_origin(line + 7, &change->origin);
+    }
+    return NULL;
+}
+
+
+/*
+ * Read the queue file at path into newly allocated memory with room for a
+ * nul byte after its contents, storing the length of the contents in length
+ * and the modification time of the file in microseconds in mtime.  Returns
+ * NULL with errno set on failure, including EFBIG if the file is larger than
+ * QUEUE_FILE_MAX.
+ */
+char *
+queue_file_read(const char *path, size_t *length, uint64_t *mtime)
+{
+    struct stat st;
+    char *data = NULL;
+    size_t size = 0;
+    ssize_t status;
+    int fd, oerrno;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0)
+        goto fail;
+    if (st.st_size > QUEUE_FILE_MAX) {
+        errno = EFBIG;
+        goto fail;
+    }
+
+    /*
+     * Read until end of file rather than trusting the size, and with one
+     * byte to spare to notice if the file grew past the limit.
+     */
+    data = malloc((size_t) QUEUE_FILE_MAX + 2);
+    if (data == NULL)
+        goto fail;
+    do {
+        status = read(fd, data + size, QUEUE_FILE_MAX + 1 - size);
+        if (status < 0 && errno != EINTR)
+            goto fail;
+        if (status > 0)
+            size += (size_t) status;
+    } while (status != 0 && size <= QUEUE_FILE_MAX);
+    if (size > QUEUE_FILE_MAX) {
+        errno = EFBIG;
+        goto fail;
+    }
+    close(fd);
+    *length = size;
+    *mtime = (uint64_t) st.st_mtime * 1000000;
+    return data;
+
+fail:
+    oerrno = errno;
+    free(data);
+    close(fd);
+    errno = oerrno;
+    return NULL;
+}
@@ -0,0 +1,762 @@
+/*
+ * Reconcile account status between the local KDC and Active Directory.
+ *
+ * Changes to account status may be lost, such as when a queued change is
+ * removed by hand, leaving accounts enabled in one place and disabled in the
+ * other.  To find them, we fetch the status of every account in each target
+ * with one paged LDAP search and then walk the local principals, either from
+ * the local KDC database via kadm5 or from a kdb5_util dump file, reporting
+ * or queuing a status change for every principal whose DISALLOW_ALL_TIX flag
+ * doesn't match userAccountControl.
+ *
+ * With an incremental reconcile, we instead use the DirSync control with a
+ * cookie saved in queue_dir by the previous run, so that Active Directory
+ * only returns the accounts that changed since then.  There are few enough
+ * of those that we keep their names and look each one up in the local KDC
+ * database, rather than walking all of it.  If there is no cookie yet, or
+ * Active Directory rejects it, we fall back on a full sweep.
+ *
+ * Changes made while the plugin was disabled, or with kadmin.local or a
+ * database load, never reach Active Directory.  To catch up on them, we can
+ * instead read the names of the principals changed since the last run from
+ * the MIT Kerberos update log, look up just those accounts in Active
+ * Directory, and check them, so the cost depends on the number of changes
+ * rather than the size of the database.
+ *
+ * Realms may have hundreds of thousands of accounts, so for a full sweep we
+ * don't keep the names of the Active Directory accounts.  The accounts in
+ * each target are kept in a hash table holding only a 64-bit hash of the
+ * lowercased userPrincipalName and the account status.  A dump file is
+ * parsed one record at a time, so memory use is bounded only with a dump
+ * file.  kadm5 has no way to page through the principals, so walking the
+ * local KDC database via kadm5 holds the names of all of them at once.
+ * Principals that don't exist in Active Directory are ignored, since not
+ * every principal has an account there.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/kadmin.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <tools/internal.h>
+#include <util/messages-krb5.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* The initial size of the account hash table, which must be a power of 2. */
+#define ACCOUNTS_INITIAL 1024
+
+/* The longest principal name we accept in a dump file. */
+#define DUMP_NAME_MAX 1024
+
+/* The largest DirSync cookie we're willing to read. */
+#define COOKIE_MAX (64 * 1024)
+
+/* Account status flags stored in the hash table. */
+#define ACCOUNT_PRESENT  0x01
+#define ACCOUNT_DISABLED 0x02
+
+/* One account in Active Directory. */
+struct account {
+    uint64_t hash;
+    unsigned char flags;
+};
+
+/*
+ * A hash table of the accounts in one target, using linear probing.  For an
+ * incremental reconcile, we also keep the names of the accounts that changed
+ * if we're going to look them up, and the new DirSync cookie.
+ */
+struct accounts {
+    struct account *table;
+    size_t size;
+    size_t count;
+    struct vector *names;
+    void *cookie;
+    size_t length;
+};
+
+/* The state of a reconcile run. */
+struct reconcile {
+    kadm5_hook_modinfo *config;
+    krb5_context ctx;
+    struct accounts *targets;   /* One hash table per target. */
+    bool queue;                 /* Whether to queue the changes. */
+    unsigned long differences;
+};
+
+
+/*
+ * Hash a principal name case-insensitively, since Active Directory doesn't
+ * care about the case of userPrincipalName.  This is 64-bit FNV-1a.
+ */
+static uint64_t
+account_hash(const char *name)
+{
+    uint64_t hash = UINT64_C(14695981039346656037);
+    const unsigned char *p;
+
+    for (p = (const unsigned char *) name; *p != '\0'; p++) {
+        hash ^= (uint64_t) tolower(*p);
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+
+/*
+ * Find the slot for a hash in the hash table, which is either the slot
+ * holding that hash or the empty slot where it belongs.
+ */
+static struct account *
+account_slot(struct accounts *accounts, uint64_t hash)
+{
+    size_t i;
+
+    i = (size_t) hash & (accounts->size - 1);
+    while (accounts->table[i].flags != 0 && accounts->table[i].hash != hash)
+        i = (i + 1) & (accounts->size - 1);
+    return &accounts->table[i];
+}
+
+
+/*
+ * Add an account to the hash table of a target, doubling the table when it
+ * becomes half full.  This is the callback for sync_ad_accounts.
+ */
+static void
+account_add(void *data, const char *upn, bool disabled)
+{
+    struct accounts *accounts = data;
+    struct account *old, *slot;
+    size_t oldsize, i;
+    uint64_t hash;
+
+    if (accounts->count + 1 > accounts->size / 2) {
+        old = accounts->table;
+        oldsize = accounts->size;
+        accounts->size = (oldsize == 0) ? ACCOUNTS_INITIAL : oldsize * 2;
+        accounts->table = xcalloc(accounts->size, sizeof(struct account));
+        for (i = 0; i < oldsize; i++)
+            if (old[i].flags != 0)
+                *account_slot(accounts, old[i].hash) = old[i];
+        free(old);
+    }
+    if (accounts->names != NULL && !sync_vector_add(accounts->names, upn))
+        sysdie("cannot allocate memory");
+    hash = account_hash(upn);
+    slot = account_slot(accounts, hash);
+    if (slot->flags == 0)
+        accounts->count++;
+    slot->hash = hash;
+    slot->flags = ACCOUNT_PRESENT | (disabled ? ACCOUNT_DISABLED : 0);
+}
+
+
+/*
+ * Return the userPrincipalName of the principal of an operation in a target,
+ * or NULL if changes to the principal aren't sent to that target.  The
+ * result belongs to the operation.
+ */
+static const char *
+map_principal(struct reconcile *state, struct sync_target *target,
+              struct sync_op *op)
+{
+    krb5_error_code code;
+    const char *ad_name;
+
+    if (!sync_target_match(target, op))
+        return NULL;
+    code = sync_op_ad_name(state->config, op, target, &ad_name);
+    if (code != 0)
+        die_krb5(state->ctx, code, "cannot map %s to %s", op->name,
+                 target->name);
+    return ad_name;
+}
+
+
+/*
+ * Check the status of one local principal against each target to which it is
+ * routed, reporting or queuing a change for each one where it differs.
+ */
+static void
+check_principal(struct reconcile *state, const char *name, bool disabled)
+{
+    kadm5_hook_modinfo *config = state->config;
+    krb5_context ctx = state->ctx;
+    struct sync_target *target;
+    struct accounts *accounts;
+    struct account *slot;
+    krb5_principal principal;
+    struct sync_op op;
+    krb5_error_code code;
+    const char *operation, *ad_name;
+    size_t i;
+    bool allowed;
+
+    code = krb5_parse_name(ctx, name, &principal);
+    if (code != 0) {
+        warn_krb5(ctx, code, "cannot parse principal %s", name);
+        return;
+    }
+    code = sync_op_init(&op, ctx, principal);
+    if (code == 0)
+        code = sync_principal_allowed(config, &op, false, &allowed);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot check principal %s", name);
+    for (i = 0; allowed && i < config->ad_targets_count; i++) {
+        target = &config->ad_targets[i];
+        accounts = &state->targets[i];
+        if (accounts->size == 0)
+            continue;
+        ad_name = map_principal(state, target, &op);
+        if (ad_name == NULL)
+            continue;
+        slot = account_slot(accounts, account_hash(ad_name));
+        if (slot->flags == 0)
+            continue;
+        if (disabled == ((slot->flags & ACCOUNT_DISABLED) != 0))
+            continue;
+
+        /* The status differs, so report or queue the change. */
+        state->differences++;
+        operation = disabled ? "disable" : "enable";
+        if (!state->queue) {
+            printf("%s %s %s\n", name, target->name, operation);
+            continue;
+        }
+        code = sync_queue_write(config, &op, target, operation, NULL);
+        if (code != 0)
+            die_krb5(ctx, code, "cannot queue %s of %s in %s", operation,
+                     name, target->name);
+    }
+    sync_op_free(&op);
+    krb5_free_principal(ctx, principal);
+}
+
+
+/*
+ * Read the next field of a dump file record into buffer, truncating it if it
+ * doesn't fit, and store the character that ended it in end.  Returns false
+ * at the end of the file.
+ */
+static bool
+dump_field(FILE *dump, char *buffer, size_t size, int *end)
+{
+    size_t length = 0;
+    int c;
+
+    while ((c = getc(dump)) != EOF && c != '\t' && c != '\n')
+        if (length + 1 < size)
+            buffer[length++] = (char) c;
+    buffer[length] = '\0';
+    *end = c;
+    return c != EOF || length > 0;
+}
+
+
+/*
+ * Walk the principals in a kdb5_util dump file.  Each principal is a princ
+ * record with the name in the seventh field and the attributes in the
+ * eighth.  Only those fields are kept, so records of any length may be
+ * handled in constant memory.
+ */
+static void
+walk_dump(struct reconcile *state, const char *path)
+{
+    FILE *dump;
+    char field[DUMP_NAME_MAX], name[DUMP_NAME_MAX];
+    unsigned long attributes;
+    size_t i;
+    int end;
+    bool header = true;
+
+    dump = fopen(path, "r");
+    if (dump == NULL)
+        sysdie("cannot open %s", path);
+    while (dump_field(dump, field, sizeof(field), &end)) {
+        if (header) {
+            if (strncmp(field, "kdb5_util load_dump", 19) != 0)
+                die("%s is not a kdb5_util dump file", path);
+            header = false;
+        } else if (strcmp(field, "princ") == 0) {
+            for (i = 1; i < 7 && end == '\t'; i++)
+                dump_field(dump, name, sizeof(name), &end);
+            if (end == '\t')
+                dump_field(dump, field, sizeof(field), &end);
+            if (i < 7 || sscanf(field, "%lu", &attributes) != 1)
+                die("invalid principal record in %s", path);
+            check_principal(state, name,
+                            (attributes & KRB5_KDB_DISALLOW_ALL_TIX) != 0);
+        }
+
+        /* Skip the rest of the record. */
+        while (end == '\t')
+            dump_field(dump, field, sizeof(field), &end);
+    }
+    if (ferror(dump))
+        sysdie("cannot read %s", path);
+    fclose(dump);
+}
+
+
+/*
+ * Open the local KDC database via kadm5.  As in the plugin, we use a separate
+ * Kerberos context for the database.
+ */
+static void *
+kadm5_open(krb5_context ctx, krb5_context *kadm_ctx)
+{
+    kadm5_config_params params;
+    krb5_error_code code;
+    char *realm;
+    void *handle;
+
+    code = krb5_get_default_realm(ctx, &realm);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot get default realm");
+    code = kadm5_init_krb5_context(kadm_ctx);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot initialize Kerberos context");
+    memset(&params, 0, sizeof(params));
+    params.realm = realm;
+    params.mask = KADM5_CONFIG_REALM;
+    code = kadm5_init_with_skey_ctx(*kadm_ctx, (char *) "kadmin/admin", NULL,
+                                    NULL, &params, KADM5_STRUCT_VERSION,
+                                    KADM5_API_VERSION_2, &handle);
+    if (code != 0)
+        die_krb5(*kadm_ctx, code, "cannot open local KDC database");
+    krb5_free_default_realm(ctx, realm);
+    return handle;
+}
+
+
+/*
+ * Look up one principal in the local KDC database and check its status.
+ * Principals that don't exist are skipped.
+ */
+static void
+kadm5_check(struct reconcile *state, void *handle, krb5_context kadm_ctx,
+            const char *name)
+{
+    krb5_principal principal;
+    kadm5_principal_ent_rec ent;
+    krb5_error_code code;
+
+    code = krb5_parse_name(kadm_ctx, name, &principal);
+    if (code != 0)
+        die_krb5(kadm_ctx, code, "cannot parse principal %s", name);
+    code = kadm5_get_principal(handle, principal, &ent, KADM5_ATTRIBUTES);
+    krb5_free_principal(kadm_ctx, principal);
+    if (code == KADM5_UNK_PRINC)
+        return;
+    if (code != 0)
+        die_krb5(kadm_ctx, code, "cannot get principal %s", name);
+    check_principal(state, name,
+                    (ent.attributes & KRB5_KDB_DISALLOW_ALL_TIX) != 0);
+    kadm5_free_principal_ent(handle, &ent);
+}
+
+
+/*
+ * Walk the principals in the local KDC database via kadm5.  This holds the
+ * names of every principal in memory, since kadm5_get_principals returns
+ * them all at once.  Use a dump file to keep memory use bounded.
+ */
+static void
+walk_kadm5(struct reconcile *state)
+{
+    krb5_context kadm_ctx;
+    krb5_error_code code;
+    char **names;
+    void *handle;
+    int count, i;
+
+    handle = kadm5_open(state->ctx, &kadm_ctx);
+    code = kadm5_get_principals(handle, (char *) "*", &names, &count);
+    if (code != 0)
+        die_krb5(kadm_ctx, code, "cannot list principals");
+    for (i = 0; i < count; i++)
+        kadm5_check(state, handle, kadm_ctx, names[i]);
+    kadm5_free_name_list(handle, names, count);
+    kadm5_destroy(handle);
+    krb5_free_context(kadm_ctx);
+}
+
+
+/*
+ * Look up each of the named local principals in the local KDC database and
+ * check its status.  The names are sorted so that duplicates can be
+ * skipped.
+ */
+static void
+check_names(struct reconcile *state, struct vector *names)
+{
+    krb5_context kadm_ctx;
+    void *handle;
+    size_t i;
+
+    if (names->count == 0)
+        return;
+    sort_strings(names->strings, names->count);
+    handle = kadm5_open(state->ctx, &kadm_ctx);
+    for (i = 0; i < names->count; i++) {
+        if (i > 0 && strcmp(names->strings[i - 1], names->strings[i]) == 0)
+            continue;
+        kadm5_check(state, handle, kadm_ctx, names->strings[i]);
+    }
+    kadm5_destroy(handle);
+    krb5_free_context(kadm_ctx);
+}
+
+
+/*
+ * Look up only the local principals corresponding to the accounts that
+ * changed in Active Directory, found by mapping the userPrincipalName of
+ * each one back to the local realm.  An account may have changed in more
+ * than one target, so remove the duplicates first.
+ */
+static void
+walk_changes(struct reconcile *state)
+{
+    krb5_context ctx = state->ctx;
+    krb5_principal principal;
+    krb5_error_code code;
+    struct vector *names, *changed;
+    char *realm, *name;
+    size_t i, j;
+
+    code = krb5_get_default_realm(ctx, &realm);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot get default realm");
+    names = sync_vector_new();
+    if (names == NULL)
+        sysdie("cannot allocate memory");
+    for (i = 0; i < state->config->ad_targets_count; i++) {
+        changed = state->targets[i].names;
+        for (j = 0; changed != NULL && j < changed->count; j++) {
+            code = krb5_parse_name(ctx, changed->strings[j], &principal);
+            if (code != 0) {
+                warn_krb5(ctx, code, "cannot parse %s", changed->strings[j]);
+                continue;
+            }
+            krb5_principal_set_realm(ctx, principal, realm);
+            code = krb5_unparse_name(ctx, principal, &name);
+            krb5_free_principal(ctx, principal);
+            if (code != 0)
+                die_krb5(ctx, code, "cannot unparse principal");
+            if (!sync_vector_add(names, name))
+                sysdie("cannot allocate memory");
+            krb5_free_unparsed_name(ctx, name);
+        }
+    }
+    krb5_free_default_realm(ctx, realm);
+    check_names(state, names);
+    sync_vector_free(names);
+}
+
+
+/*
+ * Return the path of the file holding the DirSync cookie for a target.
+ */
+static char *
+cookie_path(kadm5_hook_modinfo *config, struct sync_target *target)
+{
+    char *path;
+
+    xasprintf(&path, "%s/.dirsync-%s", config->queue_dir, target->name);
+    return path;
+}
+
+
+/*
+ * Read the saved DirSync cookie for a target, storing NULL if there isn't
+ * one yet.
+ */
+static void
+cookie_read(kadm5_hook_modinfo *config, struct sync_target *target,
+            void **cookie, size_t *length)
+{
+    char *path;
+    struct stat st;
+    ssize_t status;
+    int fd;
+
+    *cookie = NULL;
+    *length = 0;
+    path = cookie_path(config, target);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            sysdie("cannot open %s", path);
+        free(path);
+        return;
+    }
+    if (fstat(fd, &st) < 0)
+        sysdie("cannot stat %s", path);
+    if (st.st_size <= 0 || st.st_size > COOKIE_MAX) {
+        warn("ignoring invalid DirSync cookie in %s", path);
+        close(fd);
+        free(path);
+        return;
+    }
+    *length = (size_t) st.st_size;
+    *cookie = xmalloc(*length);
+    status = read(fd, *cookie, *length);
+    if (status < 0 || (size_t) status != *length)
+        sysdie("cannot read %s", path);
+    close(fd);
+    free(path);
+}
+
+
+/*
+ * Save the new DirSync cookie for a target.
+ */
+static void
+cookie_write(kadm5_hook_modinfo *config, struct sync_target *target,
+             const void *cookie, size_t length)
+{
+    char *path;
+
+    path = cookie_path(config, target);
+    replace_file(path, cookie, length);
+    free(path);
+}
+
+
+/*
+ * Load the accounts in a target that changed since the last incremental
+ * reconcile.  Sets lookup to false if we had to fall back on a full sweep,
+ * since then the local database has to be walked.
+ */
+static void
+load_changes(struct reconcile *state, struct sync_target *target,
+             struct accounts *accounts, bool *lookup)
+{
+    krb5_context ctx = state->ctx;
+    krb5_error_code code;
+    bool invalid;
+
+    cookie_read(state->config, target, &accounts->cookie, &accounts->length);
+    if (accounts->cookie == NULL)
+        *lookup = false;
+    if (*lookup) {
+        accounts->names = sync_vector_new();
+        if (accounts->names == NULL)
+            sysdie("cannot allocate memory");
+    }
+    code = sync_ad_changes(state->config, target, ctx, &accounts->cookie,
+                           &accounts->length, &invalid, account_add,
+                           accounts);
+    if (code != 0 && invalid) {
+        warn_krb5(ctx, code, "DirSync cookie for %s rejected, doing a full"
+                  " sweep", target->name);
+        *lookup = false;
+        sync_vector_free(accounts->names);
+        accounts->names = NULL;
+        free(accounts->table);
+        accounts->table = NULL;
+        accounts->size = 0;
+        accounts->count = 0;
+        free(accounts->cookie);
+        accounts->cookie = NULL;
+        accounts->length = 0;
+        code = sync_ad_changes(state->config, target, ctx, &accounts->cookie,
+                               &accounts->length, &invalid, account_add,
+                               accounts);
+    }
+    if (code != 0)
+        die_krb5(ctx, code, "cannot get changed accounts in %s",
+                 target->name);
+}
+
+
+/*
+ * Reconcile the account status of every local principal with each target to
+ * which account status changes are pushed.  Principals come from the dump
+ * file if one is given and from the local KDC database otherwise.  If
+ * incremental is true, only check the accounts that changed in Active
+ * Directory since the last incremental reconcile.  If queue is true, queue
+ * the changes needed to bring Active Directory in line with the local KDC,
+ * and otherwise print them.  Returns the number of differences found.
+ */
+unsigned long
+reconcile(kadm5_hook_modinfo *config, krb5_context ctx, const char *dump,
+          bool queue, bool incremental)
+{
+    struct reconcile state;
+    struct sync_target *target;
+    struct accounts *accounts;
+    krb5_error_code code;
+    size_t i;
+    bool lookup = (dump == NULL);
+
+    if ((queue || incremental) && config->queue_dir == NULL)
+        die("queue_dir must be set to %s",
+            queue ? "queue changes" : "save DirSync cookies");
+    memset(&state, 0, sizeof(state));
+    state.config = config;
+    state.ctx = ctx;
+    state.queue = queue;
+    state.targets = xcalloc(config->ad_targets_count,
+                            sizeof(struct accounts));
+
+    /* Load the accounts of every target that gets status changes. */
+    for (i = 0; i < config->ad_targets_count; i++) {
+        target = &config->ad_targets[i];
+        accounts = &state.targets[i];
+        if (target->ad_admin_server == NULL)
+            continue;
+        if (incremental) {
+            load_changes(&state, target, accounts, &lookup);
+            continue;
+        }
+        code = sync_ad_accounts(config, target, ctx, account_add, accounts);
+        if (code != 0)
+            die_krb5(ctx, code, "cannot get accounts in %s", target->name);
+    }
+
+    /* Walk the local principals. */
+    if (dump != NULL)
+        walk_dump(&state, dump);
+    else if (incremental && lookup)
+        walk_changes(&state);
+    else
+        walk_kadm5(&state);
+
+    /* Save the new cookies only once everything has been checked. */
+    for (i = 0; i < config->ad_targets_count; i++) {
+        accounts = &state.targets[i];
+        if (accounts->cookie != NULL)
+            cookie_write(config, &config->ad_targets[i], accounts->cookie,
+                         accounts->length);
+        free(accounts->table);
+        free(accounts->cookie);
+        sync_vector_free(accounts->names);
+    }
+    free(state.targets);
+    return state.differences;
+}
+
+
+/*
+ * Look up the accounts in a target corresponding to the named local
+ * principals, which are sorted, and add them to the hash table.
+ */
+static void
+load_accounts(struct reconcile *state, struct sync_target *target,
+              struct accounts *accounts, struct vector *names)
+{
+    krb5_context ctx = state->ctx;
+    krb5_principal principal;
+    struct sync_op op;
+    krb5_error_code code;
+    struct vector *upns;
+    const char *ad_name;
+    size_t i;
+
+    upns = sync_vector_new();
+    if (upns == NULL)
+        sysdie("cannot allocate memory");
+    for (i = 0; i < names->count; i++) {
+        if (i > 0 && strcmp(names->strings[i - 1], names->strings[i]) == 0)
+            continue;
+        code = krb5_parse_name(ctx, names->strings[i], &principal);
+        if (code != 0) {
+            warn_krb5(ctx, code, "cannot parse %s", names->strings[i]);
+            continue;
+        }
+        code = sync_op_init(&op, ctx, principal);
+        if (code != 0)
+            die_krb5(ctx, code, "cannot set up check of %s",
+                     names->strings[i]);
+        ad_name = map_principal(state, target, &op);
+        if (ad_name != NULL && !sync_vector_add(upns, ad_name))
+            sysdie("cannot allocate memory");
+        sync_op_free(&op);
+        krb5_free_principal(ctx, principal);
+    }
+    code = sync_ad_lookup(state->config, target, ctx, upns, account_add,
+                          accounts);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot look up accounts in %s", target->name);
+    sync_vector_free(upns);
+}
+
+
+/*
+ * Reconcile the account status of the local principals changed since the
+ * last run according to the MIT update log at path.  If the log no longer
+ * holds all of those changes, or this is the first run, fall back on a full
+ * reconcile.  Either way, save the serial number of the last change in the
+ * log for the next run once everything has been checked.  Returns the number
+ * of differences found.
+ */
+unsigned long
+reconcile_log(kadm5_hook_modinfo *config, krb5_context ctx, const char *path,
+              bool queue)
+{
+    struct reconcile state;
+    struct sync_target *target;
+    struct vector *names;
+    unsigned long serial, saved, differences;
+    size_t i;
+
+    if (config->queue_dir == NULL)
+        die("queue_dir must be set to save the update log serial number");
+
+    /*
+     * With no saved serial number, use one that's never in the log so that
+     * we only learn the serial number of the last change.  The log is read
+     * before the full sweep so that no change can be missed.
+     */
+    if (!ulog_serial_read(config, &saved))
+        saved = ULONG_MAX;
+    serial = saved;
+    names = ulog_read(path, &serial);
+    if (names == NULL) {
+        if (saved == ULONG_MAX)
+            warn("no saved serial number for %s, doing a full sweep", path);
+        else
+            warn("%s no longer has the changes after serial number %lu,"
+                 " doing a full sweep", path, saved);
+        differences = reconcile(config, ctx, NULL, queue, false);
+        ulog_serial_write(config, serial);
+        return differences;
+    }
+
+    /* Look up the changed principals in each target and check them. */
+    memset(&state, 0, sizeof(state));
+    state.config = config;
+    state.ctx = ctx;
+    state.queue = queue;
+    state.targets = xcalloc(config->ad_targets_count,
+                            sizeof(struct accounts));
+    sort_strings(names->strings, names->count);
+    for (i = 0; i < config->ad_targets_count; i++) {
+        target = &config->ad_targets[i];
+        if (target->ad_admin_server != NULL)
+            load_accounts(&state, target, &state.targets[i], names);
+    }
+    check_names(&state, names);
+    ulog_serial_write(config, serial);
+
+    /* Clean up. */
+    for (i = 0; i < config->ad_targets_count; i++)
+        free(state.targets[i].table);
+    free(state.targets);
+    sync_vector_free(names);
+    return state.differences;
+}
@@ -0,0 +1,36 @@
+/*
+ * Sorting lists of names for the krb5-sync utility.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <tools/internal.h>
+
+
+/*
+ * Compare two strings for qsort.
+ */
+static int
+compare_strings(const void *a, const void *b)
+{
+    const char *const *first = a;
+    const char *const *second = b;
+
+    return strcmp(*first, *second);
+}
+
+
+/*
+ * Sort an array of strings in place.
+ */
+void
+sort_strings(char **strings, size_t count)
+{
+    qsort(strings, count, sizeof(char *), compare_strings);
+}
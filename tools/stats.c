@@ -0,0 +1,393 @@
+/*
+ * Report the statistics kept by the plugin and krb5-sync.
+ *
+ * The statistics are read from the shared stats file in the queue directory,
+ * so reporting them doesn't involve kadmind.  They are printed either in a
+ * form meant for people or in the Prometheus text exposition format, for
+ * use with the node exporter textfile collector or a similar scraper.  The
+ * state of the rate and concurrency controller for each domain controller
+ * is reported along with the statistics for that domain controller, and
+ * the depth of the queue and the age of its oldest change are found by
+ * looking at the queue directory.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <tools/internal.h>
+#include <util/macros.h>
+#include <util/messages-krb5.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Names used for the dimensions of the statistics. */
+static const char *const sources[] = { "live", "drain" };
+static const char *const types[] = { "password", "status" };
+static const char *const results[] = { "success", "queued", "failed" };
+static const char *const outcomes[] = { "success", "soft", "hard" };
+static const char *const kinds[] = { NULL, "dn", "instance" };
+
+
+/*
+ * Count the queued changes, which are all the files in the queue directory
+ * that don't start with a period, and find the age in seconds of the oldest
+ * one from its modification time, which is when it was queued.  These are
+ * only gauges, so the queue isn't locked, and files that disappear while we
+ * look at them are skipped.
+ */
+static void
+queue_scan(kadm5_hook_modinfo *config, unsigned long *depth,
+           unsigned long *oldest)
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    char *path;
+    time_t now, first = 0;
+
+    *depth = 0;
+    *oldest = 0;
+    dir = opendir(config->queue_dir);
+    if (dir == NULL)
+        sysdie("cannot open %s", config->queue_dir);
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        xasprintf(&path, "%s/%s", config->queue_dir, entry->d_name);
+        if (stat(path, &st) == 0) {
+            (*depth)++;
+            if (first == 0 || st.st_mtime < first)
+                first = st.st_mtime;
+        }
+        free(path);
+    }
+    closedir(dir);
+    now = time(NULL);
+    if (first != 0 && now > first)
+        *oldest = (unsigned long) (now - first);
+}
+
+
+/*
+ * Return the upper bound, in the units of the histogram, of the bucket holding
+ * the given percentile of a histogram, 0 if the histogram is empty, or
+ * UINT64_MAX if it's in the last bucket, which has no upper bound.
+ */
+static uint64_t
+histogram_percentile(const struct sync_stats_histogram *histogram,
+                     unsigned long percentile)
+{
+    uint64_t rank, seen = 0;
+    size_t i;
+
+    if (histogram->count == 0)
+        return 0;
+    rank = (histogram->count * percentile + 99) / 100;
+    for (i = 0; i < SYNC_STATS_BUCKETS - 1; i++) {
+        seen += histogram->bucket[i];
+        if (seen >= rank)
+            return (uint64_t) 1 << i;
+    }
+    return UINT64_MAX;
+}
+
+
+/*
+ * Print the median and 99th percentile of a histogram, as an upper bound
+ * since we only know the bucket.  The values are divided by 1000 and printed
+ * with the given unit, so a histogram in microseconds should be printed in
+ * ms and one in milliseconds in s.  Prints nothing if the histogram is
+ * empty.
+ */
+static void
+print_percentiles(const struct sync_stats_histogram *histogram,
+                  const char *unit)
+{
+    unsigned long percentiles[] = { 50, 99 };
+    uint64_t value;
+    size_t i;
+
+    if (histogram->count == 0)
+        return;
+    for (i = 0; i < ARRAY_SIZE(percentiles); i++) {
+        value = histogram_percentile(histogram, percentiles[i]);
+        if (value == UINT64_MAX)
+            printf(", p%lu unbounded", percentiles[i]);
+        else
+            printf(", p%lu <= %.3f%s", percentiles[i], (double) value / 1000,
+                   unit);
+    }
+}
+
+
+/*
+ * Find the controller state for a domain controller, returning NULL if
+ * there is none.
+ */
+static struct sync_control_info *
+find_control(struct sync_control_info *info, size_t count, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        if (strcmp(info[i].name, name) == 0)
+            return &info[i];
+    return NULL;
+}
+
+
+/*
+ * Print the statistics for people.
+ */
+static void
+print_text(kadm5_hook_modinfo *config, struct sync_stats *stats,
+           struct sync_control_info *info, size_t count)
+{
+    struct sync_stats_dc *dc;
+    struct sync_control_info *control;
+    unsigned long depth, oldest;
+    size_t i, j;
+
+    for (i = 0; i < SYNC_STATS_SOURCES; i++)
+        for (j = 0; j < SYNC_STATS_TYPES; j++) {
+            printf("%s %s: success %lu, queued %lu, failed %lu", sources[i],
+                   types[j],
+                   (unsigned long) stats->changes[i][j][SYNC_STATS_SUCCESS],
+                   (unsigned long) stats->changes[i][j][SYNC_STATS_QUEUED],
+                   (unsigned long) stats->changes[i][j][SYNC_STATS_FAILED]);
+            print_percentiles(&stats->latency[i][j], "ms");
+            printf("\n");
+        }
+    for (i = 0; i < SYNC_STATS_TYPES; i++) {
+        printf("lag %s: applied %lu", types[i],
+               (unsigned long) stats->lag[i].count);
+        print_percentiles(&stats->lag[i], "s");
+        printf("\n");
+    }
+    queue_scan(config, &depth, &oldest);
+    printf("queue: depth %lu, oldest %lus, writes %lu, lock waits %lu", depth,
+           oldest, (unsigned long) stats->queue_writes,
+           (unsigned long) stats->lock_wait.count);
+    print_percentiles(&stats->lock_wait, "ms");
+    printf("\n");
+    printf("log: dropped %lu\n", (unsigned long) stats->log_dropped);
+    for (i = 1; i < SYNC_STATS_KINDS; i++)
+        printf("cache %s: hits %lu, misses %lu\n", kinds[i],
+               (unsigned long) stats->cache_hits[i],
+               (unsigned long) stats->cache_misses[i]);
+    for (i = 0; i < stats->dc_count; i++) {
+        dc = &stats->dc[i];
+        printf("%s: success %lu, soft %lu, hard %lu", dc->name,
+               (unsigned long) dc->outcomes[SYNC_OUTCOME_SUCCESS],
+               (unsigned long) dc->outcomes[SYNC_OUTCOME_SOFT],
+               (unsigned long) dc->outcomes[SYNC_OUTCOME_HARD]);
+        print_percentiles(&dc->latency, "ms");
+        control = find_control(info, count, dc->name);
+        if (control != NULL)
+            printf(", window %.2f, backoffs %lu", control->window,
+                   control->backoffs);
+        printf("\n");
+    }
+}
+
+
+/*
+ * Copy a label value for Prometheus into a buffer, escaping backslashes,
+ * double quotes, and newlines, and truncating it if needed.
+ */
+static void
+escape_label(char *buffer, size_t size, const char *value)
+{
+    size_t i = 0;
+
+    for (; *value != '\0' && i + 2 < size; value++) {
+        if (*value == '\\' || *value == '"')
+            buffer[i++] = '\\';
+        if (*value == '\n') {
+            buffer[i++] = '\\';
+            buffer[i++] = 'n';
+        } else
+            buffer[i++] = *value;
+    }
+    buffer[i] = '\0';
+}
+
+
+/*
+ * Print the header of a Prometheus metric.
+ */
+static void
+print_header(const char *name, const char *type, const char *help)
+{
+    printf("# HELP krb5_sync_%s %s\n", name, help);
+    printf("# TYPE krb5_sync_%s %s\n", name, type);
+}
+
+
+/*
+ * Print a histogram for Prometheus, in seconds.  labels is the label set of
+ * the histogram without the braces, which may be empty, and scale is the
+ * number of units of the histogram in a second.  The count is the sum of the
+ * buckets rather than the stored count, since other processes may have
+ * updated the histogram while we were copying it.
+ */
+static void
+print_histogram(const char *name, const char *labels,
+                const struct sync_stats_histogram *histogram, double scale)
+{
+    const char *comma = (labels[0] == '\0') ? "" : ",";
+    const char *open = (labels[0] == '\0') ? "" : "{";
+    const char *close = (labels[0] == '\0') ? "" : "}";
+    uint64_t total = 0;
+    size_t i;
+
+    for (i = 0; i < SYNC_STATS_BUCKETS; i++) {
+        total += histogram->bucket[i];
+        if (i == SYNC_STATS_BUCKETS - 1)
+            printf("krb5_sync_%s_bucket{%s%sle=\"+Inf\"} %lu\n", name,
+                   labels, comma, (unsigned long) total);
+        else
+            printf("krb5_sync_%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels,
+                   comma, (double) ((uint64_t) 1 << i) / scale,
+                   (unsigned long) total);
+    }
+    printf("krb5_sync_%s_sum%s%s%s %g\n", name, open, labels, close,
+           (double) histogram->sum / scale);
+    printf("krb5_sync_%s_count%s%s%s %lu\n", name, open, labels, close,
+           (unsigned long) total);
+}
+
+
+/*
+ * Print the statistics in the Prometheus text format.
+ */
+static void
+print_prometheus(kadm5_hook_modinfo *config, struct sync_stats *stats,
+                 struct sync_control_info *info, size_t count)
+{
+    char name[2 * sizeof(stats->dc[0].name)];
+    char labels[BUFSIZ];
+    unsigned long depth, oldest;
+    size_t i, j, k;
+
+    print_header("changes_total", "counter", "Changes by source, type, and"
+                 " result.");
+    for (i = 0; i < SYNC_STATS_SOURCES; i++)
+        for (j = 0; j < SYNC_STATS_TYPES; j++)
+            for (k = 0; k < SYNC_STATS_RESULTS; k++)
+                printf("krb5_sync_changes_total{source=\"%s\",type=\"%s\","
+                       "result=\"%s\"} %lu\n", sources[i], types[j],
+                       results[k], (unsigned long) stats->changes[i][j][k]);
+    print_header("change_duration_seconds", "histogram", "Time to handle a"
+                 " change.");
+    for (i = 0; i < SYNC_STATS_SOURCES; i++)
+        for (j = 0; j < SYNC_STATS_TYPES; j++) {
+            snprintf(labels, sizeof(labels), "source=\"%s\",type=\"%s\"",
+                     sources[i], types[j]);
+            print_histogram("change_duration_seconds", labels,
+                            &stats->latency[i][j], 1e6);
+        }
+    print_header("propagation_lag_seconds", "histogram", "Time from when the"
+                 " plugin saw a change until it was applied.");
+    for (i = 0; i < SYNC_STATS_TYPES; i++) {
+        snprintf(labels, sizeof(labels), "type=\"%s\"", types[i]);
+        print_histogram("propagation_lag_seconds", labels, &stats->lag[i],
+                        1e3);
+    }
+    queue_scan(config, &depth, &oldest);
+    print_header("queue_depth", "gauge", "Changes waiting in the queue.");
+    printf("krb5_sync_queue_depth %lu\n", depth);
+    print_header("queue_oldest_age_seconds", "gauge", "Age of the oldest"
+                 " change waiting in the queue.");
+    printf("krb5_sync_queue_oldest_age_seconds %lu\n", oldest);
+    print_header("queue_writes_total", "counter", "Changes written to the"
+                 " queue.");
+    printf("krb5_sync_queue_writes_total %lu\n",
+           (unsigned long) stats->queue_writes);
+    print_header("queue_lock_wait_seconds", "histogram", "Time spent waiting"
+                 " for the queue lock.");
+    print_histogram("queue_lock_wait_seconds", "", &stats->lock_wait, 1e6);
+    print_header("log_dropped_total", "counter", "Log messages dropped because"
+                 " the log buffer was full.");
+    printf("krb5_sync_log_dropped_total %lu\n",
+           (unsigned long) stats->log_dropped);
+    print_header("cache_lookups_total", "counter", "Lookups in the persistent"
+                 " cache by kind and result.");
+    for (i = 1; i < SYNC_STATS_KINDS; i++) {
+        printf("krb5_sync_cache_lookups_total{kind=\"%s\",result=\"hit\"}"
+               " %lu\n", kinds[i], (unsigned long) stats->cache_hits[i]);
+        printf("krb5_sync_cache_lookups_total{kind=\"%s\",result=\"miss\"}"
+               " %lu\n", kinds[i], (unsigned long) stats->cache_misses[i]);
+    }
+    if (stats->dc_count == 0)
+        return;
+    print_header("dc_operations_total", "counter", "Operations against a"
+                 " domain controller by outcome.");
+    for (i = 0; i < stats->dc_count; i++) {
+        escape_label(name, sizeof(name), stats->dc[i].name);
+        for (j = 0; j < SYNC_STATS_OUTCOMES; j++)
+            printf("krb5_sync_dc_operations_total{dc=\"%s\",outcome=\"%s\"}"
+                   " %lu\n", name, outcomes[j],
+                   (unsigned long) stats->dc[i].outcomes[j]);
+    }
+    print_header("dc_duration_seconds", "histogram", "Time for an operation"
+                 " against a domain controller.");
+    for (i = 0; i < stats->dc_count; i++) {
+        escape_label(name, sizeof(name), stats->dc[i].name);
+        snprintf(labels, sizeof(labels), "dc=\"%s\"", name);
+        print_histogram("dc_duration_seconds", labels, &stats->dc[i].latency,
+                        1e6);
+    }
+    print_header("dc_window", "gauge", "Concurrency window of the controller"
+                 " for a domain controller.");
+    for (i = 0; i < count; i++) {
+        escape_label(name, sizeof(name), info[i].name);
+        printf("krb5_sync_dc_window{dc=\"%s\"} %g\n", name, info[i].window);
+    }
+    print_header("dc_backoffs_total", "counter", "Times the controller backed"
+                 " off from a domain controller.");
+    for (i = 0; i < count; i++) {
+        escape_label(name, sizeof(name), info[i].name);
+        printf("krb5_sync_dc_backoffs_total{dc=\"%s\"} %lu\n", name,
+               info[i].backoffs);
+    }
+}
+
+
+/*
+ * Print the statistics, in the Prometheus text format if prometheus is true.
+ */
+void
+report_stats(kadm5_hook_modinfo *config, krb5_context ctx, bool prometheus)
+{
+    struct sync_stats *stats;
+    struct sync_control_info *info;
+    size_t count;
+    krb5_error_code code;
+
+    stats = malloc(sizeof(*stats));
+    if (stats == NULL)
+        sysdie("cannot allocate memory");
+    code = sync_stats_read(config, ctx, stats);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot read statistics");
+    code = sync_control_list(config, ctx, &info, &count);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot read controller state");
+    if (prometheus)
+        print_prometheus(config, stats, info, count);
+    else
+        print_text(config, stats, info, count);
+    free(info);
+    free(stats);
+}
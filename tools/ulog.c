@@ -0,0 +1,242 @@
+/*
+ * Reading the MIT Kerberos update log.
+ *
+ * When incremental propagation is enabled, an MIT KDC records every change
+ * to its database in an update log (the ulog) next to the database, kept as
+ * a circular buffer of fixed-size blocks after a header.  The header and the
+ * header of each block are in host byte order, and the rest of each block is
+ * the XDR encoding of the update, starting with the name of the changed
+ * principal.  Every change is logged, including those made by kadmin.local
+ * or with the plugin disabled, so the principals changed since a given
+ * serial number can be found without walking the whole database.
+ *
+ * We only need the names.  Later versions of MIT Kerberos always log the
+ * complete principal, and the current attributes are looked up in the
+ * database anyway, so we don't decode the rest of the update.
+ *
+ * The layout is taken from kdb_log.h and iprop.x in the MIT Kerberos source,
+ * which aren't installed.  kadmind takes a POSIX lock on the log while
+ * changing it, so we take a shared lock while reading.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <tools/internal.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* The file in queue_dir holding the last update log serial number seen. */
+#define SERIAL_FILE ".ulog-serial"
+
+/* Magic numbers for the log header and each entry. */
+#define ULOG_HDR_MAGIC 0x6662323
+#define ULOG_MAGIC     0x6661212
+
+/* Values of the log state. */
+#define ULOG_STABLE 1
+
+/* A timestamp in the log. */
+struct ulog_time {
+    uint32_t seconds;
+    uint32_t useconds;
+};
+
+/* The header of the log, kdb_hlog_t in kdb_log.h. */
+struct ulog_header {
+    uint32_t magic;
+    uint16_t db_version;
+    uint32_t num;
+    struct ulog_time first_time;
+    struct ulog_time last_time;
+    uint32_t first_sno;
+    uint32_t last_sno;
+    uint16_t state;
+    uint16_t block;
+};
+
+/* The header of each entry, kdb_ent_header_t in kdb_log.h. */
+struct ulog_entry {
+    uint32_t magic;
+    uint32_t sno;
+    struct ulog_time time;
+    int32_t commit;
+    uint32_t size;
+};
+
+
+/*
+ * Read exactly length bytes from offset in the log, dying on failure.
+ */
+static void
+ulog_pread(int fd, const char *path, void *buffer, size_t length,
+           off_t offset)
+{
+    ssize_t status;
+
+    status = pread(fd, buffer, length, offset);
+    if (status < 0)
+        sysdie("cannot read %s", path);
+    if ((size_t) status != length)
+        die("%s is truncated", path);
+}
+
+
+/*
+ * Read the name of the changed principal from one log entry and add it to
+ * names.  The XDR encoding of the name is a big-endian length followed by
+ * the bytes of the name.  Returns false if the entry isn't the one with the
+ * given serial number or is damaged.
+ */
+static bool
+ulog_entry(int fd, const char *path, const struct ulog_header *header,
+           uint32_t entries, uint32_t sno, struct vector *names)
+{
+    struct ulog_entry entry;
+    unsigned char *data;
+    uint32_t length;
+    off_t offset;
+    char *name;
+    bool okay = false;
+
+    offset = (off_t) sizeof(*header)
+             + (off_t) ((sno - 1) % entries) * header->block;
+    ulog_pread(fd, path, &entry, sizeof(entry), offset);
+    if (entry.magic != ULOG_MAGIC || entry.sno != sno || !entry.commit)
+        return false;
+    if (entry.size < 4 || entry.size > header->block - sizeof(entry))
+        return false;
+    data = xmalloc(entry.size);
+    ulog_pread(fd, path, data, entry.size, offset + (off_t) sizeof(entry));
+    length = ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16)
+             | ((uint32_t) data[2] << 8) | (uint32_t) data[3];
+    if (length > 0 && length <= entry.size - 4) {
+        name = xstrndup((char *) data + 4, length);
+        if (!sync_vector_add(names, name))
+            sysdie("cannot allocate memory");
+        free(name);
+        okay = true;
+    }
+    free(data);
+    return okay;
+}
+
+
+/*
+ * Return the names of the principals changed after the given serial number
+ * in the MIT update log at path, and set serial to the serial number of the
+ * last change in the log.  A principal changed more than once is listed more
+ * than once.  Returns NULL if the log no longer holds every change after
+ * serial, either because it has wrapped around or because it was reset, in
+ * which case the caller has to fall back on a full reconcile.
+ */
+struct vector *
+ulog_read(const char *path, unsigned long *serial)
+{
+    struct ulog_header header;
+    struct vector *names;
+    struct flock lock;
+    struct stat st;
+    uint32_t entries, sno;
+    int fd;
+    bool okay;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        sysdie("cannot open %s", path);
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_RDLCK;
+    lock.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &lock) < 0)
+        if (errno != EINTR)
+            sysdie("cannot lock %s", path);
+
+    /* Check the header and find how many entries the log holds. */
+    ulog_pread(fd, path, &header, sizeof(header), 0);
+    if (header.magic != ULOG_HDR_MAGIC)
+        die("%s is not an MIT Kerberos update log", path);
+    if (fstat(fd, &st) < 0)
+        sysdie("cannot stat %s", path);
+    if (header.block <= sizeof(struct ulog_entry)
+        || st.st_size < (off_t) sizeof(header) + header.block)
+        die("%s is damaged", path);
+    entries = (uint32_t) ((st.st_size - (off_t) sizeof(header))
+                          / header.block);
+
+    /*
+     * first_sno is the oldest change still in the log, so we have everything
+     * we need if it's no more than one past the saved serial number.  A saved
+     * serial number past the end of the log means the log was reset.
+     */
+    okay = (header.state == ULOG_STABLE);
+    if (okay && *serial != header.last_sno)
+        okay = (header.num > 0 && *serial < header.last_sno
+                && *serial + 1 >= header.first_sno);
+
+    /* Read the names of the changed principals. */
+    names = sync_vector_new();
+    if (names == NULL)
+        sysdie("cannot allocate memory");
+    for (sno = (uint32_t) *serial + 1; okay && sno <= header.last_sno; sno++)
+        okay = ulog_entry(fd, path, &header, entries, sno, names);
+    if (!okay) {
+        sync_vector_free(names);
+        names = NULL;
+    }
+    *serial = header.last_sno;
+    close(fd);
+    return names;
+}
+
+
+/*
+ * Read the update log serial number saved by the last run into serial.
+ * Returns false if there isn't one.
+ */
+bool
+ulog_serial_read(kadm5_hook_modinfo *config, unsigned long *serial)
+{
+    FILE *file;
+    char *path;
+    bool found;
+
+    xasprintf(&path, "%s/%s", config->queue_dir, SERIAL_FILE);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno != ENOENT)
+            sysdie("cannot open %s", path);
+        free(path);
+        return false;
+    }
+    found = (fscanf(file, "%lu", serial) == 1);
+    if (!found)
+        warn("ignoring invalid serial number in %s", path);
+    fclose(file);
+    free(path);
+    return found;
+}
+
+
+/*
+ * Save the update log serial number for the next run.
+ */
+void
+ulog_serial_write(kadm5_hook_modinfo *config, unsigned long serial)
+{
+    char *path, *data;
+
+    xasprintf(&path, "%s/%s", config->queue_dir, SERIAL_FILE);
+    xasprintf(&data, "%lu\n", serial);
+    replace_file(path, data, strlen(data));
+    free(data);
+    free(path);
+}